@@ -111,6 +111,12 @@ typedef struct EPCore_ {
     CRITICAL_SECTION   eventnumCS;
     ulong              acc_event_num;
 
+    /* counters added by all threads with epstat_inc, see epstat.h */
+    uint64             accept_num;
+    uint64             connect_num;
+    uint64             close_num;
+    uint64             wakeup_send;
+
     /* default handler of all event generated during runtime */
     IOHandler        * callback;
     void             * cbpara;
@@ -122,10 +128,39 @@ typedef struct EPCore_ {
     mpool_t          * epump_pool;
     mpool_t          * devrbn_pool;
     mpool_t          * timrbn_pool;
+    mpool_t          * udpvec_pool;
+    mpool_t          * udpgro_pool;
 
     /* DNS management instance */
     void             * dnsmgmt;
 
+    /* eptcp_nb_connect races the resolved IPv6/IPv4 addresses, starting
+       next connecting attempt every hedelay milliseconds */
+    uint8              happyeyeballs;
+    int                hedelay;
+
+    /* record event queue delay, execution time and loop time of
+       ePump and worker threads into latency histograms */
+    uint8              latency;
+
+    /* IOHandler callbacks running slowcb_thres milliseconds or longer are
+       logged, 1 of every slowcb_sample callbacks of each thread is timed */
+    int                slowcb_thres;
+    int                slowcb_sample;
+    ulong              slowcb_num;
+
+    /* per-thread binary trace rings, switched on by epcore_trace.
+       trace_tsc0/trace_ns0 pair is the base of converting TSC to time.
+       trace_list is the registry owning the rings, tracegen changes when
+       the rings are freed */
+    uint8              trace;
+    int                tracesize;
+    CRITICAL_SECTION   traceCS;
+    arr_t            * trace_list;
+    uint64             tracegen;
+    uint64             trace_tsc0;
+    uint64             trace_ns0;
+
     /* configuration file API visiting handle */
     void             * hconf;
 
@@ -139,6 +174,16 @@ void * epcore_new (int maxfd);
 void   epcore_clean (void * vpcore);
 
 int    epcore_dnsrv_add (void * vpcore, char * nsip, int port);
+int    epcore_dnsrv_clear (void * vpcore);
+int    epcore_dns_prefetch (void * vpcore, int ratio, int minhits);
+int    epcore_dns_stale (void * vpcore, int stalemax);
+int    epcore_dns_edns (void * vpcore, int size);
+int    epcore_dns_hedge (void * vpcore, int onoff);
+int    epcore_dns_snapshot (void * vpcore, char * file, int interval);
+int    epcore_dns_hosts (void * vpcore, char * hostsfile);
+int    epcore_dns_host_add (void * vpcore, char * name, char * ip);
+int    epcore_dns_host_del (void * vpcore, char * name);
+int    epcore_happy_eyeballs (void * vpcore, int onoff, int delayms);
 
 void   epcore_start_epump (void * vpcore, int maxnum);
 void   epcore_stop_epump (void * vpcore);
@@ -148,6 +193,9 @@ void   epcore_stop_worker (void * vpcore);
 
 int    epcore_set_callback (void * vpcore, void * cb, void * cbpara);
 
+/* name of the fd-watching mechanism compiled in: epoll, kqueue, select or iocp */
+char * epcore_backend (void);
+
 int    epcore_iodev_add (void * vpcore, void * vpdev);
 void * epcore_iodev_del (void * vpcore, ulong id);
 void * epcore_iodev_find (void * vpcore, ulong id);
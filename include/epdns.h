@@ -31,6 +31,7 @@
 #define _EPUMP_DNS_H_
  
 #include "frame.h"
+#include "btime.h"
 
 #ifdef  __cplusplus
 extern "C" {
@@ -124,6 +125,7 @@ extern "C" {
 #define RR_TYPE_MX      15  /* Mail Exchange */
 #define RR_TYPE_TXT     16  /* Text String */
 #define RR_TYPE_AAAA    28  /* IPv6 Host Address */
+#define RR_TYPE_OPT     41  /* EDNS0 pseudo RR, rfc6891 */
 
 #define RR_QTYPE_AXFR   252 /* a Transfer of an Entire Zone */
 #define RR_QTYPE_MAILB  253 /* Mailbox-related Records */
@@ -146,6 +148,8 @@ extern "C" {
 #define DNS_ERR_REFUSED        5
 #define DNS_ERR_IPV4           200
 #define DNS_ERR_IPV6           201
+#define DNS_ERR_NO_DATA        204
+#define DNS_ERR_LATE_ADDR      206
 #define DNS_ERR_NO_RESPONSE    404
 #define DNS_ERR_SEND_FAIL      405
 #define DNS_ERR_RESOURCE_FAIL  500
@@ -167,6 +171,14 @@ int hostn_to_dns_format (void * name, int len, void * pdst, int dstlen);
  * DNS NSrv / DNS Host - Name Server handling DNS request
  ******************************************************/
 
+/* Name Server health: RTT estimated in milliseconds as rfc6298, p95 taken
+   from the latest samples. the server timing out is skipped for a backoff
+   period doubled on each consecutive failure */
+#define DNS_HOST_RTT_INIT       200
+#define DNS_HOST_RTT_SAMPLES    32
+#define DNS_HOST_BACKOFF_MIN    1000
+#define DNS_HOST_BACKOFF_MAX    60000
+
 typedef struct dns_host_s {
     char             * host;
     char               ip[41];
@@ -175,12 +187,31 @@ typedef struct dns_host_s {
     unsigned   port      : 29;
     unsigned   alloctype : 3;//0-default kalloc/kfree 1-os-specific malloc/free 2-kmempool alloc/free 3-kmemblk alloc/free
     void     * mpool;
+
+    CRITICAL_SECTION   statCS;
+    uint32             srtt;
+    uint32             rttvar;
+    uint32             rttp95;
+    uint16             rttring[DNS_HOST_RTT_SAMPLES];
+    int                rttind;
+    int                rttnum;
+
+    int                failnum;
+    btime_t            holdtime;
 } DnsHost;
  
 void * dns_host_alloc (int alloctype, void * mpool);
 void   dns_host_free  (void * vhost);
 void * dns_host_new   (char * nshost, char * nsip, int port, int alloctype, void * mpool);
  
+void   dns_host_rtt   (void * vhost, int rttms);
+void   dns_host_fail  (void * vhost);
+
+/* lower is better, servers in backoff rank after all healthy ones */
+ulong  dns_host_score (void * vhost);
+/* hedged send is issued when no response within p95 RTT */
+int    dns_host_hedge_delay (void * vhost);
+ 
 typedef struct dns_nsrv {
  
     uint8    alloctype;//0-default kalloc/kfree 1-os-specific malloc/free 2-kmempool alloc/free 3-kmemblk alloc/free
@@ -197,7 +228,11 @@ void   dns_nsrv_free  (void * vnsrv);
 int    dns_nsrv_num   (void * vnsrv);
 int    dns_nsrv_add   (void * vnsrv, void * vhost);
  
+/* fill hosts sorted by score, fastest healthy Name Server goes first */
+int    dns_nsrv_order (void * vnsrv, DnsHost ** hlist, int max);
+ 
 int    dns_nsrv_append (void * vmgmt, char * nsip, int port);
+int    dns_nsrv_clear  (void * vmgmt);
 int    dns_nsrv_load   (void * vmgmt, char * nsip, char * resolv_file);
 
 /******************************************************
@@ -221,6 +256,9 @@ typedef struct dns_rr_s {
     char      ip[41];
     uint8     outofdate;
  
+    /* MINIMUM field of SOA RR, used as TTL of negative answer */
+    uint32    soamin;
+
     time_t    rcvtick;
 } DnsRR;
  
@@ -251,6 +289,21 @@ typedef struct dns_cache_s {
     int                failmsg;
     int                succmsg;
 
+    /* negative answer NXDOMAIN, NODATA or SERVFAIL cached till negtick + negttl,
+       index 0 for A query and 1 for AAAA query. protected by rrlistCS */
+    uint8              negative[2];
+    int                negrcode[2];
+    uint32             negttl[2];
+    time_t             negtick[2];
+
+    /* number of A/AAAA RR expired but still servable, set by dns_cache_verify */
+    int                stalenum;
+
+    /* lookup hits in current check period and in total, protected by tryCS */
+    int                hitnum;
+    ulong              hittotal;
+    time_t             prefetchtick;
+
     void             * dnsmgmt;
 } DnsCache;
  
@@ -262,10 +315,12 @@ int    dns_cache_free  (void * vcache);
 int    dns_cache_recycle (void * vcache);
  
 int    dns_cache_add    (void * vcache, void * vrr);
+int    dns_cache_drop_stale (void * vcache, int type);
 int    dns_cache_zap    (void * vcache);
 int    dns_cache_verify (void * vcache);
  
 int    dns_cache_copy    (void * vsrc, void * vdst);
+/* getters serve the fresh RR, the expired one only when anum is 0 */
 int    dns_cache_copy_ip (void * vcache, char * ip, int len);
 int    dns_cache_getip   (void * vcache, int ind, char * ip, int len);
 int    dns_cache_getiplist (void * vcache, char iplist[][41], int listnum);
@@ -277,7 +332,39 @@ int    dns_cache_find_A_rr (void * vcache, char * name);
  
 int    dns_cache_check (void * vcache);
  
+void   dns_cache_hit   (void * vcache);
+ 
+/* negative answer is kept for each qtype of RR_TYPE_A and RR_TYPE_AAAA,
+   qtype 0 sets or clears both of them */
+int    dns_cache_negative_set   (void * vcache, int qtype, int rcode, uint32 ttl);
+int    dns_cache_negative_clear (void * vcache, int qtype);
+/* return 1 and the cached rcode if negative answer of qtype is not expired */
+int    dns_cache_negative_get   (void * vcache, int qtype, int * rcode);
+/* return 1 and the rcode if every qtype the name is queried with, A and
+   AAAA when dualstack is enabled, is negatively cached */
+int    dns_cache_negative_name  (void * vcache, int * rcode);
+ 
+/* return 1 if the hot cache reaches ratio percent of TTL of its A/AAAA RR
+   before next check, which means a refresh query should be sent now */
+int    dns_cache_prefetch_check (void * vcache, int ratio, int interval);
+int    dns_cache_prefetch       (void * vcache);
+ 
+/* DnsCache instances are spread over shards by the case-insensitive hash of
+   name. lookups from different threads contend only on the same shard, and
+   the life check sweeps one shard each time */
+#define DNS_CACHE_SHARD_NUM   16
+
+typedef struct dns_cache_shard_s {
+    CRITICAL_SECTION   tableCS;
+    hashtab_t        * cache_table;
+} DnsCacheShard;
+
+int    dns_cache_shard_index (char * name, int len);
+int    dns_cache_mgmt_num (void * vmgmt);
+
 int    dns_cache_mgmt_add (void * vmgmt, void * vcache);
+/* start the life timer if not running */
+int    dns_cache_timer_start (void * vmgmt);
 void * dns_cache_mgmt_get (void * vmgmt, char * name, int namelen);
 void * dns_cache_mgmt_del (void * vmgmt, char * name, int namelen);
  
@@ -286,6 +373,61 @@ int    dns_cache_close (void * vcache);
  
 int    dns_cache_lifecheck (void * vmgmt);
  
+/* cache snapshot in network byte order:
+     header: "EPDNSC" version(1) reserved(1) savetime(4)
+     record: namelen(1) name rrnum(2)
+             { type(2) class(2) ttl(4) rcvtick(4) rdlen(2) rdata iplen(1) ip } */
+#define DNS_SNAPSHOT_MAGIC      "EPDNSC"
+#define DNS_SNAPSHOT_VERSION    1
+
+int    dns_cache_snapshot_encode (void * vcache, frame_p frm, time_t curt, int stalemax);
+/* copy all caches into the snapshot frame under the locks */
+frame_p dns_cache_snapshot_build (void * vmgmt, int * count);
+/* write the snapshot frame to temporary file and rename it to file */
+int    dns_cache_snapshot_write  (char * file, frame_p frm);
+int    dns_cache_snapshot_save   (void * vmgmt, char * file);
+int    dns_cache_snapshot_load   (void * vmgmt, char * file);
+/* the snapshot frame handed to the writing thread */
+typedef struct dns_snapshot_job_s {
+    void             * dnsmgmt;
+    frame_p            frm;
+} DnsSnapJob;
+
+/* the snapshot due is built in current thread, and written to file by a
+   worker via the user-defined event pushed into epump, or by a detached
+   thread when no worker exists. it is skipped if neither is available */
+int    dns_cache_snapshot_check  (void * vmgmt, void * epump);
+int    dns_cache_snapshot_pump   (void * vjob, void * pobj, int event, int fdtype);
+int    dns_cache_snapshot_thread (void * vjob);
+ 
+
+/*******************************************************
+ * DNS Hosts - hosts file and static entries answered locally
+ *******************************************************/
+
+#if defined(_WIN32) || defined(_WIN64)
+#define DNS_HOSTS_FILE   "C:\\Windows\\System32\\drivers\\etc\\hosts"
+#else
+#define DNS_HOSTS_FILE   "/etc/hosts"
+#endif
+
+/* seconds between checking the modification time of hosts file */
+#define DNS_HOSTS_CHECK_INTERVAL   5
+
+int    dns_hosts_key    (char * name, int len, char * key, int keylen);
+void * dns_hosts_open   (void * vmgmt, hashtab_t * table, char * name, int len);
+int    dns_hosts_addip  (void * vcache, char * ip);
+
+/* load or reload hosts file, NULL reloads the current one */
+int    dns_hosts_load   (void * vmgmt, char * hostsfile);
+/* called by the life timer, reload hosts file if it is modified */
+int    dns_hosts_check  (void * vmgmt);
+
+/* static entry overrides the same name of hosts file */
+void * dns_hosts_get    (void * vmgmt, char * name, int len);
+int    dns_hosts_add    (void * vmgmt, char * name, char * ip);
+int    dns_hosts_del    (void * vmgmt, char * name);
+ 
 
 /*******************************************************
  * DNS Msg - packing request/response for resolving name
@@ -312,9 +454,21 @@ typedef struct dns_header_s {
 } DnsHeader;
 #pragma pack()
  
+/* the callers querying the same name and QType from the same thread, while a
+   DnsMsg is outstanding, are attached to it as waiters instead of sending
+   their own requests. all waiters are notified when the DnsMsg completes.
+   early waiter is notified by the first answer with address of A and AAAA
+   queries, and notified again with DNS_ERR_LATE_ADDR by the other one */
+typedef struct dns_waiter_s {
+    DnsCB         * dnscb;
+    void          * cbobj;
+    ulong           cbobjid;
+    uint8           early;
+} DnsWaiter;
  
 typedef struct dns_msg_s {
     uint16          msgid;
+    uint8           shardind;
  
     char            name[DNS_NAME_LEN];
     int             nlen;
@@ -328,6 +482,23 @@ typedef struct dns_msg_s {
     void          * nsrv;
     int             nsrvind;
     ep_sockaddr_t * destaddr;
+    void          * clidev;
+    DnsHost       * desthost;
+    btime_t         sendtime;
+    uint8           answered;
+ 
+    /* hedged send to the second best Name Server, when no response arrives
+       within the p95 RTT of the first one */
+    void          * hedgetimer;
+    DnsHost       * hedgehost;
+    void          * hedgedev;
+    btime_t         hedgetime;
+ 
+    /* response with TC bit is retried over TCP to the same Name Server,
+       tcpfrm accumulates the 2-byte length prefixed response */
+    uint8           truncated;
+    void          * tcpdev;
+    frame_p         tcpfrm;
  
     /* response from name server */
     int             rcode;
@@ -343,8 +514,23 @@ typedef struct dns_msg_s {
     DnsCB         * dnscb;
     void          * cbobj;
     ulong           cbobjid;
+    uint8           cbearly;
     uint8           cbexec;
  
+    /* in-flight key: QType, caller thread ID and name */
+    char            pendkey[DNS_NAME_LEN + 32];
+    uint8           pending;
+    arr_t         * waiter_list;
+ 
+    /* A and AAAA queries sent in parallel are siblings. the first one
+       answered with address notifies all callbacks at once, and leaves the
+       early waiters to the other one with lateonly set. the first one failed
+       hands the callbacks over to the other by msg uid */
+    ulong           sibid;
+    uint8           sibdone;
+    int             sibrcode;
+    uint8           lateonly;
+ 
     void          * lifetimer;
     int             sendtimes;
  
@@ -358,8 +544,12 @@ int    dns_msg_cmp_msgid  (void * a, void * pat);
 ulong  dns_msg_hash_msgid (void * key);
  
 int    dns_msg_mgmt_add (void * vmgmt, void * vmsg);
-void * dns_msg_mgmt_get (void * vmgmt, uint16 msgid);
-void * dns_msg_mgmt_del (void * vmgmt, uint16 msgid);
+void * dns_msg_mgmt_get (void * vmgmt, ulong uid);
+void * dns_msg_mgmt_del (void * vmgmt, ulong uid);
+int    dns_msg_mgmt_num (void * vmgmt);
+ 
+/* uid combines shard index and msgid, identifying DnsMsg across shards */
+ulong  dns_msg_uid     (void * vmsg);
  
 int    dns_msg_init    (void * vmsg);
 int    dns_msg_free    (void * vmsg);
@@ -369,11 +559,40 @@ int    dns_msg_recycle (void * vmsg);
  
 int    dns_msg_encode (void * vmsg, char * name, int len, uint8 * pbuf, int bufsize);
 int    dns_msg_decode (void * vmsg, uint8 * buf, int len);
+/* check msgid and question of response against request without changing
+   DnsMsg, the forged or stale response is dropped before taking effect */
+int    dns_msg_verify (void * vmsg, uint8 * buf, int len);
+ 
+/* TTL of negative answer from SOA RR in Authority section, -1 if no SOA */
+int    dns_msg_negative_ttl (void * vmsg);
  
 void * dns_msg_open  (void * vmgmt, char * name, int len, DnsCB * cb, void * cbobj, ulong objid);
 int    dns_msg_close (void * vmsg);
  
+int    dns_msg_cmp_pendkey (void * a, void * pat);
+int    dns_msg_pendkey     (char * name, int len, int qtype, ulong threadid, char * key, int keylen);
+int    dns_msg_pend_add    (void * vmsg);
+void * dns_msg_pend_get    (void * vmgmt, char * key);
+int    dns_msg_pend_del    (void * vmsg);
+ 
+int    dns_msg_waiter_add  (void * vmsg, DnsCB * cb, void * cbobj, ulong objid, int early);
+int    dns_msg_waiter_num  (void * vmsg);
+ 
+/* invoke the DnsCB of DnsMsg and all attached waiters with the result */
+int    dns_msg_notify      (void * vmsg, void * vcache, int status);
+ 
+/* open and send A query, plus AAAA query in parallel if dualstack enabled */
+int    dns_msg_query (void * vmgmt, char * name, int len, void * vnsrv, void * vcache,
+                      DnsCB * cb, void * cbobj, ulong objid, int early);
+ 
 int    dns_msg_send  (void * vmsg, char * name, int len, void * vnsrv);
+int    dns_msg_hedge (void * vmsg);
+ 
+/* retry the truncated query over TCP */
+int    dns_msg_tcp_query (void * vmsg);
+int    dns_msg_tcp_send  (void * vmsg);
+int    dns_msg_tcp_recv  (void * vmgmt, void * pobj);
+int    dns_msg_tcp_fail  (void * vmgmt, void * pobj);
  
 int    dns_msg_handle (void * vmsg);
  
@@ -385,21 +604,97 @@ int    dns_msg_lifecheck (void * vmsg);
 
 #define t_dns_msg_life     1130
 #define t_dns_cache_life   1131 
+#define t_dns_msg_hedge    1132
+
+/* hedge delay bounds in milliseconds */
+#define DNS_HEDGE_DELAY_MIN        10
+#define DNS_HEDGE_DELAY_MAX        2000
+
+/* cache life check interval in seconds */
+#define DNS_CACHE_CHECK_INTERVAL   30
+
+/* default prefetch: refresh cache hit 2 times in last check period
+   when 80 percent of its TTL elapsed */
+#define DNS_PREFETCH_RATIO         80
+#define DNS_PREFETCH_HITS          2
+
+/* rfc8767, expired RR is kept and served up to 1 day beyond its expiry
+   while the refreshing is in flight or Name Servers are unreachable */
+#define DNS_STALE_MAX              86400
+
+/* rfc2308, negative answer TTL is the minimum of SOA TTL and SOA MINIMUM,
+   capped to 3 hours. SERVFAIL has no SOA and is cached for 30 seconds */
+#define DNS_NEGATIVE_TTL_MAX       10800
+#define DNS_SERVFAIL_TTL           30
+ 
+/* rfc6891 EDNS0 UDP payload size advertised in OPT record. 1232 avoids IP
+   fragmentation on most paths, 0 disables EDNS0 */
+#define DNS_EDNS_SIZE              1232
+
+/* receiving buffer of UDP response, the advertised EDNS0 payload size is
+   limited by it */
+#define DNS_UDP_BUFSIZE            32768
+ 
+/* query state is split into shards, a shard owns the UDP sockets bound to
+   random source ports, its msgid space and DnsMsg table. every ePump thread
+   creates its own shard on its first query, whose sockets are bound to that
+   ePump, so the query and its response are handled by the same thread with
+   uncontended msgCS. the first DNS_SHARD_NUM shards are created at startup
+   and shared by worker threads and other threads by the hash of thread ID,
+   as well as by ePump threads beyond DNS_SHARD_MAX shards. their sockets are
+   bound to any ePump thread. response is accepted only from the socket and
+   Name Server the request was sent by, with the same msgid and question */
+#define DNS_SHARD_NUM              8
+#define DNS_SHARD_MAX              64
+#define DNS_SHARD_BIND_TRY         8
+
+typedef struct dns_shard_s {
+    int                index;
+    void             * dnsmgmt;
+
+    /* ePump thread owning the shard, 0 for the shared ones */
+    ulong              threadid;
+
+    int                cli_dev_num;
+    iodev_t          * cli_dev[4];
+
+    CRITICAL_SECTION   msgCS;
+    hashtab_t        * msg_table;
+    uint32             randstate;
+} DnsShard;
+
+int    dns_shard_init  (void * vmgmt, void * vshard, int index, ulong threadid);
+void   dns_shard_clean (void * vshard);
+uint16 dns_shard_rand  (void * vshard);
+void * dns_shard_dev   (void * vshard, int family);
+/* return the shard index for the caller thread */
+int    dns_shard_select (void * vmgmt);
  
 typedef struct dns_mgmt_s {
     char             * resolv_conf;
     void             * nsrv;
+
+    /* Name Servers removed by dns_nsrv_clear, kept until dns_mgmt_clean
+       since DnsMsg in flight may still refer to them */
+    void             * nsrv_old;
+ 
+    DnsCacheShard      cache_shard[DNS_CACHE_SHARD_NUM];
  
+    /* protecting cachetimer and the shard index of next life check */
     CRITICAL_SECTION   cacheCS;
-    hashtab_t        * cache_table;
+    int                sweepind;
  
-    int                cli_dev_num;
-    iodev_t          * cli_dev[4];
+    /* shards of index below shardnum are initialized, protected by shardCS
+       when created. shardnum only grows till dns_mgmt_clean */
+    DnsShard           shard[DNS_SHARD_MAX];
+    int                shardnum;
+    CRITICAL_SECTION   shardCS;
  
-    uint32             msgid;
-    hashtab_t        * msg_table;
     CRITICAL_SECTION   msgCS;
  
+    /* outstanding DnsMsg indexed by pendkey, protected by msgCS */
+    hashtab_t        * pend_table;
+ 
     mpool_t          * cache_pool;
     mpool_t          * msg_pool;
  
@@ -408,6 +703,53 @@ typedef struct dns_mgmt_s {
 
     void             * cachetimer;
  
+    /* the counters below are added by epstat_inc from all threads.
+       queries not given as IP address, and the ones answered by cache */
+    uint64             query_num;
+    uint64             cache_hit;
+
+    /* ratio 0 disables prefetching */
+    int                prefetch_ratio;
+    int                prefetch_hits;
+    uint64             prefetch_num;
+ 
+    /* query AAAA record in parallel with A record */
+    uint8              dualstack;
+ 
+    /* seconds beyond expiry that RR is still served, 0 disables serve-stale */
+    int                stale_max;
+    uint64             stale_num;
+    uint64             negative_num;
+ 
+    /* UDP payload size of EDNS0, and the number of TCP retries */
+    int                edns_size;
+    uint64             tcp_num;
+ 
+    /* hedged sends switched off by default */
+    uint8              hedge;
+    uint64             hedge_num;
+ 
+    /* cache snapshot saved every interval seconds and on cleaning,
+       interval 0 saves on cleaning only */
+    char               snapshot_file[256];
+    int                snapshot_interval;
+    time_t             snapshot_tick;
+    uint8              snapshot_writing;
+ 
+    /* names answered without Name Server, static entries go first. reloading
+       builds a new hosts table and swaps it in, the replaced ones are kept
+       in hosts_old till dns_mgmt_clean since callers may still hold their
+       DnsCache. the life timer checks the modification of hosts file.
+       protected by hostsCS */
+    char               hosts_file[256];
+    CRITICAL_SECTION   hostsCS;
+    hashtab_t        * hosts_table;
+    arr_t            * hosts_old;
+    hashtab_t        * static_table;
+    time_t             hosts_mtime;
+    time_t             hosts_checktick;
+    uint64             hosts_hit;
+ 
     void             * pcore;
 } DnsMgmt;
  
@@ -416,6 +758,23 @@ void   dns_mgmt_clean (void * vmgmt);
  
 int    dns_nb_query (void * vmgmt, char * name, int len, void * vnsrv, void ** pcache,
                      DnsCB * cb, void * cbobj, ulong objid);
+/* same as dns_nb_query, but the callback is invoked as soon as the first one
+   of A and AAAA queries is answered with address, and invoked once more with
+   DNS_ERR_LATE_ADDR when the other address family is answered later */
+int    dns_nb_query_early (void * vmgmt, char * name, int len, void * vnsrv, void ** pcache,
+                           DnsCB * cb, void * cbobj, ulong objid);
+ 
+int    dns_prefetch_set (void * vmgmt, int ratio, int minhits);
+int    dns_stale_set    (void * vmgmt, int stalemax);
+int    dns_dualstack_get (void * vmgmt);
+int    dns_dualstack_set (void * vmgmt, int onoff);
+int    dns_edns_set     (void * vmgmt, int size);
+int    dns_hedge_set    (void * vmgmt, int onoff);
+/* set snapshot file and load it for warm start */
+int    dns_snapshot_set (void * vmgmt, char * file, int interval);
+ 
+/* return 1 if both family, address and port are same */
+int    dns_addr_match (ep_sockaddr_t * a, ep_sockaddr_t * b);
  
 int    dns_recv  (void * vmgmt, void * pobj);
  
@@ -0,0 +1,76 @@
+/*
+ * Copyright (c) 2003-2024 Ke Hengzhong <kehengzhong@hotmail.com>
+ * All rights reserved. See MIT LICENSE for redistribution.
+ *
+ * #####################################################
+ * #                       _oo0oo_                     #
+ * #                      o8888888o                    #
+ * #                      88" . "88                    #
+ * #                      (| -_- |)                    #
+ * #                      0\  =  /0                    #
+ * #                    ___/`---'\___                  #
+ * #                  .' \\|     |// '.                #
+ * #                 / \\|||  :  |||// \               #
+ * #                / _||||| -:- |||||- \              #
+ * #               |   | \\\  -  /// |   |             #
+ * #               | \_|  ''\---/''  |_/ |             #
+ * #               \  .-\__  '-'  ___/-. /             #
+ * #             ___'. .'  /--.--\  `. .'___           #
+ * #          ."" '<  `.___\_<|>_/___.'  >' "" .       #
+ * #         | | :  `- \`.;`\ _ /`;.`/ -`  : | |       #
+ * #         \  \ `_.   \_ __\ /__ _/   .-` /  /       #
+ * #     =====`-.____`.___ \_____/___.-`___.-'=====    #
+ * #                       `=---='                     #
+ * #     ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~   #
+ * #               佛力加持      佛光普照              #
+ * #  Buddha's power blessing, Buddha's light shining  #
+ * #####################################################
+ */
+
+#ifndef _EPUMP_PROBE_H_
+#define _EPUMP_PROBE_H_
+
+/* USDT probes of provider epump, defined when sys/sdt.h is found by the
+   Makefile. a disabled probe is a single nop instruction, bpftrace or perf
+   attaches to the running process without rebuilding, for example:
+
+     bpftrace -e 'usdt:./libepump.so:epump:ioevent_execute_begin
+                  { @t[tid] = nsecs; }
+                  usdt:./libepump.so:epump:ioevent_execute_end /@t[tid]/
+                  { @ns[arg0] = hist(nsecs - @t[tid]); delete(@t[tid]); }'
+
+   probe                    arguments
+   epoll_dispatch           epump threadid, nfds returned
+   ioevent_dispatch         event type, object id, target threadid, 1 if worker
+   ioevent_execute_begin    event type, object id
+   ioevent_execute_end      event type, object id
+   iotimer_start            timer id, cmdid, milliseconds
+   iotimer_stop             timer id, cmdid
+   iotimer_fire             timer id, cmdid
+   iodev_bind_epump         device id, fd, bindtype, epump threadid
+   iodev_close              device id, fd, fdtype
+   dns_msg_send             message uid, name, sending times
+   dns_msg_handle           message uid, name, rcode
+
+   compile with -DEP_NO_PROBE to remove them */
+
+#if defined(HAVE_SDT) && !defined(EP_NO_PROBE)
+
+#include <sys/sdt.h>
+
+#define EPPROBE1(name, a1)                  DTRACE_PROBE1(epump, name, a1)
+#define EPPROBE2(name, a1, a2)              DTRACE_PROBE2(epump, name, a1, a2)
+#define EPPROBE3(name, a1, a2, a3)          DTRACE_PROBE3(epump, name, a1, a2, a3)
+#define EPPROBE4(name, a1, a2, a3, a4)      DTRACE_PROBE4(epump, name, a1, a2, a3, a4)
+
+#else
+
+#define EPPROBE1(name, a1)
+#define EPPROBE2(name, a1, a2)
+#define EPPROBE3(name, a1, a2, a3)
+#define EPPROBE4(name, a1, a2, a3, a4)
+
+#endif
+
+#endif
+
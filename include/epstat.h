@@ -0,0 +1,240 @@
+/*
+ * Copyright (c) 2003-2024 Ke Hengzhong <kehengzhong@hotmail.com>
+ * All rights reserved. See MIT LICENSE for redistribution.
+ *
+ * #####################################################
+ * #                       _oo0oo_                     #
+ * #                      o8888888o                    #
+ * #                      88" . "88                    #
+ * #                      (| -_- |)                    #
+ * #                      0\  =  /0                    #
+ * #                    ___/`---'\___                  #
+ * #                  .' \\|     |// '.                #
+ * #                 / \\|||  :  |||// \               #
+ * #                / _||||| -:- |||||- \              #
+ * #               |   | \\\  -  /// |   |             #
+ * #               | \_|  ''\---/''  |_/ |             #
+ * #               \  .-\__  '-'  ___/-. /             #
+ * #             ___'. .'  /--.--\  `. .'___           #
+ * #          ."" '<  `.___\_<|>_/___.'  >' "" .       #
+ * #         | | :  `- \`.;`\ _ /`;.`/ -`  : | |       #
+ * #         \  \ `_.   \_ __\ /__ _/   .-` /  /       #
+ * #     =====`-.____`.___ \_____/___.-`___.-'=====    #
+ * #                       `=---='                     #
+ * #     ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~   #
+ * #               佛力加持      佛光普照              #
+ * #  Buddha's power blessing, Buddha's light shining  #
+ * #####################################################
+ */
+
+#ifndef _EPUMP_STAT_H_
+#define _EPUMP_STAT_H_
+
+#include "btype.h"
+#include "frame.h"
+
+#ifdef  __cplusplus
+extern "C" {
+#endif
+
+/* log-linear latency histogram in nanoseconds, in the manner of HdrHistogram.
+   values less than 4 have one bucket each, every power of 2 above is split
+   into 4 sub-buckets, so the relative error is no more than 25%. values
+   above 2^45 ns (about 9.7 hours) are all counted in the last bucket */
+#define EPS_HIST_SUBBITS     2
+#define EPS_HIST_BUCKETS     176
+
+typedef struct EPHist_ {
+    uint64        count;
+    uint64        sum;
+    uint64        max;
+    uint64        bucket[EPS_HIST_BUCKETS];
+} ephist_t;
+
+/* callback execution time is classified by event type and by fdtype */
+#define EPS_IOE_NUM          11
+#define EPS_FDT_NUM          16
+
+#define EPS_THREAD_EPUMP     1
+#define EPS_THREAD_WORKER    2
+
+/* every ePump and worker thread owns one eplat_t, which is only written by
+   the owner thread without any lock. other threads read it by copying with
+   eplat_copy, the sample being recorded may be half seen and count is
+   recalculated from buckets. histograms are accumulated since thread started,
+   the latency of a period is the difference of two snapshots */
+typedef struct EPLatency_ {
+    ulong         threadid;
+    int           type;          /* EPS_THREAD_EPUMP or EPS_THREAD_WORKER, 0 for merged */
+
+    ephist_t      queue;         /* from event pushed into queue to its execution */
+    ephist_t      exec;          /* execution time of all events */
+    ephist_t      exec_ioe[EPS_IOE_NUM];
+    ephist_t      exec_fdt[EPS_FDT_NUM];
+
+    ephist_t      poll;          /* blocking in epoll_wait/kevent/select, or event_wait of worker */
+    ephist_t      loop;          /* one loop iteration, blocking time excluded */
+
+    uint64        evnum[EPS_IOE_NUM];  /* executed events, counted even if recording is off */
+} eplat_t;
+
+
+/* the counters of epcore_t are added by multiple threads */
+#if defined(_WIN32) || defined(_WIN64)
+#define epstat_inc(p)  InterlockedIncrement64((volatile LONG64 *)(p))
+#elif defined(__GNUC__)
+#define epstat_inc(p)  __sync_fetch_and_add((p), 1)
+#else
+#define epstat_inc(p)  (++(*(p)))
+#endif
+
+/* memory pools of epcore and DNS, in the order of EPS_POOL_NAMES */
+#define EPS_POOL_NUM         10
+#define EPS_POOL_NAMES       { "device", "timer", "event", "epump", "devrbn", \
+                               "timrbn", "udpvec", "udpgro", "dnsmsg", "dnscache" }
+#define EPS_NS_MAX           8
+#define EPS_THREAD_MAX       128
+
+typedef struct EPStatPool_ {
+    long          size;          /* bytes allocated from OS */
+    int           allocated;     /* units allocated */
+    int           consumed;      /* units in use */
+} epstat_pool_t;
+
+typedef struct EPStatNS_ {
+    char          ip[41];
+    int           port;
+    uint32        srtt;          /* milliseconds */
+    uint32        rttvar;
+    uint32        rttp95;
+    int           failnum;
+} epstat_ns_t;
+
+typedef struct EPStatThread_ {
+    ulong         threadid;
+    int           type;          /* EPS_THREAD_EPUMP or EPS_THREAD_WORKER */
+    int           devnum;
+    int           timernum;
+    int           queuenum;      /* events waiting in queue */
+    uint64        wakeup_recv;
+    uint64        evnum[EPS_IOE_NUM];
+} epstat_thread_t;
+
+/* counters are accumulated since epcore started, and the rates are
+   calculated from two snapshots by the collector */
+typedef struct EPStat_ {
+    time_t        startup;
+    int           devnum;
+    int           timernum;
+
+    uint64        event_num;
+    uint64        accept_num;
+    uint64        connect_num;
+    uint64        close_num;
+    uint64        wakeup_send;
+    uint64        wakeup_recv;
+
+    epstat_pool_t pool[EPS_POOL_NUM];
+
+    uint64        dns_query;
+    uint64        dns_cache_hit;
+    uint64        dns_hosts_hit;
+    uint64        dns_stale;
+    uint64        dns_negative;
+    uint64        dns_prefetch;
+    uint64        dns_tcp;
+    uint64        dns_hedge;
+    int           dns_cachenum;
+    int           dns_msgnum;
+
+    int           nsnum;
+    epstat_ns_t   ns[EPS_NS_MAX];
+
+    int           thread_num;
+    epstat_thread_t thread[EPS_THREAD_MAX];
+} epstat_t;
+
+
+/* monotonic clock in nanoseconds */
+uint64 epnanotime (void);
+
+/* name string of IOE_XXX event type */
+char * epstat_event_name (int event);
+
+void   ephist_add (ephist_t * hist, uint64 val);
+void   ephist_copy (ephist_t * dst, ephist_t * src);
+void   ephist_merge (ephist_t * dst, ephist_t * src);
+
+/* the highest value of the bucket that pct percent of samples fall into */
+uint64 ephist_percentile (ephist_t * hist, double pct);
+uint64 ephist_mean (ephist_t * hist);
+/* number of samples no more than val */
+uint64 ephist_count_le (ephist_t * hist, uint64 val);
+
+void * eplat_alloc (int type);
+void   eplat_free (void * vlat);
+
+/* index of exec_ioe for IOE_XXX event type, and of exec_fdt for FDT_XXX */
+int    eplat_ioe_index (int type);
+int    eplat_fdt_index (int fdtype);
+
+void   eplat_exec_add (void * vlat, int type, int fdtype, uint64 stamp, uint64 start, uint64 end);
+
+void   eplat_copy (eplat_t * dst, eplat_t * src);
+void   eplat_merge (eplat_t * dst, eplat_t * src);
+
+void   eplat_print (eplat_t * lat, frame_p frm, FILE * fp);
+
+/* watchdog of callbacks running too long. the device attributes are kept
+   by epslow_begin since the device may be closed in callback */
+typedef struct EPSlowCB_ {
+    uint64        start;
+    void        * cb;
+    int           event;
+    int           fdtype;
+    ulong         objid;
+    char          remote_ip[41];
+    uint16        remote_port;
+} epslow_t;
+
+/* callbacks running thresms milliseconds or longer are logged with the
+   event, device and symbolized callback. 0 disables the watchdog. only
+   1 of every sample callbacks is timed, 1 for timing all of them */
+int    epcore_slow_callback (void * vpcore, int thresms, int sample);
+
+/* return 1 if the callback is sampled for timing */
+int    epslow_begin (void * vpcore, epslow_t * slow, int event, void * cb,
+                     void * vdev, ulong objid, int fdtype);
+int    epslow_end   (void * vpcore, epslow_t * slow);
+
+/* collect counters of epcore, memory pools, DNS and every thread. the
+   threads are not locked or stopped, the counters and the sizes of DNS
+   tables are read as they are. only the Name Server list and the thread
+   lists are locked while copying */
+int    epcore_stat (void * vpcore, epstat_t * st);
+
+/* render the stat and the merged latency histograms in Prometheus text
+   exposition format. lat may be NULL */
+int    epstat_prometheus (epstat_t * st, eplat_t * lat, frame_p frm);
+
+/* collect and render in one call, for the handler of metrics scraping */
+int    epcore_prometheus (void * vpcore, frame_p frm);
+
+/* recording of latency histograms is off by default, it costs two clock
+   reads per event and the application enables it when needed */
+int    epcore_latency_enable (void * vpcore, int onoff);
+
+/* copy the histograms of ePump or worker thread with threadid, or merge
+   all threads when threadid is 0. return the number of threads copied */
+int    epcore_latency (void * vpcore, ulong threadid, eplat_t * lat);
+
+/* copy the histograms of all ePump threads and then worker threads into
+   list, return the number of eplat_t filled */
+int    epcore_latency_snapshot (void * vpcore, eplat_t * list, int num);
+
+#ifdef  __cplusplus
+}
+#endif
+
+#endif
+
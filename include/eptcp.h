@@ -47,8 +47,8 @@ void * eptcp_listen (void * vpcore, char * localip, int port, void * popt, void
    and future-started epump threads.
    if not, create only one listen socket for all epump threads to bind. */
 
-void * eptcp_mlisten (void * vpcore, char * localip, int port, void * para,
-                      IOHandler * cb, void * cbpara);
+void * eptcp_mlisten (void * vpcore, char * localip, int port, void * popt,
+                      void * para, IOHandler * cb, void * cbpara);
 
 void * eptcp_accept (void * vpcore, void * vld, void * popt, void * para, IOHandler * cb,
                      void * cbpara, int bindtype, ulong threadid, int * retval);
@@ -61,6 +61,42 @@ void * eptcp_nb_connect (void * vpcore, char * host, int port, char * localip,
                          int localport, void * popt, void * para, IOHandler * cb,
                          void * cbpara, ulong threadid, int * retval);
 
+/* Happy Eyeballs v2 (rfc8305) connecting. the resolved IPv6 and IPv4 addresses
+   are interleaved and connected one after another every hedelay milliseconds,
+   or immediately when the former attempt fails. every attempt is a separate
+   iodev_t, the first connected socket is handed over to the iodev_t returned
+   by eptcp_nb_connect and all other attempts are closed. the racing starts
+   once the first address family is resolved, the addresses of the other
+   family answered later are interleaved into the attempts not started yet */
+#define EPTCP_HE_ADDRNUM     16
+#define EPTCP_HE_DELAY       250
+
+#define t_eptcp_he_delay     1150
+
+typedef struct EPTcpHE_ {
+    ep_sockaddr_t   addr[EPTCP_HE_ADDRNUM];
+    char            ip[EPTCP_HE_ADDRNUM][41];
+    int             addrnum;
+    int             addrind;
+
+    /* iodev_t IDs of the connecting attempts */
+    ulong           attempt[EPTCP_HE_ADDRNUM];
+    int             pending;
+
+    sockopt_t       opt;
+    uint8           hasopt;
+
+    void          * timer;
+} eptcp_he_t;
+
+int    eptcp_he_start (void * vpcore, void * vdev, void * cache, void * popt);
+/* add the addresses answered late by the other family into the racing */
+int    eptcp_he_add   (void * vpcore, void * vdev, void * cache);
+int    eptcp_he_next  (void * vpcore, void * vdev);
+int    eptcp_he_won   (void * vpcore, void * vdev, void * vaux, int ind, SOCKET fd);
+int    eptcp_he_pump  (void * vpcore, void * pobj, int event, int fdtype);
+void   eptcp_he_free  (void * vpcore, void * vhe);
+
 #ifdef __cplusplus
 }
 #endif
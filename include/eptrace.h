@@ -0,0 +1,118 @@
+/*
+ * Copyright (c) 2003-2024 Ke Hengzhong <kehengzhong@hotmail.com>
+ * All rights reserved. See MIT LICENSE for redistribution.
+ *
+ * #####################################################
+ * #                       _oo0oo_                     #
+ * #                      o8888888o                    #
+ * #                      88" . "88                    #
+ * #                      (| -_- |)                    #
+ * #                      0\  =  /0                    #
+ * #                    ___/`---'\___                  #
+ * #                  .' \\|     |// '.                #
+ * #                 / \\|||  :  |||// \               #
+ * #                / _||||| -:- |||||- \              #
+ * #               |   | \\\  -  /// |   |             #
+ * #               | \_|  ''\---/''  |_/ |             #
+ * #               \  .-\__  '-'  ___/-. /             #
+ * #             ___'. .'  /--.--\  `. .'___           #
+ * #          ."" '<  `.___\_<|>_/___.'  >' "" .       #
+ * #         | | :  `- \`.;`\ _ /`;.`/ -`  : | |       #
+ * #         \  \ `_.   \_ __\ /__ _/   .-` /  /       #
+ * #     =====`-.____`.___ \_____/___.-`___.-'=====    #
+ * #                       `=---='                     #
+ * #     ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~   #
+ * #               佛力加持      佛光普照              #
+ * #  Buddha's power blessing, Buddha's light shining  #
+ * #####################################################
+ */
+
+#ifndef _EPUMP_TRACE_H_
+#define _EPUMP_TRACE_H_
+
+#include "btype.h"
+#include "frame.h"
+
+#ifdef  __cplusplus
+extern "C" {
+#endif
+
+/* flight recorder of ePump. every thread writes binary records into its own
+   ring without lock once tracing is switched on by epcore_trace, the oldest
+   records are overwritten when the ring is full. timestamps are read from TSC
+   on x86 and converted into nanoseconds when dumping. compiling with
+   -DEP_NO_TRACE removes all trace points */
+
+#define EPT_IOE_PUSH         1   /* event=ioe type, objid=object pointer */
+#define EPT_IOE_DISPATCH     2   /* event=ioe type, objid, aux=target thread */
+#define EPT_IOE_EXEC_BEGIN   3   /* event=ioe type, objid */
+#define EPT_IOE_EXEC_END     4   /* event=ioe type */
+#define EPT_DEV_CLOSE        5   /* fd, objid=device id, aux=fdtype */
+#define EPT_POLL_CTL         6   /* event=EPOLL_CTL_XXX, fd, objid=device id, aux=events */
+#define EPT_POLL_BEGIN       7   /* aux=timeout ms */
+#define EPT_POLL_END         8   /* aux=ready fd number */
+#define EPT_TIMER_START      9   /* event=cmdid, objid=timer id, aux=ms */
+#define EPT_TIMER_FIRE       10  /* event=cmdid, objid=timer id */
+#define EPT_TIMER_STOP       11  /* objid=timer id */
+#define EPT_WAKEUP_SEND      12  /* aux=target ePump thread, 0 for all */
+#define EPT_WAKEUP_RECV      13
+#define EPT_MIGRATE          14  /* fd, objid=device id, aux=new thread */
+#define EPT_TYPE_MAX         15
+
+#define EPT_RING_SIZE        8192
+
+typedef struct EPTraceRec_ {
+    uint64        tsc;
+    uint16        type;
+    uint16        event;
+    int           fd;
+    uint64        objid;
+    uint64        aux;
+} eptrace_rec_t;
+
+typedef struct EPTraceRing_ {
+    ulong           threadid;
+    void          * pcore;
+    uint32          size;          /* power of 2 */
+    uint64          head;          /* records ever written */
+    eptrace_rec_t * rec;
+} eptrace_ring_t;
+
+#ifdef EP_NO_TRACE
+#define EPTRACE(pcore, type, event, fd, objid, aux)
+#else
+#define EPTRACE(pcore, type, event, fd, objid, aux) do {                         \
+    if ((pcore) && ((epcore_t *)(pcore))->trace)                                  \
+        eptrace_add((pcore), (type), (event), (fd), (uint64)(objid), (uint64)(aux)); \
+} while (0)
+#endif
+
+uint64 eptrace_tsc (void);
+
+/* new generation of the ring registry of epcore, the ring cached by thread
+   is valid only when its generation is same as epcore */
+uint64 eptrace_gen_next (void);
+
+void   eptrace_add (void * vpcore, int type, int event, int fd, uint64 objid, uint64 aux);
+
+void   eptrace_clean (void * vpcore);
+
+/* ringsize is the record number of each thread, rounded up to power of 2 */
+int    epcore_trace (void * vpcore, int onoff, int ringsize);
+
+/* write all rings into binary file, which is converted by eptrace_json */
+int    epcore_trace_save (void * vpcore, char * file);
+
+/* render all rings in Chrome trace event JSON, loadable by Perfetto UI
+   and chrome://tracing */
+int    epcore_trace_json (void * vpcore, frame_p frm);
+
+/* convert the binary file saved by epcore_trace_save into JSON */
+int    eptrace_file_json (char * file, frame_p frm);
+
+#ifdef  __cplusplus
+}
+#endif
+
+#endif
+
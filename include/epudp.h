@@ -30,10 +30,51 @@
 #ifndef _EPUDP_H_
 #define _EPUDP_H_
 
+/* included by epump.h as the public UDP API, it uses only the types that
+   epump.h declares before including it */
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+/* message unit for batched UDP receiving and sending. for receiving, buf and
+   size give the buffer, len, flags and addr are filled with the datagram length,
+   MSG_TRUNC etc. flags and source address. for sending, len bytes of buf are
+   sent to addr, or to the connected peer if addr.socklen is 0.
+   segsize is the segment size of UDP GSO/GRO. the received buffer coalesced by
+   GRO consists of segments of segsize bytes except the last one, 0 means one
+   single datagram. the sending buffer is split by kernel into segsize datagrams
+   if segsize is greater than 0 and less than len. */
+typedef struct EPUdpMsg_ {
+    void          * buf;
+    int             size;
+    int             len;
+    int             flags;
+    int             segsize;
+    ep_sockaddr_t   addr;
+} epudp_msg_t;
+
+/* pooled vector used when caller provides no message vector. the datagram
+   longer than EPUDP_BATCH_BUFSIZE is truncated and marked MSG_TRUNC */
+#define EPUDP_BATCH_NUM      32
+#define EPUDP_BATCH_BUFSIZE  2048
+
+typedef struct EPUdpVec_ {
+    epudp_msg_t     msgs[EPUDP_BATCH_NUM];
+    uint8           bufs[EPUDP_BATCH_NUM][EPUDP_BATCH_BUFSIZE];
+} epudp_vec_t;
+
+/* with UDP_GRO enabled, kernel coalesces datagrams up to 64K bytes */
+#define EPUDP_GRO_NUM        8
+#define EPUDP_GRO_BUFSIZE    65536
+
+typedef struct EPUdpGroVec_ {
+    epudp_msg_t     msgs[EPUDP_GRO_NUM];
+    uint8           bufs[EPUDP_GRO_NUM][EPUDP_GRO_BUFSIZE];
+} epudp_grovec_t;
+
+typedef int UdpBatchCB (void * cbpara, void * vdev, epudp_msg_t * msgs, int num);
+
 void * epudp_listen_create (void * vpcore, char * localip, int port, void * popt,
                             void * para, IOHandler * cb, void * cbpara,
                             iodev_t ** devlist, int * devnum, int * retval);
@@ -51,6 +92,28 @@ void * epudp_client (void * vpcore, char * localip, int port, void * popt,
 
 int epudp_recvfrom (void * vdev, void * vfrm, void * pbuf, int bufsize, void * addr, int * pnum);
 
+/* receive up to num datagrams by one system call. return the number of
+   datagrams received, 0 if no more data available, negative on error */
+int epudp_recvmmsg (void * vdev, epudp_msg_t * msgs, int num);
+
+/* send num datagrams in batch. return the number of datagrams sent, which
+   is less than num when socket buffer is full, negative on error */
+int epudp_sendmmsg (void * vdev, epudp_msg_t * msgs, int num);
+
+/* drain the device until EAGAIN, handing every batch of received datagrams
+   to cb. if msgs is NULL, a pooled vector of EPUDP_BATCH_NUM buffers is used.
+   return the total number of datagrams received */
+int epudp_recv_batch (void * vdev, epudp_msg_t * msgs, int num, UdpBatchCB * cb, void * cbpara);
+
+/* set the UDP_SEGMENT size of the device, all the following sendings with
+   segsize of 0 are segmented by kernel with this size. 0 disables GSO */
+int epudp_gso_set (void * vdev, int segsize);
+int epudp_gso     (void * vdev);
+
+/* enable UDP_GRO receiving, epudp_recvmmsg hands over coalesced buffers */
+int epudp_gro_set (void * vdev, int onoff);
+int epudp_gro     (void * vdev);
+
 #ifdef __cplusplus
 }
 #endif
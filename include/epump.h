@@ -31,6 +31,7 @@
 #define _EVENT_PUMP_H_
  
 #include "btype.h"
+#include "epstat.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -57,6 +58,7 @@ typedef int GeneralCB (void * vpara, int status);
 #define IOE_READ             4
 #define IOE_WRITE            5
 #define IOE_INVALID_DEV      6
+#define IOE_ZEROCOPY         7
 #define IOE_TIMEOUT          100
 #define IOE_DNS_RECV         200
 #define IOE_DNS_CLOSE        201
@@ -80,8 +82,42 @@ typedef struct EPCore_ epcore_t;
 void * epcore_new (int maxfd);
 void   epcore_clean (void * vpcore);
 int    epcore_dnsrv_add (void * vpcore, char * nsip, int port);
+/* remove all Name Servers including the ones of resolv.conf, e.g. to resolve
+   only through a local stub server. queries in flight keep the removed ones
+   until they finish, their memory is released by epcore_clean */
+int    epcore_dnsrv_clear (void * vpcore);
+/* refresh DNS cache hit at least minhits times in 30 seconds, when ratio
+   percent of its TTL elapsed. ratio 0 disables prefetching */
+int    epcore_dns_prefetch (void * vpcore, int ratio, int minhits);
+/* serve expired DNS RR up to stalemax seconds when refreshing is in flight
+   or Name Servers are unreachable. stalemax 0 disables serve-stale */
+int    epcore_dns_stale (void * vpcore, int stalemax);
+/* UDP payload size advertised by EDNS0 OPT record, default 1232, 0 disables
+   EDNS0, at most 32768. truncated response is always retried over TCP */
+int    epcore_dns_edns (void * vpcore, int size);
+/* DNS queries go to the fastest healthy Name Server by measured RTT. with
+   hedging on, the query is sent again to the next best server when no
+   response arrives within the p95 RTT of the first one */
+int    epcore_dns_hedge (void * vpcore, int onoff);
+/* DNS cache is loaded from the snapshot file at once for warm start, and
+   saved to it every interval seconds (0 for never) and on epcore_clean.
+   the RRs past TTL are loaded only within the serve-stale window */
+int    epcore_dns_snapshot (void * vpcore, char * file, int interval);
+/* names in hosts file (default /etc/hosts, reloaded when modified) and static
+   entries are answered synchronously without Name Server. static entry added
+   by epcore_dns_host_add overrides hosts file, multiple IPs can be added */
+int    epcore_dns_hosts (void * vpcore, char * hostsfile);
+int    epcore_dns_host_add (void * vpcore, char * name, char * ip);
+int    epcore_dns_host_del (void * vpcore, char * name);
+/* Happy Eyeballs v2 (rfc8305): resolve A and AAAA records in parallel, and
+   eptcp_nb_connect races the connects to all addresses, staggered by delayms
+   (default 250). the first connected one is kept and reported by IOE_CONNECTED */
+int    epcore_happy_eyeballs (void * vpcore, int onoff, int delayms);
 int    epcore_set_callback (void * vpcore, void * cb, void * cbpara);
 
+/* name of the fd-watching mechanism compiled in: epoll, kqueue, select or iocp */
+char * epcore_backend (void);
+
 void   epcore_start_epump (void * vpcore, int maxnum);
 void   epcore_stop_epump (void * vpcore);
 void * epump_thread_find (void * vpcore, ulong threadid);
@@ -96,6 +132,24 @@ void * worker_thread_self (void * vpcore);
 void * worker_thread_select (void * vpcore);
 
 void   epcore_print (void * vpcore, frame_p frm, FILE * fp);
+
+
+/* latency histograms ephist_t and eplat_t, the structured stats epstat_t,
+   and the functions recording, collecting and rendering them are declared
+   in epstat.h */
+
+/* per-thread binary trace rings record ioevent push/dispatch/execute, device
+   close, epoll_ctl, polling, timer start/fire/stop, wakeup and migration of
+   device between threads. ringsize is the record number of each thread.
+   compile with -DEP_NO_TRACE to remove all trace points */
+int    epcore_trace (void * vpcore, int onoff, int ringsize);
+
+/* save the trace rings into binary file, converted by sample/eptrace tool */
+int    epcore_trace_save (void * vpcore, char * file);
+
+/* render the trace rings in Chrome trace event JSON for Perfetto UI */
+int    epcore_trace_json (void * vpcore, frame_p frm);
+int    eptrace_file_json (char * file, frame_p frm);
  
 
 struct EPump_ ;
@@ -196,6 +250,21 @@ int      iodev_tcp_nodelay_set (void * vpdev, int value);
 int      iodev_tcp_nopush      (void * vpdev);
 int      iodev_tcp_nopush_set  (void * vpdev, int value);
 
+/* MSG_ZEROCOPY sending for TCP connection. the buffer passed to iodev_zerocopy_send
+   must be kept intact until IOE_ZEROCOPY event arrives and iodev_zerocopy_done
+   returns 1 for the sequence number returned in pseq. only Linux epoll backend
+   supports it, iodev_zerocopy_set returns negative on others */
+int      iodev_zerocopy        (void * vpdev);
+int      iodev_zerocopy_set    (void * vpdev, int onoff);
+int      iodev_zerocopy_send   (void * vpdev, void * pbuf, int len, uint32 * pseq);
+int      iodev_zerocopy_done   (void * vpdev, uint32 seq);
+uint32   iodev_zerocopy_doneseq(void * vpdev);
+
+/* the listen device bound with BIND_ALL_EPUMP is registered into epoll
+   with EPOLLEXCLUSIVE by default, it can be disabled by iodev_pollexcl_set */
+int      iodev_pollexcl        (void * vpdev);
+int      iodev_pollexcl_set    (void * vpdev, int onoff);
+
 void     epump_iodev_print (void * vepump, int printtype);
  
 
@@ -223,6 +292,19 @@ int    mlisten_close (void * vmln);
 int    mlisten_port  (void * vmln);
 char * mlisten_lip   (void * vmln);
 
+/* steer new connections among the REUSEPORT listen sockets of mlisten.
+   MLN_STEER_HASH is the kernel default hashing, MLN_STEER_CPU pins the epump
+   threads to the CPUs allowed for the process, changing their affinity, and
+   directs the connection to the listen socket of the
+   epump running on the CPU handling the packet, MLN_STEER_LOAD spreads the
+   connections weighted by the inverse of the epump load */
+#define MLN_STEER_HASH       0
+#define MLN_STEER_CPU        1
+#define MLN_STEER_LOAD       2
+
+int    mlisten_steer_set (void * vmln, int mode);
+int    mlisten_stat      (void * vmln, ulong * epumpid, ulong * acceptnum, int num);
+
 
 void * eptcp_listen (void * vpcore, char * localip, int port, void * popt, void * para,
                      IOHandler * cb, void * cbpara, int bindtype, void ** plist,
@@ -248,18 +330,9 @@ void * eptcp_nb_connect (void * vpcore, char * host, int port, char * localip,
                          void * cbpara, ulong threadid, int * retval);
 
 
-void * epudp_listen (void * vpcore, char * localip, int port, void * popt, void * para,
-                     IOHandler * cb, void * cbpara, int bindtype, void ** plist,
-                     int * listnum, int * pret);
- 
-void * epudp_mlisten (void * vpcore, char * localip, int port, void * popt,
-                      void * para, IOHandler * cb, void * cbpara);
- 
-void * epudp_client (void * vpcore, char * localip, int port, void * popt,
-                     void * para, IOHandler * cb, void * cbpara,
-                     iodev_t ** devlist, int * devnum, int * retval);
-
-int    epudp_recvfrom (void * vdev, void * vfrm, void * pbuf, int bufsize, void * addr, int * pnum);
+/* UDP devices, batched receiving and sending with epudp_msg_t, and UDP
+   GSO/GRO are declared in epudp.h */
+#include "epudp.h"
 
 void * epusock_connect (void * vpcore, char * sockname, void * para, IOHandler * ioh,
                         void * iohpara, ulong threadid, int * retval);
@@ -286,6 +359,8 @@ void * epfile_bind_stdin (void * vpcore, void * para, IOHandler * ioh, void * io
 #define DNS_ERR_REFUSED        5
 #define DNS_ERR_IPV4           200
 #define DNS_ERR_IPV6           201
+#define DNS_ERR_NO_DATA        204
+#define DNS_ERR_LATE_ADDR      206
 #define DNS_ERR_NO_RESPONSE    404
 #define DNS_ERR_SEND_FAIL      405
 #define DNS_ERR_RESOURCE_FAIL  500
@@ -82,6 +82,15 @@ typedef struct EPump_ {
 
     uint8              epumpsleep;
 
+    /* nanoseconds blocked in last epoll_wait/kevent/select */
+    uint64             pollns;
+
+    /* times of being woken up by wakeup fd */
+    uint64             wakeup_recv;
+
+    /* latency histograms of current ePump thread, see epstat.h */
+    void             * lat;
+
     /* Store all devices that need event monitoring in the current ePump thread.
        The same device object may be added to the device_tree in multiple ePump,
        so the alloc_node parameter must be set to 1 when creating the device_tree. */
@@ -109,6 +118,12 @@ typedef struct EPump_ {
 
     /* current threads management */
     ulong              threadid;
+#ifdef UNIX
+    pthread_t          thid;
+#endif
+
+    /* CPU the thread is pinned to, -1 if not pinned to one CPU */
+    int                cpu;
 #if defined(_WIN32) || defined(_WIN64)
     HANDLE             epumphandle;
 #endif
@@ -137,6 +152,11 @@ int epump_cmp_epump_by_timernum (void * a, void * b);
 int epump_objnum (void * veps, int type);
 ulong  epumpid (void * veps);
 
+/* pin the ePump thread to one CPU, used by CPU steering of mlisten */
+int    epump_cpu_pin (void * veps, int cpu);
+int    epump_cpu     (void * veps);
+int    epump_cpu_allowed (int * cpus, int max);
+
 int    epump_iodev_add (void * veps, void * vpdev);
 void * epump_iodev_del (void * veps, SOCKET fd);
 void * epump_iodev_find (void * vepump, SOCKET fd);
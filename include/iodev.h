@@ -46,6 +46,12 @@
 extern "C" {
 #endif
 
+/* MSG_ZEROCOPY transmission needs kernel 4.14+ and the corresponding libc headers.
+   the completions are drained by epoll backend only, select build has no support */
+#if defined(_LINUX_) && defined(HAVE_EPOLL) && defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY)
+#define HAVE_ZEROCOPY
+#endif
+
 #define RWF_READ  0x02
 #define RWF_WRITE 0x04
 
@@ -144,6 +150,29 @@ typedef struct IODevice_ {
     unsigned    keepalive:1;
 
     unsigned    ssl_handshaked:1;
+    unsigned    zerocopy:1;
+
+    /* listen device shared by all epump threads is registered with
+       EPOLLEXCLUSIVE, only one epump is woken up for the new connection */
+    unsigned    pollexcl:1;
+
+    /* MSG_ZEROCOPY sending state. every successful zerocopy send is numbered
+       by zc_sendseq. the completion notifications read from error queue
+       advance zc_doneseq, the buffers sent with sequence number less than
+       zc_doneseq have been released by kernel and can be reused or freed. */
+    uint32      zc_sendseq;
+    uint32      zc_doneseq;
+    uint32      zc_copied;
+
+    /* UDP_SEGMENT size set on the UDP socket, and UDP_GRO enabled or not */
+    uint16      gso_size;
+    uint8       udp_gro;
+
+    /* the number of connections accepted by the listen device */
+    ulong       acceptnum;
+
+    /* Happy Eyeballs racing state while connecting to multiple addresses */
+    void      * hectx;
 
     void      * iot;
 
@@ -212,6 +241,16 @@ int      iodev_tcp_nodelay_set (void * vpdev, int value);
 int      iodev_tcp_nopush      (void * vpdev);
 int      iodev_tcp_nopush_set  (void * vpdev, int value);
 
+int      iodev_zerocopy        (void * vpdev);
+int      iodev_zerocopy_set    (void * vpdev, int onoff);
+int      iodev_zerocopy_send   (void * vpdev, void * pbuf, int len, uint32 * pseq);
+int      iodev_zerocopy_recv   (void * vpdev);
+int      iodev_zerocopy_done   (void * vpdev, uint32 seq);
+uint32   iodev_zerocopy_doneseq(void * vpdev);
+
+int      iodev_pollexcl        (void * vpdev);
+int      iodev_pollexcl_set    (void * vpdev, int onoff);
+
 
 int iodev_print (void * vpcore);
 
@@ -43,6 +43,7 @@ extern "C" {
 #define IOE_READ             4
 #define IOE_WRITE            5
 #define IOE_INVALID_DEV      6
+#define IOE_ZEROCOPY         7
 #define IOE_TIMEOUT          100
 #define IOE_DNS_RECV         200
 #define IOE_DNS_CLOSE        201
@@ -60,7 +61,8 @@ typedef struct IOEvent_ {
     void      * callback;
     void      * cbpara;
 
-    time_t      stamp;
+    /* monotonic nanoseconds when the event is pushed, for queue delay */
+    uint64      stamp;
 
     ulong       epumpid;
     ulong       workerid;
@@ -81,6 +83,13 @@ int    ioevent_remove (void * vepump, void * obj);
 
 void * ioevent_execute (void * vpcore, void * vioe);
 
+/* FDT_XXX type of the object that the event occurs on */
+int    ioevent_fdtype (void * vioe);
+
+/* execute the event and record its queue delay and execution time into
+   the latency histograms vlat of current thread */
+void * ioevent_execute_lat (void * vpcore, void * vioe, void * vlat);
+
 int    ioevent_handle (void * vepump);
 
 void   ioevent_print (void * vioe, char * title);
@@ -92,6 +101,7 @@ void   ioevent_print (void * vioe, char * title);
 #define PushWritableEvent(epump, obj)    ioevent_push((epump), IOE_WRITE, (obj), NULL, NULL)
 #define PushTimeoutEvent(epump, obj)     ioevent_push((epump), IOE_TIMEOUT, (obj), NULL, NULL)
 #define PushInvalidDevEvent(epump, obj)  ioevent_push((epump), IOE_INVALID_DEV, (obj), NULL, NULL)
+#define PushZeroCopyEvent(epump, obj)    ioevent_push((epump), IOE_ZEROCOPY, (obj), NULL, NULL)
 #define PushDnsRecvEvent(epump, obj)     ioevent_push((epump), IOE_DNS_RECV, (obj), NULL, NULL)
 #define PushDnsCloseEvent(epump, obj)    ioevent_push((epump), IOE_DNS_CLOSE, (obj), NULL, NULL)
 
@@ -46,6 +46,26 @@ extern "C" {
    in kernel that only one epump thread got accept success!
  */
 
+/* steering mode of new connections among the REUSEPORT listen sockets.
+   by default, kernel selects the listen socket by the hash of 4-tuple.
+   MLN_STEER_CPU pins the epump thread of every listen socket to one CPU and
+   directs the connection to the listen socket whose epump runs on the CPU
+   that handles the packet. note that it changes the affinity of the epump
+   threads not pinned yet, the CPUs are taken in turn from the ones allowed
+   for the process. MLN_STEER_LOAD spreads new connections randomly
+   with the weights inversely proportional to the load of the epump threads,
+   re-evaluated every MLN_STEER_INTERVAL milliseconds. both modes are
+   implemented by the classic BPF program attached to the reuseport group,
+   which addresses at most MLN_STEER_MAX listen sockets. */
+#define MLN_STEER_HASH       0
+#define MLN_STEER_CPU        1
+#define MLN_STEER_LOAD       2
+
+#define MLN_STEER_INTERVAL   1000
+#define MLN_STEER_MAX        512
+
+#define t_mlisten_steer      1140
+
 typedef struct mlisten_st_ {
     char         localip[41];
     int          port;
@@ -62,6 +82,11 @@ typedef struct mlisten_st_ {
     int          fdtype; 
     arr_t      * devlist;
 
+    /* steering mode and the device index of least-loaded epump in LOAD mode */
+    int          steer;
+    int          steerind;
+    void       * steertimer;
+
     void       * pcore;
 } mlisten_t;
 
@@ -72,6 +97,13 @@ int    mlisten_iodev_add (void * vmln, void * pdev);
 int    mlisten_port (void * vmln);
 char * mlisten_lip (void * vmln);
 
+int    mlisten_steer_set   (void * vmln, int mode);
+int    mlisten_steer_apply (void * vmln);
+int    mlisten_steer_pump  (void * vmln, void * pobj, int event, int fdtype);
+
+/* get the accepted number of every listen device and the epump it is bound to */
+int    mlisten_stat (void * vmln, ulong * epumpid, ulong * acceptnum, int num);
+
 int    epcore_mlisten_init (void * epcore);
 int    epcore_mlisten_clean (void * epcore);
 
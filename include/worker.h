@@ -70,6 +70,9 @@ typedef struct Worker_s {
 
     int                workload;
 
+    /* latency histograms of current worker thread, see epstat.h */
+    void             * lat;
+
     epcore_t         * epcore;
     uint8              quit;
 
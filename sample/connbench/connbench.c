@@ -0,0 +1,461 @@
+/*
+ * Copyright (c) 2003-2024 Ke Hengzhong <kehengzhong@hotmail.com>
+ * All rights reserved.
+ */
+
+#include "adifall.ext"
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include "epump.h"
+
+/* loopback benchmark of short-lived TCP connections. for every ePump thread
+   number given, two phases are run in a new epcore_t instance:
+
+   churn   C client slots keep connecting by eptcp_nb_connect, sending one
+           byte and waiting the server accepting by eptcp_accept, reading the
+           byte and closing. each slot reconnects at once in its own ePump
+           thread. connections per second and the time from connecting
+           to closing are reported.
+   calls   every ePump thread runs K rounds of iodev_new_from_fd,
+           iodev_bind_epump and iodev_close_by on a fresh socket at the same
+           time, showing the serialization on device table and pools as the
+           ePump thread number grows.
+
+   Usage: connbench [-e 1,2,4] [-c slots] [-t seconds] [-k rounds]
+                    [-p port] [-o result.json] */
+
+#define MAX_LIST     16
+#define MAX_EPUMP    64
+
+#define CMD_CALLS    1
+
+typedef struct BenchConf_ {
+    int       epump[MAX_LIST];
+    int       epnum;
+    int       slots;
+    int       duration;
+    int       rounds;
+    int       port;
+    char    * output;
+} bench_conf_t;
+
+/* client slot, reconnected always in the same ePump thread */
+typedef struct ConnSlot_ {
+    epcore_t * pcore;
+    void     * pdev;
+    uint64     start;
+    uint64     conns;
+    uint64     fails;
+    ephist_t   hist;
+} conn_slot_t;
+
+/* per-call cost measured by one ePump thread */
+typedef struct CallStat_ {
+    ephist_t   newdev;
+    ephist_t   bind;
+    ephist_t   close;
+} call_stat_t;
+
+typedef struct BenchResult_ {
+    int          epump;
+    double       seconds;
+    uint64       conns;
+    uint64       fails;
+    ephist_t     hist;
+    call_stat_t  calls;
+    double       calls_sec;   /* elapsed time of all threads doing the rounds */
+} bench_result_t;
+
+bench_conf_t         gconf;
+static volatile int  running = 0;
+static volatile int  measuring = 0;
+static volatile int  calls_done = 0;
+
+int conn_srv_pump (void * vpcore, void * vobj, int event, int fdtype);
+int conn_cli_pump (void * vpcore, void * vobj, int event, int fdtype);
+int calls_pump (void * vpcore, void * vobj, int event, int fdtype);
+
+
+static int parse_list (char * str, int * list, int max)
+{
+    char  * p = str;
+    int     num = 0;
+
+    while (p && *p && num < max) {
+        list[num++] = (int)strtol(p, &p, 10);
+        while (*p == ',' || *p == ' ') p++;
+    }
+
+    return num;
+}
+
+/* thread ids of running ePump threads, taken from structured stats */
+static int epump_ids (epcore_t * pcore, ulong * ids, int max)
+{
+    epstat_t  * st = NULL;
+    int         i, num = 0;
+
+    st = kzalloc(sizeof(*st));
+    if (!st) return 0;
+
+    epcore_stat(pcore, st);
+
+    for (i = 0; i < st->thread_num && num < max; i++) {
+        if (st->thread[i].type == EPS_THREAD_EPUMP)
+            ids[num++] = st->thread[i].threadid;
+    }
+
+    kfree(st);
+
+    return num;
+}
+
+
+int conn_srv_pump (void * vpcore, void * vobj, int event, int fdtype)
+{
+    epcore_t  * pcore = (epcore_t *)vpcore;
+    void      * pdev = NULL;
+    char        buf[256];
+    int         ret = 0, num = 0;
+
+    switch (event) {
+    case IOE_ACCEPT:
+        if (fdtype != FDT_LISTEN)
+            return -1;
+
+        while (1) {
+            pdev = eptcp_accept(pcore, vobj, NULL, NULL, conn_srv_pump, pcore,
+                                BIND_ONE_EPUMP, 0, &ret);
+            if (!pdev) break;
+        }
+        break;
+
+    case IOE_READ:
+        /* one byte received or the client closed, server closes at once */
+        tcp_nb_recv(iodev_fd(vobj), buf, sizeof(buf), &num);
+        iodev_close(vobj);
+        break;
+
+    case IOE_INVALID_DEV:
+        iodev_close(vobj);
+        break;
+    }
+
+    return 0;
+}
+
+static void conn_slot_start (conn_slot_t * slot, ulong epumpid)
+{
+    int  ret = 0;
+
+    slot->start = epnanotime();
+
+    slot->pdev = eptcp_nb_connect(slot->pcore, "127.0.0.1", gconf.port, NULL, 0, NULL,
+                                  slot, conn_cli_pump, slot->pcore, epumpid, &ret);
+    if (!slot->pdev) {
+        slot->fails++;
+        return;
+    }
+
+    /* connection set up immediately is reported by IOE_WRITE */
+    if (ret >= 0) iodev_add_notify(slot->pdev, RWF_WRITE);
+}
+
+static void conn_slot_done (conn_slot_t * slot, void * pdev, int succ)
+{
+    ulong  epumpid = iodev_epumpid(pdev);
+
+    if (measuring) {
+        if (succ) {
+            slot->conns++;
+            ephist_add(&slot->hist, epnanotime() - slot->start);
+        } else {
+            slot->fails++;
+        }
+    }
+
+    slot->pdev = NULL;
+    iodev_close(pdev);
+
+    if (!running) return;
+
+    conn_slot_start(slot, epumpid);
+}
+
+int conn_cli_pump (void * vpcore, void * vobj, int event, int fdtype)
+{
+    conn_slot_t * slot = (conn_slot_t *)iodev_para(vobj);
+    char          buf[256];
+    int           ret = 0, num = 0;
+
+    if (!slot) return -1;
+
+    switch (event) {
+    case IOE_CONNECTED:
+    case IOE_WRITE:
+        iodev_del_notify(vobj, RWF_WRITE);
+
+        ret = tcp_nb_send(iodev_fd(vobj), "x", 1, &num);
+        if (ret < 0) conn_slot_done(slot, vobj, 0);
+        break;
+
+    case IOE_READ:
+        /* server closed the connection after reading the byte */
+        ret = tcp_nb_recv(iodev_fd(vobj), buf, sizeof(buf), &num);
+        if (ret < 0) conn_slot_done(slot, vobj, 1);
+        break;
+
+    case IOE_CONNFAIL:
+    case IOE_INVALID_DEV:
+        conn_slot_done(slot, vobj, 0);
+        break;
+    }
+
+    return 0;
+}
+
+
+/* run in the ePump thread given by the timer */
+int calls_pump (void * vpcore, void * vobj, int event, int fdtype)
+{
+    epcore_t    * pcore = (epcore_t *)vpcore;
+    call_stat_t * cs = NULL;
+    void        * pdev = NULL;
+    SOCKET        fd;
+    uint64        t0, t1, t2, t3;
+    int           i;
+
+    if (event != IOE_TIMEOUT || iotimer_cmdid(vobj) != CMD_CALLS)
+        return 0;
+
+    cs = (call_stat_t *)iotimer_para(vobj);
+
+    for (i = 0; cs && i < gconf.rounds; i++) {
+        fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd == INVALID_SOCKET) break;
+
+        t0 = epnanotime();
+        pdev = iodev_new_from_fd(pcore, fd, FDT_CONNECTED, NULL, calls_pump, pcore);
+        t1 = epnanotime();
+        if (!pdev) {
+            close(fd);
+            break;
+        }
+
+        iodev_bind_epump(pdev, BIND_CURRENT_EPUMP, 0, 0);
+        t2 = epnanotime();
+
+        iodev_close_by(pcore, iodev_id(pdev));
+        t3 = epnanotime();
+
+        ephist_add(&cs->newdev, t1 - t0);
+        ephist_add(&cs->bind, t2 - t1);
+        ephist_add(&cs->close, t3 - t2);
+    }
+
+    __sync_fetch_and_add(&calls_done, 1);
+
+    return 0;
+}
+
+
+static int bench_run (int epnum, int port, bench_result_t * res)
+{
+    epcore_t     * pcore = NULL;
+    conn_slot_t  * slots = NULL;
+    call_stat_t  * cs = NULL;
+    void         * mlisten = NULL;
+    ulong          ids[MAX_EPUMP];
+    uint64         t0, t1;
+    int            i, num, started = 0, ret = 0;
+
+    memset(res, 0, sizeof(*res));
+    res->epump = epnum;
+
+    pcore = epcore_new(65536);
+    if (!pcore) return -1;
+
+    epcore_start_epump(pcore, epnum);
+
+    mlisten = eptcp_mlisten(pcore, "127.0.0.1", port, NULL, NULL, conn_srv_pump, pcore);
+    if (!mlisten) {
+        printf("listen port %d failed\n", port);
+        ret = -2;
+        goto clean;
+    }
+
+    usleep(200*1000);
+
+    num = epump_ids(pcore, ids, MAX_EPUMP);
+
+    /* churn phase */
+    gconf.port = port;
+    slots = kzalloc(gconf.slots * sizeof(*slots));
+    running = 1;
+    for (i = 0; slots && i < gconf.slots; i++) {
+        slots[i].pcore = pcore;
+        conn_slot_start(&slots[i], num > 0 ? ids[i % num] : 0);
+    }
+
+    sleep(1);
+
+    t0 = epnanotime();
+    measuring = 1;
+    sleep(gconf.duration);
+    measuring = 0;
+    t1 = epnanotime();
+
+    res->seconds = (double)(t1 - t0) / 1000000000.0;
+
+    /* slots stop reconnecting, the closing in progress drains before
+       the calls phase */
+    running = 0;
+    usleep(500*1000);
+
+    for (i = 0; slots && i < gconf.slots; i++) {
+        res->conns += slots[i].conns;
+        res->fails += slots[i].fails;
+        ephist_merge(&res->hist, &slots[i].hist);
+    }
+
+    /* calls phase, all ePump threads run the rounds at the same time */
+    cs = kzalloc((num > 0 ? num : 1) * sizeof(*cs));
+    calls_done = 0;
+
+    t0 = epnanotime();
+    for (i = 0, started = 0; cs && i < num; i++) {
+        if (iotimer_start(pcore, 0, CMD_CALLS, &cs[i], calls_pump, pcore, ids[i]))
+            started++;
+    }
+
+    while (calls_done < started) usleep(1000);
+    t1 = epnanotime();
+
+    res->calls_sec = (double)(t1 - t0) / 1000000000.0;
+
+    for (i = 0; cs && i < num; i++) {
+        ephist_merge(&res->calls.newdev, &cs[i].newdev);
+        ephist_merge(&res->calls.bind, &cs[i].bind);
+        ephist_merge(&res->calls.close, &cs[i].close);
+    }
+
+clean:
+    epcore_stop_epump(pcore);
+    usleep(200*1000);
+    epcore_clean(pcore);
+
+    if (slots) kfree(slots);
+    if (cs) kfree(cs);
+
+    return ret;
+}
+
+static void bench_print (bench_result_t * res)
+{
+    printf("%-7s ePump=%-2d Conn/s=%.0f fails=%llu connect-close p50=%.1fus p99=%.1fus | "
+           "iodev_new=%.2fus bind=%.2fus close_by=%.2fus (mean)\n",
+           epcore_backend(), res->epump,
+           res->seconds > 0 ? (double)res->conns / res->seconds : 0,
+           (unsigned long long)res->fails,
+           ephist_percentile(&res->hist, 50) / 1000.0,
+           ephist_percentile(&res->hist, 99) / 1000.0,
+           ephist_mean(&res->calls.newdev) / 1000.0,
+           ephist_mean(&res->calls.bind) / 1000.0,
+           ephist_mean(&res->calls.close) / 1000.0);
+}
+
+static void hist_json (FILE * fp, char * name, ephist_t * hist, char * tail)
+{
+    fprintf(fp, "\"%s\":{\"mean_us\":%.3f,\"p50_us\":%.3f,\"p99_us\":%.3f,\"max_us\":%.3f}%s",
+            name, ephist_mean(hist) / 1000.0,
+            ephist_percentile(hist, 50) / 1000.0,
+            ephist_percentile(hist, 99) / 1000.0,
+            hist->max / 1000.0, tail);
+}
+
+static void bench_json (FILE * fp, bench_result_t * res, int first)
+{
+    fprintf(fp, "%s  {\"bench\":\"conn\",\"backend\":\"%s\",\"epump\":%d,\"slots\":%d,"
+            "\"seconds\":%.3f,\"conns\":%llu,\"fails\":%llu,\"conns_per_sec\":%.1f,",
+            first ? "" : ",\n", epcore_backend(), res->epump, gconf.slots,
+            res->seconds, (unsigned long long)res->conns, (unsigned long long)res->fails,
+            res->seconds > 0 ? (double)res->conns / res->seconds : 0);
+
+    hist_json(fp, "connect_close", &res->hist, ",");
+
+    fprintf(fp, "\"rounds\":%d,\"calls_sec\":%.3f,", gconf.rounds, res->calls_sec);
+    hist_json(fp, "iodev_new", &res->calls.newdev, ",");
+    hist_json(fp, "iodev_bind_epump", &res->calls.bind, ",");
+    hist_json(fp, "iodev_close_by", &res->calls.close, "}");
+}
+
+int main (int argc, char ** argv)
+{
+    bench_result_t * res = NULL;
+    FILE           * fp = NULL;
+    int              i, num = 0;
+    int              baseport;
+    int              opt;
+
+    signal(SIGPIPE, SIG_IGN);
+
+    memset(&gconf, 0, sizeof(gconf));
+    gconf.epump[0] = 1; gconf.epump[1] = 2; gconf.epump[2] = 4; gconf.epnum = 3;
+    gconf.slots = 64;
+    gconf.duration = 10;
+    gconf.rounds = 20000;
+    gconf.port = 19080;
+    gconf.output = "connbench.json";
+
+    while ((opt = getopt(argc, argv, "e:c:t:k:p:o:h")) != -1) {
+        switch (opt) {
+        case 'e': gconf.epnum = parse_list(optarg, gconf.epump, MAX_LIST); break;
+        case 'c': gconf.slots = atoi(optarg); break;
+        case 't': gconf.duration = atoi(optarg); break;
+        case 'k': gconf.rounds = atoi(optarg); break;
+        case 'p': gconf.port = atoi(optarg); break;
+        case 'o': gconf.output = optarg; break;
+        default:
+            printf("Usage: %s [-e 1,2,4] [-c slots] [-t seconds] [-k rounds]\n"
+                   "       [-p port] [-o result.json]\n", argv[0]);
+            return 0;
+        }
+    }
+
+    if (gconf.slots < 1) gconf.slots = 1;
+    if (gconf.duration < 1) gconf.duration = 1;
+    if (gconf.rounds < 1) gconf.rounds = 1;
+    if (gconf.epnum < 1) { gconf.epump[0] = 1; gconf.epnum = 1; }
+
+    res = kzalloc(gconf.epnum * sizeof(*res));
+    if (!res) return -1;
+
+    baseport = gconf.port;
+
+    for (i = 0; i < gconf.epnum; i++) {
+        if (gconf.epump[i] > MAX_EPUMP) gconf.epump[i] = MAX_EPUMP;
+
+        if (bench_run(gconf.epump[i], baseport + i, &res[num]) < 0)
+            continue;
+
+        bench_print(&res[num]);
+        num++;
+    }
+
+    fp = fopen(gconf.output, "w");
+    if (fp) {
+        fprintf(fp, "[\n");
+        for (i = 0; i < num; i++)
+            bench_json(fp, &res[i], i == 0);
+        fprintf(fp, "\n]\n");
+        fclose(fp);
+
+        printf("results written into %s\n", gconf.output);
+    }
+
+    kfree(res);
+
+    return 0;
+}
+
@@ -0,0 +1,859 @@
+/*
+ * Copyright (c) 2003-2024 Ke Hengzhong <kehengzhong@hotmail.com>
+ * All rights reserved.
+ */
+
+#include "adifall.ext"
+#include <signal.h>
+#include <unistd.h>
+#include "epump.h"
+
+/* benchmark of the DNS resolver against a stub Name Server running on
+   loopback in the same process. the stub answers A queries over UDP and TCP
+   with a configured delay, TTL, loss ratio and truncation ratio, or drops
+   all queries / answers SERVFAIL when failure is simulated. the resolver
+   of the benchmarked epcore_t is pointed at the stub only, no network
+   needed. the phases run in order:
+
+   miss      N distinct names resolved with W queries outstanding
+   hit       the cached names queried by every ePump thread at the same time
+   expiry    after the TTL elapsed, every name queried D times at once, with
+             serve-stale enabled and then disabled
+   failure   the stub stops answering, the expired names are queried, then
+             the new names, then the stub recovers and new names again
+
+   Usage: dnsbench [-e epumps] [-n names] [-w window] [-q hits] [-d dups]
+                   [-l delayms] [-s ttl] [-L loss%] [-T trunc%] [-F drop|servfail]
+                   [-p port] [-o result.json] */
+
+#define MAX_EPUMP    64
+
+#define CMD_ISSUE    1
+#define CMD_HIT      2
+#define CMD_REPLY    3
+
+#define STUB_OK        0
+#define STUB_DROP      1
+#define STUB_SERVFAIL  2
+
+typedef struct BenchConf_ {
+    int       epump;
+    int       names;
+    int       window;
+    int       hits;
+    int       dups;
+    int       delay;
+    int       ttl;
+    int       loss;
+    int       trunc;
+    int       failmode;
+    int       port;
+    char    * output;
+} bench_conf_t;
+
+/* stub Name Server, all of its devices run in one ePump thread */
+typedef struct DnsStub_ {
+    epcore_t      * pcore;
+    void          * udpdev;
+    void          * tcpdev;
+
+    volatile int    mode;
+    uint32          seed;
+
+    volatile uint64 udp_recv;
+    volatile uint64 udp_drop;
+    volatile uint64 udp_trunc;
+    volatile uint64 tcp_recv;
+} dns_stub_t;
+
+typedef struct StubReply_ {
+    void          * pdev;
+    ep_sockaddr_t   addr;
+    int             len;
+    uint8           buf[512];
+} stub_reply_t;
+
+typedef struct StubConn_ {
+    int             len;
+    uint8           buf[4096];
+} stub_conn_t;
+
+typedef struct QueryRec_ {
+    uint64          start;
+    uint64          end;
+    int             status;
+} query_rec_t;
+
+/* queries of one phase, the i-th query resolves the name prefix(i % names) */
+typedef struct QueryPhase_ {
+    char          * title;
+    char          * prefix;
+    epcore_t      * pcore;
+    int             names;
+    int             num;
+    int             window;
+    volatile int    next;
+    volatile int    done;
+    query_rec_t   * rec;
+
+    uint64          t0;
+    uint64          t1;
+    uint64          udp;         /* queries arrived at stub during the phase */
+    uint64          tcp;
+
+    int             ok;
+    int             fail;
+    int             unfinished;
+    ephist_t        hist;
+} query_phase_t;
+
+/* cache-hit calls run by one ePump thread */
+typedef struct HitSlot_ {
+    epcore_t      * pcore;
+    int             calls;
+    int             hit;
+    int             stale;
+    int             other;
+    uint64          t0;
+    uint64          t1;
+    ephist_t        hist;
+} hit_slot_t;
+
+bench_conf_t          gconf;
+static dns_stub_t     gstub;
+static volatile int   hit_done = 0;
+
+int stub_pump (void * vstub, void * vobj, int event, int fdtype);
+int drive_pump (void * vpcore, void * vobj, int event, int fdtype);
+
+
+static uint32 stub_rand (dns_stub_t * stub)
+{
+    /* xorshift32, the stub runs in one thread */
+    stub->seed ^= stub->seed << 13;
+    stub->seed ^= stub->seed >> 17;
+    stub->seed ^= stub->seed << 5;
+    return stub->seed;
+}
+
+static uint32 name_hash (uint8 * p, int len)
+{
+    uint32  h = 2166136261U;
+    int     i;
+
+    for (i = 0; i < len; i++) {
+        h ^= p[i];
+        h *= 16777619U;
+    }
+
+    return h;
+}
+
+/* build the response of query q into out. only A record is answered, other
+   types get empty answer. truncated response carries the question only */
+static int stub_answer (dns_stub_t * stub, uint8 * q, int qlen, uint8 * out, int outsize, int trunc)
+{
+    uint16   qtype = 0;
+    uint32   ttl = 0;
+    uint32   hash = 0;
+    int      iter = 12;
+    int      len = 0;
+
+    if (qlen < 12 || q[4] != 0 || q[5] != 1)
+        return -1;
+
+    /* question name of labels, no compression in query */
+    while (iter < qlen && q[iter] != 0) {
+        if (q[iter] > 63) return -2;
+        iter += q[iter] + 1;
+    }
+    if (iter + 5 > qlen) return -3;
+
+    hash = name_hash(q + 12, iter - 12);
+    iter += 1;
+    qtype = (q[iter] << 8) | q[iter + 1];
+    iter += 4;
+
+    if (iter + 16 > outsize) return -4;
+
+    memcpy(out, q, iter);
+    out[2] = 0x80 | (q[2] & 0x79) | (trunc ? 0x02 : 0);    /* QR, Opcode, RD, TC */
+    out[3] = 0x80 | (stub->mode == STUB_SERVFAIL ? 2 : 0); /* RA, RCODE */
+    out[6] = out[7] = 0;     /* ancount */
+    out[8] = out[9] = 0;     /* nscount */
+    out[10] = out[11] = 0;   /* arcount */
+    len = iter;
+
+    if (qtype != 1 || trunc || stub->mode == STUB_SERVFAIL)
+        return len;
+
+    out[7] = 1;
+
+    /* name pointer to question, type A, class IN, TTL, 4-byte address */
+    ttl = gconf.ttl;
+    out[len++] = 0xC0; out[len++] = 0x0C;
+    out[len++] = 0; out[len++] = 1;
+    out[len++] = 0; out[len++] = 1;
+    out[len++] = (ttl >> 24) & 0xFF; out[len++] = (ttl >> 16) & 0xFF;
+    out[len++] = (ttl >> 8) & 0xFF;  out[len++] = ttl & 0xFF;
+    out[len++] = 0; out[len++] = 4;
+    out[len++] = 10;
+    out[len++] = (hash >> 16) & 0xFF;
+    out[len++] = (hash >> 8) & 0xFF;
+    out[len++] = (hash & 0xFF) | 1;
+
+    return len;
+}
+
+static void stub_udp_recv (dns_stub_t * stub, void * pdev)
+{
+    stub_reply_t  * reply = NULL;
+    ep_sockaddr_t   addr;
+    uint8           buf[2048];
+    uint8           out[512];
+    int             len = 0, trunc = 0;
+    int             ret = 0;
+
+    while (1) {
+        ret = epudp_recvfrom(pdev, NULL, buf, sizeof(buf), &addr, &len);
+        if (ret <= 0) break;
+
+        stub->udp_recv++;
+
+        if (stub->mode == STUB_DROP ||
+            (gconf.loss > 0 && (int)(stub_rand(stub) % 100) < gconf.loss)) {
+            stub->udp_drop++;
+            continue;
+        }
+
+        trunc = gconf.trunc > 0 && (int)(stub_rand(stub) % 100) < gconf.trunc;
+        if (trunc) stub->udp_trunc++;
+
+        ret = stub_answer(stub, buf, len, out, sizeof(out), trunc);
+        if (ret <= 0) continue;
+
+        if (gconf.delay <= 0) {
+            sendto(iodev_fd(pdev), out, ret, 0, (struct sockaddr *)&addr.u.addr, addr.socklen);
+            continue;
+        }
+
+        reply = kzalloc(sizeof(*reply));
+        if (!reply) continue;
+
+        reply->pdev = pdev;
+        reply->addr = addr;
+        reply->len = ret;
+        memcpy(reply->buf, out, ret);
+
+        if (!iotimer_start(stub->pcore, gconf.delay, CMD_REPLY, reply, stub_pump, stub,
+                           iodev_epumpid(pdev)))
+            kfree(reply);
+    }
+}
+
+/* DNS over TCP, messages are prefixed with 2-byte length. answered at once
+   without delay, loss and truncation */
+static int stub_tcp_recv (dns_stub_t * stub, void * pdev)
+{
+    stub_conn_t  * conn = (stub_conn_t *)iodev_para(pdev);
+    uint8          out[514];
+    int            num = 0, msglen = 0;
+    int            ret = 0, sent = 0;
+
+    if (!conn) return -1;
+
+    ret = tcp_nb_recv(iodev_fd(pdev), conn->buf + conn->len, sizeof(conn->buf) - conn->len, &num);
+    if (num > 0) conn->len += num;
+
+    while (conn->len >= 2) {
+        msglen = (conn->buf[0] << 8) | conn->buf[1];
+        if (conn->len < 2 + msglen) break;
+
+        stub->tcp_recv++;
+
+        num = stub_answer(stub, conn->buf + 2, msglen, out + 2, sizeof(out) - 2, 0);
+        if (num > 0) {
+            out[0] = (num >> 8) & 0xFF;
+            out[1] = num & 0xFF;
+            tcp_nb_send(iodev_fd(pdev), out, num + 2, &sent);
+        }
+
+        conn->len -= 2 + msglen;
+        memmove(conn->buf, conn->buf + 2 + msglen, conn->len);
+    }
+
+    if (ret < 0 || conn->len >= sizeof(conn->buf)) {
+        iodev_close(pdev);
+        kfree(conn);
+    }
+
+    return 0;
+}
+
+int stub_pump (void * vstub, void * vobj, int event, int fdtype)
+{
+    dns_stub_t   * stub = (dns_stub_t *)vstub;
+    stub_reply_t * reply = NULL;
+    stub_conn_t  * conn = NULL;
+    void         * pdev = NULL;
+    int            ret = 0;
+
+    switch (event) {
+    case IOE_READ:
+        if (fdtype == FDT_UDPSRV)
+            stub_udp_recv(stub, vobj);
+        else if (fdtype == FDT_ACCEPTED)
+            stub_tcp_recv(stub, vobj);
+        break;
+
+    case IOE_ACCEPT:
+        if (fdtype != FDT_LISTEN) return -1;
+
+        while (1) {
+            conn = kzalloc(sizeof(*conn));
+            if (!conn) break;
+
+            pdev = eptcp_accept(stub->pcore, vobj, NULL, conn, stub_pump, stub,
+                                BIND_ONE_EPUMP, 0, &ret);
+            if (!pdev) {
+                kfree(conn);
+                break;
+            }
+        }
+        break;
+
+    case IOE_TIMEOUT:
+        if (iotimer_cmdid(vobj) != CMD_REPLY) break;
+
+        reply = (stub_reply_t *)iotimer_para(vobj);
+        if (!reply) break;
+
+        sendto(iodev_fd(reply->pdev), reply->buf, reply->len, 0,
+               (struct sockaddr *)&reply->addr.u.addr, reply->addr.socklen);
+        kfree(reply);
+        break;
+
+    case IOE_INVALID_DEV:
+        if (fdtype == FDT_ACCEPTED) {
+            conn = (stub_conn_t *)iodev_para(vobj);
+            iodev_close(vobj);
+            if (conn) kfree(conn);
+        }
+        break;
+    }
+
+    return 0;
+}
+
+static int stub_start (dns_stub_t * stub, int port)
+{
+    int  ret = 0;
+
+    memset(stub, 0, sizeof(*stub));
+    stub->seed = 2463534242U;
+    stub->mode = STUB_OK;
+
+    stub->pcore = epcore_new(4096);
+    if (!stub->pcore) return -1;
+
+    stub->udpdev = epudp_listen(stub->pcore, "127.0.0.1", port, NULL, stub, stub_pump, stub,
+                                BIND_ONE_EPUMP, NULL, NULL, &ret);
+    if (!stub->udpdev) {
+        printf("stub UDP port %d failed\n", port);
+        return -2;
+    }
+
+    stub->tcpdev = eptcp_mlisten(stub->pcore, "127.0.0.1", port, NULL, stub, stub_pump, stub);
+    if (!stub->tcpdev) {
+        printf("stub TCP port %d failed\n", port);
+        return -3;
+    }
+
+    epcore_start_epump(stub->pcore, 1);
+
+    return 0;
+}
+
+static void stub_stop (dns_stub_t * stub)
+{
+    if (!stub->pcore) return;
+
+    epcore_stop_epump(stub->pcore);
+    usleep(200*1000);
+    epcore_clean(stub->pcore);
+    stub->pcore = NULL;
+}
+
+
+/* thread ids of running ePump threads, taken from structured stats */
+static int epump_ids (epcore_t * pcore, ulong * ids, int max)
+{
+    epstat_t  * st = NULL;
+    int         i, num = 0;
+
+    st = kzalloc(sizeof(*st));
+    if (!st) return 0;
+
+    epcore_stat(pcore, st);
+
+    for (i = 0; i < st->thread_num && num < max; i++) {
+        if (st->thread[i].type == EPS_THREAD_EPUMP)
+            ids[num++] = st->thread[i].threadid;
+    }
+
+    kfree(st);
+
+    return num;
+}
+
+static void phase_issue (query_phase_t * ph);
+
+static int query_cb (void * cbobj, ulong objid, char * name, int namelen, void * cache, int status)
+{
+    query_phase_t * ph = (query_phase_t *)cbobj;
+    query_rec_t   * rec = NULL;
+
+    if (!ph || objid >= (ulong)ph->num) return -1;
+
+    rec = &ph->rec[objid];
+    rec->end = epnanotime();
+    rec->status = status;
+    if (status == DNS_ERR_NO_ERROR && (!cache || dns_cache_a_num(cache) <= 0))
+        rec->status = DNS_ERR_NO_RESPONSE;
+
+    __sync_fetch_and_add(&ph->done, 1);
+
+    /* keep W queries outstanding */
+    if (ph->window < ph->num) phase_issue(ph);
+
+    return 0;
+}
+
+static void phase_issue (query_phase_t * ph)
+{
+    char   name[128];
+    int    i, len, ret;
+
+    while ((i = __sync_fetch_and_add(&ph->next, 1)) < ph->num) {
+        len = sprintf(name, "%s%d.bench.test", ph->prefix, i % ph->names);
+
+        ph->rec[i].start = epnanotime();
+        ph->rec[i].status = -1;
+
+        ret = dns_query(ph->pcore, name, len, query_cb, ph, i);
+        if (ret >= 0 || ph->rec[i].end > 0)
+            return;
+
+        /* failed without callback, e.g. no free msgid or sending failed */
+        ph->rec[i].end = epnanotime();
+        ph->rec[i].status = DNS_ERR_SEND_FAIL;
+        __sync_fetch_and_add(&ph->done, 1);
+
+        if (ph->window >= ph->num) return;
+    }
+}
+
+static int hit_cb (void * cbobj, ulong objid, char * name, int namelen, void * cache, int status)
+{
+    return 0;
+}
+
+static void hit_run (hit_slot_t * slot)
+{
+    char     name[128];
+    uint64   t0, t1;
+    int      i, len, ret;
+
+    slot->t0 = epnanotime();
+
+    for (i = 0; i < slot->calls; i++) {
+        len = sprintf(name, "h%d.bench.test", i % gconf.names);
+
+        t0 = epnanotime();
+        ret = dns_query(slot->pcore, name, len, hit_cb, slot, i);
+        t1 = epnanotime();
+
+        ephist_add(&slot->hist, t1 - t0);
+
+        if (ret == 3) slot->hit++;
+        else if (ret == 4) slot->stale++;
+        else slot->other++;
+    }
+
+    slot->t1 = epnanotime();
+}
+
+/* run in ePump thread assigned by timer */
+int drive_pump (void * vpcore, void * vobj, int event, int fdtype)
+{
+    query_phase_t * ph = NULL;
+    int             i;
+
+    if (event != IOE_TIMEOUT) return 0;
+
+    switch (iotimer_cmdid(vobj)) {
+    case CMD_ISSUE:
+        ph = (query_phase_t *)iotimer_para(vobj);
+        for (i = 0; ph && i < ph->window && i < ph->num; i++)
+            phase_issue(ph);
+        break;
+
+    case CMD_HIT:
+        hit_run((hit_slot_t *)iotimer_para(vobj));
+        __sync_fetch_and_add(&hit_done, 1);
+        break;
+    }
+
+    return 0;
+}
+
+static query_phase_t * phase_new (epcore_t * pcore, char * title, char * prefix,
+                                  int names, int num, int window)
+{
+    query_phase_t * ph = NULL;
+
+    ph = kzalloc(sizeof(*ph));
+    if (!ph) return NULL;
+
+    ph->rec = kzalloc((num > 0 ? num : 1) * sizeof(query_rec_t));
+    if (!ph->rec) {
+        kfree(ph);
+        return NULL;
+    }
+
+    ph->title = title;
+    ph->prefix = prefix;
+    ph->pcore = pcore;
+    ph->names = names;
+    ph->num = num;
+    ph->window = window < num ? window : num;
+
+    return ph;
+}
+
+static void phase_free (query_phase_t * ph)
+{
+    if (!ph) return;
+
+    kfree(ph->rec);
+    kfree(ph);
+}
+
+/* issue the queries from the ePump thread epumpid and wait for all the
+   callbacks, or maxsec seconds */
+static void phase_run (query_phase_t * ph, ulong epumpid, int maxsec)
+{
+    uint64   udp0, tcp0;
+    uint64   deadline;
+    int      i;
+
+    udp0 = gstub.udp_recv;
+    tcp0 = gstub.tcp_recv;
+
+    ph->t0 = epnanotime();
+    deadline = ph->t0 + (uint64)maxsec * 1000000000ULL;
+
+    iotimer_start(ph->pcore, 0, CMD_ISSUE, ph, drive_pump, ph->pcore, epumpid);
+
+    while (ph->done < ph->num && epnanotime() < deadline)
+        usleep(1000);
+
+    ph->t1 = epnanotime();
+
+    /* response of the last query may be in flight to stub */
+    usleep(50*1000);
+    ph->udp = gstub.udp_recv - udp0;
+    ph->tcp = gstub.tcp_recv - tcp0;
+
+    for (i = 0; i < ph->num; i++) {
+        if (ph->rec[i].end == 0) {
+            ph->unfinished++;
+            continue;
+        }
+
+        ephist_add(&ph->hist, ph->rec[i].end - ph->rec[i].start);
+
+        if (ph->rec[i].status == DNS_ERR_NO_ERROR) ph->ok++;
+        else ph->fail++;
+    }
+}
+
+static double phase_seconds (query_phase_t * ph)
+{
+    return (double)(ph->t1 - ph->t0) / 1000000000.0;
+}
+
+static void phase_print (query_phase_t * ph)
+{
+    double  sec = phase_seconds(ph);
+
+    printf("%-16s queries=%-6d ok=%-6d fail=%-5d unfinished=%-4d qps=%-8.0f "
+           "p50=%.1fus p99=%.1fus max=%.1fms upstream udp=%llu tcp=%llu\n",
+           ph->title, ph->num, ph->ok, ph->fail, ph->unfinished,
+           sec > 0 ? (ph->num - ph->unfinished) / sec : 0,
+           ephist_percentile(&ph->hist, 50) / 1000.0,
+           ephist_percentile(&ph->hist, 99) / 1000.0,
+           ph->hist.max / 1000000.0,
+           (unsigned long long)ph->udp, (unsigned long long)ph->tcp);
+}
+
+static void hist_json (FILE * fp, ephist_t * hist)
+{
+    fprintf(fp, "\"latency\":{\"mean_us\":%.3f,\"p50_us\":%.3f,\"p99_us\":%.3f,"
+            "\"p999_us\":%.3f,\"max_us\":%.3f}",
+            ephist_mean(hist) / 1000.0,
+            ephist_percentile(hist, 50) / 1000.0,
+            ephist_percentile(hist, 99) / 1000.0,
+            ephist_percentile(hist, 99.9) / 1000.0,
+            hist->max / 1000.0);
+}
+
+static void phase_json (FILE * fp, char * key, query_phase_t * ph, char * tail)
+{
+    double  sec = phase_seconds(ph);
+
+    fprintf(fp, "  \"%s\":{\"queries\":%d,\"ok\":%d,\"fail\":%d,\"unfinished\":%d,"
+            "\"seconds\":%.3f,\"qps\":%.1f,\"upstream_udp\":%llu,\"upstream_tcp\":%llu,",
+            key, ph->num, ph->ok, ph->fail, ph->unfinished, sec,
+            sec > 0 ? (ph->num - ph->unfinished) / sec : 0,
+            (unsigned long long)ph->udp, (unsigned long long)ph->tcp);
+    hist_json(fp, &ph->hist);
+    fprintf(fp, "}%s\n", tail);
+}
+
+/* cached RR is taken as expired after twice of its TTL */
+static void wait_expiry (char * what)
+{
+    printf("waiting %d seconds for TTL expiry before %s\n", gconf.ttl * 2 + 1, what);
+    sleep(gconf.ttl * 2 + 1);
+}
+
+static void usage (char * prog)
+{
+    printf("Usage: %s [-e epumps] [-n names] [-w window] [-q hits] [-d dups]\n"
+           "       [-l delayms] [-s ttl] [-L loss%%] [-T trunc%%] [-F drop|servfail]\n"
+           "       [-p port] [-o result.json]\n", prog);
+}
+
+int main (int argc, char ** argv)
+{
+    epcore_t       * pcore = NULL;
+    query_phase_t  * miss = NULL;
+    query_phase_t  * stale = NULL;
+    query_phase_t  * nostale = NULL;
+    query_phase_t  * failstale = NULL;
+    query_phase_t  * failnew = NULL;
+    query_phase_t  * recover = NULL;
+    hit_slot_t     * slots = NULL;
+    hit_slot_t       hit;
+    ulong            ids[MAX_EPUMP];
+    int              i, num = 0, fresh = 0;
+    int              started = 0;
+    uint64           t0, t1;
+    double           sec = 0;
+    FILE           * fp = NULL;
+    int              opt;
+
+    signal(SIGPIPE, SIG_IGN);
+
+    memset(&gconf, 0, sizeof(gconf));
+    gconf.epump = 2;
+    gconf.names = 2000;
+    gconf.window = 64;
+    gconf.hits = 200000;
+    gconf.dups = 4;
+    gconf.delay = 1;
+    gconf.ttl = 3;
+    gconf.failmode = STUB_DROP;
+    gconf.port = 19053;
+    gconf.output = "dnsbench.json";
+
+    while ((opt = getopt(argc, argv, "e:n:w:q:d:l:s:L:T:F:p:o:h")) != -1) {
+        switch (opt) {
+        case 'e': gconf.epump = atoi(optarg); break;
+        case 'n': gconf.names = atoi(optarg); break;
+        case 'w': gconf.window = atoi(optarg); break;
+        case 'q': gconf.hits = atoi(optarg); break;
+        case 'd': gconf.dups = atoi(optarg); break;
+        case 'l': gconf.delay = atoi(optarg); break;
+        case 's': gconf.ttl = atoi(optarg); break;
+        case 'L': gconf.loss = atoi(optarg); break;
+        case 'T': gconf.trunc = atoi(optarg); break;
+        case 'F':
+            gconf.failmode = strcasecmp(optarg, "servfail") == 0 ? STUB_SERVFAIL : STUB_DROP;
+            break;
+        case 'p': gconf.port = atoi(optarg); break;
+        case 'o': gconf.output = optarg; break;
+        default:
+            usage(argv[0]);
+            return 0;
+        }
+    }
+
+    if (gconf.epump < 1) gconf.epump = 1;
+    if (gconf.epump > MAX_EPUMP) gconf.epump = MAX_EPUMP;
+    if (gconf.names < 1) gconf.names = 1;
+    if (gconf.window < 1) gconf.window = 1;
+    if (gconf.hits < 1) gconf.hits = 1;
+    if (gconf.dups < 1) gconf.dups = 1;
+    if (gconf.ttl < 1) gconf.ttl = 1;
+
+    if (stub_start(&gstub, gconf.port) < 0) {
+        stub_stop(&gstub);
+        return -1;
+    }
+
+    pcore = epcore_new(65536);
+    if (!pcore) {
+        stub_stop(&gstub);
+        return -2;
+    }
+
+    /* resolving goes to the stub only */
+    epcore_dnsrv_clear(pcore);
+    epcore_dnsrv_add(pcore, "127.0.0.1", gconf.port);
+
+    epcore_start_epump(pcore, gconf.epump);
+    usleep(200*1000);
+
+    num = epump_ids(pcore, ids, MAX_EPUMP);
+    if (num <= 0) {
+        printf("no ePump thread running\n");
+        goto clean;
+    }
+
+    fresh = gconf.names < 100 ? gconf.names : 100;
+
+    /* miss: every query goes to stub */
+    miss = phase_new(pcore, "miss", "h", gconf.names, gconf.names, gconf.window);
+    if (!miss) goto clean;
+    phase_run(miss, 0, 30);
+    phase_print(miss);
+
+    /* hit: the cached names queried by all ePump threads */
+    slots = kzalloc(num * sizeof(*slots));
+    if (!slots) goto clean;
+
+    hit_done = 0;
+    t0 = epnanotime();
+    for (i = 0, started = 0; i < num; i++) {
+        slots[i].pcore = pcore;
+        slots[i].calls = gconf.hits;
+        if (iotimer_start(pcore, 0, CMD_HIT, &slots[i], drive_pump, pcore, ids[i]))
+            started++;
+    }
+    while (hit_done < started) usleep(1000);
+    t1 = epnanotime();
+    sec = (double)(t1 - t0) / 1000000000.0;
+
+    memset(&hit, 0, sizeof(hit));
+    for (i = 0; i < num; i++) {
+        hit.calls += slots[i].hit + slots[i].stale + slots[i].other;
+        hit.hit += slots[i].hit;
+        hit.stale += slots[i].stale;
+        hit.other += slots[i].other;
+        ephist_merge(&hit.hist, &slots[i].hist);
+    }
+
+    printf("%-16s calls=%-8d hit=%-8d stale=%-6d other=%-6d calls/s=%-10.0f "
+           "p50=%.3fus p99=%.3fus\n", "hit", hit.calls, hit.hit, hit.stale, hit.other,
+           sec > 0 ? hit.calls / sec : 0,
+           ephist_percentile(&hit.hist, 50) / 1000.0,
+           ephist_percentile(&hit.hist, 99) / 1000.0);
+
+    /* expiry storm with serve-stale, expired RR answered at once and
+       refreshed in background */
+    wait_expiry("storm");
+    stale = phase_new(pcore, "expiry-stale", "h", gconf.names,
+                      gconf.names * gconf.dups, gconf.names * gconf.dups);
+    if (!stale) goto clean;
+    phase_run(stale, ids[0], 30);
+    phase_print(stale);
+
+    /* expiry storm without serve-stale, duplicate queries of the name
+       wait for the one in flight */
+    epcore_dns_stale(pcore, 0);
+    wait_expiry("storm");
+    nostale = phase_new(pcore, "expiry-nostale", "h", gconf.names,
+                        gconf.names * gconf.dups, gconf.names * gconf.dups);
+    if (!nostale) goto clean;
+    phase_run(nostale, ids[0], 30);
+    phase_print(nostale);
+
+    /* Name Server failure */
+    epcore_dns_stale(pcore, 86400);
+    gstub.mode = gconf.failmode;
+    wait_expiry("failure");
+
+    failstale = phase_new(pcore, "failure-stale", "h", gconf.names,
+                          gconf.names, gconf.names);
+    if (!failstale) goto clean;
+    phase_run(failstale, ids[0], 30);
+    phase_print(failstale);
+
+    failnew = phase_new(pcore, "failure-new", "f", fresh, fresh, fresh);
+    if (!failnew) goto clean;
+    phase_run(failnew, ids[0], 30);
+    phase_print(failnew);
+
+    gstub.mode = STUB_OK;
+    recover = phase_new(pcore, "recovery", "r", fresh, fresh, fresh);
+    if (!recover) goto clean;
+    phase_run(recover, ids[0], 30);
+    phase_print(recover);
+
+    printf("stub udp=%llu dropped=%llu truncated=%llu tcp=%llu\n",
+           (unsigned long long)gstub.udp_recv, (unsigned long long)gstub.udp_drop,
+           (unsigned long long)gstub.udp_trunc, (unsigned long long)gstub.tcp_recv);
+
+    fp = fopen(gconf.output, "w");
+    if (fp) {
+        fprintf(fp, "{\n  \"bench\":\"dns\",\"backend\":\"%s\",\"epump\":%d,\"names\":%d,"
+                "\"window\":%d,\"dups\":%d,\"delay_ms\":%d,\"ttl\":%d,\"loss\":%d,"
+                "\"trunc\":%d,\"failmode\":\"%s\",\n",
+                epcore_backend(), gconf.epump, gconf.names, gconf.window, gconf.dups,
+                gconf.delay, gconf.ttl, gconf.loss, gconf.trunc,
+                gconf.failmode == STUB_SERVFAIL ? "servfail" : "drop");
+
+        phase_json(fp, "miss", miss, ",");
+
+        fprintf(fp, "  \"hit\":{\"calls\":%d,\"hit\":%d,\"stale\":%d,\"other\":%d,"
+                "\"seconds\":%.3f,\"calls_per_sec\":%.1f,",
+                hit.calls, hit.hit, hit.stale, hit.other, sec,
+                sec > 0 ? hit.calls / sec : 0);
+        hist_json(fp, &hit.hist);
+        fprintf(fp, "},\n");
+
+        phase_json(fp, "expiry_stale", stale, ",");
+        phase_json(fp, "expiry_nostale", nostale, ",");
+        phase_json(fp, "failure_stale", failstale, ",");
+        phase_json(fp, "failure_new", failnew, ",");
+        phase_json(fp, "recovery", recover, ",");
+
+        fprintf(fp, "  \"stub\":{\"udp\":%llu,\"dropped\":%llu,\"truncated\":%llu,\"tcp\":%llu}\n}\n",
+                (unsigned long long)gstub.udp_recv, (unsigned long long)gstub.udp_drop,
+                (unsigned long long)gstub.udp_trunc, (unsigned long long)gstub.tcp_recv);
+        fclose(fp);
+
+        printf("results written into %s\n", gconf.output);
+    }
+
+clean:
+    epcore_stop_epump(pcore);
+    usleep(200*1000);
+    epcore_clean(pcore);
+
+    stub_stop(&gstub);
+
+    /* the phases timed out may be called back until epcore cleaned */
+    phase_free(miss);
+    phase_free(stale);
+    phase_free(nostale);
+    phase_free(failstale);
+    phase_free(failnew);
+    phase_free(recover);
+    if (slots) kfree(slots);
+
+    return 0;
+}
+
@@ -0,0 +1,558 @@
+/*
+ * Copyright (c) 2003-2024 Ke Hengzhong <kehengzhong@hotmail.com>
+ * All rights reserved.
+ */
+
+#include "adifall.ext"
+#include <signal.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include "epump.h"
+
+/* loopback throughput benchmark of pipelined echo. the echo server of
+   sample/echosrv and the clients run in one epcore_t instance. each client
+   connection keeps depth requests of size bytes in flight and measures the
+   round-trip time of every request. one run is made for every combination
+   of ePump thread number and worker thread number.
+
+   Usage: echobench [-e 1,2,4] [-w 0,2] [-c conns] [-d depth] [-s size]
+                    [-t seconds] [-u warmup seconds] [-p port] [-o result.json]
+
+   the backend is chosen when building libepump, make BACKEND=select gives
+   the select numbers to compare with epoll. latency percentiles come from
+   ephist_t whose relative error is no more than 25% */
+
+#define MAX_LIST  16
+
+typedef struct BenchConf_ {
+    int       epump[MAX_LIST];
+    int       epnum;
+    int       worker[MAX_LIST];
+    int       wknum;
+    int       conns;
+    int       depth;
+    int       size;
+    int       duration;
+    int       warmup;
+    int       port;
+    char    * output;
+} bench_conf_t;
+
+/* client connection, accessed only by the thread handling its device */
+typedef struct EchoConn_ {
+    void     * pdev;
+    int        connected;
+
+    uint64   * stamp;       /* sending time of requests in flight, in FIFO */
+    int        head;
+    int        inflight;
+    int        rcvlen;      /* bytes received of current response */
+
+    uint8    * sndbuf;
+    int        sndlen;
+    int        wrnotify;    /* RWF_WRITE notification is set */
+
+    uint64     reqs;
+    ephist_t   hist;
+} echo_conn_t;
+
+/* accepted device on server side, keeps the bytes not sent out */
+typedef struct EchoSrv_ {
+    uint8    * buf;
+    int        len;
+    int        size;
+    int        wrnotify;
+} echo_srv_t;
+
+typedef struct BenchResult_ {
+    int        epump;
+    int        worker;
+    int        connected;
+    double     seconds;
+    uint64     reqs;
+    double     cpu_us;
+    ephist_t   hist;
+} bench_result_t;
+
+bench_conf_t       gconf;
+static volatile int  measuring = 0;
+
+static CRITICAL_SECTION  srvCS;
+static arr_t           * srv_list = NULL;
+
+int echo_srv_pump (void * vpcore, void * vobj, int event, int fdtype);
+int echo_cli_pump (void * vpcore, void * vobj, int event, int fdtype);
+
+
+static int parse_list (char * str, int * list, int max)
+{
+    char  * p = str;
+    int     num = 0;
+
+    while (p && *p && num < max) {
+        list[num++] = (int)strtol(p, &p, 10);
+        while (*p == ',' || *p == ' ') p++;
+    }
+
+    return num;
+}
+
+static double cpu_time_us (void)
+{
+    struct rusage  ru;
+
+    getrusage(RUSAGE_SELF, &ru);
+
+    return (double)(ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000.0 +
+           (double)(ru.ru_utime.tv_usec + ru.ru_stime.tv_usec);
+}
+
+static void echo_srv_free (void * vsrv)
+{
+    echo_srv_t * srv = (echo_srv_t *)vsrv;
+
+    if (!srv) return;
+
+    if (srv->buf) kfree(srv->buf);
+    kfree(srv);
+}
+
+static int echo_srv_keep (echo_srv_t * srv, uint8 * pbuf, int len)
+{
+    uint8  * buf = NULL;
+    int      size = 0;
+
+    if (len <= 0) return 0;
+
+    if (srv->len + len > srv->size) {
+        size = srv->size * 2;
+        if (size < srv->len + len) size = srv->len + len;
+
+        buf = kzalloc(size);
+        if (!buf) return -1;
+
+        if (srv->len > 0) memcpy(buf, srv->buf, srv->len);
+        if (srv->buf) kfree(srv->buf);
+
+        srv->buf = buf;
+        srv->size = size;
+    }
+
+    memcpy(srv->buf + srv->len, pbuf, len);
+    srv->len += len;
+
+    return 0;
+}
+
+/* echo the bytes back, the part not sent out is kept and sent when writable */
+static int echo_srv_send (void * pdev, echo_srv_t * srv, uint8 * pbuf, int len)
+{
+    int  ret, num = 0;
+
+    if (srv->len > 0) {
+        if (echo_srv_keep(srv, pbuf, len) < 0) return -1;
+        pbuf = srv->buf;
+        len = srv->len;
+    }
+
+    if (len <= 0) return 0;
+
+    ret = tcp_nb_send(iodev_fd(pdev), pbuf, len, &num);
+    if (ret < 0) return -1;
+
+    if (pbuf == srv->buf) {
+        if (num < len) memmove(srv->buf, srv->buf + num, len - num);
+        srv->len = len - num;
+
+    } else if (num < len) {
+        if (echo_srv_keep(srv, pbuf + num, len - num) < 0) return -1;
+    }
+
+    if (srv->len > 0 && !srv->wrnotify) {
+        srv->wrnotify = 1;
+        iodev_add_notify(pdev, RWF_WRITE);
+
+    } else if (srv->len == 0 && srv->wrnotify) {
+        srv->wrnotify = 0;
+        iodev_del_notify(pdev, RWF_WRITE);
+    }
+
+    return 0;
+}
+
+int echo_srv_pump (void * vpcore, void * vobj, int event, int fdtype)
+{
+    epcore_t   * pcore = (epcore_t *)vpcore;
+    iodev_t    * pdev = NULL;
+    echo_srv_t * srv = NULL;
+    uint8        rcvbuf[65536];
+    int          ret = 0, num = 0;
+
+    switch (event) {
+    case IOE_ACCEPT:
+        if (fdtype != FDT_LISTEN)
+            return -1;
+
+        while (1) {
+            srv = kzalloc(sizeof(*srv));
+            if (!srv) break;
+
+            pdev = eptcp_accept(pcore, vobj, NULL, srv, echo_srv_pump, pcore,
+                                BIND_ONE_EPUMP, 0, &ret);
+            if (!pdev) {
+                kfree(srv);
+                break;
+            }
+
+            iodev_tcp_nodelay_set(pdev, 1);
+
+            EnterCriticalSection(&srvCS);
+            arr_push(srv_list, srv);
+            LeaveCriticalSection(&srvCS);
+        }
+        break;
+
+    case IOE_READ:
+        srv = iodev_para(vobj);
+
+        while (1) {
+            ret = tcp_nb_recv(iodev_fd(vobj), rcvbuf, sizeof(rcvbuf), &num);
+            if (ret < 0) {
+                iodev_close(vobj);
+                return -100;
+            }
+            if (num <= 0) break;
+
+            if (echo_srv_send(vobj, srv, rcvbuf, num) < 0) {
+                iodev_close(vobj);
+                return -101;
+            }
+
+            if (num < (int)sizeof(rcvbuf)) break;
+        }
+        break;
+
+    case IOE_WRITE:
+        srv = iodev_para(vobj);
+
+        if (echo_srv_send(vobj, srv, NULL, 0) < 0) {
+            iodev_close(vobj);
+            return -101;
+        }
+        break;
+
+    case IOE_INVALID_DEV:
+        iodev_close(vobj);
+        break;
+    }
+
+    return 0;
+}
+
+
+/* fill the pipeline up to depth requests and flush the sending buffer */
+static int echo_conn_send (echo_conn_t * conn)
+{
+    uint64  now = epnanotime();
+    int     ret, num = 0;
+
+    while (conn->inflight < gconf.depth) {
+        conn->stamp[(conn->head + conn->inflight) % gconf.depth] = now;
+        conn->inflight++;
+
+        memset(conn->sndbuf + conn->sndlen, 'a' + (int)(conn->reqs % 26), gconf.size);
+        conn->sndlen += gconf.size;
+    }
+
+    if (conn->sndlen > 0) {
+        ret = tcp_nb_send(iodev_fd(conn->pdev), conn->sndbuf, conn->sndlen, &num);
+        if (ret < 0) return -1;
+
+        if (num < conn->sndlen)
+            memmove(conn->sndbuf, conn->sndbuf + num, conn->sndlen - num);
+        conn->sndlen -= num;
+    }
+
+    if (conn->sndlen > 0 && !conn->wrnotify) {
+        conn->wrnotify = 1;
+        iodev_add_notify(conn->pdev, RWF_WRITE);
+
+    } else if (conn->sndlen == 0 && conn->wrnotify) {
+        conn->wrnotify = 0;
+        iodev_del_notify(conn->pdev, RWF_WRITE);
+    }
+
+    return 0;
+}
+
+static int echo_conn_recv (echo_conn_t * conn)
+{
+    uint8   rcvbuf[65536];
+    uint64  now = 0;
+    int     ret, num = 0;
+
+    while (1) {
+        ret = tcp_nb_recv(iodev_fd(conn->pdev), rcvbuf, sizeof(rcvbuf), &num);
+        if (ret < 0) return -1;
+        if (num <= 0) break;
+
+        now = epnanotime();
+
+        conn->rcvlen += num;
+        while (conn->rcvlen >= gconf.size && conn->inflight > 0) {
+            conn->rcvlen -= gconf.size;
+
+            if (measuring) {
+                ephist_add(&conn->hist, now - conn->stamp[conn->head]);
+                conn->reqs++;
+            }
+
+            conn->head = (conn->head + 1) % gconf.depth;
+            conn->inflight--;
+        }
+
+        if (num < (int)sizeof(rcvbuf)) break;
+    }
+
+    return echo_conn_send(conn);
+}
+
+int echo_cli_pump (void * vpcore, void * vobj, int event, int fdtype)
+{
+    echo_conn_t * conn = (echo_conn_t *)iodev_para(vobj);
+
+    if (!conn) return -1;
+
+    switch (event) {
+    case IOE_CONNECTED:
+    case IOE_WRITE:
+        /* connection set up immediately is started by the first IOE_WRITE */
+        if (!conn->connected) {
+            conn->connected = 1;
+            iodev_tcp_nodelay_set(vobj, 1);
+        }
+
+        if (echo_conn_send(conn) < 0) {
+            conn->pdev = NULL;
+            iodev_close(vobj);
+        }
+        break;
+
+    case IOE_READ:
+        if (echo_conn_recv(conn) < 0) {
+            conn->pdev = NULL;
+            iodev_close(vobj);
+        }
+        break;
+
+    case IOE_CONNFAIL:
+    case IOE_INVALID_DEV:
+        conn->pdev = NULL;
+        iodev_close(vobj);
+        break;
+    }
+
+    return 0;
+}
+
+
+static int bench_run (int epnum, int wknum, int port, bench_result_t * res)
+{
+    epcore_t     * pcore = NULL;
+    echo_conn_t  * conns = NULL;
+    void         * mlisten = NULL;
+    void         * epump = NULL;
+    uint64         t0, t1;
+    double         cpu0, cpu1;
+    int            i, ret = 0;
+
+    memset(res, 0, sizeof(*res));
+    res->epump = epnum;
+    res->worker = wknum;
+
+    pcore = epcore_new(65536);
+    if (!pcore) return -1;
+
+    InitializeCriticalSection(&srvCS);
+    srv_list = arr_new(4);
+
+    epcore_start_epump(pcore, epnum);
+    if (wknum > 0) epcore_start_worker(pcore, wknum);
+
+    mlisten = eptcp_mlisten(pcore, "127.0.0.1", port, NULL, NULL, echo_srv_pump, pcore);
+    if (!mlisten) {
+        printf("listen port %d failed\n", port);
+        ret = -2;
+        goto clean;
+    }
+
+    /* waiting for all threads running */
+    usleep(200*1000);
+
+    conns = kzalloc(gconf.conns * sizeof(*conns));
+    for (i = 0; conns && i < gconf.conns; i++) {
+        conns[i].stamp = kzalloc(gconf.depth * sizeof(uint64));
+        conns[i].sndbuf = kzalloc(gconf.depth * gconf.size);
+
+        /* non-blocking connecting watches writability */
+        conns[i].wrnotify = 1;
+
+        epump = epump_thread_select(pcore);
+
+        conns[i].pdev = eptcp_nb_connect(pcore, "127.0.0.1", port, NULL, 0, NULL,
+                                         &conns[i], echo_cli_pump, pcore,
+                                         epumpid(epump), &ret);
+        if (conns[i].pdev && ret >= 0)
+            iodev_add_notify(conns[i].pdev, RWF_WRITE);
+    }
+
+    sleep(gconf.warmup);
+
+    cpu0 = cpu_time_us();
+    t0 = epnanotime();
+    measuring = 1;
+
+    sleep(gconf.duration);
+
+    measuring = 0;
+    t1 = epnanotime();
+    cpu1 = cpu_time_us();
+
+    epcore_stop_worker(pcore);
+    epcore_stop_epump(pcore);
+    usleep(200*1000);
+
+    res->seconds = (double)(t1 - t0) / 1000000000.0;
+    res->cpu_us = cpu1 - cpu0;
+
+    for (i = 0; conns && i < gconf.conns; i++) {
+        if (conns[i].connected) res->connected++;
+        res->reqs += conns[i].reqs;
+        ephist_merge(&res->hist, &conns[i].hist);
+    }
+    ret = 0;
+
+clean:
+    epcore_clean(pcore);
+
+    for (i = 0; conns && i < gconf.conns; i++) {
+        kfree(conns[i].stamp);
+        kfree(conns[i].sndbuf);
+    }
+    if (conns) kfree(conns);
+
+    arr_pop_free(srv_list, echo_srv_free);
+    srv_list = NULL;
+    DeleteCriticalSection(&srvCS);
+
+    return ret;
+}
+
+static void bench_print (bench_result_t * res)
+{
+    double  rps = res->seconds > 0 ? (double)res->reqs / res->seconds : 0;
+
+    printf("%-7s ePump=%-2d Worker=%-2d Conn=%d/%d Req/s=%.0f "
+           "p50=%.1fus p99=%.1fus p999=%.1fus mean=%.1fus CPU/Req=%.2fus\n",
+           epcore_backend(), res->epump, res->worker, res->connected, gconf.conns, rps,
+           ephist_percentile(&res->hist, 50) / 1000.0,
+           ephist_percentile(&res->hist, 99) / 1000.0,
+           ephist_percentile(&res->hist, 99.9) / 1000.0,
+           ephist_mean(&res->hist) / 1000.0,
+           res->reqs > 0 ? res->cpu_us / (double)res->reqs : 0);
+}
+
+static void bench_json (FILE * fp, bench_result_t * res, int first)
+{
+    fprintf(fp, "%s  {\"bench\":\"echo\",\"backend\":\"%s\",\"epump\":%d,\"worker\":%d,"
+            "\"conns\":%d,\"connected\":%d,\"depth\":%d,\"size\":%d,\"seconds\":%.3f,"
+            "\"requests\":%llu,\"rps\":%.1f,\"p50_us\":%.3f,\"p99_us\":%.3f,"
+            "\"p999_us\":%.3f,\"mean_us\":%.3f,\"max_us\":%.3f,\"cpu_us_per_req\":%.4f}",
+            first ? "" : ",\n",
+            epcore_backend(), res->epump, res->worker, gconf.conns, res->connected,
+            gconf.depth, gconf.size, res->seconds,
+            (unsigned long long)res->reqs,
+            res->seconds > 0 ? (double)res->reqs / res->seconds : 0,
+            ephist_percentile(&res->hist, 50) / 1000.0,
+            ephist_percentile(&res->hist, 99) / 1000.0,
+            ephist_percentile(&res->hist, 99.9) / 1000.0,
+            ephist_mean(&res->hist) / 1000.0,
+            res->hist.max / 1000.0,
+            res->reqs > 0 ? res->cpu_us / (double)res->reqs : 0);
+}
+
+int main (int argc, char ** argv)
+{
+    bench_result_t * res = NULL;
+    FILE           * fp = NULL;
+    int              i, j, num = 0;
+    int              opt;
+
+    signal(SIGPIPE, SIG_IGN);
+
+    memset(&gconf, 0, sizeof(gconf));
+    gconf.epump[0] = 1; gconf.epump[1] = 2; gconf.epump[2] = 4; gconf.epnum = 3;
+    gconf.worker[0] = 0; gconf.worker[1] = 2; gconf.wknum = 2;
+    gconf.conns = 64;
+    gconf.depth = 8;
+    gconf.size = 64;
+    gconf.duration = 10;
+    gconf.warmup = 1;
+    gconf.port = 18080;
+    gconf.output = "echobench.json";
+
+    while ((opt = getopt(argc, argv, "e:w:c:d:s:t:u:p:o:h")) != -1) {
+        switch (opt) {
+        case 'e': gconf.epnum = parse_list(optarg, gconf.epump, MAX_LIST); break;
+        case 'w': gconf.wknum = parse_list(optarg, gconf.worker, MAX_LIST); break;
+        case 'c': gconf.conns = atoi(optarg); break;
+        case 'd': gconf.depth = atoi(optarg); break;
+        case 's': gconf.size = atoi(optarg); break;
+        case 't': gconf.duration = atoi(optarg); break;
+        case 'u': gconf.warmup = atoi(optarg); break;
+        case 'p': gconf.port = atoi(optarg); break;
+        case 'o': gconf.output = optarg; break;
+        default:
+            printf("Usage: %s [-e 1,2,4] [-w 0,2] [-c conns] [-d depth] [-s size]\n"
+                   "       [-t seconds] [-u warmup] [-p port] [-o result.json]\n", argv[0]);
+            return 0;
+        }
+    }
+
+    if (gconf.conns < 1) gconf.conns = 1;
+    if (gconf.depth < 1) gconf.depth = 1;
+    if (gconf.size < 1) gconf.size = 1;
+    if (gconf.duration < 1) gconf.duration = 1;
+    if (gconf.epnum < 1) { gconf.epump[0] = 1; gconf.epnum = 1; }
+    if (gconf.wknum < 1) { gconf.worker[0] = 0; gconf.wknum = 1; }
+
+    res = kzalloc(gconf.epnum * gconf.wknum * sizeof(*res));
+    if (!res) return -1;
+
+    for (i = 0; i < gconf.epnum; i++) {
+        for (j = 0; j < gconf.wknum; j++) {
+            /* a new port each run, avoiding the TIME_WAIT sockets of last run */
+            if (bench_run(gconf.epump[i], gconf.worker[j], gconf.port + num, &res[num]) < 0)
+                continue;
+
+            bench_print(&res[num]);
+            num++;
+        }
+    }
+
+    fp = fopen(gconf.output, "w");
+    if (fp) {
+        fprintf(fp, "[\n");
+        for (i = 0; i < num; i++)
+            bench_json(fp, &res[i], i == 0);
+        fprintf(fp, "\n]\n");
+        fclose(fp);
+
+        printf("results written into %s\n", gconf.output);
+    }
+
+    kfree(res);
+
+    return 0;
+}
+
@@ -0,0 +1,48 @@
+/*
+ * Copyright (c) 2003-2024 Ke Hengzhong <kehengzhong@hotmail.com>
+ * All rights reserved.
+ */
+
+#include "adifall.ext"
+#include "epump.h"
+
+/* convert the binary trace file saved by epcore_trace_save into Chrome trace
+   event JSON, which can be opened in https://ui.perfetto.dev or chrome://tracing */
+
+int main (int argc, char ** argv)
+{
+    frame_p   frm = NULL;
+    FILE    * fp = stdout;
+    int       ret = 0;
+
+    if (argc < 2) {
+        printf("Usage: %s <trace file> [json file]\n", argv[0]);
+        return -1;
+    }
+
+    frm = frame_new(1024*1024);
+
+    ret = eptrace_file_json(argv[1], frm);
+    if (ret < 0) {
+        fprintf(stderr, "trace file %s parsed failed, ret=%d\n", argv[1], ret);
+        if (frameL(frm) <= 0) {
+            frame_free(frm);
+            return -2;
+        }
+    }
+
+    if (argc > 2 && (fp = fopen(argv[2], "wb")) == NULL) {
+        fprintf(stderr, "json file %s opened failed\n", argv[2]);
+        frame_free(frm);
+        return -3;
+    }
+
+    fwrite(frameP(frm), 1, frameL(frm), fp);
+
+    if (fp != stdout) fclose(fp);
+
+    frame_free(frm);
+
+    return ret < 0 ? -4 : 0;
+}
+
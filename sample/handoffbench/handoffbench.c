@@ -0,0 +1,377 @@
+/*
+ * Copyright (c) 2003-2024 Ke Hengzhong <kehengzhong@hotmail.com>
+ * All rights reserved.
+ */
+
+#include "adifall.ext"
+#include <signal.h>
+#include <unistd.h>
+#include "epump.h"
+
+/* round-trip latency of handing work over between threads. one ping is
+   passed back and forth by 0-millisecond iotimer_t bound to the peer thread,
+   the timer is inserted into the peer ePump and epump_wakeup_send wakes it
+   up through eventfd if it is sleeping in epoll_wait. two modes are run:
+
+   epump   no worker thread, ping goes from ePump A to ePump B and back,
+           ioevent_dispatch pushes the timeout event to the ePump itself
+   worker  ping goes from worker thread to the ePump and back to the worker,
+           ioevent_dispatch hands the timeout event over to the worker by
+           worker_ioevent_push and event_set
+
+   each mode runs idle and under load. the load is L chains per ePump of
+   self-rescheduled timers spinning B microseconds each, which keep the ePump
+   threads (and the worker threads) busy, so epump_wakeup_send is skipped
+   mostly since the target ePump is not sleeping. the wakeups sent per round
+   trip are reported besides the latency distribution, in worker mode they
+   include the wakeups caused by the load chains.
+
+   Usage: handoffbench [-e epumps] [-w workers] [-t seconds] [-l chains]
+                       [-b busyus] [-o result.json] */
+
+#define MAX_EPUMP    64
+
+#define CMD_PING     1
+#define CMD_LOAD     2
+
+#define MODE_EPUMP   0
+#define MODE_WORKER  1
+
+typedef struct BenchConf_ {
+    int       epump;
+    int       worker;
+    int       duration;
+    int       chains;
+    int       busyus;
+    char    * output;
+} bench_conf_t;
+
+typedef struct PingChain_ {
+    epcore_t      * pcore;
+    ulong           home;     /* ePump A, 0 for worker mode */
+    ulong           peer;     /* ePump the ping is sent to from home */
+    uint64          stamp;
+    volatile int    measure;
+    volatile int    stop;
+    volatile int    stopped;
+    uint64          trips;
+    ephist_t        hist;
+} ping_chain_t;
+
+typedef struct LoadChain_ {
+    epcore_t      * pcore;
+    ulong           epumpid;
+    volatile int  * stop;
+    volatile int    stopped;
+    uint64          runs;
+} load_chain_t;
+
+typedef struct BenchResult_ {
+    int             mode;
+    int             loaded;
+    double          seconds;
+    uint64          trips;
+    uint64          wakeup;
+    uint64          loadruns;
+    ephist_t        hist;
+} bench_result_t;
+
+bench_conf_t   gconf;
+
+int ping_pump (void * vpcore, void * vobj, int event, int fdtype);
+int load_pump (void * vpcore, void * vobj, int event, int fdtype);
+
+
+/* thread ids of running ePump threads, taken from structured stats */
+static int epump_ids (epcore_t * pcore, ulong * ids, int max, uint64 * wakeup)
+{
+    epstat_t  * st = NULL;
+    int         i, num = 0;
+
+    st = kzalloc(sizeof(*st));
+    if (!st) return 0;
+
+    epcore_stat(pcore, st);
+
+    for (i = 0; i < st->thread_num && num < max; i++) {
+        if (st->thread[i].type == EPS_THREAD_EPUMP)
+            ids[num++] = st->thread[i].threadid;
+    }
+
+    if (wakeup) *wakeup = st->wakeup_send;
+
+    kfree(st);
+
+    return num;
+}
+
+int ping_pump (void * vpcore, void * vobj, int event, int fdtype)
+{
+    epcore_t     * pcore = (epcore_t *)vpcore;
+    ping_chain_t * chain = NULL;
+    uint64         now = 0;
+
+    if (event != IOE_TIMEOUT || iotimer_cmdid(vobj) != CMD_PING)
+        return 0;
+
+    chain = (ping_chain_t *)iotimer_para(vobj);
+    if (!chain) return -1;
+
+    /* arrived at ePump B, pass back to ePump A */
+    if (chain->home > 0 && get_threadid() == chain->peer) {
+        iotimer_start(pcore, 0, CMD_PING, chain, ping_pump, pcore, chain->home);
+        return 0;
+    }
+
+    /* back at ePump A or the worker thread, one round trip done */
+    now = epnanotime();
+    if (chain->measure && chain->stamp > 0) {
+        ephist_add(&chain->hist, now - chain->stamp);
+        chain->trips++;
+    }
+
+    if (chain->stop) {
+        chain->stopped = 1;
+        return 0;
+    }
+
+    chain->stamp = epnanotime();
+    iotimer_start(pcore, 0, CMD_PING, chain, ping_pump, pcore, chain->peer);
+
+    return 0;
+}
+
+int load_pump (void * vpcore, void * vobj, int event, int fdtype)
+{
+    epcore_t     * pcore = (epcore_t *)vpcore;
+    load_chain_t * load = NULL;
+    uint64         t0 = 0;
+
+    if (event != IOE_TIMEOUT || iotimer_cmdid(vobj) != CMD_LOAD)
+        return 0;
+
+    load = (load_chain_t *)iotimer_para(vobj);
+    if (!load) return -1;
+
+    t0 = epnanotime();
+    while (epnanotime() - t0 < (uint64)gconf.busyus * 1000);
+
+    load->runs++;
+
+    if (*load->stop) {
+        load->stopped = 1;
+        return 0;
+    }
+
+    iotimer_start(pcore, 0, CMD_LOAD, load, load_pump, pcore, load->epumpid);
+
+    return 0;
+}
+
+static int bench_run (int mode, int loaded, bench_result_t * res)
+{
+    epcore_t      * pcore = NULL;
+    ping_chain_t  * chain = NULL;
+    load_chain_t  * loads = NULL;
+    volatile int    loadstop = 0;
+    ulong           ids[MAX_EPUMP];
+    uint64          wk0 = 0, wk1 = 0;
+    uint64          t0, t1;
+    int             i, j, num = 0, loadnum = 0;
+    int             ret = 0;
+
+    memset(res, 0, sizeof(*res));
+    res->mode = mode;
+    res->loaded = loaded;
+
+    pcore = epcore_new(4096);
+    if (!pcore) return -1;
+
+    epcore_start_epump(pcore, gconf.epump);
+    if (mode == MODE_WORKER)
+        epcore_start_worker(pcore, gconf.worker);
+
+    usleep(200*1000);
+
+    num = epump_ids(pcore, ids, MAX_EPUMP, NULL);
+    if (num < 1 || (mode == MODE_EPUMP && num < 2)) {
+        printf("%s mode needs %d ePump threads, %d running\n",
+               mode == MODE_EPUMP ? "epump" : "worker", mode == MODE_EPUMP ? 2 : 1, num);
+        ret = -2;
+        goto clean;
+    }
+
+    chain = kzalloc(sizeof(*chain));
+    if (!chain) { ret = -3; goto clean; }
+
+    chain->pcore = pcore;
+    if (mode == MODE_EPUMP) {
+        chain->home = ids[0];
+        chain->peer = ids[1];
+    } else {
+        chain->home = 0;
+        chain->peer = ids[0];
+    }
+
+    if (loaded && gconf.chains > 0) {
+        loadnum = gconf.chains * num;
+        loads = kzalloc(loadnum * sizeof(*loads));
+
+        for (i = 0; loads && i < loadnum; i++) {
+            loads[i].pcore = pcore;
+            loads[i].epumpid = ids[i % num];
+            loads[i].stop = &loadstop;
+            if (!iotimer_start(pcore, 0, CMD_LOAD, &loads[i], load_pump, pcore, loads[i].epumpid))
+                loads[i].stopped = 1;
+        }
+
+        usleep(200*1000);
+    }
+
+    /* the first ping starts at home, or at a worker chosen by dispatching */
+    iotimer_start(pcore, 0, CMD_PING, chain, ping_pump, pcore,
+                  mode == MODE_EPUMP ? chain->home : chain->peer);
+
+    /* warm up before sampling */
+    sleep(1);
+    epump_ids(pcore, ids, MAX_EPUMP, &wk0);
+
+    t0 = epnanotime();
+    chain->measure = 1;
+    sleep(gconf.duration);
+    chain->stop = 1;
+    t1 = epnanotime();
+
+    for (i = 0; i < 1000 && !chain->stopped; i++) usleep(1000);
+    epump_ids(pcore, ids, MAX_EPUMP, &wk1);
+
+    loadstop = 1;
+    for (i = 0; loads && i < loadnum; i++) {
+        for (j = 0; j < 1000 && !loads[i].stopped; j++) usleep(1000);
+        res->loadruns += loads[i].runs;
+    }
+
+    res->seconds = (double)(t1 - t0) / 1000000000.0;
+    res->trips = chain->trips;
+    res->wakeup = wk1 - wk0;
+    ephist_merge(&res->hist, &chain->hist);
+
+clean:
+    epcore_stop_worker(pcore);
+    epcore_stop_epump(pcore);
+    usleep(200*1000);
+    epcore_clean(pcore);
+
+    if (chain) kfree(chain);
+    if (loads) kfree(loads);
+
+    return ret;
+}
+
+static char * mode_name (int mode)
+{
+    return mode == MODE_EPUMP ? "epump" : "worker";
+}
+
+static void bench_print (bench_result_t * res)
+{
+    printf("%-7s %-6s %-4s trips=%-9llu rtt p50=%.2fus p99=%.2fus p99.9=%.2fus max=%.1fus "
+           "wakeup/trip=%.3f\n",
+           epcore_backend(), mode_name(res->mode), res->loaded ? "load" : "idle",
+           (unsigned long long)res->trips,
+           ephist_percentile(&res->hist, 50) / 1000.0,
+           ephist_percentile(&res->hist, 99) / 1000.0,
+           ephist_percentile(&res->hist, 99.9) / 1000.0,
+           res->hist.max / 1000.0,
+           res->trips > 0 ? (double)res->wakeup / res->trips : 0);
+}
+
+static void bench_json (FILE * fp, bench_result_t * res, int first)
+{
+    fprintf(fp, "%s  {\"bench\":\"handoff\",\"backend\":\"%s\",\"mode\":\"%s\",\"load\":%s,"
+            "\"epump\":%d,\"worker\":%d,\"chains\":%d,\"busy_us\":%d,\"seconds\":%.3f,"
+            "\"trips\":%llu,\"trips_per_sec\":%.1f,\"wakeup\":%llu,\"wakeup_per_trip\":%.4f,"
+            "\"load_runs\":%llu,",
+            first ? "" : ",\n", epcore_backend(), mode_name(res->mode),
+            res->loaded ? "true" : "false", gconf.epump,
+            res->mode == MODE_WORKER ? gconf.worker : 0,
+            res->loaded ? gconf.chains : 0, gconf.busyus, res->seconds,
+            (unsigned long long)res->trips,
+            res->seconds > 0 ? res->trips / res->seconds : 0,
+            (unsigned long long)res->wakeup,
+            res->trips > 0 ? (double)res->wakeup / res->trips : 0,
+            (unsigned long long)res->loadruns);
+
+    fprintf(fp, "\"rtt\":{\"mean_us\":%.3f,\"p50_us\":%.3f,\"p99_us\":%.3f,"
+            "\"p999_us\":%.3f,\"max_us\":%.3f}}",
+            ephist_mean(&res->hist) / 1000.0,
+            ephist_percentile(&res->hist, 50) / 1000.0,
+            ephist_percentile(&res->hist, 99) / 1000.0,
+            ephist_percentile(&res->hist, 99.9) / 1000.0,
+            res->hist.max / 1000.0);
+}
+
+int main (int argc, char ** argv)
+{
+    bench_result_t   res[4];
+    FILE           * fp = NULL;
+    int              mode, loaded;
+    int              i, num = 0;
+    int              opt;
+
+    signal(SIGPIPE, SIG_IGN);
+
+    memset(&gconf, 0, sizeof(gconf));
+    gconf.epump = 2;
+    gconf.worker = 2;
+    gconf.duration = 5;
+    gconf.chains = 4;
+    gconf.busyus = 20;
+    gconf.output = "handoffbench.json";
+
+    while ((opt = getopt(argc, argv, "e:w:t:l:b:o:h")) != -1) {
+        switch (opt) {
+        case 'e': gconf.epump = atoi(optarg); break;
+        case 'w': gconf.worker = atoi(optarg); break;
+        case 't': gconf.duration = atoi(optarg); break;
+        case 'l': gconf.chains = atoi(optarg); break;
+        case 'b': gconf.busyus = atoi(optarg); break;
+        case 'o': gconf.output = optarg; break;
+        default:
+            printf("Usage: %s [-e epumps] [-w workers] [-t seconds] [-l chains]\n"
+                   "       [-b busyus] [-o result.json]\n", argv[0]);
+            return 0;
+        }
+    }
+
+    if (gconf.epump < 2) gconf.epump = 2;
+    if (gconf.epump > MAX_EPUMP) gconf.epump = MAX_EPUMP;
+    if (gconf.worker < 1) gconf.worker = 1;
+    if (gconf.duration < 1) gconf.duration = 1;
+    if (gconf.chains < 0) gconf.chains = 0;
+    if (gconf.busyus < 0) gconf.busyus = 0;
+
+    for (mode = MODE_EPUMP; mode <= MODE_WORKER; mode++) {
+        for (loaded = 0; loaded <= 1; loaded++) {
+            if (bench_run(mode, loaded, &res[num]) < 0)
+                continue;
+
+            bench_print(&res[num]);
+            num++;
+        }
+    }
+
+    fp = fopen(gconf.output, "w");
+    if (fp) {
+        fprintf(fp, "[\n");
+        for (i = 0; i < num; i++)
+            bench_json(fp, &res[i], i == 0);
+        fprintf(fp, "\n]\n");
+        fclose(fp);
+
+        printf("results written into %s\n", gconf.output);
+    }
+
+    return 0;
+}
+
@@ -0,0 +1,403 @@
+/*
+ * Copyright (c) 2003-2024 Ke Hengzhong <kehengzhong@hotmail.com>
+ * All rights reserved.
+ */
+
+#include "adifall.ext"
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "epump.h"
+
+/* microbenchmark and stress harness of iotimer_start/iotimer_stop and timeout
+   firing. three phases are run in one epcore_t instance:
+
+   local   N timers are started and then stopped inside an ePump thread,
+           the fast path without waking up any thread.
+   remote  N timers are started and stopped by T threads other than ePump
+           threads, each call inserts into the timer tree of an ePump thread
+           and wakes it up by epump_wakeup_send when it is sleeping.
+   fire    M timers with mixed deadlines, short% of them in 1-100ms and the
+           rest in 1-3s, are started and the lateness of every firing against
+           its deadline is recorded.
+
+   memory per timer is counted in the local phase from the timer and timer-tree
+   memory pools and from the process RSS while N timers are pending. the pools
+   keep the memory for reusing, so it is not counted again in remote phase.
+
+   Usage: timerbench [-e epumps] [-n timers] [-m firing timers] [-s short%]
+                     [-T threads] [-o result.json] */
+
+#define CMD_LOCAL    1
+#define CMD_FIRE     2
+#define CMD_PENDING  3    /* never fired during the benchmark */
+
+#define SHORT_MIN    1
+#define SHORT_MAX    100
+#define LONG_MIN     1000
+#define LONG_MAX     3000
+
+typedef struct BenchConf_ {
+    int       epump;
+    int       timers;
+    int       fires;
+    int       shortpct;
+    int       threads;
+    char    * output;
+} bench_conf_t;
+
+typedef struct PhaseResult_ {
+    double    start_ops;     /* iotimer_start calls per second */
+    double    stop_ops;      /* iotimer_stop calls per second */
+    uint64    wakeup;        /* epump_wakeup_send calls during the phase */
+    double    pool_bytes;    /* bytes of timer pools per pending timer */
+    double    rss_bytes;     /* RSS growth per pending timer */
+} phase_result_t;
+
+typedef struct FireRec_ {
+    uint64    deadline;
+    uint64    fired;
+    int       ms;
+} fire_rec_t;
+
+typedef struct ArmThread_ {
+    epcore_t * pcore;
+    void    ** tid;
+    int        num;
+    uint64     start_ns;
+    uint64     stop_ns;
+    pthread_barrier_t * barrier;
+} arm_thread_t;
+
+bench_conf_t       gconf;
+epcore_t         * gpcore = NULL;
+
+static void       ** timer_list = NULL;
+static fire_rec_t  * fire_list = NULL;
+static volatile int  local_done = 0;
+static phase_result_t  local_res;
+
+int timer_pump (void * vpcore, void * vobj, int event, int fdtype);
+
+
+static long rss_bytes (void)
+{
+    FILE  * fp = NULL;
+    long    size = 0, rss = 0;
+
+    fp = fopen("/proc/self/statm", "r");
+    if (!fp) return 0;
+
+    if (fscanf(fp, "%ld %ld", &size, &rss) != 2) rss = 0;
+    fclose(fp);
+
+    return rss * sysconf(_SC_PAGESIZE);
+}
+
+/* bytes allocated by the pools of iotimer_t and its red-black tree node */
+static long timer_pool_bytes (epcore_t * pcore, uint64 * wakeup)
+{
+    epstat_t  * st = NULL;
+    long        size = 0;
+
+    st = kzalloc(sizeof(*st));
+    if (!st) return 0;
+
+    epcore_stat(pcore, st);
+
+    size = st->pool[1].size + st->pool[5].size;
+    if (wakeup) *wakeup = st->wakeup_send;
+
+    kfree(st);
+
+    return size;
+}
+
+static double ops_per_sec (int num, uint64 ns)
+{
+    if (ns == 0) return 0;
+
+    return (double)num * 1000000000.0 / (double)ns;
+}
+
+/* run in the ePump thread, timers are bound to current ePump thread */
+static void local_phase (epcore_t * pcore)
+{
+    uint64  t0, t1;
+    uint64  wk0 = 0, wk1 = 0;
+    long    pool0, rss0;
+    int     i;
+
+    pool0 = timer_pool_bytes(pcore, &wk0);
+    rss0 = rss_bytes();
+
+    t0 = epnanotime();
+    for (i = 0; i < gconf.timers; i++)
+        timer_list[i] = iotimer_start(pcore, 3600*1000, CMD_PENDING, NULL, timer_pump, pcore, 0);
+    t1 = epnanotime();
+
+    local_res.start_ops = ops_per_sec(gconf.timers, t1 - t0);
+    local_res.pool_bytes = (double)(timer_pool_bytes(pcore, NULL) - pool0) / gconf.timers;
+    local_res.rss_bytes = (double)(rss_bytes() - rss0) / gconf.timers;
+
+    t0 = epnanotime();
+    for (i = 0; i < gconf.timers; i++)
+        iotimer_stop(pcore, timer_list[i]);
+    t1 = epnanotime();
+
+    local_res.stop_ops = ops_per_sec(gconf.timers, t1 - t0);
+
+    timer_pool_bytes(pcore, &wk1);
+    local_res.wakeup = wk1 - wk0;
+}
+
+int timer_pump (void * vpcore, void * vobj, int event, int fdtype)
+{
+    epcore_t   * pcore = (epcore_t *)vpcore;
+    fire_rec_t * rec = NULL;
+    int          cmdid = 0;
+
+    if (event != IOE_TIMEOUT) return 0;
+
+    cmdid = iotimer_cmdid(vobj);
+
+    if (cmdid == CMD_LOCAL) {
+        local_phase(pcore);
+        local_done = 1;
+
+    } else if (cmdid == CMD_FIRE) {
+        rec = (fire_rec_t *)iotimer_para(vobj);
+        if (rec) rec->fired = epnanotime();
+    }
+
+    return 0;
+}
+
+
+static void * arm_thread (void * varg)
+{
+    arm_thread_t * arg = (arm_thread_t *)varg;
+    uint64         t0;
+    int            i;
+
+    pthread_barrier_wait(arg->barrier);
+
+    t0 = epnanotime();
+    for (i = 0; i < arg->num; i++)
+        arg->tid[i] = iotimer_start(arg->pcore, 3600*1000, CMD_PENDING, NULL,
+                                    timer_pump, arg->pcore, 0);
+    arg->start_ns = epnanotime() - t0;
+
+    pthread_barrier_wait(arg->barrier);
+
+    /* all threads finish starting before stopping */
+    pthread_barrier_wait(arg->barrier);
+
+    t0 = epnanotime();
+    for (i = 0; i < arg->num; i++)
+        iotimer_stop(arg->pcore, arg->tid[i]);
+    arg->stop_ns = epnanotime() - t0;
+
+    return NULL;
+}
+
+static void remote_phase (epcore_t * pcore, phase_result_t * res)
+{
+    arm_thread_t      * args = NULL;
+    pthread_t         * ths = NULL;
+    pthread_barrier_t   barrier;
+    uint64              wk0 = 0, wk1 = 0;
+    uint64              maxstart = 0, maxstop = 0;
+    int                 i, per;
+
+    memset(res, 0, sizeof(*res));
+
+    args = kzalloc(gconf.threads * sizeof(*args));
+    ths = kzalloc(gconf.threads * sizeof(*ths));
+    if (!args || !ths) goto end;
+
+    pthread_barrier_init(&barrier, NULL, gconf.threads + 1);
+
+    per = gconf.timers / gconf.threads;
+    timer_pool_bytes(pcore, &wk0);
+
+    for (i = 0; i < gconf.threads; i++) {
+        args[i].pcore = pcore;
+        args[i].tid = timer_list + i * per;
+        args[i].num = per;
+        args[i].barrier = &barrier;
+        pthread_create(&ths[i], NULL, arm_thread, &args[i]);
+    }
+
+    pthread_barrier_wait(&barrier);   /* start arming */
+    pthread_barrier_wait(&barrier);   /* all armed */
+    pthread_barrier_wait(&barrier);   /* start stopping */
+
+    for (i = 0; i < gconf.threads; i++) {
+        pthread_join(ths[i], NULL);
+        if (args[i].start_ns > maxstart) maxstart = args[i].start_ns;
+        if (args[i].stop_ns > maxstop) maxstop = args[i].stop_ns;
+    }
+    pthread_barrier_destroy(&barrier);
+
+    timer_pool_bytes(pcore, &wk1);
+
+    res->start_ops = ops_per_sec(per * gconf.threads, maxstart);
+    res->stop_ops = ops_per_sec(per * gconf.threads, maxstop);
+    res->wakeup = wk1 - wk0;
+
+end:
+    if (args) kfree(args);
+    if (ths) kfree(ths);
+}
+
+static void fire_phase (epcore_t * pcore, ephist_t * hist, int * missed)
+{
+    uint64  now;
+    int     i;
+
+    memset(hist, 0, sizeof(*hist));
+    *missed = 0;
+
+    srand(1);
+
+    for (i = 0; i < gconf.fires; i++) {
+        if (rand() % 100 < gconf.shortpct)
+            fire_list[i].ms = SHORT_MIN + rand() % (SHORT_MAX - SHORT_MIN + 1);
+        else
+            fire_list[i].ms = LONG_MIN + rand() % (LONG_MAX - LONG_MIN + 1);
+    }
+
+    for (i = 0; i < gconf.fires; i++) {
+        now = epnanotime();
+        fire_list[i].deadline = now + (uint64)fire_list[i].ms * 1000000;
+        fire_list[i].fired = 0;
+
+        iotimer_start(pcore, fire_list[i].ms, CMD_FIRE, &fire_list[i], timer_pump, pcore, 0);
+    }
+
+    /* waiting for the longest deadline */
+    sleep((LONG_MAX + 2000) / 1000);
+
+    for (i = 0; i < gconf.fires; i++) {
+        if (fire_list[i].fired == 0) {
+            (*missed)++;
+            continue;
+        }
+
+        /* firing earlier than deadline is counted as 0 lateness */
+        if (fire_list[i].fired > fire_list[i].deadline)
+            ephist_add(hist, fire_list[i].fired - fire_list[i].deadline);
+        else
+            ephist_add(hist, 0);
+    }
+}
+
+static void phase_print (char * name, phase_result_t * res)
+{
+    printf("%-7s start=%.0f/s stop=%.0f/s wakeup=%llu\n",
+           name, res->start_ops, res->stop_ops, (unsigned long long)res->wakeup);
+}
+
+static void phase_json (FILE * fp, char * name, phase_result_t * res)
+{
+    fprintf(fp, "  \"%s\":{\"start_ops\":%.1f,\"stop_ops\":%.1f,\"wakeup_send\":%llu},\n",
+            name, res->start_ops, res->stop_ops, (unsigned long long)res->wakeup);
+}
+
+int main (int argc, char ** argv)
+{
+    epcore_t       * pcore = NULL;
+    phase_result_t   remote_res;
+    ephist_t         hist;
+    FILE           * fp = NULL;
+    int              missed = 0;
+    int              opt;
+
+    signal(SIGPIPE, SIG_IGN);
+
+    memset(&gconf, 0, sizeof(gconf));
+    gconf.epump = 2;
+    gconf.timers = 1000000;
+    gconf.fires = 200000;
+    gconf.shortpct = 50;
+    gconf.threads = 2;
+    gconf.output = "timerbench.json";
+
+    while ((opt = getopt(argc, argv, "e:n:m:s:T:o:h")) != -1) {
+        switch (opt) {
+        case 'e': gconf.epump = atoi(optarg); break;
+        case 'n': gconf.timers = atoi(optarg); break;
+        case 'm': gconf.fires = atoi(optarg); break;
+        case 's': gconf.shortpct = atoi(optarg); break;
+        case 'T': gconf.threads = atoi(optarg); break;
+        case 'o': gconf.output = optarg; break;
+        default:
+            printf("Usage: %s [-e epumps] [-n timers] [-m firing timers] [-s short%%]\n"
+                   "       [-T threads] [-o result.json]\n", argv[0]);
+            return 0;
+        }
+    }
+
+    if (gconf.epump < 1) gconf.epump = 1;
+    if (gconf.timers < 1) gconf.timers = 1;
+    if (gconf.fires < 1) gconf.fires = 1;
+    if (gconf.threads < 1) gconf.threads = 1;
+    if (gconf.threads > gconf.timers) gconf.threads = gconf.timers;
+
+    timer_list = kzalloc(gconf.timers * sizeof(void *));
+    fire_list = kzalloc(gconf.fires * sizeof(fire_rec_t));
+    if (!timer_list || !fire_list) return -1;
+
+    gpcore = pcore = epcore_new(65536);
+
+    epcore_start_epump(pcore, gconf.epump);
+    usleep(200*1000);
+
+    /* local phase is run by the ePump thread executing the timeout event */
+    iotimer_start(pcore, 0, CMD_LOCAL, NULL, timer_pump, pcore, 0);
+    while (!local_done) usleep(10*1000);
+    phase_print("local", &local_res);
+    printf("memory  per timer: pool=%.1fB rss=%.1fB\n", local_res.pool_bytes, local_res.rss_bytes);
+
+    remote_phase(pcore, &remote_res);
+    phase_print("remote", &remote_res);
+
+    fire_phase(pcore, &hist, &missed);
+    printf("fire    timers=%d missed=%d lateness: p50=%.3fms p99=%.3fms p999=%.3fms max=%.3fms\n",
+           gconf.fires, missed,
+           ephist_percentile(&hist, 50) / 1000000.0,
+           ephist_percentile(&hist, 99) / 1000000.0,
+           ephist_percentile(&hist, 99.9) / 1000000.0,
+           hist.max / 1000000.0);
+
+    fp = fopen(gconf.output, "w");
+    if (fp) {
+        fprintf(fp, "{\n  \"bench\":\"timer\",\"backend\":\"%s\",\"epump\":%d,\"timers\":%d,"
+                "\"threads\":%d,\n", epcore_backend(), gconf.epump, gconf.timers, gconf.threads);
+        fprintf(fp, "  \"memory\":{\"pool_bytes_per_timer\":%.1f,\"rss_bytes_per_timer\":%.1f},\n",
+                local_res.pool_bytes, local_res.rss_bytes);
+        phase_json(fp, "local", &local_res);
+        phase_json(fp, "remote", &remote_res);
+        fprintf(fp, "  \"fire\":{\"timers\":%d,\"short_pct\":%d,\"missed\":%d,"
+                "\"p50_ms\":%.3f,\"p99_ms\":%.3f,\"p999_ms\":%.3f,\"max_ms\":%.3f}\n}\n",
+                gconf.fires, gconf.shortpct, missed,
+                ephist_percentile(&hist, 50) / 1000000.0,
+                ephist_percentile(&hist, 99) / 1000000.0,
+                ephist_percentile(&hist, 99.9) / 1000000.0,
+                hist.max / 1000000.0);
+        fclose(fp);
+
+        printf("results written into %s\n", gconf.output);
+    }
+
+    epcore_stop_epump(pcore);
+    usleep(100*1000);
+    epcore_clean(pcore);
+
+    kfree(timer_list);
+    kfree(fire_list);
+
+    return 0;
+}
+
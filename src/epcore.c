@@ -47,6 +47,10 @@
 #include "epwakeup.h"
 #include "mlisten.h"
 #include "epdns.h"
+#include "epudp.h"
+#include "eptcp.h"
+#include "epstat.h"
+#include "eptrace.h"
 
 #ifdef HAVE_IOCP
 #include "epiocp.h"
@@ -115,6 +119,19 @@ void * epcore_new (int maxfd)
     time(&pcore->startup_time);
     pcore->quit = 0;
 
+    pcore->happyeyeballs = 0;
+    pcore->hedelay = EPTCP_HE_DELAY;
+
+    pcore->latency = 0;
+
+    pcore->slowcb_thres = 0;
+    pcore->slowcb_sample = 1;
+
+    pcore->trace = 0;
+    pcore->tracesize = EPT_RING_SIZE;
+    pcore->trace_tsc0 = 0;
+    pcore->trace_ns0 = 0;
+
 #ifdef HAVE_EVENTFD
     pcore->wakeupfd = -1;
 #else
@@ -171,6 +188,18 @@ void * epcore_new (int maxfd)
         mpool_set_allocnum(pcore->timrbn_pool, 2978);
     }
 
+    if (!pcore->udpvec_pool) {
+        pcore->udpvec_pool = mpool_alloc();
+        mpool_set_unitsize(pcore->udpvec_pool, sizeof(epudp_vec_t));
+        mpool_set_allocnum(pcore->udpvec_pool, 4);
+    }
+
+    if (!pcore->udpgro_pool) {
+        pcore->udpgro_pool = mpool_alloc();
+        mpool_set_unitsize(pcore->udpgro_pool, sizeof(epudp_grovec_t));
+        mpool_set_allocnum(pcore->udpgro_pool, 1);
+    }
+
     /* initialization of IODevice operation & management */
     InitializeCriticalSection(&pcore->devicetableCS);
     pcore->device_table = ht_only_new(pcore->maxfd, iodev_cmp_id);
@@ -202,6 +231,10 @@ void * epcore_new (int maxfd)
     InitializeCriticalSection(&pcore->eventnumCS);
     pcore->acc_event_num = 0;
 
+    InitializeCriticalSection(&pcore->traceCS);
+    pcore->trace_list = arr_new(8);
+    pcore->tracegen = eptrace_gen_next();
+
     epcore_mlisten_init(pcore);
     epcore_wakeup_init(pcore);
 
@@ -262,6 +295,10 @@ void epcore_clean (void * vpcore)
 
     DeleteCriticalSection(&pcore->eventnumCS);
 
+    /* free the trace rings after all threads stopped */
+    eptrace_clean(pcore);
+    DeleteCriticalSection(&pcore->traceCS);
+
 #ifdef HAVE_IOCP
     epcore_iocp_clean(pcore);
 #endif
@@ -273,6 +310,8 @@ void epcore_clean (void * vpcore)
     mpool_free(pcore->epump_pool);
     mpool_free(pcore->devrbn_pool);
     mpool_free(pcore->timrbn_pool);
+    mpool_free(pcore->udpvec_pool);
+    mpool_free(pcore->udpgro_pool);
 
     kfree(pcore);
 
@@ -290,6 +329,104 @@ int epcore_dnsrv_add (void * vpcore, char * nsip, int port)
     return dns_nsrv_append (pcore->dnsmgmt, nsip, port);
 }
 
+int epcore_dnsrv_clear (void * vpcore)
+{
+    epcore_t  * pcore = (epcore_t *)vpcore;
+
+    if (!pcore) return -1;
+
+    return dns_nsrv_clear(pcore->dnsmgmt);
+}
+
+int epcore_dns_prefetch (void * vpcore, int ratio, int minhits)
+{
+    epcore_t  * pcore = (epcore_t *)vpcore;
+
+    if (!pcore) return -1;
+
+    return dns_prefetch_set(pcore->dnsmgmt, ratio, minhits);
+}
+
+int epcore_dns_stale (void * vpcore, int stalemax)
+{
+    epcore_t  * pcore = (epcore_t *)vpcore;
+
+    if (!pcore) return -1;
+
+    return dns_stale_set(pcore->dnsmgmt, stalemax);
+}
+
+int epcore_dns_edns (void * vpcore, int size)
+{
+    epcore_t  * pcore = (epcore_t *)vpcore;
+
+    if (!pcore) return -1;
+
+    return dns_edns_set(pcore->dnsmgmt, size);
+}
+
+int epcore_dns_hedge (void * vpcore, int onoff)
+{
+    epcore_t  * pcore = (epcore_t *)vpcore;
+
+    if (!pcore) return -1;
+
+    return dns_hedge_set(pcore->dnsmgmt, onoff);
+}
+
+int epcore_dns_snapshot (void * vpcore, char * file, int interval)
+{
+    epcore_t  * pcore = (epcore_t *)vpcore;
+
+    if (!pcore) return -1;
+
+    return dns_snapshot_set(pcore->dnsmgmt, file, interval);
+}
+
+int epcore_dns_hosts (void * vpcore, char * hostsfile)
+{
+    epcore_t  * pcore = (epcore_t *)vpcore;
+
+    if (!pcore) return -1;
+
+    return dns_hosts_load(pcore->dnsmgmt, hostsfile);
+}
+
+int epcore_dns_host_add (void * vpcore, char * name, char * ip)
+{
+    epcore_t  * pcore = (epcore_t *)vpcore;
+
+    if (!pcore) return -1;
+
+    return dns_hosts_add(pcore->dnsmgmt, name, ip);
+}
+
+int epcore_dns_host_del (void * vpcore, char * name)
+{
+    epcore_t  * pcore = (epcore_t *)vpcore;
+
+    if (!pcore) return -1;
+
+    return dns_hosts_del(pcore->dnsmgmt, name);
+}
+
+int epcore_happy_eyeballs (void * vpcore, int onoff, int delayms)
+{
+    epcore_t  * pcore = (epcore_t *)vpcore;
+
+    if (!pcore) return -1;
+
+    /* rfc8305 recommends 250ms, no less than 10ms and no more than 2s */
+    if (delayms <= 0) delayms = EPTCP_HE_DELAY;
+    if (delayms < 10) delayms = 10;
+    if (delayms > 2000) delayms = 2000;
+
+    pcore->happyeyeballs = onoff ? 1 : 0;
+    pcore->hedelay = delayms;
+
+    return dns_dualstack_set(pcore->dnsmgmt, onoff);
+}
+
 
 int epcore_set_callback (void * vpcore, void * cb, void * cbpara)
 {
@@ -303,6 +440,19 @@ int epcore_set_callback (void * vpcore, void * cb, void * cbpara)
     return 0;
 }
 
+char * epcore_backend (void)
+{
+#if defined(HAVE_IOCP)
+    return "iocp";
+#elif defined(HAVE_EPOLL)
+    return "epoll";
+#elif defined(HAVE_KQUEUE)
+    return "kqueue";
+#else
+    return "select";
+#endif
+}
+
  
 void epcore_start_epump (void * vpcore, int maxnum)
 {
@@ -935,9 +1085,11 @@ void epcore_print (void * vpcore, frame_p frm, FILE * fp)
     epump_t    * epump = NULL;
     worker_t   * wker = NULL;
     mlisten_t  * mln = NULL;
+    iodev_t    * pdev = NULL;
     DnsMgmt    * dnsmgmt = NULL;
-    int          i, num;
+    int          i, j, num;
     long         memsize = 0;
+    eplat_t    * lat = NULL;
 
     if (!pcore) return;
 
@@ -949,6 +1101,8 @@ void epcore_print (void * vpcore, frame_p frm, FILE * fp)
     memsize += mpool_size(pcore->epump_pool);
     memsize += mpool_size(pcore->devrbn_pool);
     memsize += mpool_size(pcore->timrbn_pool);
+    memsize += mpool_size(pcore->udpvec_pool);
+    memsize += mpool_size(pcore->udpgro_pool);
     if (dnsmgmt) {
         memsize += mpool_size(dnsmgmt->msg_pool);
         memsize += mpool_size(dnsmgmt->cache_pool);
@@ -964,6 +1118,9 @@ void epcore_print (void * vpcore, frame_p frm, FILE * fp)
         frame_appendf(frm, "  glbDeviceNum=%d\n", arr_num(pcore->glbiodev_list));
         frame_appendf(frm, "  glbTimerNum=%d\n", arr_num(pcore->glbiotimer_list));
         frame_appendf(frm, "  glbMListenNum=%d\n", arr_num(pcore->glbmlisten_list));
+        if (pcore->slowcb_thres > 0)
+            frame_appendf(frm, "  SlowCallback=%lu threshold=%dms sample=%d\n",
+                          pcore->slowcb_num, pcore->slowcb_thres, pcore->slowcb_sample);
 
         mpool_print(pcore->device_pool, "DevicePool", 2, frm, NULL);
         mpool_print(pcore->timer_pool, "TimerPool", 2, frm, NULL);
@@ -971,9 +1128,14 @@ void epcore_print (void * vpcore, frame_p frm, FILE * fp)
         mpool_print(pcore->epump_pool, "EPumpPool", 2, frm, NULL);
         mpool_print(pcore->devrbn_pool, "DeviceRBNodePool", 2, frm, NULL);
         mpool_print(pcore->timrbn_pool, "TimerRBNodePool", 2, frm, NULL);
-
-        frame_appendf(frm, "  DNS: msgnum=%d msgid=%u cachenum=%d\n",
-                      ht_num(dnsmgmt->msg_table), dnsmgmt->msgid, ht_num(dnsmgmt->cache_table));
+        mpool_print(pcore->udpvec_pool, "UdpVectorPool", 2, frm, NULL);
+        mpool_print(pcore->udpgro_pool, "UdpGroVectorPool", 2, frm, NULL);
+
+        frame_appendf(frm, "  DNS: msgnum=%d shards=%d cachenum=%d prefetch=%llu stale=%llu negative=%llu tcp=%llu hosts=%llu hedge=%llu\n",
+                      dns_msg_mgmt_num(dnsmgmt), dnsmgmt->shardnum, dns_cache_mgmt_num(dnsmgmt),
+                      (unsigned long long)dnsmgmt->prefetch_num, (unsigned long long)dnsmgmt->stale_num,
+                      (unsigned long long)dnsmgmt->negative_num, (unsigned long long)dnsmgmt->tcp_num,
+                      (unsigned long long)dnsmgmt->hosts_hit, (unsigned long long)dnsmgmt->hedge_num);
         mpool_print(dnsmgmt->msg_pool, "DnsMsgPool", 2, frm, NULL);
         mpool_print(dnsmgmt->cache_pool, "DnsCachePool", 2, frm, NULL);
 
@@ -993,6 +1155,9 @@ void epcore_print (void * vpcore, frame_p frm, FILE * fp)
         fprintf(fp, "  glbDeviceNum=%d\n", arr_num(pcore->glbiodev_list));
         fprintf(fp, "  glbTimerNum=%d\n", arr_num(pcore->glbiotimer_list));
         fprintf(fp, "  glbMListenNum=%d\n", arr_num(pcore->glbmlisten_list));
+        if (pcore->slowcb_thres > 0)
+            fprintf(fp, "  SlowCallback=%lu threshold=%dms sample=%d\n",
+                    pcore->slowcb_num, pcore->slowcb_thres, pcore->slowcb_sample);
 
         mpool_print(pcore->device_pool, "DevicePool", 2, NULL, fp);
         mpool_print(pcore->timer_pool, "TimerPool", 2, NULL, fp);
@@ -1000,9 +1165,14 @@ void epcore_print (void * vpcore, frame_p frm, FILE * fp)
         mpool_print(pcore->epump_pool, "EPumpPool", 2, NULL, fp);
         mpool_print(pcore->devrbn_pool, "DeviceRBNodePool", 2, NULL, fp);
         mpool_print(pcore->timrbn_pool, "TimerRBNodePool", 2, NULL, fp);
-
-        fprintf(fp, "  DNS: msgnum=%d msgid=%u cachenum=%d\n",
-                ht_num(dnsmgmt->msg_table), dnsmgmt->msgid, ht_num(dnsmgmt->cache_table));
+        mpool_print(pcore->udpvec_pool, "UdpVectorPool", 2, NULL, fp);
+        mpool_print(pcore->udpgro_pool, "UdpGroVectorPool", 2, NULL, fp);
+
+        fprintf(fp, "  DNS: msgnum=%d shards=%d cachenum=%d prefetch=%llu stale=%llu negative=%llu tcp=%llu hosts=%llu hedge=%llu\n",
+                dns_msg_mgmt_num(dnsmgmt), dnsmgmt->shardnum, dns_cache_mgmt_num(dnsmgmt),
+                (unsigned long long)dnsmgmt->prefetch_num, (unsigned long long)dnsmgmt->stale_num,
+                (unsigned long long)dnsmgmt->negative_num, (unsigned long long)dnsmgmt->tcp_num,
+                (unsigned long long)dnsmgmt->hosts_hit, (unsigned long long)dnsmgmt->hedge_num);
         mpool_print(dnsmgmt->msg_pool, "DnsMsgPool", 2, NULL, fp);
         mpool_print(dnsmgmt->cache_pool, "DnsCachePool", 2, NULL, fp);
 
@@ -1013,12 +1183,29 @@ void epcore_print (void * vpcore, frame_p frm, FILE * fp)
         }
     }
 
+    EnterCriticalSection(&pcore->glbmlistenlistCS);
     num = arr_num(pcore->glbmlisten_list);
     for (i = 0; i < num; i++) {
         mln = arr_value(pcore->glbmlisten_list, i);
-        if (frm) frame_appendf(frm, "  TCP Listen: %s:%d\n", mln->localip, mln->port);
-        if (fp) fprintf(fp, "  TCP Listen: %s:%d\n", mln->localip, mln->port);
+        if (frm) frame_appendf(frm, "  TCP Listen: %s:%d reuseport=%d steer=%d\n",
+                               mln->localip, mln->port, mln->reuseport, mln->steer);
+        if (fp) fprintf(fp, "  TCP Listen: %s:%d reuseport=%d steer=%d\n",
+                        mln->localip, mln->port, mln->reuseport, mln->steer);
+
+        /* accepted number of each listen device to check the balance among epumps */
+        for (j = 0; j < arr_num(mln->devlist); j++) {
+            pdev = arr_value(mln->devlist, j);
+            if (!pdev) continue;
+
+            if (frm) frame_appendf(frm, "    [Listen %-2d]: fd=%d ePump=%lu accepted=%lu\n",
+                                   j+1, pdev->fd, iodev_epumpid(pdev), pdev->acceptnum);
+            if (fp) fprintf(fp, "    [Listen %-2d]: fd=%d ePump=%lu accepted=%lu\n",
+                            j+1, pdev->fd, iodev_epumpid(pdev), pdev->acceptnum);
+        }
     }
+    LeaveCriticalSection(&pcore->glbmlistenlistCS);
+
+    if (pcore->latency) lat = kzalloc(sizeof(*lat));
 
     EnterCriticalSection(&pcore->epumplistCS);
     num = arr_num(pcore->epump_list);
@@ -1036,6 +1223,11 @@ void epcore_print (void * vpcore, frame_p frm, FILE * fp)
         if (fp)
             fprintf(fp, "  [ePump %-2d]:%lu iodev:%d iotimer:%d\n", i+1, epump->threadid,
                     epump_objnum(epump, 1), epump_objnum(epump, 2));
+
+        if (lat && epump->lat) {
+            eplat_copy(lat, epump->lat);
+            eplat_print(lat, frm, fp);
+        }
     }
     LeaveCriticalSection(&pcore->epumplistCS);
 
@@ -1061,9 +1253,16 @@ void epcore_print (void * vpcore, frame_p frm, FILE * fp)
                    i+1, wker->threadid, wker->acc_idle_time,
                    wker->acc_working_time, wker->working_ratio,
                    wker->acc_event_num, lt_num(wker->ioevent_list), wker->workload);
+
+        if (lat && wker->lat) {
+            eplat_copy(lat, wker->lat);
+            eplat_print(lat, frm, fp);
+        }
     }
     LeaveCriticalSection(&pcore->workerlistCS);
 
+    if (lat) kfree(lat);
+
     if (frm)
         frame_appendf(frm, "\n");
     if (fp)
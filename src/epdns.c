@@ -38,14 +38,31 @@
 #include "mpool.h"
 #include "trace.h"
 #include "kemalloc.h"
+#include "btime.h"
 
 #include "epcore.h"
 #include "iodev.h"
 #include "iotimer.h"
 #include "ioevent.h"
 #include "epudp.h"
+#include "eptcp.h"
 
 #include "epdns.h"
+#include "epprobe.h"
+#include "epstat.h"
+
+#include <sys/stat.h>
+
+#if defined(_WIN32) || defined(_WIN64)
+#define EP_TLS  __declspec(thread)
+#else
+#define EP_TLS  __thread
+#endif
+
+/* shard of DnsMgmt picked by current thread last time */
+static EP_TLS void * tls_dnsmgmt = NULL;
+static EP_TLS int    tls_shardind = 0;
+static EP_TLS int    tls_shared = 0;
 
 /* converts a DNS-based hostname into dot-based format, 
    3www5apple3com0 into www.apple.com */
@@ -137,6 +154,8 @@ void * dns_host_alloc (int alloctype, void * mpool)
     if (host) {
         host->alloctype = alloctype;
         host->mpool = mpool;
+
+        InitializeCriticalSection(&host->statCS);
     }
 
     return host;
@@ -150,6 +169,8 @@ void dns_host_free (void * vhost)
  
     if (host->host) k_mem_free(host->host, host->alloctype, host->mpool);
  
+    DeleteCriticalSection(&host->statCS);
+
     k_mem_free(host, host->alloctype, host->mpool);
 }
  
@@ -181,6 +202,114 @@ void * dns_host_new (char * hostn, char * nsip, int port, int alloctype, void *
     return host;
 }
  
+void dns_host_rtt (void * vhost, int rttms)
+{
+    DnsHost * host = (DnsHost *)vhost;
+    uint16    samples[DNS_HOST_RTT_SAMPLES];
+    uint16    val = 0;
+    uint32    diff = 0;
+    int       i, j, num;
+ 
+    if (!host) return;
+ 
+    if (rttms < 0) rttms = 0;
+    if (rttms > 65535) rttms = 65535;
+ 
+    EnterCriticalSection(&host->statCS);
+ 
+    /* rfc6298: RTTVAR = 3/4 RTTVAR + 1/4 |SRTT - R|, SRTT = 7/8 SRTT + 1/8 R */
+    if (host->rttnum == 0) {
+        host->srtt = rttms;
+        host->rttvar = rttms / 2;
+    } else {
+        diff = host->srtt > (uint32)rttms ? host->srtt - rttms : rttms - host->srtt;
+        host->rttvar = (host->rttvar * 3 + diff) / 4;
+        host->srtt = (host->srtt * 7 + rttms) / 8;
+    }
+ 
+    host->rttring[host->rttind] = (uint16)rttms;
+    host->rttind = (host->rttind + 1) % DNS_HOST_RTT_SAMPLES;
+    if (host->rttnum < DNS_HOST_RTT_SAMPLES) host->rttnum++;
+ 
+    /* insertion sort of the latest samples to take p95 */
+    num = host->rttnum;
+    for (i = 0; i < num; i++) {
+        val = host->rttring[i];
+        for (j = i; j > 0 && samples[j-1] > val; j--)
+            samples[j] = samples[j-1];
+        samples[j] = val;
+    }
+    host->rttp95 = samples[(num * 95) / 100 < num ? (num * 95) / 100 : num - 1];
+ 
+    /* response arrived, the server is healthy again */
+    host->failnum = 0;
+    memset(&host->holdtime, 0, sizeof(host->holdtime));
+ 
+    LeaveCriticalSection(&host->statCS);
+}
+ 
+void dns_host_fail (void * vhost)
+{
+    DnsHost * host = (DnsHost *)vhost;
+    int       backoff = DNS_HOST_BACKOFF_MIN;
+    int       i;
+ 
+    if (!host) return;
+ 
+    EnterCriticalSection(&host->statCS);
+ 
+    host->failnum++;
+ 
+    for (i = 1; i < host->failnum && backoff < DNS_HOST_BACKOFF_MAX; i++)
+        backoff *= 2;
+    if (backoff > DNS_HOST_BACKOFF_MAX) backoff = DNS_HOST_BACKOFF_MAX;
+ 
+    btime_now_add(&host->holdtime, backoff);
+ 
+    LeaveCriticalSection(&host->statCS);
+}
+ 
+ulong dns_host_score (void * vhost)
+{
+    DnsHost * host = (DnsHost *)vhost;
+    btime_t   curt;
+    ulong     score = 0;
+ 
+    if (!host) return (ulong)-1;
+ 
+    btime(&curt);
+ 
+    EnterCriticalSection(&host->statCS);
+ 
+    score = host->rttnum > 0 ? host->srtt : DNS_HOST_RTT_INIT;
+    score = score * (host->failnum + 1);
+ 
+    if (host->failnum > 0 && btime_cmp(&host->holdtime, >, &curt))
+        score += 1000000000UL;
+ 
+    LeaveCriticalSection(&host->statCS);
+ 
+    return score;
+}
+ 
+int dns_host_hedge_delay (void * vhost)
+{
+    DnsHost * host = (DnsHost *)vhost;
+    int       delay = DNS_HOST_RTT_INIT * 2;
+ 
+    if (!host) return DNS_HEDGE_DELAY_MAX;
+ 
+    EnterCriticalSection(&host->statCS);
+    if (host->rttnum >= 8)
+        delay = host->rttp95 + host->rttp95 / 4;
+    LeaveCriticalSection(&host->statCS);
+ 
+    if (delay < DNS_HEDGE_DELAY_MIN) delay = DNS_HEDGE_DELAY_MIN;
+    if (delay > DNS_HEDGE_DELAY_MAX) delay = DNS_HEDGE_DELAY_MAX;
+ 
+    return delay;
+}
+ 
 void * dns_nsrv_alloc (int alloctype, void * mpool)
 {
     DnsNSrv * ns = NULL;
@@ -236,6 +365,42 @@ int dns_nsrv_add (void * vnsrv, void * vhost)
     return 0;
 }
  
+int dns_nsrv_order (void * vnsrv, DnsHost ** hlist, int max)
+{
+    DnsNSrv * ns = (DnsNSrv *)vnsrv;
+    DnsHost * host = NULL;
+    ulong     score[16];
+    ulong     val = 0;
+    int       i, j, num;
+ 
+    if (!ns) return -1;
+    if (!hlist || max <= 0) return -2;
+ 
+    if (max > 16) max = 16;
+ 
+    EnterCriticalSection(&ns->hostCS);
+ 
+    num = arr_num(ns->host_list);
+    if (num > max) num = max;
+ 
+    /* stable insertion sort keeps the configured order among equal scores */
+    for (i = 0; i < num; i++) {
+        host = arr_value(ns->host_list, i);
+        val = dns_host_score(host);
+ 
+        for (j = i; j > 0 && score[j-1] > val; j--) {
+            score[j] = score[j-1];
+            hlist[j] = hlist[j-1];
+        }
+        score[j] = val;
+        hlist[j] = host;
+    }
+ 
+    LeaveCriticalSection(&ns->hostCS);
+ 
+    return num;
+}
+ 
 int dns_nsrv_append (void * vmgmt, char * nsip, int port)
 {
     DnsMgmt * mgmt = (DnsMgmt *)vmgmt;
@@ -252,6 +417,30 @@ int dns_nsrv_append (void * vmgmt, char * nsip, int port)
     return 0;
 }
 
+int dns_nsrv_clear (void * vmgmt)
+{
+    DnsMgmt * mgmt = (DnsMgmt *)vmgmt;
+    DnsNSrv * ns = NULL;
+    int       num = 0;
+
+    if (!mgmt) return -1;
+
+    ns = (DnsNSrv *)mgmt->nsrv;
+    if (!ns) return -2;
+
+    /* DnsMsg in flight refers to DnsHost by desthost, hedgehost and
+       destaddr. the removed hosts are retired to nsrv_old instead of being
+       freed, and released in dns_mgmt_clean after all DnsMsg are gone */
+    EnterCriticalSection(&ns->hostCS);
+    while (arr_num(ns->host_list) > 0) {
+        dns_nsrv_add(mgmt->nsrv_old, arr_pop(ns->host_list));
+        num++;
+    }
+    LeaveCriticalSection(&ns->hostCS);
+
+    return num;
+}
+
 void dns_nsrv_print (void * vmgmt)
 {
 #ifdef _DEBUG
@@ -270,7 +459,8 @@ void dns_nsrv_print (void * vmgmt)
         host = arr_value(ns->host_list, i);
         if (!host) continue;
 
-        printf("name server - %s:%d\n", host->ip, host->port);
+        printf("name server - %s:%d srtt=%u p95=%u samples=%d fail=%d\n", host->ip, host->port,
+               host->srtt, host->rttp95, host->rttnum, host->failnum);
     }
     LeaveCriticalSection(&ns->hostCS);
 #endif
@@ -417,6 +607,7 @@ void * dns_rr_dup (void * vrr)
  
     memcpy(dup->ip, rr->ip, sizeof(rr->ip));
  
+    dup->soamin = rr->soamin;
     dup->rcvtick = rr->rcvtick;
     dup->outofdate = 0;
  
@@ -518,6 +709,8 @@ int dns_rr_parse (void * vrr, uint8 * p, int len, uint8 * bufbgn, uint8 ** nextr
     uint16   val16 = 0;
     int      i, iplen = 0;
     uint8  * pname = NULL;
+    uint8  * rdbgn = NULL;
+    int      rdlen = 0;
     int      ret;
  
     if (!rr) return -1;
@@ -532,7 +725,7 @@ int dns_rr_parse (void * vrr, uint8 * p, int len, uint8 * bufbgn, uint8 ** nextr
     if (rr->name) k_mem_free(rr->name, rr->alloctype, rr->mpool);
     rr->name = (char *)pname;
  
-    if (piter + 10 >= pend) return -101;
+    if (piter + 10 > pend) return -101;
  
     /* Type */
     memcpy(&val16, piter, 2);  piter += 2;
@@ -578,9 +771,20 @@ int dns_rr_parse (void * vrr, uint8 * p, int len, uint8 * bufbgn, uint8 ** nextr
         }
  
     } else {
+        rdbgn = piter;
+        rdlen = rr->rdlen;
+
         if ((ret = dns_rr_name_parse(rr, piter, rr->rdlen, bufbgn, &pnext, &pname, &iplen)) < 0)
             return -120;
-        piter = pnext;
+
+        /* SOA RDATA: MNAME RNAME SERIAL REFRESH RETRY EXPIRE MINIMUM */
+        if (rr->type == RR_TYPE_SOA && rdlen >= 22) {
+            memcpy(&val32, rdbgn + rdlen - 4, 4);
+            rr->soamin = ntohl(val32);
+        }
+
+        /* RDATA of SOA, MX etc. has fields after the first name */
+        piter = rdbgn + rdlen;
  
         if (rr->rdata) { k_mem_free(rr->rdata, rr->alloctype, rr->mpool); rr->rdata = NULL; }
         rr->rdata = pname;
@@ -633,6 +837,16 @@ void * dns_cache_alloc (void * vmgmt)
     cache->failmsg = 0;
     cache->succmsg = 0;
 
+    memset(cache->negative, 0, sizeof(cache->negative));
+    memset(cache->negrcode, 0, sizeof(cache->negrcode));
+    memset(cache->negttl, 0, sizeof(cache->negttl));
+    memset(cache->negtick, 0, sizeof(cache->negtick));
+    cache->stalenum = 0;
+
+    cache->hitnum = 0;
+    cache->hittotal = 0;
+    cache->prefetchtick = 0;
+
     cache->dnsmgmt = NULL;
  
     return cache;
@@ -661,6 +875,16 @@ int dns_cache_init (void * vca)
     cache->failmsg = 0;
     cache->succmsg = 0;
 
+    memset(cache->negative, 0, sizeof(cache->negative));
+    memset(cache->negrcode, 0, sizeof(cache->negrcode));
+    memset(cache->negttl, 0, sizeof(cache->negttl));
+    memset(cache->negtick, 0, sizeof(cache->negtick));
+    cache->stalenum = 0;
+
+    cache->hitnum = 0;
+    cache->hittotal = 0;
+    cache->prefetchtick = 0;
+
     cache->dnsmgmt = NULL;
 
     return 0;
@@ -729,6 +953,18 @@ void dns_cache_trymsg_succ (void * vcache)
     LeaveCriticalSection(&cache->tryCS);
 }
 
+void dns_cache_hit (void * vcache)
+{
+    DnsCache * cache = (DnsCache *)vcache;
+
+    if (!cache) return;
+
+    EnterCriticalSection(&cache->tryCS);
+    cache->hitnum++;
+    cache->hittotal++;
+    LeaveCriticalSection(&cache->tryCS);
+}
+
 
 int dns_cache_add (void * vcache, void * vrr)
 {
@@ -771,6 +1007,44 @@ int dns_cache_add (void * vcache, void * vrr)
     return 1;
 }
  
+/* drop the expired RR of type, called before the new answer of the same
+   type is added so that the retired address is not served any more */
+int dns_cache_drop_stale (void * vcache, int type)
+{
+    DnsCache * cache = (DnsCache *)vcache;
+    DnsRR    * rr = NULL;
+    int        i, num;
+    int        dropnum = 0;
+    time_t     curt = 0;
+
+    if (!cache) return -1;
+
+    EnterCriticalSection(&cache->rrlistCS);
+
+    num = arr_num(cache->rr_list);
+    curt = time(0);
+
+    for (i = 0; i < num; i++) {
+        rr = arr_value(cache->rr_list, i);
+        if (!rr || rr->type != type) continue;
+
+        if (rr->outofdate || (rr->ttl > 0 && curt - rr->rcvtick > rr->ttl * 2)) {
+            arr_delete(cache->rr_list, i); i--; num--;
+            dns_rr_free(rr);
+            dropnum++;
+        }
+    }
+
+    if (dropnum > 0 && cache->stalenum > 0) {
+        cache->stalenum -= dropnum;
+        if (cache->stalenum < 0) cache->stalenum = 0;
+    }
+
+    LeaveCriticalSection(&cache->rrlistCS);
+
+    return dropnum;
+}
+
 int dns_cache_zap (void * vcache)
 {
     DnsCache * cache = (DnsCache *)vcache;
@@ -797,13 +1071,19 @@ int dns_cache_zap (void * vcache)
 int dns_cache_verify (void * vcache)
 {
     DnsCache * cache = (DnsCache *)vcache;
+    DnsMgmt  * mgmt = NULL;
     DnsRR    * rr = NULL;
     int        i, num;
     int        anum = 0;
+    int        stalenum = 0;
+    int        stalemax = 0;
     time_t     curt = 0;
  
     if (!cache) return -1;
  
+    mgmt = (DnsMgmt *)cache->dnsmgmt;
+    if (mgmt) stalemax = mgmt->stale_max;
+
     EnterCriticalSection(&cache->rrlistCS);
  
     num = arr_num(cache->rr_list);
@@ -811,14 +1091,17 @@ int dns_cache_verify (void * vcache)
  
     for (i = 0; i < num; i++) {
         rr = arr_value(cache->rr_list, i);
-        if (!rr || (rr->ttl > 0 && curt - rr->rcvtick > rr->ttl * 2)) {
+        if (!rr || (rr->ttl > 0 && curt - rr->rcvtick > rr->ttl * 2 + stalemax)) {
             arr_delete(cache->rr_list, i); i--; num--;
             dns_rr_free(rr);
             continue;
         }
 
+        /* expired RR is kept for serve-stale */
         if (rr->ttl > 0 && curt - rr->rcvtick > rr->ttl * 2) {
             rr->outofdate = 1;
+            if (rr->type == RR_TYPE_A || rr->type == RR_TYPE_AAAA)
+                stalenum++;
             continue;
         }
         rr->outofdate = 0;
@@ -826,6 +1109,7 @@ int dns_cache_verify (void * vcache)
     }
 
     cache->anum = anum;
+    cache->stalenum = stalenum;
  
     LeaveCriticalSection(&cache->rrlistCS);
  
@@ -854,6 +1138,9 @@ int dns_cache_copy_ip (void * vcache, char * ip, int len)
             continue;
         }
  
+        /* expired RR is served only when no fresh one exists */
+        if (rr->outofdate && cache->anum > 0) continue;
+
         str_secpy(ip, len, rr->ip, strlen(rr->ip));
         break;
     }
@@ -880,13 +1167,17 @@ int dns_cache_getip (void * vcache, int ind, char * ip, int len)
     if (ind >= num) ind = num - 1;
     if (ind < 0) ind = 0;
 
-    for (i = 0; i < num && ip && len > 0; i++) {
-        rr = arr_value(cache->rr_list, ind % num);
-        if (rr && ip) {
-            str_secpy(ip, len, rr->ip, strlen(rr->ip));
-            if (!rr->outofdate) break;
-        }
+    /* starting from ind, the first fresh RR is taken. expired RR is served
+       only when no fresh one exists */
+    for (i = 0; i < num; i++) {
+        rr = arr_value(cache->rr_list, (ind + i) % num);
+        if (!rr) continue;
+        if (rr->outofdate && cache->anum > 0) continue;
+
+        str_secpy(ip, len, rr->ip, strlen(rr->ip));
+        break;
     }
+    if (i >= num) num = 0;
  
     LeaveCriticalSection(&cache->rrlistCS);
  
@@ -908,9 +1199,10 @@ int dns_cache_getiplist (void * vcache, char iplist[][41], int listnum)
     time(&cache->stamp);
 
     num = arr_num(cache->rr_list);
-    for (i = 0; i < num && i < listnum; i++) {
+    for (i = 0; i < num && iter < listnum; i++) {
         rr = arr_value(cache->rr_list, i);
         if (!rr) continue;
+        if (rr->outofdate && cache->anum > 0) continue;
  
         strcpy(iplist[iter], rr->ip);
         iter++;
@@ -940,8 +1232,10 @@ int dns_cache_sockaddr (void * vcache, int index, int port, ep_sockaddr_t * addr
     for (i = 0; i < num; i++) {
         rr = arr_value(cache->rr_list, (i + index) % num);
         if (!rr) continue;
+        if (rr->outofdate && cache->anum > 0) continue;
  
         if (sock_addr_parse(rr->ip, -1, port, addr) > 0) {
+            LeaveCriticalSection(&cache->rrlistCS);
             return 1;
         }
     }
@@ -1120,77 +1414,301 @@ int dns_cache_check (void * vcache)
 }
  
  
-int dns_cache_mgmt_add (void * vmgmt, void * vcache)
+int dns_cache_negative_set (void * vcache, int qtype, int rcode, uint32 ttl)
 {
-    DnsMgmt  * mgmt = (DnsMgmt *)vmgmt;
     DnsCache * cache = (DnsCache *)vcache;
-    DnsCache * tmp = NULL;
- 
-    if (!mgmt) return -1;
-    if (!cache) return -2;
- 
-    EnterCriticalSection(&mgmt->cacheCS);
-    tmp = ht_get(mgmt->cache_table, cache->name);
-    if (!tmp) {
-        ht_set(mgmt->cache_table, cache->name, cache);
-    } else {
-        if (tmp != cache) {
-            ht_delete(mgmt->cache_table, cache->name);
-            dns_cache_recycle(tmp);
- 
-            ht_set(mgmt->cache_table, cache->name, cache);
-        }
+    int        i;
+
+    if (!cache) return -1;
+
+    if (ttl > DNS_NEGATIVE_TTL_MAX) ttl = DNS_NEGATIVE_TTL_MAX;
+
+    EnterCriticalSection(&cache->rrlistCS);
+    for (i = 0; i < 2; i++) {
+        if (qtype == RR_TYPE_A && i != 0) continue;
+        if (qtype == RR_TYPE_AAAA && i != 1) continue;
+
+        cache->negative[i] = 1;
+        cache->negrcode[i] = rcode;
+        cache->negttl[i] = ttl;
+        cache->negtick[i] = time(0);
     }
- 
-    if (ht_num(mgmt->cache_table) > 0 && mgmt->cachetimer == NULL)
-        mgmt->cachetimer = iotimer_start(mgmt->pcore, 30*1000,
-                                  t_dns_cache_life, NULL,
-                                  dns_pump, mgmt, 0);
+    LeaveCriticalSection(&cache->rrlistCS);
 
-    LeaveCriticalSection(&mgmt->cacheCS);
+    return 0;
+}
+
+int dns_cache_negative_clear (void * vcache, int qtype)
+{
+    DnsCache * cache = (DnsCache *)vcache;
+    int        i;
+
+    if (!cache) return -1;
+
+    EnterCriticalSection(&cache->rrlistCS);
+    for (i = 0; i < 2; i++) {
+        if (qtype == RR_TYPE_A && i != 0) continue;
+        if (qtype == RR_TYPE_AAAA && i != 1) continue;
+
+        cache->negative[i] = 0;
+        cache->negrcode[i] = 0;
+        cache->negttl[i] = 0;
+    }
+    LeaveCriticalSection(&cache->rrlistCS);
 
     return 0;
 }
- 
-void * dns_cache_mgmt_get (void * vmgmt, char * name, int namelen)
+
+int dns_cache_negative_get (void * vcache, int qtype, int * rcode)
 {
-    DnsMgmt  * mgmt = (DnsMgmt *)vmgmt;
-    char       sname[256];
-    DnsCache * cache = NULL;
- 
-    if (!mgmt) return NULL;
+    DnsCache * cache = (DnsCache *)vcache;
+    int        i = qtype == RR_TYPE_AAAA ? 1 : 0;
+    int        ret = 0;
+
+    if (!cache) return -1;
+
+    EnterCriticalSection(&cache->rrlistCS);
+    if (cache->negative[i]) {
+        if (time(0) - cache->negtick[i] < (time_t)cache->negttl[i]) {
+            if (rcode) *rcode = cache->negrcode[i];
+            ret = 1;
+        } else {
+            cache->negative[i] = 0;
+        }
+    }
+    LeaveCriticalSection(&cache->rrlistCS);
+
+    return ret;
+}
+
+int dns_cache_negative_name (void * vcache, int * rcode)
+{
+    DnsCache * cache = (DnsCache *)vcache;
+    DnsMgmt  * mgmt = NULL;
+    int        code = 0;
+
+    if (!cache) return -1;
+
+    mgmt = (DnsMgmt *)cache->dnsmgmt;
+
+    if (dns_cache_negative_get(cache, RR_TYPE_A, &code) <= 0)
+        return 0;
+
+    if (mgmt && mgmt->dualstack) {
+        if (dns_cache_negative_get(cache, RR_TYPE_AAAA, NULL) <= 0)
+            return 0;
+    }
+
+    if (rcode) *rcode = code;
+    return 1;
+}
+
+int dns_cache_prefetch_check (void * vcache, int ratio, int interval)
+{
+    DnsCache * cache = (DnsCache *)vcache;
+    DnsRR    * rr = NULL;
+    int        i, num;
+    int        need = 0;
+    time_t     curt = 0;
  
-    sname[0] = '\0';
-    str_secpy(sname, sizeof(sname)-1, name, namelen);
+    if (!cache) return -1;
+    if (ratio <= 0) return 0;
  
-    EnterCriticalSection(&mgmt->cacheCS);
-    cache = ht_get(mgmt->cache_table, sname);
-    LeaveCriticalSection(&mgmt->cacheCS);
+    EnterCriticalSection(&cache->rrlistCS);
  
-    return cache;
-}
+    num = arr_num(cache->rr_list);
+    curt = time(0);
  
-void * dns_cache_mgmt_del (void * vmgmt, char * name, int namelen)
-{
-    DnsMgmt  * mgmt = (DnsMgmt *)vmgmt;
-    char       sname[256];
-    DnsCache * cache = NULL;
+    for (i = 0; i < num; i++) {
+        rr = arr_value(cache->rr_list, i);
+        if (!rr || rr->ttl == 0) continue;
  
-    if (!mgmt) return NULL;
+        if (rr->type != RR_TYPE_A && rr->type != RR_TYPE_AAAA)
+            continue;
  
-    str_secpy(sname, sizeof(sname)-1, name, namelen);
+        /* the RR will pass the ratio of its TTL before next check */
+        if ((curt + interval - rr->rcvtick) * 100 >= (time_t)rr->ttl * ratio) {
+            need = 1;
+            break;
+        }
+    }
  
-    EnterCriticalSection(&mgmt->cacheCS);
-    cache = ht_delete(mgmt->cache_table, sname);
-    LeaveCriticalSection(&mgmt->cacheCS);
+    LeaveCriticalSection(&cache->rrlistCS);
  
-    return cache;
+    return need;
 }
  
-void * dns_cache_open (void * vmgmt, char * name, int len)
+int dns_cache_prefetch (void * vcache)
 {
-    DnsMgmt  * mgmt = (DnsMgmt *)vmgmt;
-    DnsCache * cache = NULL;
+    DnsCache * cache = (DnsCache *)vcache;
+    DnsMgmt  * mgmt = NULL;
+    time_t     curt = 0;
+ 
+    if (!cache) return -1;
+ 
+    mgmt = (DnsMgmt *)cache->dnsmgmt;
+    if (!mgmt) return -2;
+ 
+    /* refresh query sent recently is still waiting for response */
+    curt = time(0);
+    if (curt - cache->prefetchtick < 12)
+        return 0;
+
+    /* no refreshing while the qtypes of refresh query are all negatively
+       cached, the negative answer of one family does not stop the other */
+    if (dns_cache_negative_name(cache, NULL) > 0)
+        return 0;
+ 
+    /* the callers querying the same name in the same thread will wait for
+       the refresh query */
+    if (dns_msg_query(mgmt, cache->name, -1, NULL, cache, NULL, NULL, 0, 0) < 0) {
+        dns_cache_trymsg_fail(cache);
+        return -101;
+    }
+ 
+    cache->prefetchtick = curt;
+    epstat_inc(&mgmt->prefetch_num);
+ 
+    return 1;
+}
+ 
+ 
+int dns_cache_shard_index (char * name, int len)
+{
+    uint32   hash = 2166136261U;
+    uint8    ch = 0;
+    int      i;
+ 
+    if (!name) return 0;
+    if (len < 0) len = strlen(name);
+ 
+    /* FNV-1a hash of lower-case name, same as strcasecmp comparing */
+    for (i = 0; i < len && name[i]; i++) {
+        ch = (uint8)name[i];
+        if (ch >= 'A' && ch <= 'Z') ch += 'a' - 'A';
+        hash ^= ch;
+        hash *= 16777619U;
+    }
+ 
+    return (int)(hash % DNS_CACHE_SHARD_NUM);
+}
+ 
+int dns_cache_mgmt_num (void * vmgmt)
+{
+    DnsMgmt       * mgmt = (DnsMgmt *)vmgmt;
+    DnsCacheShard * shard = NULL;
+    int             i, num = 0;
+ 
+    if (!mgmt) return 0;
+ 
+    /* the sizes of shards are read without tableCS, the sum is approximate
+       and used only for metrics and the life timer restarting */
+    for (i = 0; i < DNS_CACHE_SHARD_NUM; i++) {
+        shard = &mgmt->cache_shard[i];
+        num += ht_num(shard->cache_table);
+    }
+ 
+    return num;
+}
+ 
+int dns_cache_mgmt_add (void * vmgmt, void * vcache)
+{
+    DnsMgmt       * mgmt = (DnsMgmt *)vmgmt;
+    DnsCache      * cache = (DnsCache *)vcache;
+    DnsCache      * tmp = NULL;
+    DnsCacheShard * shard = NULL;
+ 
+    if (!mgmt) return -1;
+    if (!cache) return -2;
+ 
+    shard = &mgmt->cache_shard[dns_cache_shard_index(cache->name, -1)];
+ 
+    EnterCriticalSection(&shard->tableCS);
+    tmp = ht_get(shard->cache_table, cache->name);
+    if (!tmp) {
+        ht_set(shard->cache_table, cache->name, cache);
+    } else {
+        if (tmp != cache) {
+            ht_delete(shard->cache_table, cache->name);
+            dns_cache_recycle(tmp);
+ 
+            ht_set(shard->cache_table, cache->name, cache);
+        }
+    }
+    LeaveCriticalSection(&shard->tableCS);
+ 
+    dns_cache_timer_start(mgmt);
+
+    return 0;
+}
+
+int dns_cache_timer_start (void * vmgmt)
+{
+    DnsMgmt * mgmt = (DnsMgmt *)vmgmt;
+
+    if (!mgmt) return -1;
+
+    if (mgmt->cachetimer) return 0;
+
+    /* every tick of the life timer checks one shard, all shards are checked
+       in DNS_CACHE_CHECK_INTERVAL seconds */
+    EnterCriticalSection(&mgmt->cacheCS);
+    if (mgmt->cachetimer == NULL)
+        mgmt->cachetimer = iotimer_start(mgmt->pcore,
+                                  DNS_CACHE_CHECK_INTERVAL*1000/DNS_CACHE_SHARD_NUM,
+                                  t_dns_cache_life, NULL,
+                                  dns_pump, mgmt, 0);
+    LeaveCriticalSection(&mgmt->cacheCS);
+
+    return 1;
+}
+ 
+void * dns_cache_mgmt_get (void * vmgmt, char * name, int namelen)
+{
+    DnsMgmt       * mgmt = (DnsMgmt *)vmgmt;
+    DnsCacheShard * shard = NULL;
+    char            sname[256];
+    DnsCache      * cache = NULL;
+ 
+    if (!mgmt) return NULL;
+ 
+    sname[0] = '\0';
+    str_secpy(sname, sizeof(sname)-1, name, namelen);
+ 
+    shard = &mgmt->cache_shard[dns_cache_shard_index(sname, -1)];
+ 
+    EnterCriticalSection(&shard->tableCS);
+    cache = ht_get(shard->cache_table, sname);
+    LeaveCriticalSection(&shard->tableCS);
+ 
+    return cache;
+}
+ 
+void * dns_cache_mgmt_del (void * vmgmt, char * name, int namelen)
+{
+    DnsMgmt       * mgmt = (DnsMgmt *)vmgmt;
+    DnsCacheShard * shard = NULL;
+    char            sname[256];
+    DnsCache      * cache = NULL;
+ 
+    if (!mgmt) return NULL;
+ 
+    sname[0] = '\0';
+    str_secpy(sname, sizeof(sname)-1, name, namelen);
+ 
+    shard = &mgmt->cache_shard[dns_cache_shard_index(sname, -1)];
+ 
+    EnterCriticalSection(&shard->tableCS);
+    cache = ht_delete(shard->cache_table, sname);
+    LeaveCriticalSection(&shard->tableCS);
+ 
+    return cache;
+}
+ 
+void * dns_cache_open (void * vmgmt, char * name, int len)
+{
+    DnsMgmt  * mgmt = (DnsMgmt *)vmgmt;
+    DnsCache * cache = NULL;
  
     if (!mgmt) return NULL;
  
@@ -1235,43 +1753,812 @@ int dns_cache_close (void * vcache)
  
 int dns_cache_lifecheck (void * vmgmt)
 {
-    DnsMgmt  * mgmt = (DnsMgmt *)vmgmt;
-    DnsCache * cache = NULL;
-    int        i, num;
-    time_t     tick;
+    DnsMgmt       * mgmt = (DnsMgmt *)vmgmt;
+    DnsCacheShard * shard = NULL;
+    DnsCache      * cache = NULL;
+    char          * names = NULL;
+    int             i, num;
+    int             hitnum;
+    int             prenum = 0;
+    time_t          tick;
  
     if (!mgmt) return -1;
  
+    /* incremental check: one shard is swept each time, the lookups
+       of names in other shards are never blocked */
     EnterCriticalSection(&mgmt->cacheCS);
+    shard = &mgmt->cache_shard[mgmt->sweepind];
+    mgmt->sweepind = (mgmt->sweepind + 1) % DNS_CACHE_SHARD_NUM;
+    LeaveCriticalSection(&mgmt->cacheCS);
+ 
+    EnterCriticalSection(&shard->tableCS);
  
     tick = time(0);
-    num = ht_num(mgmt->cache_table);
+    num = ht_num(shard->cache_table);
  
+    if (mgmt->prefetch_ratio > 0 && num > 0)
+        names = kzalloc(num * DNS_NAME_LEN);
+
     for (i = 0; i < num; i++) {
-        cache = ht_value(mgmt->cache_table, i);
+        cache = ht_value(shard->cache_table, i);
         if (!cache) continue;
  
         EnterCriticalSection(&cache->tryCS);
         cache->trymsg = 0;
         cache->failmsg = 0;
         cache->succmsg = 0;
+        hitnum = cache->hitnum;
+        cache->hitnum = 0;
         LeaveCriticalSection(&cache->tryCS);
 
         dns_cache_check(cache);
  
         if (tick - cache->stamp > 300) { // && cache->anum <= 0) {
-            ht_delete(mgmt->cache_table, cache->name);
+            ht_delete(shard->cache_table, cache->name);
             dns_cache_recycle(cache);
 
             i--, num--;
+            continue;
+        }
+
+        /* hot cache is refreshed before its TTL expires, so that the lookup
+           never pays the round-trip to Name Server while the name is in use.
+           the names are collected here and refreshed after tableCS released,
+           dns_msg_query takes msgCS which must not be nested in tableCS */
+        if (names && hitnum >= mgmt->prefetch_hits &&
+            dns_cache_prefetch_check(cache, mgmt->prefetch_ratio, DNS_CACHE_CHECK_INTERVAL) > 0)
+        {
+            str_secpy(names + prenum * DNS_NAME_LEN, DNS_NAME_LEN - 1, cache->name, strlen(cache->name));
+            prenum++;
         }
     }
  
-    LeaveCriticalSection(&mgmt->cacheCS);
+    LeaveCriticalSection(&shard->tableCS);
  
+    for (i = 0; i < prenum; i++) {
+        cache = dns_cache_mgmt_get(mgmt, names + i * DNS_NAME_LEN, -1);
+        if (cache) dns_cache_prefetch(cache);
+    }
+
+    if (names) kfree(names);
+
+    return 0;
+}
+
+/*******************************************************
+ * DNS Cache Snapshot - persisting cache for warm start
+ *******************************************************/
+
+static void snap_put8 (frame_p frm, uint8 val)
+{
+    frame_put_nlast(frm, &val, 1);
+}
+
+static void snap_put16 (frame_p frm, uint16 val)
+{
+    val = htons(val);
+    frame_put_nlast(frm, &val, 2);
+}
+
+static void snap_put32 (frame_p frm, uint32 val)
+{
+    val = htonl(val);
+    frame_put_nlast(frm, &val, 4);
+}
+
+static int snap_get (uint8 ** pp, uint8 * pend, void * dst, int len)
+{
+    if (*pp + len > pend) return -1;
+    memcpy(dst, *pp, len);
+    *pp += len;
+    return len;
+}
+
+/* encode RRs of DnsCache that can still be served after a restart */
+int dns_cache_snapshot_encode (void * vcache, frame_p frm, time_t curt, int stalemax)
+{
+    DnsCache * cache = (DnsCache *)vcache;
+    DnsRR    * rr = NULL;
+    int        i, num, rrnum = 0;
+    int        namelen, iplen;
+    int        pos = 0;
+
+    if (!cache || !frm) return -1;
+
+    namelen = strlen(cache->name);
+    if (namelen <= 0 || namelen > 255) return 0;
+
+    pos = frameL(frm);
+    snap_put8(frm, (uint8)namelen);
+    frame_put_nlast(frm, cache->name, namelen);
+    snap_put16(frm, 0);
+
+    EnterCriticalSection(&cache->rrlistCS);
+
+    num = arr_num(cache->rr_list);
+    for (i = 0; i < num; i++) {
+        rr = arr_value(cache->rr_list, i);
+        if (!rr || rr->ttl == 0 || !rr->rdata) continue;
+        if (curt - rr->rcvtick > rr->ttl * 2 + stalemax) continue;
+
+        iplen = strlen(rr->ip);
+
+        snap_put16(frm, rr->type);
+        snap_put16(frm, rr->class);
+        snap_put32(frm, rr->ttl);
+        snap_put32(frm, (uint32)rr->rcvtick);
+        snap_put16(frm, rr->rdlen);
+        frame_put_nlast(frm, rr->rdata, rr->rdlen);
+        snap_put8(frm, (uint8)iplen);
+        frame_put_nlast(frm, rr->ip, iplen);
+
+        rrnum++;
+    }
+
+    LeaveCriticalSection(&cache->rrlistCS);
+
+    if (rrnum <= 0) {
+        frame_len_set(frm, pos);
+        return 0;
+    }
+
+    rrnum = htons((uint16)rrnum);
+    memcpy(frameP(frm) + pos + 1 + namelen, &rrnum, 2);
+
+    return 1;
+}
+
+frame_p dns_cache_snapshot_build (void * vmgmt, int * pcount)
+{
+    DnsMgmt       * mgmt = (DnsMgmt *)vmgmt;
+    DnsCacheShard * shard = NULL;
+    DnsCache      * cache = NULL;
+    frame_p         frm = NULL;
+    time_t          curt = 0;
+    int             i, j, num, count = 0;
+
+    if (pcount) *pcount = 0;
+    if (!mgmt) return NULL;
+
+    frm = frame_new(16384);
+    if (!frm) return NULL;
+
+    curt = time(0);
+
+    frame_put_nlast(frm, DNS_SNAPSHOT_MAGIC, 6);
+    snap_put8(frm, DNS_SNAPSHOT_VERSION);
+    snap_put8(frm, 0);
+    snap_put32(frm, (uint32)curt);
+
+    for (i = 0; i < DNS_CACHE_SHARD_NUM; i++) {
+        shard = &mgmt->cache_shard[i];
+
+        EnterCriticalSection(&shard->tableCS);
+        num = ht_num(shard->cache_table);
+        for (j = 0; j < num; j++) {
+            cache = ht_value(shard->cache_table, j);
+            if (cache && dns_cache_snapshot_encode(cache, frm, curt, mgmt->stale_max) > 0)
+                count++;
+        }
+        LeaveCriticalSection(&shard->tableCS);
+    }
+
+    if (pcount) *pcount = count;
+    return frm;
+}
+
+int dns_cache_snapshot_write (char * file, frame_p frm)
+{
+    FILE   * fp = NULL;
+    char     tmpfile[300];
+
+    if (!file || strlen(file) <= 0) return -1;
+    if (!frm) return -2;
+
+    /* written to temporary file and renamed, the loader never sees a
+       partial snapshot */
+    snprintf(tmpfile, sizeof(tmpfile), "%s.tmp", file);
+
+    fp = fopen(tmpfile, "wb");
+    if (!fp) return -101;
+
+    if (fwrite(frameP(frm), 1, frameL(frm), fp) != frameL(frm)) {
+        fclose(fp);
+        remove(tmpfile);
+        return -102;
+    }
+    fclose(fp);
+
+#if defined(_WIN32) || defined(_WIN64)
+    remove(file);
+#endif
+    if (rename(tmpfile, file) != 0) {
+        remove(tmpfile);
+        return -103;
+    }
+
+    return 0;
+}
+
+int dns_cache_snapshot_save (void * vmgmt, char * file)
+{
+    DnsMgmt  * mgmt = (DnsMgmt *)vmgmt;
+    frame_p    frm = NULL;
+    int        count = 0;
+    int        ret = 0;
+
+    if (!mgmt) return -1;
+
+    if (!file) file = mgmt->snapshot_file;
+    if (!file || strlen(file) <= 0) return -2;
+
+    frm = dns_cache_snapshot_build(mgmt, &count);
+    if (!frm) return -100;
+
+    ret = dns_cache_snapshot_write(file, frm);
+    frame_free(frm);
+    if (ret < 0) return ret;
+
+    mgmt->snapshot_tick = time(0);
+
+    return count;
+}
+
+int dns_cache_snapshot_load (void * vmgmt, char * file)
+{
+    DnsMgmt  * mgmt = (DnsMgmt *)vmgmt;
+    DnsCache * cache = NULL;
+    DnsRR    * rr = NULL;
+    FILE     * fp = NULL;
+    uint8    * pbuf = NULL;
+    uint8    * p = NULL;
+    uint8    * pend = NULL;
+    long       fsize = 0;
+    time_t     curt = 0;
+    char       name[256];
+    uint8      namelen = 0;
+    uint8      iplen = 0;
+    uint8      hdr[8];
+    uint16     rrnum = 0;
+    uint16     val16 = 0;
+    uint32     val32 = 0;
+    int        i, count = 0;
+
+    if (!mgmt) return -1;
+
+    if (!file) file = mgmt->snapshot_file;
+    if (!file || strlen(file) <= 0) return -2;
+
+    fp = fopen(file, "rb");
+    if (!fp) return 0;
+
+    fseek(fp, 0, SEEK_END);
+    fsize = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+
+    if (fsize < 12 || fsize > 64*1024*1024) {
+        fclose(fp);
+        return -100;
+    }
+
+    pbuf = kzalloc(fsize);
+    if (!pbuf) {
+        fclose(fp);
+        return -101;
+    }
+
+    if (fread(pbuf, 1, fsize, fp) != fsize) {
+        fclose(fp);
+        kfree(pbuf);
+        return -102;
+    }
+    fclose(fp);
+
+    p = pbuf; pend = pbuf + fsize;
+
+    snap_get(&p, pend, hdr, 8);
+    if (memcmp(hdr, DNS_SNAPSHOT_MAGIC, 6) != 0 || hdr[6] != DNS_SNAPSHOT_VERSION) {
+        kfree(pbuf);
+        return -103;
+    }
+    snap_get(&p, pend, &val32, 4);
+
+    curt = time(0);
+
+    while (p < pend) {
+        if (snap_get(&p, pend, &namelen, 1) < 0) break;
+        if (snap_get(&p, pend, name, namelen) < 0) break;
+        name[namelen] = '\0';
+        if (snap_get(&p, pend, &rrnum, 2) < 0) break;
+        rrnum = ntohs(rrnum);
+
+        cache = namelen > 0 ? dns_cache_open(mgmt, name, namelen) : NULL;
+
+        for (i = 0; i < rrnum; i++) {
+            rr = dns_rr_alloc(mgmt->fragmem_alloctype, mgmt->fragmem_kempool);
+            if (!rr) {
+                /* the rest of record can not be skipped without parsing,
+                   loading is aborted instead of reading from mid-record */
+                if (cache) dns_cache_verify(cache);
+                kfree(pbuf);
+
+                tolog(1, "Panic: DNS cache snapshot %s loading aborted, %d RRs loaded\n", file, count);
+                return count;
+            }
+
+            if (snap_get(&p, pend, &val16, 2) < 0) goto corrupt;
+            rr->type = ntohs(val16);
+            if (snap_get(&p, pend, &val16, 2) < 0) goto corrupt;
+            rr->class = ntohs(val16);
+            if (snap_get(&p, pend, &val32, 4) < 0) goto corrupt;
+            rr->ttl = ntohl(val32);
+            if (snap_get(&p, pend, &val32, 4) < 0) goto corrupt;
+            rr->rcvtick = (time_t)ntohl(val32);
+            if (snap_get(&p, pend, &val16, 2) < 0) goto corrupt;
+            rr->rdlen = ntohs(val16);
+
+            rr->rdata = k_mem_zalloc(rr->rdlen + 1, rr->alloctype, rr->mpool);
+            if (snap_get(&p, pend, rr->rdata, rr->rdlen) < 0) goto corrupt;
+
+            if (snap_get(&p, pend, &iplen, 1) < 0) goto corrupt;
+            if (iplen >= sizeof(rr->ip)) goto corrupt;
+            if (snap_get(&p, pend, rr->ip, iplen) < 0) goto corrupt;
+            rr->ip[iplen] = '\0';
+
+            rr->name = k_mem_str_dup(name, namelen, rr->alloctype, rr->mpool);
+            rr->namelen = namelen;
+
+            /* RR beyond the serve-stale window is not loaded */
+            if (!cache || rr->ttl == 0 || curt < rr->rcvtick ||
+                curt - rr->rcvtick > rr->ttl * 2 + mgmt->stale_max ||
+                dns_cache_add(cache, rr) <= 0)
+            {
+                dns_rr_free(rr);
+                continue;
+            }
+            count++;
+        }
+
+        if (cache) dns_cache_verify(cache);
+    }
+
+    kfree(pbuf);
+    return count;
+
+corrupt:
+    dns_rr_free(rr);
+    if (cache) dns_cache_verify(cache);
+    kfree(pbuf);
+
+    tolog(1, "Warning: DNS cache snapshot %s corrupted, %d RRs loaded\n", file, count);
+    return count;
+}
+
+int dns_cache_snapshot_check (void * vmgmt, void * epump)
+{
+    DnsMgmt    * mgmt = (DnsMgmt *)vmgmt;
+    epcore_t   * pcore = NULL;
+    DnsSnapJob * job = NULL;
+    frame_p      frm = NULL;
+    time_t     curt = 0;
+    int        count = 0;
+
+    if (!mgmt) return -1;
+
+    pcore = (epcore_t *)mgmt->pcore;
+
+    if (mgmt->snapshot_interval <= 0 || strlen(mgmt->snapshot_file) <= 0)
+        return 0;
+
+    curt = time(0);
+
+    EnterCriticalSection(&mgmt->cacheCS);
+    if (curt - mgmt->snapshot_tick < mgmt->snapshot_interval || mgmt->snapshot_writing) {
+        LeaveCriticalSection(&mgmt->cacheCS);
+        return 0;
+    }
+    mgmt->snapshot_tick = curt;
+    mgmt->snapshot_writing = 1;
+    LeaveCriticalSection(&mgmt->cacheCS);
+
+    /* the caches are copied here, the file writing never blocks the
+       ePump thread and holds no lock */
+    frm = dns_cache_snapshot_build(mgmt, &count);
+    if (!frm) {
+        mgmt->snapshot_writing = 0;
+        return count;
+    }
+
+    job = kzalloc(sizeof(*job));
+    if (job) {
+        job->dnsmgmt = mgmt;
+        job->frm = frm;
+
+        /* user-defined event is dispatched to worker only when worker
+           threads exist, or else it runs in ePump thread */
+        if (epump && ht_num(pcore->worker_tab) > 0 &&
+            ioevent_push(epump, IOE_USER_DEFINED, NULL, dns_cache_snapshot_pump, job) >= 0)
+            return count;
+
+        if (dns_cache_snapshot_thread(job) >= 0)
+            return count;
+
+        kfree(job);
+    }
+
+    /* no thread to write it, the periodic snapshot is skipped */
+    frame_free(frm);
+    mgmt->snapshot_writing = 0;
+
+    return count;
+}
+
+int dns_cache_snapshot_pump (void * vjob, void * pobj, int event, int fdtype)
+{
+    DnsSnapJob * job = (DnsSnapJob *)vjob;
+    DnsMgmt    * mgmt = NULL;
+
+    if (!job) return -1;
+
+    mgmt = (DnsMgmt *)job->dnsmgmt;
+
+    dns_cache_snapshot_write(mgmt->snapshot_file, job->frm);
+    frame_free(job->frm);
+    kfree(job);
+
+    mgmt->snapshot_writing = 0;
+    return 0;
+}
+
+#if defined(_WIN32) || defined(_WIN64)
+static unsigned WINAPI dns_cache_snapshot_entry (void * arg)
+{
+#endif
+#ifdef UNIX
+static void * dns_cache_snapshot_entry (void * arg)
+{
+#endif
+    dns_cache_snapshot_pump(arg, NULL, 0, 0);
+
+    return 0;
+}
+
+int dns_cache_snapshot_thread (void * vjob)
+{
+#if defined(_WIN32) || defined(_WIN64)
+    HANDLE     hpth;
+    unsigned   thid;
+#endif
+#ifdef UNIX
+    pthread_attr_t attr;
+    pthread_t  thid;
+    int        ret = 0;
+#endif
+
+    if (!vjob) return -1;
+
+#if defined(_WIN32) || defined(_WIN64)
+    hpth = (HANDLE)_beginthreadex(NULL, 0, dns_cache_snapshot_entry, vjob, 0, &thid);
+    if (hpth == NULL) return -101;
+    CloseHandle(hpth);
+#endif
+
+#ifdef UNIX
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+    ret = pthread_create(&thid, &attr, dns_cache_snapshot_entry, vjob);
+    pthread_attr_destroy(&attr);
+    if (ret != 0) return -101;
+#endif
+
     return 0;
 }
 
+int dns_snapshot_set (void * vmgmt, char * file, int interval)
+{
+    DnsMgmt  * mgmt = (DnsMgmt *)vmgmt;
+
+    if (!mgmt) return -1;
+
+    mgmt->snapshot_file[0] = '\0';
+    if (file && strlen(file) > 0)
+        str_secpy(mgmt->snapshot_file, sizeof(mgmt->snapshot_file)-1, file, strlen(file));
+
+    if (interval < 0) interval = 0;
+    mgmt->snapshot_interval = interval;
+    mgmt->snapshot_tick = time(0);
+
+    /* warm start from the snapshot saved by last run */
+    return dns_cache_snapshot_load(mgmt, NULL);
+}
+
+/*******************************************************
+ * DNS Hosts - hosts file and static entries answered locally
+ *******************************************************/
+
+/* lower-case key keeps the hash of the same name identical */
+int dns_hosts_key (char * name, int len, char * key, int keylen)
+{
+    int   i;
+
+    if (!key || keylen <= 0) return 0;
+    key[0] = '\0';
+
+    if (!name) return 0;
+    if (len < 0) len = strlen(name);
+    if (len <= 0 || len >= keylen) return 0;
+
+    for (i = 0; i < len; i++) {
+        if (name[i] >= 'A' && name[i] <= 'Z')
+            key[i] = name[i] + 'a' - 'A';
+        else
+            key[i] = name[i];
+    }
+    key[len] = '\0';
+
+    return len;
+}
+
+/* called in hostsCS, or with the table not yet published */
+void * dns_hosts_open (void * vmgmt, hashtab_t * table, char * name, int len)
+{
+    DnsMgmt  * mgmt = (DnsMgmt *)vmgmt;
+    DnsCache * cache = NULL;
+    char       key[256];
+
+    if (!mgmt || !table) return NULL;
+
+    if ((len = dns_hosts_key(name, len, key, sizeof(key))) <= 0)
+        return NULL;
+
+    cache = ht_get(table, key);
+    if (!cache) {
+        cache = mpool_fetch(mgmt->cache_pool);
+        if (!cache) return NULL;
+
+        cache->dnsmgmt = mgmt;
+
+        dns_cache_init(cache);
+
+        str_secpy(cache->name, sizeof(cache->name)-1, key, len);
+        cache->dnsmgmt = mgmt;
+
+        ht_set(table, cache->name, cache);
+    }
+
+    return cache;
+}
+
+int dns_hosts_addip (void * vcache, char * ip)
+{
+    DnsCache      * cache = (DnsCache *)vcache;
+    DnsMgmt       * mgmt = NULL;
+    DnsRR         * rr = NULL;
+    ep_sockaddr_t   addr;
+    int             ret = 0;
+
+    if (!cache) return -1;
+    if (!ip) return -2;
+
+    mgmt = (DnsMgmt *)cache->dnsmgmt;
+    if (!mgmt) return -3;
+
+    if (sock_addr_parse(ip, -1, 0, &addr) <= 0)
+        return -100;
+
+    rr = dns_rr_alloc(mgmt->fragmem_alloctype, mgmt->fragmem_kempool);
+    if (!rr) return -101;
+
+    rr->name = k_mem_str_dup(cache->name, -1, rr->alloctype, rr->mpool);
+    rr->namelen = strlen(cache->name);
+    rr->class = RR_CLASS_IN;
+
+    /* TTL 0 never expires */
+    rr->ttl = 0;
+
+    if (addr.family == AF_INET6) {
+        rr->type = RR_TYPE_AAAA;
+        rr->rdlen = sizeof(addr.u.addr6.sin6_addr);
+        rr->rdata = k_mem_zalloc(rr->rdlen + 1, rr->alloctype, rr->mpool);
+        memcpy(rr->rdata, &addr.u.addr6.sin6_addr, rr->rdlen);
+    } else {
+        rr->type = RR_TYPE_A;
+        rr->rdlen = sizeof(addr.u.addr4.sin_addr);
+        rr->rdata = k_mem_zalloc(rr->rdlen + 1, rr->alloctype, rr->mpool);
+        memcpy(rr->rdata, &addr.u.addr4.sin_addr, rr->rdlen);
+    }
+    sock_addr_ntop(&addr.u.addr, rr->ip);
+
+    rr->rcvtick = time(0);
+    rr->outofdate = 0;
+
+    ret = dns_cache_add(cache, rr);
+    if (ret <= 0) dns_rr_free(rr);
+
+    dns_cache_verify(cache);
+
+    return ret;
+}
+
+int dns_hosts_load (void * vmgmt, char * hostsfile)
+{
+    DnsMgmt     * mgmt = (DnsMgmt *)vmgmt;
+    DnsCache    * cache = NULL;
+    hashtab_t   * table = NULL;
+    FILE        * fp = NULL;
+    struct stat   st;
+    char          file[256];
+    char          buf[1024];
+    char        * tok[16];
+    char        * p = NULL;
+    int           i, num, ntok;
+    time_t        mtime = 0;
+
+    if (!mgmt) return -1;
+
+    EnterCriticalSection(&mgmt->hostsCS);
+    if (hostsfile && strlen(hostsfile) > 0)
+        str_secpy(mgmt->hosts_file, sizeof(mgmt->hosts_file)-1, hostsfile, strlen(hostsfile));
+    str_secpy(file, sizeof(file)-1, mgmt->hosts_file, strlen(mgmt->hosts_file));
+    LeaveCriticalSection(&mgmt->hostsCS);
+
+    if (stat(file, &st) == 0)
+        mtime = st.st_mtime;
+
+    /* the DnsCache of live hosts table is never rewritten, a new table is
+       built out of the lock. the names removed from hosts file resolve
+       through Name Server again */
+    table = ht_new(64, dns_cache_cmp_name);
+    if (!table) return -100;
+
+    fp = fopen(file, "r");
+    while (fp && fgets(buf, sizeof(buf), fp)) {
+        /* IP canonical_hostname [aliases...] # comment */
+        if ((p = strchr(buf, '#'))) *p = '\0';
+
+        for (p = buf, ntok = 0; *p && ntok < 16; ) {
+            while (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n') p++;
+            if (*p == '\0') break;
+
+            tok[ntok++] = p;
+            while (*p && *p != ' ' && *p != '\t' && *p != '\r' && *p != '\n') p++;
+            if (*p) *p++ = '\0';
+        }
+
+        for (i = 1; i < ntok; i++) {
+            cache = dns_hosts_open(mgmt, table, tok[i], -1);
+            if (cache) dns_hosts_addip(cache, tok[0]);
+        }
+    }
+    if (fp) fclose(fp);
+
+    num = ht_num(table);
+    for (i = 0; i < num; i++) {
+        cache = ht_value(table, i);
+        if (cache) dns_cache_verify(cache);
+    }
+
+    /* callers may still hold DnsCache of the replaced table, it is retired
+       to hosts_old and freed in dns_mgmt_clean */
+    EnterCriticalSection(&mgmt->hostsCS);
+    if (mgmt->hosts_table)
+        arr_push(mgmt->hosts_old, mgmt->hosts_table);
+    mgmt->hosts_table = table;
+
+    mgmt->hosts_mtime = mtime;
+    mgmt->hosts_checktick = time(0);
+    LeaveCriticalSection(&mgmt->hostsCS);
+
+    return num;
+}
+
+int dns_hosts_check (void * vmgmt)
+{
+    DnsMgmt     * mgmt = (DnsMgmt *)vmgmt;
+    struct stat   st;
+    char          file[256];
+    time_t        curt = 0;
+    time_t        mtime = 0;
+    time_t        lastmtime = 0;
+
+    if (!mgmt) return -1;
+
+    curt = time(0);
+
+    EnterCriticalSection(&mgmt->hostsCS);
+    if (curt - mgmt->hosts_checktick < DNS_HOSTS_CHECK_INTERVAL) {
+        LeaveCriticalSection(&mgmt->hostsCS);
+        return 0;
+    }
+    mgmt->hosts_checktick = curt;
+    str_secpy(file, sizeof(file)-1, mgmt->hosts_file, strlen(mgmt->hosts_file));
+    lastmtime = mgmt->hosts_mtime;
+    LeaveCriticalSection(&mgmt->hostsCS);
+
+    if (stat(file, &st) == 0)
+        mtime = st.st_mtime;
+
+    if (mtime == lastmtime)
+        return 0;
+
+    dns_hosts_load(mgmt, NULL);
+    return 1;
+}
+
+void * dns_hosts_get (void * vmgmt, char * name, int len)
+{
+    DnsMgmt  * mgmt = (DnsMgmt *)vmgmt;
+    DnsCache * cache = NULL;
+    char       key[256];
+
+    if (!mgmt) return NULL;
+
+    if (dns_hosts_key(name, len, key, sizeof(key)) <= 0)
+        return NULL;
+
+    /* hosts file is checked by the life timer, never in the query path */
+    if (!mgmt->cachetimer)
+        dns_cache_timer_start(mgmt);
+
+    EnterCriticalSection(&mgmt->hostsCS);
+
+    cache = ht_get(mgmt->static_table, key);
+    if (!cache || cache->anum <= 0)
+        cache = ht_get(mgmt->hosts_table, key);
+    if (cache && cache->anum <= 0)
+        cache = NULL;
+
+    if (cache) epstat_inc(&mgmt->hosts_hit);
+
+    LeaveCriticalSection(&mgmt->hostsCS);
+
+    return cache;
+}
+
+int dns_hosts_add (void * vmgmt, char * name, char * ip)
+{
+    DnsMgmt  * mgmt = (DnsMgmt *)vmgmt;
+    DnsCache * cache = NULL;
+    int        ret = 0;
+
+    if (!mgmt) return -1;
+    if (!name || !ip) return -2;
+
+    EnterCriticalSection(&mgmt->hostsCS);
+    cache = dns_hosts_open(mgmt, mgmt->static_table, name, -1);
+    if (cache)
+        ret = dns_hosts_addip(cache, ip);
+    else
+        ret = -100;
+    LeaveCriticalSection(&mgmt->hostsCS);
+
+    return ret;
+}
+
+int dns_hosts_del (void * vmgmt, char * name)
+{
+    DnsMgmt  * mgmt = (DnsMgmt *)vmgmt;
+    DnsCache * cache = NULL;
+    char       key[256];
+
+    if (!mgmt) return -1;
+
+    if (dns_hosts_key(name, -1, key, sizeof(key)) <= 0)
+        return -2;
+
+    EnterCriticalSection(&mgmt->hostsCS);
+    cache = ht_get(mgmt->static_table, key);
+    if (cache) {
+        dns_cache_zap(cache);
+        dns_cache_verify(cache);
+    }
+    LeaveCriticalSection(&mgmt->hostsCS);
+
+    return cache ? 1 : 0;
+}
+
+
 /*******************************************************
  * DNS Msg - packing request/response for resolving name 
  *******************************************************/
@@ -1294,49 +2581,98 @@ ulong dns_msg_hash_msgid (void * key)
     return (ulong)msgid;
 }
  
+ulong dns_msg_uid (void * vmsg)
+{
+    DnsMsg  * msg = (DnsMsg *)vmsg;
+
+    if (!msg) return 0;
+
+    return ((ulong)msg->shardind << 16) | msg->msgid;
+}
+
+/* pick a random msgid not used in the shard of DnsMsg, and add DnsMsg
+   into the shard table */
 int dns_msg_mgmt_add (void * vmgmt, void * vmsg)
 {    
     DnsMgmt   * mgmt = (DnsMgmt *)vmgmt;
     DnsMsg    * pmsg = (DnsMsg *)vmsg;
-    int         ret = 0;
+    DnsShard  * shard = NULL;
+    uint16      msgid = 0;
+    int         i, ret = 0;
      
     if (!mgmt) return -1;
     if (!pmsg) return -2;
  
-    EnterCriticalSection(&mgmt->msgCS);
-    ret = ht_set(mgmt->msg_table, &pmsg->msgid, pmsg);
-    LeaveCriticalSection(&mgmt->msgCS);
+    if (pmsg->shardind >= mgmt->shardnum) return -3;
+    shard = &mgmt->shard[pmsg->shardind];
+
+    EnterCriticalSection(&shard->msgCS);
+    for (i = 0; i < 16; i++) {
+        msgid = dns_shard_rand(shard);
+        if (msgid == 0) continue;
+
+        if (ht_get(shard->msg_table, &msgid) == NULL) {
+            pmsg->msgid = msgid;
+            ret = ht_set(shard->msg_table, &pmsg->msgid, pmsg);
+            break;
+        }
+    }
+    LeaveCriticalSection(&shard->msgCS);
  
     return ret; 
 }
  
-void * dns_msg_mgmt_get (void * vmgmt, uint16 msgid)
+void * dns_msg_mgmt_get (void * vmgmt, ulong uid)
 {
     DnsMgmt   * mgmt = (DnsMgmt *)vmgmt;
+    DnsShard  * shard = NULL;
     DnsMsg    * pmsg = NULL;
+    uint16      msgid = (uint16)(uid & 0xFFFF);
  
     if (!mgmt) return NULL;
  
-    EnterCriticalSection(&mgmt->msgCS);
-    pmsg = ht_get(mgmt->msg_table, &msgid);
-    LeaveCriticalSection(&mgmt->msgCS);
+    if ((uid >> 16) >= (ulong)mgmt->shardnum) return NULL;
+    shard = &mgmt->shard[uid >> 16];
+
+    EnterCriticalSection(&shard->msgCS);
+    pmsg = ht_get(shard->msg_table, &msgid);
+    LeaveCriticalSection(&shard->msgCS);
  
     return pmsg;
 }
  
-void * dns_msg_mgmt_del (void * vmgmt, uint16 msgid)
+void * dns_msg_mgmt_del (void * vmgmt, ulong uid)
 {
     DnsMgmt   * mgmt = (DnsMgmt *)vmgmt;
+    DnsShard  * shard = NULL;
     DnsMsg    * pmsg = NULL;
+    uint16      msgid = (uint16)(uid & 0xFFFF);
  
     if (!mgmt) return NULL;
  
-    EnterCriticalSection(&mgmt->msgCS);
-    pmsg = ht_delete(mgmt->msg_table, &msgid);
-    LeaveCriticalSection(&mgmt->msgCS);
+    if ((uid >> 16) >= (ulong)mgmt->shardnum) return NULL;
+    shard = &mgmt->shard[uid >> 16];
+
+    EnterCriticalSection(&shard->msgCS);
+    pmsg = ht_delete(shard->msg_table, &msgid);
+    LeaveCriticalSection(&shard->msgCS);
  
     return pmsg;
 }
+
+int dns_msg_mgmt_num (void * vmgmt)
+{
+    DnsMgmt   * mgmt = (DnsMgmt *)vmgmt;
+    int         i, num = 0;
+
+    if (!mgmt) return 0;
+
+    /* read without msgCS, the sum is approximate and used for metrics */
+    for (i = 0; i < mgmt->shardnum; i++)
+        num += ht_num(mgmt->shard[i].msg_table);
+
+    return num;
+}
  
 int dns_msg_init (void * vmsg)
 {
@@ -1363,6 +2699,17 @@ int dns_msg_init (void * vmsg)
     msg->nsrvind = 0;
  
     msg->destaddr = NULL;
+    msg->clidev = NULL;
+    msg->desthost = NULL;
+    msg->answered = 0;
+ 
+    msg->hedgetimer = NULL;
+    msg->hedgehost = NULL;
+    msg->hedgedev = NULL;
+ 
+    msg->truncated = 0;
+    msg->tcpdev = NULL;
+    if (msg->tcpfrm) frame_empty(msg->tcpfrm);
  
     msg->rcode = 0;
  
@@ -1394,8 +2741,24 @@ int dns_msg_init (void * vmsg)
     msg->dnscb = NULL;
     msg->cbobj = NULL;
     msg->cbobjid = 0;
+    msg->cbearly = 0;
     msg->cbexec = 0;
  
+    msg->pendkey[0] = '\0';
+    msg->pending = 0;
+
+    msg->sibid = 0;
+    msg->sibdone = 0;
+    msg->sibrcode = 0;
+    msg->lateonly = 0;
+
+    if (!msg->waiter_list) {
+        msg->waiter_list = arr_alloc(2, mgmt->fragmem_alloctype, mgmt->fragmem_kempool);
+    } else {
+        while (arr_num(msg->waiter_list) > 0)
+            k_mem_free(arr_pop(msg->waiter_list), mgmt->fragmem_alloctype, mgmt->fragmem_kempool);
+    }
+
     msg->lifetimer = NULL;
     msg->sendtimes = 0;
  
@@ -1437,6 +2800,11 @@ int dns_msg_free (void * vmsg)
         msg->lifetimer = NULL;
     }
  
+    if (msg->hedgetimer) {
+        iotimer_stop(mgmt->pcore, msg->hedgetimer);
+        msg->hedgetimer = NULL;
+    }
+ 
     if (msg->nsrv) {
         dns_nsrv_free(msg->nsrv);
         msg->nsrv = NULL;
@@ -1455,6 +2823,22 @@ int dns_msg_free (void * vmsg)
         msg->ar_list = NULL;
     }
  
+    if (msg->waiter_list) {
+        while (arr_num(msg->waiter_list) > 0)
+            k_mem_free(arr_pop(msg->waiter_list), mgmt->fragmem_alloctype, mgmt->fragmem_kempool);
+        arr_free(msg->waiter_list);
+        msg->waiter_list = NULL;
+    }
+ 
+    if (msg->tcpdev) {
+        iodev_close(msg->tcpdev);
+        msg->tcpdev = NULL;
+    }
+    if (msg->tcpfrm) {
+        frame_free(msg->tcpfrm);
+        msg->tcpfrm = NULL;
+    }
+
     return 0;
 }
  
@@ -1473,13 +2857,11 @@ void * dns_msg_fetch (void * vmgmt)
  
     dns_msg_init(msg);
  
-    EnterCriticalSection(&mgmt->msgCS);
-    msg->msgid = mgmt->msgid++;
-    if (msg->msgid == 0) msg->msgid = mgmt->msgid++;
-    LeaveCriticalSection(&mgmt->msgCS);
+    /* the queries issued from one thread always go through the same shard */
+    msg->shardind = (uint8)dns_shard_select(mgmt);
  
     if (dns_msg_mgmt_add(mgmt, msg) <= 0) {
-        tolog(1, "Panic: dns_msg_fetch failed, msgid=%u exist in msg_table\n", msg->msgid);
+        tolog(1, "Panic: dns_msg_fetch failed, no free msgid in shard %d\n", msg->shardind);
         dns_msg_recycle(msg);
         return NULL;
     }
@@ -1503,6 +2885,14 @@ int dns_msg_recycle (void * vmsg)
         msg->lifetimer = NULL;
     }
  
+    if (msg->hedgetimer) {
+        iotimer_stop(mgmt->pcore, msg->hedgetimer);
+        msg->hedgetimer = NULL;
+    }
+ 
+    msg->desthost = NULL;
+    msg->hedgehost = NULL;
+
     if (msg->nsrv) {
         dns_nsrv_free(msg->nsrv);
         msg->nsrv = NULL;
@@ -1523,6 +2913,18 @@ int dns_msg_recycle (void * vmsg)
             dns_rr_free(arr_pop(msg->ar_list));
     }
 
+    dns_msg_pend_del(msg);
+
+    if (msg->waiter_list) {
+        while (arr_num(msg->waiter_list) > 0)
+            k_mem_free(arr_pop(msg->waiter_list), mgmt->fragmem_alloctype, mgmt->fragmem_kempool);
+    }
+
+    if (msg->tcpdev) {
+        iodev_close(msg->tcpdev);
+        msg->tcpdev = NULL;
+    }
+
     mpool_recycle(mgmt->msg_pool, msg);
     return 0;
 }
@@ -1530,12 +2932,18 @@ int dns_msg_recycle (void * vmsg)
 int dns_msg_encode (void * vmsg, char * name, int len, uint8 * pbuf, int bufsize)
 {
     DnsMsg    * msg = (DnsMsg *)vmsg;
+    DnsMgmt   * mgmt = NULL;
     DnsHeader   hdr = {0};
     int         enclen = 0;
     uint16      val16 = 0;
+    uint8       opt[11];
+    int         ednssize = 0;
  
     if (!msg) return 0;
  
+    mgmt = (DnsMgmt *)msg->dnsmgmt;
+    if (mgmt) ednssize = mgmt->edns_size;
+
     hdr.ID = htons(msg->msgid);
  
     hdr.RD = 1;
@@ -1551,14 +2959,14 @@ int dns_msg_encode (void * vmsg, char * name, int len, uint8 * pbuf, int bufsize
     hdr.qdcount = htons(1);
     hdr.ancount = 0;
     hdr.nscount = 0;
-    hdr.arcount = 0;
+    hdr.arcount = ednssize > 0 ? htons(1) : 0;
  
     /* Question: Dot-format name converts to DNS name */
     msg->qnlen = hostn_to_dns_format(name, len, msg->qname, sizeof(msg->qname)-1);
     if (msg->qnlen <= 0)
         return -100;
  
-    msg->qtype = RR_TYPE_A;
+    if (msg->qtype == 0) msg->qtype = RR_TYPE_A;
     msg->qclass = RR_CLASS_IN;
  
     /* Header */
@@ -1582,9 +2990,59 @@ int dns_msg_encode (void * vmsg, char * name, int len, uint8 * pbuf, int bufsize
         memcpy(pbuf + enclen, &val16, 2);
     enclen += 2;
  
+    /* Additional: EDNS0 OPT RR with root name, UDP payload size in CLASS,
+       zero extended RCODE/version/flags in TTL and empty RDATA */
+    if (ednssize > 0) {
+        memset(opt, 0, sizeof(opt));
+        val16 = htons(RR_TYPE_OPT);
+        memcpy(opt + 1, &val16, 2);
+        val16 = htons((uint16)ednssize);
+        memcpy(opt + 3, &val16, 2);
+
+        if (pbuf && bufsize - enclen >= sizeof(opt))
+            memcpy(pbuf + enclen, opt, sizeof(opt));
+        enclen += sizeof(opt);
+    }
+ 
     return enclen;
 }
  
+int dns_msg_verify (void * vmsg, uint8 * pbgn, int len)
+{
+    DnsMsg    * msg = (DnsMsg *)vmsg;
+    DnsHeader   hdr = {0};
+    uint16      val16 = 0;
+    char        name[256];
+    int         namelen = 0;
+    int         iter = 0;
+    int         ret;
+ 
+    if (!msg) return -1;
+    if (!pbgn || len < sizeof(hdr)) return -10;
+ 
+    memcpy(&hdr, pbgn, sizeof(hdr));
+    iter += sizeof(hdr);
+ 
+    if (ntohs(hdr.ID) != msg->msgid) return -100;
+    if (!hdr.QR || ntohs(hdr.qdcount) != 1) return -101;
+ 
+    ret = hostn_to_dot_format(pbgn + iter, len - iter, name, sizeof(name)-1, &namelen);
+    if (ret <= 0) return -102;
+    if (str_ncasecmp(msg->qname, pbgn + iter, msg->qnlen) != 0)
+        return -103;
+    iter += ret;
+ 
+    if (iter + 4 > len) return -104;
+ 
+    memcpy(&val16, pbgn + iter, 2); iter += 2;
+    if (ntohs(val16) != msg->qtype) return -105;
+ 
+    memcpy(&val16, pbgn + iter, 2); iter += 2;
+    if (ntohs(val16) != msg->qclass) return -106;
+ 
+    return iter;
+}
+ 
 int dns_msg_decode (void * vmsg, uint8 * pbgn, int len)
 {
     DnsMsg    * msg = (DnsMsg *)vmsg;
@@ -1616,6 +3074,7 @@ int dns_msg_decode (void * vmsg, uint8 * pbgn, int len)
     hdr.arcount = ntohs(hdr.arcount);
  
     msg->rcode = hdr.RCODE;
+    msg->truncated = hdr.TC;
     msg->an_num = hdr.ancount;
     msg->ns_num = hdr.nscount;
     msg->ar_num = hdr.arcount;
@@ -1639,94 +3098,425 @@ int dns_msg_decode (void * vmsg, uint8 * pbgn, int len)
     val16 = ntohs(val16);
     if (msg->qclass != val16) return -106;
  
-    /* Decoding all Answer PDU */
-    for (i = 0; i < msg->an_num && iter < len; i++) {
-        rr = dns_rr_alloc(mgmt->fragmem_alloctype, mgmt->fragmem_kempool);
-        ret = dns_rr_parse(rr, pbgn + iter, len - iter, pbgn, NULL);
-        if (ret < 0) {
-            dns_rr_free(rr);
-            return ret;
-        }
+    /* the records of truncated response may be cut in the middle, they
+       are discarded and the query is retried over TCP */
+    if (msg->truncated) return iter;
+ 
+    /* Decoding all Answer PDU */
+    for (i = 0; i < msg->an_num && iter < len; i++) {
+        rr = dns_rr_alloc(mgmt->fragmem_alloctype, mgmt->fragmem_kempool);
+        ret = dns_rr_parse(rr, pbgn + iter, len - iter, pbgn, NULL);
+        if (ret < 0) {
+            dns_rr_free(rr);
+            return ret;
+        }
+ 
+        arr_push(msg->an_list, rr);
+        iter += ret;
+    }
+ 
+    /* Decoding all Authority PDU */
+    for (i = 0; i < msg->ns_num && iter < len; i++) {
+        rr = dns_rr_alloc(mgmt->fragmem_alloctype, mgmt->fragmem_kempool);
+        ret = dns_rr_parse(rr, pbgn + iter, len - iter, pbgn, NULL);
+        if (ret < 0) {
+            dns_rr_free(rr);
+            return ret;
+        }
+ 
+        arr_push(msg->ns_list, rr);
+        iter += ret;
+    }
+ 
+    /* Decoding all Additional PDU */
+    for (i = 0; i < msg->ar_num && iter < len; i++) {
+        /* skip EDNS0 OPT RR of root name, it carries no resolving result */
+        if (pbgn[iter] == 0 && iter + 11 <= len) {
+            memcpy(&val16, pbgn + iter + 1, 2);
+            if (ntohs(val16) == RR_TYPE_OPT) {
+                memcpy(&val16, pbgn + iter + 9, 2);
+                iter += 11 + ntohs(val16);
+                continue;
+            }
+        }
+
+        rr = dns_rr_alloc(mgmt->fragmem_alloctype, mgmt->fragmem_kempool);
+        ret = dns_rr_parse(rr, pbgn + iter, len - iter, pbgn, NULL);
+        if (ret < 0) {
+            dns_rr_free(rr);
+            return ret;
+        }
+ 
+        arr_push(msg->ar_list, rr);
+        iter += ret;
+    }
+ 
+    return iter;
+}
+ 
+int dns_msg_negative_ttl (void * vmsg)
+{
+    DnsMsg    * msg = (DnsMsg *)vmsg;
+    DnsRR     * rr = NULL;
+    int         i, num;
+ 
+    if (!msg) return -1;
+ 
+    num = arr_num(msg->ns_list);
+    for (i = 0; i < num; i++) {
+        rr = arr_value(msg->ns_list, i);
+        if (!rr || rr->type != RR_TYPE_SOA) continue;
+ 
+        return rr->ttl < rr->soamin ? (int)rr->ttl : (int)rr->soamin;
+    }
+ 
+    return -1;
+}
+ 
+void * dns_msg_open (void * vmgmt, char * name, int len, DnsCB * cb, void * cbobj, ulong objid)
+{
+    DnsMgmt  * mgmt = (DnsMgmt *)vmgmt;
+    DnsMsg   * msg = NULL;
+ 
+    if (!mgmt) return NULL;
+ 
+    if (!name) return NULL;
+    if (len < 0) len = strlen(name);
+    if (len <= 0) return NULL;
+ 
+    msg = dns_msg_fetch(mgmt);
+    if (!msg) return NULL;
+ 
+    str_secpy(msg->name, sizeof(msg->name)-1, name, len);
+    msg->nlen = len;
+ 
+    msg->dnscb = cb;
+    msg->cbobj = cbobj;
+    msg->cbobjid = objid;
+ 
+    msg->qtype = RR_TYPE_A;
+
+    /* When the upper-layer application calls dns_query, it calls the current
+       function to create a DnsMsg instance, and the DnsMsg records the caller
+       thread ID. In this way, dns_query callback function will be invoked by
+       the same thread as the caller to process the DNS resolution result, 
+       ensuring that the upper-layer application data is processed in the same thread. */
+    msg->threadid = get_threadid();
+
+    return msg;
+}
+ 
+int dns_msg_close (void * vmsg)
+{
+    DnsMsg   * msg = (DnsMsg *)vmsg;
+    DnsMgmt  * mgmt = NULL;
+    DnsCache * cache = NULL;
+ 
+    if (!msg) return -1;
+ 
+    mgmt = (DnsMgmt *)msg->dnsmgmt;
+    if (!mgmt) return -2;
+
+    if (dns_msg_mgmt_del(mgmt, dns_msg_uid(msg)) != msg)
+        return -100;
+ 
+    if (!msg->cbexec) {
+        /* resolving failed or timed out, answer the waiters with the cached
+           RR that is still valid or servable as stale */
+        cache = dns_cache_mgmt_get(mgmt, msg->name, msg->nlen);
+        if (cache && dns_cache_verify(cache) <= 0 &&
+            (mgmt->stale_max <= 0 || cache->stalenum <= 0))
+            cache = NULL;
+ 
+        if (cache) {
+            if (cache->anum <= 0) epstat_inc(&mgmt->stale_num);
+            dns_msg_notify(msg, cache, DNS_ERR_NO_ERROR);
+        } else {
+            dns_msg_notify(msg, NULL, msg->rcode);
+        }
+    }
+ 
+    return dns_msg_recycle(msg);
+}
+ 
+int dns_msg_query (void * vmgmt, char * name, int len, void * vnsrv, void * vcache,
+                   DnsCB * cb, void * cbobj, ulong objid, int early)
+{
+    DnsMgmt  * mgmt = (DnsMgmt *)vmgmt;
+    DnsMsg   * msg = NULL;
+    DnsMsg   * sib = NULL;
+    int        ret = 0;
+ 
+    if (!mgmt) return -1;
+ 
+    msg = dns_msg_open(mgmt, name, len, cb, cbobj, objid);
+    if (!msg) return -100;
+ 
+    msg->cache = vcache;
+    msg->cbearly = early ? 1 : 0;
+ 
+    /* designated NameServer is owned by DnsMsg and can not be shared, AAAA
+       query is sent only with the NameServers of DnsMgmt */
+    if (mgmt->dualstack && !vnsrv) {
+        sib = dns_msg_open(mgmt, name, len, NULL, NULL, 0);
+        if (sib) {
+            sib->qtype = RR_TYPE_AAAA;
+            sib->cache = vcache;
+ 
+            msg->sibid = dns_msg_uid(sib);
+            sib->sibid = dns_msg_uid(msg);
+        }
+    }
+ 
+    ret = dns_msg_send(msg, name, len, vnsrv);
+    if (ret < 0) {
+        /* no result will come back, release DnsMsg without notifying */
+        if (dns_msg_mgmt_del(mgmt, dns_msg_uid(msg)) == msg)
+            dns_msg_recycle(msg);
+ 
+        if (sib && dns_msg_mgmt_del(mgmt, dns_msg_uid(sib)) == sib)
+            dns_msg_recycle(sib);
+        return ret;
+    }
+ 
+    if (!vnsrv) dns_msg_pend_add(msg);
+ 
+    if (sib) {
+        if (dns_msg_send(sib, name, len, NULL) < 0) {
+            msg->sibid = 0;
+            if (dns_msg_mgmt_del(mgmt, dns_msg_uid(sib)) == sib)
+                dns_msg_recycle(sib);
+        } else {
+            dns_msg_pend_add(sib);
+        }
+    }
+ 
+    return ret;
+}
+ 
+int dns_msg_cmp_pendkey (void * a, void * pat)
+{
+    DnsMsg * msg = (DnsMsg *)a;
+    char   * key = (char *)pat;
+ 
+    if (!msg) return -1;
+    if (!key) return 1;
+ 
+    return strcasecmp(msg->pendkey, key);
+}
+ 
+int dns_msg_pendkey (char * name, int len, int qtype, ulong threadid, char * key, int keylen)
+{
+    char  sname[DNS_NAME_LEN];
+ 
+    if (!name || !key || keylen <= 0) return -1;
+ 
+    if (len < 0) len = strlen(name);
+ 
+    str_secpy(sname, sizeof(sname)-1, name, len);
+ 
+    /* DnsCB is invoked in the thread that opened the DnsMsg. Callers from
+       different threads are not merged so that each one still receives
+       the result in its own thread */
+    return snprintf(key, keylen, "%d:%lu:%s", qtype, threadid, sname);
+}
+ 
+int dns_msg_pend_add (void * vmsg)
+{
+    DnsMsg   * msg = (DnsMsg *)vmsg;
+    DnsMgmt  * mgmt = NULL;
+    int        ret = 0;
+ 
+    if (!msg) return -1;
+ 
+    mgmt = (DnsMgmt *)msg->dnsmgmt;
+    if (!mgmt) return -2;
+ 
+    dns_msg_pendkey(msg->name, msg->nlen, msg->qtype, msg->threadid,
+                    msg->pendkey, sizeof(msg->pendkey));
+ 
+    EnterCriticalSection(&mgmt->msgCS);
+    if (ht_get(mgmt->pend_table, msg->pendkey) == NULL) {
+        ht_set(mgmt->pend_table, msg->pendkey, msg);
+        msg->pending = 1;
+        ret = 1;
+    }
+    LeaveCriticalSection(&mgmt->msgCS);
+ 
+    return ret;
+}
+ 
+void * dns_msg_pend_get (void * vmgmt, char * key)
+{
+    DnsMgmt  * mgmt = (DnsMgmt *)vmgmt;
+    DnsMsg   * msg = NULL;
+ 
+    if (!mgmt || !key) return NULL;
+ 
+    EnterCriticalSection(&mgmt->msgCS);
+    msg = ht_get(mgmt->pend_table, key);
+    LeaveCriticalSection(&mgmt->msgCS);
+ 
+    return msg;
+}
+ 
+int dns_msg_pend_del (void * vmsg)
+{
+    DnsMsg   * msg = (DnsMsg *)vmsg;
+    DnsMgmt  * mgmt = NULL;
+ 
+    if (!msg) return -1;
+ 
+    mgmt = (DnsMgmt *)msg->dnsmgmt;
+    if (!mgmt) return -2;
+ 
+    if (!msg->pending) return 0;
+ 
+    EnterCriticalSection(&mgmt->msgCS);
+    if (ht_get(mgmt->pend_table, msg->pendkey) == msg)
+        ht_delete(mgmt->pend_table, msg->pendkey);
+    msg->pending = 0;
+    LeaveCriticalSection(&mgmt->msgCS);
+ 
+    return 1;
+}
+ 
+int dns_msg_waiter_add (void * vmsg, DnsCB * cb, void * cbobj, ulong objid, int early)
+{
+    DnsMsg    * msg = (DnsMsg *)vmsg;
+    DnsMgmt   * mgmt = NULL;
+    DnsWaiter * waiter = NULL;
+ 
+    if (!msg) return -1;
+    if (!cb) return 0;
+ 
+    mgmt = (DnsMgmt *)msg->dnsmgmt;
+    if (!mgmt) return -2;
+ 
+    waiter = k_mem_zalloc(sizeof(*waiter), mgmt->fragmem_alloctype, mgmt->fragmem_kempool);
+    if (!waiter) return -100;
  
-        arr_push(msg->an_list, rr);
-        iter += ret;
-    }
+    waiter->dnscb = cb;
+    waiter->cbobj = cbobj;
+    waiter->cbobjid = objid;
+    waiter->early = early ? 1 : 0;
  
-    /* Decoding all Authority PDU */
-    for (i = 0; i < msg->ns_num && iter < len; i++) {
-        rr = dns_rr_alloc(mgmt->fragmem_alloctype, mgmt->fragmem_kempool);
-        ret = dns_rr_parse(rr, pbgn + iter, len - iter, pbgn, NULL);
-        if (ret < 0) {
-            dns_rr_free(rr);
-            return ret;
-        }
+    arr_push(msg->waiter_list, waiter);
  
-        arr_push(msg->ns_list, rr);
-        iter += ret;
-    }
+    return arr_num(msg->waiter_list);
+}
  
-    /* Decoding all Additional PDU */
-    for (i = 0; i < msg->ar_num && iter < len; i++) {
-        rr = dns_rr_alloc(mgmt->fragmem_alloctype, mgmt->fragmem_kempool);
-        ret = dns_rr_parse(rr, pbgn + iter, len - iter, pbgn, NULL);
-        if (ret < 0) {
-            dns_rr_free(rr);
-            return ret;
-        }
+int dns_msg_waiter_num (void * vmsg)
+{
+    DnsMsg * msg = (DnsMsg *)vmsg;
  
-        arr_push(msg->ar_list, rr);
-        iter += ret;
-    }
+    if (!msg) return 0;
  
-    return iter;
+    return arr_num(msg->waiter_list);
 }
  
-void * dns_msg_open (void * vmgmt, char * name, int len, DnsCB * cb, void * cbobj, ulong objid)
+int dns_msg_notify (void * vmsg, void * vcache, int status)
 {
-    DnsMgmt  * mgmt = (DnsMgmt *)vmgmt;
-    DnsMsg   * msg = NULL;
+    DnsMsg    * msg = (DnsMsg *)vmsg;
+    DnsMsg    * sib = NULL;
+    DnsMgmt   * mgmt = NULL;
+    DnsWaiter * waiter = NULL;
+    int         i, num = 0;
+    int         positive = 0;
  
-    if (!mgmt) return NULL;
+    if (!msg) return -1;
  
-    if (!name) return NULL;
-    if (len < 0) len = strlen(name);
-    if (len <= 0) return NULL;
+    mgmt = (DnsMgmt *)msg->dnsmgmt;
+    if (!mgmt) return -2;
  
-    msg = dns_msg_fetch(mgmt);
-    if (!msg) return NULL;
+    msg->cbexec = 1;
  
-    str_secpy(msg->name, sizeof(msg->name)-1, name, len);
-    msg->nlen = len;
+    /* detach from in-flight table first, the callbacks issuing new query
+       of the same name will open a new DnsMsg */
+    dns_msg_pend_del(msg);
  
-    msg->dnscb = cb;
-    msg->cbobj = cbobj;
-    msg->cbobjid = objid;
+    positive = (status == DNS_ERR_NO_ERROR && vcache && dns_cache_a_num(vcache) > 0);
+
+    if (msg->sibid) {
+        sib = dns_msg_mgmt_get(mgmt, msg->sibid);
+        msg->sibid = 0;
  
-    /* When the upper-layer application calls dns_query, it calls the current
-       function to create a DnsMsg instance, and the DnsMsg records the caller
-       thread ID. In this way, dns_query callback function will be invoked by
-       the same thread as the caller to process the DNS resolution result, 
-       ensuring that the upper-layer application data is processed in the same thread. */
-    msg->threadid = get_threadid();
+        /* the handover is serialized by msgCS, the A and AAAA answers
+           arriving together never take the callbacks both */
+        EnterCriticalSection(&mgmt->msgCS);
 
-    return msg;
-}
+        if (sib && sib->sibid == dns_msg_uid(msg) && !sib->cbexec) {
+            sib->sibid = 0;
+            sib->sibdone = 1;
+
+            if (!positive) {
+                /* sibling query is outstanding, it will notify all callbacks */
+                if (msg->dnscb)
+                    dns_msg_waiter_add(sib, msg->dnscb, msg->cbobj, msg->cbobjid, msg->cbearly);
+                msg->dnscb = NULL;
  
-int dns_msg_close (void * vmsg)
-{
-    DnsMsg   * msg = (DnsMsg *)vmsg;
+                while (arr_num(msg->waiter_list) > 0)
+                    arr_push(sib->waiter_list, arr_delete(msg->waiter_list, 0));
  
-    if (!msg) return -1;
+                sib->sibrcode = status != DNS_ERR_NO_ERROR ? status : DNS_ERR_NO_RESPONSE;
+                LeaveCriticalSection(&mgmt->msgCS);
+                return 0;
+            }
+
+            /* the first answer with address is notified to all callbacks at
+               once, the callbacks held by the sibling are taken over */
+            if (sib->dnscb)
+                dns_msg_waiter_add(msg, sib->dnscb, sib->cbobj, sib->cbobjid, sib->cbearly);
+            sib->dnscb = NULL;
+
+            while (arr_num(sib->waiter_list) > 0)
+                arr_push(msg->waiter_list, arr_delete(sib->waiter_list, 0));
+
+            /* the early callbacks get the addresses of the other family
+               later, such as the racing of Happy Eyeballs connecting */
+            if (msg->dnscb && msg->cbearly)
+                dns_msg_waiter_add(sib, msg->dnscb, msg->cbobj, msg->cbobjid, 1);
+
+            for (i = 0; i < arr_num(msg->waiter_list); i++) {
+                waiter = arr_value(msg->waiter_list, i);
+                if (waiter && waiter->early)
+                    dns_msg_waiter_add(sib, waiter->dnscb, waiter->cbobj, waiter->cbobjid, 1);
+            }
+
+            sib->sibrcode = DNS_ERR_NO_ERROR;
+            sib->lateonly = 1;
+        } else {
+            sib = NULL;
+        }
+
+        LeaveCriticalSection(&mgmt->msgCS);
+
+        /* new query of the name does not wait for the late answer */
+        if (sib) dns_msg_pend_del(sib);
+    }
  
-    if (dns_msg_mgmt_del(msg->dnsmgmt, msg->msgid) != msg)
-        return -100;
+    /* the callbacks were notified by the sibling, the early ones are told
+       the addresses of this family only if answered */
+    if (msg->lateonly) status = DNS_ERR_LATE_ADDR;
+
+    if (msg->dnscb && (!msg->lateonly || positive)) {
+        (*msg->dnscb)(msg->cbobj, msg->cbobjid, msg->name, msg->nlen, vcache, status);
+        num++;
+    }
  
-    if (!msg->cbexec) {
-        msg->cbexec = 1;
-        (*msg->dnscb)(msg->cbobj, msg->cbobjid, msg->name, msg->nlen, NULL, msg->rcode);
+    while (arr_num(msg->waiter_list) > 0) {
+        waiter = arr_delete(msg->waiter_list, 0);
+        if (!waiter) continue;
+ 
+        if (!msg->lateonly || positive) {
+            (*waiter->dnscb)(waiter->cbobj, waiter->cbobjid, msg->name, msg->nlen, vcache, status);
+            num++;
+        }
+ 
+        k_mem_free(waiter, mgmt->fragmem_alloctype, mgmt->fragmem_kempool);
     }
  
-    return dns_msg_recycle(msg);
+    return num;
 }
  
  
@@ -1736,8 +3526,10 @@ int dns_msg_send (void * vmsg, char * name, int len, void * vnsrv)
     DnsNSrv  * nsrv = (DnsNSrv *)vnsrv;
     DnsMgmt  * mgmt = NULL;
     DnsHost  * host = NULL;
+    DnsShard * shard = NULL;
     iodev_t  * pdev = NULL;
-    int        i, j, num, ret;
+    DnsHost  * hlist[16];
+    int        i, num, ret;
     uint8      buf[16384];
     int        enclen = 0;
  
@@ -1769,29 +3561,49 @@ int dns_msg_send (void * vmsg, char * name, int len, void * vnsrv)
         if (host) dns_nsrv_add(mgmt->nsrv, host);
     }
 
-    num = arr_num(nsrv->host_list);
+    /* the fastest healthy Name Server first. the resending goes to the
+       next one other than the last tried */
+    num = dns_nsrv_order(nsrv, hlist, 16);
+    shard = &mgmt->shard[msg->shardind];
  
     for (i = 0; i < num; i++) {
-        host = arr_value(nsrv->host_list, (i + msg->nsrvind) % num);
+        host = hlist[i];
         if (!host) continue;
+        if (num > 1 && host == msg->desthost) continue;
  
-        for (j = 0; j < mgmt->cli_dev_num; j++) {
-            pdev = mgmt->cli_dev[j];
-            if (pdev->family == host->addr.u.addr.sa_family)
-                break;
-        }
+        pdev = dns_shard_dev(shard, host->addr.u.addr.sa_family);
+        if (!pdev) continue;
 
         ret = sendto(iodev_fd(pdev),
                      buf, enclen, 0,
                      (struct sockaddr *)&host->addr.u.addr,
                      host->addr.socklen);
         if (ret < 0 || ret != enclen) {
+            dns_host_fail(host);
             continue;
         }
  
         msg->destaddr = &host->addr;
+        msg->clidev = pdev;
+        msg->desthost = host;
+        btime(&msg->sendtime);
+        msg->answered = 0;
+        msg->hedgehost = NULL;
+        msg->hedgedev = NULL;
         msg->sendtimes++;
         msg->nsrvind++;
+
+        EPPROBE3(dns_msg_send, dns_msg_uid(msg), msg->name, msg->sendtimes);
+ 
+        if (msg->hedgetimer) {
+            iotimer_stop(mgmt->pcore, msg->hedgetimer);
+            msg->hedgetimer = NULL;
+        }
+        if (mgmt->hedge && num > 1) {
+            msg->hedgetimer = iotimer_start(mgmt->pcore, dns_host_hedge_delay(host),
+                                  t_dns_msg_hedge, (void *)dns_msg_uid(msg),
+                                  dns_pump, mgmt, iodev_epumpid(pdev));
+        }
  
         if (msg->lifetimer) iotimer_stop(mgmt->pcore, msg->lifetimer);
 
@@ -1805,7 +3617,7 @@ int dns_msg_send (void * vmsg, char * name, int len, void * vnsrv)
            Therefore, the correct way is to set the epumpid of the timer to the ePump thread
            ID bound by the iodev_t that sends the current DnsMsg.*/
         msg->lifetimer = iotimer_start(mgmt->pcore, 12*1000,
-                                  t_dns_msg_life, (void *)(ulong)msg->msgid,
+                                  t_dns_msg_life, (void *)dns_msg_uid(msg),
                                   dns_pump, mgmt, iodev_epumpid(pdev));
         return 0;
     }
@@ -1813,6 +3625,78 @@ int dns_msg_send (void * vmsg, char * name, int len, void * vnsrv)
     return -200;
 }
  
+int dns_msg_hedge (void * vmsg)
+{
+    DnsMsg   * msg = (DnsMsg *)vmsg;
+    DnsNSrv  * nsrv = NULL;
+    DnsMgmt  * mgmt = NULL;
+    DnsShard * shard = NULL;
+    DnsHost  * host = NULL;
+    iodev_t  * pdev = NULL;
+    DnsHost  * hlist[16];
+    int        i, num, ret;
+    uint8      buf[16384];
+    int        enclen = 0;
+ 
+    if (!msg) return -1;
+ 
+    mgmt = (DnsMgmt *)msg->dnsmgmt;
+    if (!mgmt) return -2;
+ 
+    shard = &mgmt->shard[msg->shardind];
+
+    if (msg->answered || msg->cbexec || msg->tcpdev || msg->hedgehost)
+        return 0;
+ 
+    nsrv = msg->nsrv ? msg->nsrv : mgmt->nsrv;
+ 
+    enclen = dns_msg_encode(msg, msg->name, msg->nlen, buf, sizeof(buf));
+    if (enclen <= 0 || enclen > sizeof(buf)) return -100;
+ 
+    num = dns_nsrv_order(nsrv, hlist, 16);
+ 
+    for (i = 0; i < num; i++) {
+        host = hlist[i];
+        if (!host || host == msg->desthost) continue;
+ 
+        pdev = dns_shard_dev(shard, host->addr.u.addr.sa_family);
+        if (!pdev) continue;
+ 
+        /* dns_recv matches the answer with hedgehost under msgCS, the fields
+           are set before sending or a fast answer would be dropped */
+        EnterCriticalSection(&shard->msgCS);
+        if (msg->answered) {
+            LeaveCriticalSection(&shard->msgCS);
+            return 0;
+        }
+        msg->hedgehost = host;
+        msg->hedgedev = pdev;
+        btime(&msg->hedgetime);
+        LeaveCriticalSection(&shard->msgCS);
+
+        ret = sendto(iodev_fd(pdev),
+                     buf, enclen, 0,
+                     (struct sockaddr *)&host->addr.u.addr,
+                     host->addr.socklen);
+        if (ret < 0 || ret != enclen) {
+            EnterCriticalSection(&shard->msgCS);
+            if (msg->hedgehost == host) {
+                msg->hedgehost = NULL;
+                msg->hedgedev = NULL;
+            }
+            LeaveCriticalSection(&shard->msgCS);
+
+            dns_host_fail(host);
+            continue;
+        }
+ 
+        epstat_inc(&mgmt->hedge_num);
+        return 1;
+    }
+ 
+    return 0;
+}
+ 
 int dns_msg_nsrv_cb (void * vmsg, ulong msgid, char * name, int namelen, void * vnscac, int status)
 {
     DnsMsg    * msg = (DnsMsg *)vmsg;
@@ -1874,11 +3758,15 @@ int dns_msg_handle (void * vmsg)
     int         j, jnum;
     DnsRR     * jrr = NULL;
     int         anum = 0;
+    int         negttl = -1;
+    int         rcode = 0;
  
     if (!msg) return -1;
  
     mgmt = (DnsMgmt *)msg->dnsmgmt;
     if (!mgmt) return -2;
+
+    EPPROBE3(dns_msg_handle, dns_msg_uid(msg), msg->name, msg->rcode);
  
     cache = dns_cache_open(mgmt, msg->name, msg->nlen);
     if (!cache) {
@@ -1890,6 +3778,34 @@ int dns_msg_handle (void * vmsg)
     }
  
     num = arr_num(msg->an_list);
+
+    /* rfc2308, NXDOMAIN or NODATA with SOA in Authority section is cached as
+       negative answer, further queries of the name fail without Name Server */
+    if (msg->rcode == DNS_ERR_NAME_ERROR ||
+        (msg->rcode == DNS_ERR_NO_ERROR && num <= 0 && arr_num(msg->ns_list) > 0))
+    {
+        negttl = dns_msg_negative_ttl(msg);
+        if (negttl >= 0 || msg->rcode == DNS_ERR_NAME_ERROR) {
+            /* NODATA is cached for the qtype queried only, NXDOMAIN means
+               the name has no record of any type */
+            rcode = msg->rcode == DNS_ERR_NO_ERROR ? DNS_ERR_NO_DATA : msg->rcode;
+            if (negttl >= 0) {
+                dns_cache_negative_set(cache, rcode == DNS_ERR_NO_DATA ? msg->qtype : 0,
+                                       rcode, negttl);
+                epstat_inc(&mgmt->negative_num);
+            }
+ 
+            /* name does not exist any more, stale RR must not be served */
+            if (msg->rcode == DNS_ERR_NAME_ERROR)
+                dns_cache_zap(cache);
+ 
+            dns_cache_trymsg_succ(cache);
+            dns_msg_notify(msg, cache, rcode);
+            dns_msg_close(msg);
+            return 0;
+        }
+    }
+
     if (num <= 0 && msg->sendtimes < 3) {
         ret = dns_msg_send(msg, NULL, 0, NULL);
         if (ret < 0) {
@@ -1903,6 +3819,16 @@ int dns_msg_handle (void * vmsg)
         return ret;
     }
 
+    /* the answer replaces the expired RR of the queried type, or the address
+       retired by the server would be served as stale beyond its TTL */
+    for (i = 0; i < num; i++) {
+        rr = arr_value(msg->an_list, i);
+        if (rr && rr->type == msg->qtype) {
+            dns_cache_drop_stale(cache, msg->qtype);
+            break;
+        }
+    }
+
     for (i = 0; i < num; i++) {
         rr = arr_value(msg->an_list, i);
         if (!rr) continue;
@@ -1947,63 +3873,222 @@ int dns_msg_handle (void * vmsg)
             }
             dns_rr_free(rr);
  
-        } else {
-            dns_rr_free(rr);
+        } else {
+            dns_rr_free(rr);
+        }
+    }
+ 
+    if (dns_cache_a_num(cache) > 0) {
+        dns_cache_trymsg_succ(cache);
+        goto got_resolv;
+    }
+ 
+    /* coming here shows that there is no valid AnswerRR in response.
+       check AuthorityRR list and re-query with new NameServer in list */
+ 
+    num = arr_num(msg->ns_list);
+    for (i = 0; i < num; i++) {
+        rr = arr_value(msg->ns_list, i);
+        if (!rr) continue;
+ 
+        rdata = (char *)rr->rdata;
+        rdlen = rdata ? strlen(rdata) : 0;
+ 
+        if (rr->type == RR_TYPE_NS) {
+            jnum = arr_num(msg->ar_list);
+            for (j = 0; j < jnum; j++) {
+                jrr = arr_value(msg->ar_list, j);
+                if (!jrr) continue;
+ 
+                if ((jrr->type == RR_TYPE_A || jrr->type == RR_TYPE_AAAA) &&
+                    strcasecmp(jrr->name, rdata) == 0)
+                {
+                    nshost = dns_host_new(rdata, jrr->ip, 0,
+                                          mgmt->fragmem_alloctype, mgmt->fragmem_kempool);
+                    nsrv = dns_nsrv_alloc(mgmt->fragmem_alloctype, mgmt->fragmem_kempool);
+                    dns_nsrv_add(nsrv, nshost);
+ 
+                    /* if rdata in AuthorityRR (Name Server) of response is same as 
+                       the name of AdditionalRR, and AdditionalRR is an IP address,
+                       the IP address will be used as new NameServer to resolve hostname */
+                    return dns_msg_send(msg, NULL, 0, nsrv);
+                }
+            }
+ 
+            /* if AuthorityRR has no attached AdditionalRR, the Name Sever should be resolved first */
+            if (j > jnum) {
+                return dns_nb_query(mgmt, rdata, rdlen, NULL, NULL, dns_msg_nsrv_cb, msg, 0);
+            }
+        }
+    }
+    
+got_resolv:
+
+    if (dns_cache_a_num(cache) > 0) {
+        dns_cache_negative_clear(cache, msg->qtype);
+ 
+    } else if (msg->rcode == DNS_ERR_SERVER_FAILURE || msg->rcode == DNS_ERR_REFUSED) {
+        /* SERVFAIL is cached shortly, the stale RR kept is served meanwhile */
+        dns_cache_negative_set(cache, msg->qtype, msg->rcode, DNS_SERVFAIL_TTL);
+        epstat_inc(&mgmt->negative_num);
+    }
+ 
+    dns_msg_notify(msg, cache, msg->rcode);
+ 
+    dns_msg_close(msg);
+    return 0;
+}
+ 
+int dns_msg_tcp_query (void * vmsg)
+{
+    DnsMsg   * msg = (DnsMsg *)vmsg;
+    DnsMgmt  * mgmt = NULL;
+    iodev_t  * pdev = NULL;
+    char       ip[64];
+    int        port = 0;
+    int        ret = 0;
+ 
+    if (!msg) return -1;
+ 
+    mgmt = (DnsMgmt *)msg->dnsmgmt;
+    if (!mgmt) return -2;
+ 
+    if (msg->tcpdev) return 0;
+    if (!msg->destaddr || !msg->clidev) return -3;
+ 
+    if (msg->destaddr->family == AF_INET6)
+        port = ntohs(msg->destaddr->u.addr6.sin6_port);
+    else
+        port = ntohs(msg->destaddr->u.addr4.sin_port);
+    sock_addr_ntop(&msg->destaddr->u.addr, ip);
+ 
+    if (!msg->tcpfrm) msg->tcpfrm = frame_new(2048);
+    else frame_empty(msg->tcpfrm);
+    if (!msg->tcpfrm) return -100;
+ 
+    /* TCP connection is bound to the ePump thread of the UDP iodev, which
+       also runs the life timer of DnsMsg */
+    pdev = eptcp_nb_connect(mgmt->pcore, ip, port, NULL, 0, NULL,
+                            (void *)dns_msg_uid(msg), dns_pump, mgmt,
+                            iodev_epumpid(msg->clidev), &ret);
+    if (!pdev) {
+        tolog(1, "Warning: DnsMsg TCP retry failed, msgid=%u name=%s %s:%d ret=%d\n",
+              msg->msgid, msg->name, ip, port, ret);
+        return -101;
+    }
+ 
+    msg->tcpdev = pdev;
+    epstat_inc(&mgmt->tcp_num);
+ 
+    /* connected immediately, IOE_CONNECTED will not be delivered */
+    if (ret >= 0) {
+        if (dns_msg_tcp_send(msg) < 0) {
+            iodev_close(pdev);
+            msg->tcpdev = NULL;
+            return -102;
+        }
+    }
+ 
+    return 0;
+}
+ 
+int dns_msg_tcp_send (void * vmsg)
+{
+    DnsMsg   * msg = (DnsMsg *)vmsg;
+    uint8      buf[2048];
+    uint16     val16 = 0;
+    int        enclen = 0;
+    int        sndnum = 0;
+ 
+    if (!msg) return -1;
+    if (!msg->tcpdev) return -2;
+ 
+    /* rfc1035 4.2.2, TCP message is prefixed with 2-byte length */
+    enclen = dns_msg_encode(msg, msg->name, msg->nlen, buf + 2, sizeof(buf) - 2);
+    if (enclen <= 0 || enclen > sizeof(buf) - 2) return -100;
+ 
+    val16 = htons((uint16)enclen);
+    memcpy(buf, &val16, 2);
+ 
+    if (tcp_nb_send(iodev_fd(msg->tcpdev), buf, enclen + 2, &sndnum) < 0 ||
+        sndnum != enclen + 2)
+        return -101;
+ 
+    return 0;
+}
+ 
+int dns_msg_tcp_recv (void * vmgmt, void * pobj)
+{
+    DnsMgmt  * mgmt = (DnsMgmt *)vmgmt;
+    iodev_t  * pdev = (iodev_t *)pobj;
+    DnsMsg   * msg = NULL;
+    uint8      buf[8192];
+    uint16     val16 = 0;
+    int        num = 0;
+    int        ret = 0;
+ 
+    if (!mgmt) return -1;
+ 
+    msg = dns_msg_mgmt_get(mgmt, (ulong)iodev_para(pdev));
+    if (!msg || msg->tcpdev != pdev) return -2;
+ 
+    do {
+        ret = tcp_nb_recv(iodev_fd(pdev), buf, sizeof(buf), &num);
+        if (num > 0) frame_put_nlast(msg->tcpfrm, buf, num);
+    } while (ret >= 0 && num == sizeof(buf));
+ 
+    if (frameL(msg->tcpfrm) >= 2) {
+        memcpy(&val16, frameP(msg->tcpfrm), 2);
+        val16 = ntohs(val16);
+ 
+        if (frameL(msg->tcpfrm) >= 2 + val16) {
+            msg->tcpdev = NULL;
+ 
+            /* response over TCP is verified as UDP one, its msgid and
+               question must be same as the request */
+            if ((ret = dns_msg_verify(msg, frameP(msg->tcpfrm) + 2, val16)) < 0) {
+                tolog(1, "Warning: DnsMsg TCP response mismatched, msgid=%u name=%s ret=%d\n",
+                      msg->msgid, msg->name, ret);
+                dns_cache_trymsg_fail(msg->cache);
+                msg->rcode = DNS_ERR_FORMAT_ERROR;
+                PushDnsCloseEvent(iodev_epump(pdev), msg);
+ 
+            } else if (dns_msg_decode(msg, frameP(msg->tcpfrm) + 2, val16) < 0 || msg->truncated) {
+                dns_cache_trymsg_fail(msg->cache);
+                msg->rcode = DNS_ERR_FORMAT_ERROR;
+                PushDnsCloseEvent(iodev_epump(pdev), msg);
+            } else {
+                PushDnsRecvEvent(iodev_epump(pdev), msg);
+            }
+ 
+            iodev_close(pdev);
+            return 0;
         }
     }
  
-    if (dns_cache_a_num(cache) > 0) {
-        dns_cache_trymsg_succ(cache);
-        goto got_resolv;
-    }
- 
-    /* coming here shows that there is no valid AnswerRR in response.
-       check AuthorityRR list and re-query with new NameServer in list */
- 
-    num = arr_num(msg->ns_list);
-    for (i = 0; i < num; i++) {
-        rr = arr_value(msg->ns_list, i);
-        if (!rr) continue;
+    /* Name Server closed the connection before sending whole response */
+    if (ret < 0) return dns_msg_tcp_fail(mgmt, pdev);
  
-        rdata = (char *)rr->rdata;
-        rdlen = rdata ? strlen(rdata) : 0;
+    return 0;
+}
  
-        if (rr->type == RR_TYPE_NS) {
-            jnum = arr_num(msg->ar_list);
-            for (j = 0; j < jnum; j++) {
-                jrr = arr_value(msg->ar_list, j);
-                if (!jrr) continue;
+int dns_msg_tcp_fail (void * vmgmt, void * pobj)
+{
+    DnsMgmt  * mgmt = (DnsMgmt *)vmgmt;
+    iodev_t  * pdev = (iodev_t *)pobj;
+    DnsMsg   * msg = NULL;
  
-                if ((jrr->type == RR_TYPE_A || jrr->type == RR_TYPE_AAAA) &&
-                    strcasecmp(jrr->name, rdata) == 0)
-                {
-                    nshost = dns_host_new(rdata, jrr->ip, 0,
-                                          mgmt->fragmem_alloctype, mgmt->fragmem_kempool);
-                    nsrv = dns_nsrv_alloc(mgmt->fragmem_alloctype, mgmt->fragmem_kempool);
-                    dns_nsrv_add(nsrv, nshost);
+    if (!mgmt) return -1;
  
-                    /* if rdata in AuthorityRR (Name Server) of response is same as 
-                       the name of AdditionalRR, and AdditionalRR is an IP address,
-                       the IP address will be used as new NameServer to resolve hostname */
-                    return dns_msg_send(msg, NULL, 0, nsrv);
-                }
-            }
+    /* iodev already closed by DnsMsg recycling */
+    msg = dns_msg_mgmt_get(mgmt, (ulong)iodev_para(pdev));
+    if (!msg || msg->tcpdev != pdev) return -2;
  
-            /* if AuthorityRR has no attached AdditionalRR, the Name Sever should be resolved first */
-            if (j > jnum) {
-                return dns_nb_query(mgmt, rdata, rdlen, NULL, NULL, dns_msg_nsrv_cb, msg, 0);
-            }
-        }
-    }
-    
-got_resolv:
-
-    if (msg->dnscb) {
-        msg->cbexec = 1;
-        (*msg->dnscb)(msg->cbobj, msg->cbobjid, msg->name, msg->nlen, cache, msg->rcode);
-    }
+    msg->tcpdev = NULL;
+    msg->rcode = DNS_ERR_NO_RESPONSE;
+    PushDnsCloseEvent(iodev_epump(pdev), msg);
  
-    dns_msg_close(msg);
+    iodev_close(pdev);
     return 0;
 }
  
@@ -2019,6 +4104,178 @@ int dns_msg_lifecheck (void * vmsg)
 }
 
 
+/*******************************************************
+ * DNS Shard - query state, sockets and msgid space
+ *******************************************************/
+
+int dns_shard_init (void * vmgmt, void * vshard, int index, ulong threadid)
+{
+    DnsMgmt   * mgmt = (DnsMgmt *)vmgmt;
+    DnsShard  * shard = (DnsShard *)vshard;
+    sockopt_t   opt;
+#ifdef UNIX
+    FILE      * fp = NULL;
+    uint32      seed = 0;
+#endif
+    int         i, port = 0;
+
+    if (!mgmt) return -1;
+    if (!shard) return -2;
+
+    shard->index = index;
+    shard->dnsmgmt = mgmt;
+    shard->threadid = threadid;
+
+    InitializeCriticalSection(&shard->msgCS);
+    shard->msg_table = ht_only_new(64, dns_msg_cmp_msgid);
+    ht_set_hash_func(shard->msg_table, dns_msg_hash_msgid);
+
+    shard->randstate = (uint32)time(0) ^ (uint32)(ulong)shard ^
+                       ((uint32)(index + 1) * 2654435761U);
+#ifdef UNIX
+    fp = fopen("/dev/urandom", "rb");
+    if (fp) {
+        if (fread(&seed, 1, sizeof(seed), fp) == sizeof(seed))
+            shard->randstate ^= seed;
+        fclose(fp);
+    }
+#endif
+    if (shard->randstate == 0) shard->randstate = 0x9E3779B9;
+
+    /* source port is randomized against spoofed responses, SO_REUSEPORT is
+       turned off so that no other socket shares the same port */
+    memset(&opt, 0, sizeof(opt));
+    opt.mask |= SOM_REUSEADDR;
+    opt.reuseaddr = 0;
+    opt.mask |= SOM_REUSEPORT;
+    opt.reuseport = 0;
+
+    for (i = 0; i < DNS_SHARD_BIND_TRY; i++) {
+        port = 1024 + dns_shard_rand(shard) % (65536 - 1024);
+
+        shard->cli_dev_num = 4;
+        epudp_client(mgmt->pcore, NULL, port, &opt, shard, dns_pump, mgmt,
+                     shard->cli_dev, &shard->cli_dev_num, NULL);
+        if (shard->cli_dev_num > 0) break;
+    }
+
+    /* fall back to the ephemeral port assigned by system */
+    if (shard->cli_dev_num <= 0) {
+        shard->cli_dev_num = 4;
+        epudp_client(mgmt->pcore, NULL, 0, &opt, shard, dns_pump, mgmt,
+                     shard->cli_dev, &shard->cli_dev_num, NULL);
+    }
+
+    if (shard->cli_dev_num <= 0) return -100;
+
+    /* sockets of the shard owned by ePump thread are moved to that thread */
+    for (i = 0; threadid > 0 && i < shard->cli_dev_num; i++)
+        iodev_bind_epump(shard->cli_dev[i], BIND_GIVEN_EPUMP, threadid, 0);
+
+    return 0;
+}
+
+int dns_shard_select (void * vmgmt)
+{
+    DnsMgmt   * mgmt = (DnsMgmt *)vmgmt;
+    DnsShard  * shard = NULL;
+    ulong       tid = 0;
+    int         i, ind = 0;
+
+    if (!mgmt) return 0;
+
+    tid = get_threadid();
+
+    /* the shard picked last time is cached by thread, and verified since
+       DnsMgmt may be another instance at the same address */
+    if (tls_dnsmgmt == mgmt && tls_shardind < mgmt->shardnum) {
+        shard = &mgmt->shard[tls_shardind];
+        if (shard->threadid == tid || (shard->threadid == 0 && tls_shared))
+            return tls_shardind;
+    }
+
+    ind = (int)((((tid >> 12) * 2654435761UL) >> 16) % DNS_SHARD_NUM);
+
+    if (epump_thread_find(mgmt->pcore, tid)) {
+        EnterCriticalSection(&mgmt->shardCS);
+        for (i = DNS_SHARD_NUM; i < mgmt->shardnum; i++) {
+            if (mgmt->shard[i].threadid == tid) break;
+        }
+
+        if (i < mgmt->shardnum) {
+            ind = i;
+
+        } else if (mgmt->shardnum < DNS_SHARD_MAX) {
+            shard = &mgmt->shard[mgmt->shardnum];
+            if (dns_shard_init(mgmt, shard, mgmt->shardnum, tid) >= 0) {
+                ind = mgmt->shardnum;
+                /* readers index shards below shardnum, it is increased
+                   after the shard is completely initialized */
+                mgmt->shardnum++;
+            } else {
+                dns_shard_clean(shard);
+                memset(shard, 0, sizeof(*shard));
+            }
+        }
+        LeaveCriticalSection(&mgmt->shardCS);
+    }
+
+    tls_dnsmgmt = mgmt;
+    tls_shardind = ind;
+    tls_shared = mgmt->shard[ind].threadid == 0 ? 1 : 0;
+
+    return ind;
+}
+
+void dns_shard_clean (void * vshard)
+{
+    DnsShard  * shard = (DnsShard *)vshard;
+    int         i;
+
+    if (!shard) return;
+
+    for (i = 0; i < shard->cli_dev_num; i++)
+        iodev_close(shard->cli_dev[i]);
+    shard->cli_dev_num = 0;
+
+    DeleteCriticalSection(&shard->msgCS);
+    ht_free_all(shard->msg_table, dns_mgmt_msg_free);
+    shard->msg_table = NULL;
+}
+
+void * dns_shard_dev (void * vshard, int family)
+{
+    DnsShard  * shard = (DnsShard *)vshard;
+    int         i;
+
+    if (!shard) return NULL;
+
+    for (i = 0; i < shard->cli_dev_num; i++) {
+        if (shard->cli_dev[i] && shard->cli_dev[i]->family == family)
+            return shard->cli_dev[i];
+    }
+
+    return NULL;
+}
+
+/* xorshift32, called in msgCS of shard or during initialization */
+uint16 dns_shard_rand (void * vshard)
+{
+    DnsShard  * shard = (DnsShard *)vshard;
+    uint32      x = 0;
+
+    if (!shard) return 0;
+
+    x = shard->randstate;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    shard->randstate = x;
+
+    return (uint16)(x >> 8);
+}
+
+
 /*******************************************************
  * DNS Mgmt - entry structure for DNS resolving management
  *******************************************************/
@@ -2026,19 +4283,22 @@ int dns_msg_lifecheck (void * vmsg)
 void * dns_mgmt_init (void * pcore, char * nsip, char * resolv_file)
 {
     DnsMgmt * mgmt = NULL;
+    int       i;
  
     mgmt = kzalloc(sizeof(*mgmt));
     if (!mgmt) return NULL;
  
     mgmt->resolv_conf = resolv_file;
  
+    for (i = 0; i < DNS_CACHE_SHARD_NUM; i++) {
+        InitializeCriticalSection(&mgmt->cache_shard[i].tableCS);
+        mgmt->cache_shard[i].cache_table = ht_new(256, dns_cache_cmp_name);
+    }
     InitializeCriticalSection(&mgmt->cacheCS);
-    mgmt->cache_table = ht_new(2000, dns_cache_cmp_name);
+    mgmt->sweepind = 0;
  
     InitializeCriticalSection(&mgmt->msgCS);
-    mgmt->msgid = 1;
-    mgmt->msg_table = ht_only_new(200, dns_msg_cmp_msgid);
-    ht_set_hash_func(mgmt->msg_table, dns_msg_hash_msgid);
+    mgmt->pend_table = ht_new(200, dns_msg_cmp_pendkey);
  
     if (!mgmt->cache_pool) {
         mgmt->cache_pool = mpool_alloc();
@@ -2061,11 +4321,38 @@ void * dns_mgmt_init (void * pcore, char * nsip, char * resolv_file)
 
     mgmt->pcore = pcore;
  
+    mgmt->prefetch_ratio = DNS_PREFETCH_RATIO;
+    mgmt->prefetch_hits = DNS_PREFETCH_HITS;
+    mgmt->prefetch_num = 0;
+
+    mgmt->dualstack = 0;
+
+    mgmt->stale_max = DNS_STALE_MAX;
+    mgmt->stale_num = 0;
+    mgmt->negative_num = 0;
+
+    mgmt->edns_size = DNS_EDNS_SIZE;
+    mgmt->tcp_num = 0;
+ 
+    mgmt->hedge = 0;
+    mgmt->hedge_num = 0;
+
+    InitializeCriticalSection(&mgmt->hostsCS);
+    mgmt->hosts_table = ht_new(64, dns_cache_cmp_name);
+    mgmt->hosts_old = arr_new(4);
+    mgmt->static_table = ht_new(64, dns_cache_cmp_name);
+    strcpy(mgmt->hosts_file, DNS_HOSTS_FILE);
+    mgmt->hosts_hit = 0;
+    dns_hosts_load(mgmt, NULL);
+
     mgmt->nsrv = dns_nsrv_alloc(mgmt->fragmem_alloctype, mgmt->fragmem_kempool);
+    mgmt->nsrv_old = dns_nsrv_alloc(mgmt->fragmem_alloctype, mgmt->fragmem_kempool);
     dns_nsrv_load(mgmt, nsip, resolv_file);
 
-    mgmt->cli_dev_num = 4;
-    epudp_client(pcore, NULL, 0, NULL, mgmt, dns_pump, mgmt, mgmt->cli_dev, &mgmt->cli_dev_num, NULL);
+    InitializeCriticalSection(&mgmt->shardCS);
+    for (i = 0; i < DNS_SHARD_NUM; i++)
+        dns_shard_init(mgmt, &mgmt->shard[i], i, 0);
+    mgmt->shardnum = DNS_SHARD_NUM;
  
     return mgmt;
 }
@@ -2082,16 +4369,37 @@ void dns_mgmt_clean (void * vmgmt)
         mgmt->cachetimer = NULL;
     }
  
-    for (i = 0; i < mgmt->cli_dev_num; i++)
-        iodev_close(mgmt->cli_dev[i]);
+    /* periodic snapshot in writing refers to mgmt, wait for it a moment */
+    for (i = 0; mgmt->snapshot_writing && i < 100; i++)
+        SLEEP(10);
+
+    /* snapshot on shutdown for the warm start of next run */
+    if (strlen(mgmt->snapshot_file) > 0)
+        dns_cache_snapshot_save(mgmt, NULL);
+ 
+    for (i = 0; i < mgmt->shardnum; i++)
+        dns_shard_clean(&mgmt->shard[i]);
+    mgmt->shardnum = 0;
+    DeleteCriticalSection(&mgmt->shardCS);
  
     dns_nsrv_free(mgmt->nsrv);
+    dns_nsrv_free(mgmt->nsrv_old);
  
-    ht_free_all(mgmt->cache_table, dns_cache_recycle);
+    for (i = 0; i < DNS_CACHE_SHARD_NUM; i++) {
+        ht_free_all(mgmt->cache_shard[i].cache_table, dns_cache_recycle);
+        DeleteCriticalSection(&mgmt->cache_shard[i].tableCS);
+    }
     DeleteCriticalSection(&mgmt->cacheCS);
  
+    ht_free_all(mgmt->hosts_table, dns_cache_recycle);
+    while (arr_num(mgmt->hosts_old) > 0)
+        ht_free_all(arr_pop(mgmt->hosts_old), dns_cache_recycle);
+    arr_free(mgmt->hosts_old);
+    ht_free_all(mgmt->static_table, dns_cache_recycle);
+    DeleteCriticalSection(&mgmt->hostsCS);
+ 
     DeleteCriticalSection(&mgmt->msgCS);
-    ht_free_all(mgmt->msg_table, dns_mgmt_msg_free);
+    ht_free(mgmt->pend_table);
  
     if (mgmt->msg_pool) {
         mpool_free(mgmt->msg_pool);
@@ -2111,13 +4419,16 @@ void dns_mgmt_clean (void * vmgmt)
     kfree(mgmt);
 }
  
-int dns_nb_query (void * vmgmt, char * name, int len, void * nsrv, void ** pcache, DnsCB * cb, void * cbobj, ulong objid)
+static int dns_nb_query_do (void * vmgmt, char * name, int len, void * nsrv, void ** pcache,
+                            DnsCB * cb, void * cbobj, ulong objid, int early)
 {
     DnsMgmt       * mgmt = (DnsMgmt *)vmgmt;
     DnsCache      * cache = NULL;
     DnsMsg        * msg = NULL;
     int             ret;
+    int             rcode = 0;
     ep_sockaddr_t   addr;
+    char            key[DNS_NAME_LEN + 32];
  
     if (!mgmt) return -1;
  
@@ -2135,14 +4446,46 @@ int dns_nb_query (void * vmgmt, char * name, int len, void * nsrv, void ** pcach
         }
     }
 
+    epstat_inc(&mgmt->query_num);
+
+    /* names of static entries or hosts file are answered without Name Server */
+    cache = dns_hosts_get(mgmt, name, len);
+    if (cache) {
+        if (pcache) *pcache = cache;
+        if (cb) (*cb)(cbobj, objid, name, len, cache, DNS_ERR_NO_ERROR);
+        return 5;
+    }
+
     /* find the im-memory cache for the Name */
     cache = dns_cache_open(mgmt, name, len);
     if (cache && (ret = dns_cache_verify(cache)) > 0) {
+        dns_cache_hit(cache);
+        epstat_inc(&mgmt->cache_hit);
         if (pcache) *pcache = cache;
         if (cb) (*cb)(cbobj, objid, name, len, cache, DNS_ERR_NO_ERROR);
         return 3;
     }
  
+    /* rfc8767 serve-stale: answer with the expired RR immediately and refresh
+       it in background. dns_cache_prefetch sends no refreshing while the
+       qtypes being refreshed are negatively cached */
+    if (cache && mgmt->stale_max > 0 && cache->stalenum > 0) {
+        dns_cache_hit(cache);
+        epstat_inc(&mgmt->stale_num);
+ 
+        dns_cache_prefetch(cache);
+ 
+        if (pcache) *pcache = cache;
+        if (cb) (*cb)(cbobj, objid, name, len, cache, DNS_ERR_NO_ERROR);
+        return 4;
+    }
+ 
+    if (cache && dns_cache_negative_name(cache, &rcode) > 0) {
+        if (pcache) *pcache = cache;
+        if (cb) (*cb)(cbobj, objid, name, len, cache, rcode);
+        return -21;
+    }
+ 
     if (!cache || (cache->trymsg > 16 && cache->failmsg * 100 / cache->trymsg >= 95)) {
         /* if the success ratio of connecting to DNS Server is lower than 5% */
         if (pcache) *pcache = cache;
@@ -2150,14 +4493,24 @@ int dns_nb_query (void * vmgmt, char * name, int len, void * nsrv, void ** pcach
         return -20;
     }
 
-    msg = dns_msg_open(mgmt, name, len, cb, cbobj, objid);
-    if (!msg) {
-        return -100;
+    /* an identical query is already in flight, wait for its result instead
+       of sending another request to the Name Server. query with designated
+       NameServer is never merged */
+    if (!nsrv) {
+        dns_msg_pendkey(name, len, RR_TYPE_A, get_threadid(), key, sizeof(key));
+ 
+        EnterCriticalSection(&mgmt->msgCS);
+        msg = ht_get(mgmt->pend_table, key);
+        if (msg && !msg->cbexec && !msg->lateonly &&
+            dns_msg_waiter_add(msg, cb, cbobj, objid, early) >= 0) {
+            LeaveCriticalSection(&mgmt->msgCS);
+            if (pcache) *pcache = cache;
+            return 0;
+        }
+        LeaveCriticalSection(&mgmt->msgCS);
     }
  
-    msg->cache = cache;
-
-    ret = dns_msg_send(msg, name, len, nsrv);
+    ret = dns_msg_query(mgmt, name, len, nsrv, cache, cb, cbobj, objid, early);
     if (ret < 0) {
         dns_cache_trymsg_fail(cache);
     }
@@ -2165,13 +4518,122 @@ int dns_nb_query (void * vmgmt, char * name, int len, void * nsrv, void ** pcach
     return ret;
 }
  
+int dns_nb_query (void * vmgmt, char * name, int len, void * nsrv, void ** pcache, DnsCB * cb, void * cbobj, ulong objid)
+{
+    return dns_nb_query_do(vmgmt, name, len, nsrv, pcache, cb, cbobj, objid, 0);
+}
+
+int dns_nb_query_early (void * vmgmt, char * name, int len, void * nsrv, void ** pcache, DnsCB * cb, void * cbobj, ulong objid)
+{
+    return dns_nb_query_do(vmgmt, name, len, nsrv, pcache, cb, cbobj, objid, 1);
+}
+ 
+ 
+int dns_prefetch_set (void * vmgmt, int ratio, int minhits)
+{
+    DnsMgmt * mgmt = (DnsMgmt *)vmgmt;
+
+    if (!mgmt) return -1;
+
+    if (ratio < 0) ratio = 0;
+    if (ratio > 100) ratio = 100;
+    if (minhits < 1) minhits = 1;
+
+    mgmt->prefetch_ratio = ratio;
+    mgmt->prefetch_hits = minhits;
+
+    return 0;
+}
+ 
+int dns_stale_set (void * vmgmt, int stalemax)
+{
+    DnsMgmt * mgmt = (DnsMgmt *)vmgmt;
+
+    if (!mgmt) return -1;
+
+    if (stalemax < 0) stalemax = 0;
+
+    mgmt->stale_max = stalemax;
+
+    return 0;
+}
+ 
+int dns_edns_set (void * vmgmt, int size)
+{
+    DnsMgmt * mgmt = (DnsMgmt *)vmgmt;
+
+    if (!mgmt) return -1;
+
+    /* rfc6891, payload size less than 512 is treated as 512 */
+    if (size > 0 && size < 512) size = 512;
+    /* the larger response can not be received by dns_recv buffer */
+    if (size > DNS_UDP_BUFSIZE) size = DNS_UDP_BUFSIZE;
+    if (size < 0) size = 0;
+
+    mgmt->edns_size = size;
+
+    return 0;
+}
+ 
+int dns_hedge_set (void * vmgmt, int onoff)
+{
+    DnsMgmt * mgmt = (DnsMgmt *)vmgmt;
+
+    if (!mgmt) return -1;
+
+    mgmt->hedge = onoff ? 1 : 0;
+
+    return 0;
+}
+ 
+int dns_dualstack_get (void * vmgmt)
+{
+    DnsMgmt * mgmt = (DnsMgmt *)vmgmt;
+
+    if (!mgmt) return 0;
+
+    return mgmt->dualstack;
+}
+ 
+int dns_dualstack_set (void * vmgmt, int onoff)
+{
+    DnsMgmt * mgmt = (DnsMgmt *)vmgmt;
+
+    if (!mgmt) return -1;
+
+    mgmt->dualstack = onoff ? 1 : 0;
+
+    return 0;
+}
  
+int dns_addr_match (ep_sockaddr_t * a, ep_sockaddr_t * b)
+{
+    if (!a || !b) return 0;
+
+    if (a->family != b->family) return 0;
+
+    if (a->family == AF_INET) {
+        return a->u.addr4.sin_port == b->u.addr4.sin_port &&
+               a->u.addr4.sin_addr.s_addr == b->u.addr4.sin_addr.s_addr;
+    } else if (a->family == AF_INET6) {
+        return a->u.addr6.sin6_port == b->u.addr6.sin6_port &&
+               memcmp(&a->u.addr6.sin6_addr, &b->u.addr6.sin6_addr,
+                      sizeof(a->u.addr6.sin6_addr)) == 0;
+    }
+
+    return 0;
+}
+
 int dns_recv (void * vmgmt, void * pobj)
 {
     DnsMgmt       * mgmt = (DnsMgmt *)vmgmt;
     iodev_t       * pdev = (iodev_t *)pobj;
+    DnsShard      * shard = NULL;
+    DnsHost       * host = NULL;
+    btime_t       * sendtime = NULL;
+    btime_t         curt;
     ep_sockaddr_t   sock;
-    uint8           buf[32768];
+    uint8           buf[DNS_UDP_BUFSIZE];
     int             rcvlen = 0;
     int             ret = 0;
     uint16          msgid = 0;
@@ -2179,16 +4641,69 @@ int dns_recv (void * vmgmt, void * pobj)
  
     if (!mgmt) return -1;
  
+    shard = (DnsShard *)iodev_para(pdev);
+    if (!shard || shard->dnsmgmt != mgmt) return -2;
+
     while (1) {
         ret = epudp_recvfrom(pdev, NULL, buf, sizeof(buf), &sock, &rcvlen);
         if (ret <= 0) return 0;
+        if (rcvlen < sizeof(DnsHeader)) continue;
 
         memcpy(&msgid, buf, 2);
         msgid = ntohs(msgid);
  
-        msg = dns_msg_mgmt_get(mgmt, msgid);
+        msg = dns_msg_mgmt_get(mgmt, ((ulong)shard->index << 16) | msgid);
         if (!msg) continue;
  
+        /* response must come back to the socket the request was sent by,
+           and from the Name Server it was sent to, with the same question.
+           hedgehost is set by dns_msg_hedge under msgCS */
+        EnterCriticalSection(&shard->msgCS);
+        if (msg->clidev == pdev && dns_addr_match(&sock, msg->destaddr)) {
+            host = msg->desthost;
+            sendtime = &msg->sendtime;
+        } else if (msg->hedgehost && msg->hedgedev == pdev &&
+                   dns_addr_match(&sock, &msg->hedgehost->addr)) {
+            host = msg->hedgehost;
+            sendtime = &msg->hedgetime;
+        } else {
+            LeaveCriticalSection(&shard->msgCS);
+            tolog(1, "Warning: DnsMsg response mismatched, msgid=%u name=%s\n", msgid, msg->name);
+            continue;
+        }
+ 
+        /* the response with other question does not consume the query */
+        if (dns_msg_verify(msg, buf, rcvlen) < 0) {
+            LeaveCriticalSection(&shard->msgCS);
+            tolog(1, "Warning: DnsMsg response question mismatched, msgid=%u name=%s\n", msgid, msg->name);
+            continue;
+        }
+ 
+        /* the response of hedged send or retrying over TCP is in progress,
+           the duplicate UDP responses are dropped. the responses from both
+           Name Servers may arrive together on different threads, only one
+           of them takes the DnsMsg by test-and-set under msgCS of the shard,
+           and the hedged send not fired yet is canceled meanwhile */
+        if (msg->answered || msg->tcpdev) {
+            LeaveCriticalSection(&shard->msgCS);
+            continue;
+        }
+        msg->answered = 1;
+ 
+        if (msg->hedgetimer) {
+            iotimer_stop(mgmt->pcore, msg->hedgetimer);
+            msg->hedgetimer = NULL;
+        }
+        LeaveCriticalSection(&shard->msgCS);
+ 
+        btime(&curt);
+        dns_host_rtt(host, btime_diff_ms(sendtime, &curt));
+ 
+        /* TCP retry goes to the Name Server that answered first */
+        msg->desthost = host;
+        msg->destaddr = &host->addr;
+        msg->clidev = pdev;
+ 
         if ((ret = dns_msg_decode(msg, buf, rcvlen)) < 0) {
             dns_cache_trymsg_fail(msg->cache);
 
@@ -2199,6 +4714,14 @@ int dns_recv (void * vmgmt, void * pobj)
             continue;
         }
  
+        if (msg->truncated) {
+            if (dns_msg_tcp_query(msg) < 0) {
+                msg->rcode = DNS_ERR_NO_RESPONSE;
+                PushDnsCloseEvent(iodev_epump(pdev), msg);
+            }
+            continue;
+        }
+ 
         PushDnsRecvEvent(iodev_epump(pdev), msg);
     }
  
@@ -2254,10 +4777,12 @@ void print_dnspump_arg (void * vobj, int event, int fdtype)
 
 int dns_pump (void * vmgmt, void * pobj, int event, int fdtype)
 {
-    DnsMgmt * mgmt = (DnsMgmt *)vmgmt;
-    DnsMsg  * msg = NULL;
-    uint16    msgid = 0;
-    int       cmd = 0;
+    DnsMgmt  * mgmt = (DnsMgmt *)vmgmt;
+    DnsMsg   * msg = NULL;
+    DnsShard * shard = NULL;
+    ulong      uid = 0;
+    int        cmd = 0;
+    int        hedge = 0;
  
     if (!mgmt) return -1;
  
@@ -2267,30 +4792,72 @@ int dns_pump (void * vmgmt, void * pobj, int event, int fdtype)
     if (event == IOE_READ && fdtype == FDT_UDPCLI) {
         return dns_recv(mgmt, pobj);
  
+    } else if (event == IOE_CONNECTED && fdtype == FDT_CONNECTED) {
+        msg = dns_msg_mgmt_get(mgmt, (ulong)iodev_para(pobj));
+        if (!msg || msg->tcpdev != pobj) return -2;
+ 
+        if (dns_msg_tcp_send(msg) < 0)
+            return dns_msg_tcp_fail(mgmt, pobj);
+ 
+    } else if (event == IOE_READ && fdtype == FDT_CONNECTED) {
+        return dns_msg_tcp_recv(mgmt, pobj);
+ 
+    } else if (event == IOE_CONNFAIL || event == IOE_INVALID_DEV) {
+        if (fdtype == FDT_CONNECTED)
+            return dns_msg_tcp_fail(mgmt, pobj);
+ 
     } else if (event == IOE_TIMEOUT) {
         cmd = iotimer_cmdid(pobj);
  
         if (cmd == t_dns_msg_life) {
-            msgid = (uint16)(ulong)iotimer_para(pobj);
-            msg = dns_msg_mgmt_get(mgmt, msgid);
+            uid = (ulong)iotimer_para(pobj);
+            msg = dns_msg_mgmt_get(mgmt, uid);
             if (msg && (ulong)msg->lifetimer == iotimer_id(pobj)) {
                 msg->lifetimer = NULL;
+ 
+                /* no response from the Name Servers, back off them */
+                if (!msg->answered) {
+                    dns_host_fail(msg->desthost);
+                    dns_host_fail(msg->hedgehost);
+                }
+ 
                 msg->rcode = DNS_ERR_NO_RESPONSE;
                 PushDnsCloseEvent(iotimer_epump(pobj), msg);
             } else
-                tolog(1, "Panic: DnsMsgLife timer invalid, msgid=%u msg %s lifetimer=%lu timerid=%lu\n",
-                      msgid, msg?"exist":"NULL", msg?(ulong)msg->lifetimer:0, iotimer_id(pobj));
+                tolog(1, "Panic: DnsMsgLife timer invalid, uid=%lu msg %s lifetimer=%lu timerid=%lu\n",
+                      uid, msg?"exist":"NULL", msg?(ulong)msg->lifetimer:0, iotimer_id(pobj));
+ 
+        } else if (cmd == t_dns_msg_hedge) {
+            msg = dns_msg_mgmt_get(mgmt, (ulong)iotimer_para(pobj));
+            if (!msg) return 0;
+
+            /* the timer is taken under msgCS, no hedged send goes out once
+               the DnsMsg is answered */
+            shard = &mgmt->shard[msg->shardind];
+
+            EnterCriticalSection(&shard->msgCS);
+            if ((ulong)msg->hedgetimer == iotimer_id(pobj) && !msg->answered) {
+                msg->hedgetimer = NULL;
+                hedge = 1;
+            }
+            LeaveCriticalSection(&shard->msgCS);
+
+            if (hedge) dns_msg_hedge(msg);
  
         } else if (cmd == t_dns_cache_life) {
             if ((ulong)mgmt->cachetimer == iotimer_id(pobj)) {
-                mgmt->cachetimer = NULL;
- 
                 dns_cache_lifecheck(mgmt);
+                dns_cache_snapshot_check(mgmt, iotimer_epump(pobj));
+                dns_hosts_check(mgmt);
  
-                if (ht_num(mgmt->cache_table) > 0)
-                    mgmt->cachetimer = iotimer_start(mgmt->pcore, 30*1000,
+                EnterCriticalSection(&mgmt->cacheCS);
+                mgmt->cachetimer = NULL;
+                if (dns_cache_mgmt_num(mgmt) > 0 || mgmt->hosts_mtime > 0)
+                    mgmt->cachetimer = iotimer_start(mgmt->pcore,
+                                          DNS_CACHE_CHECK_INTERVAL*1000/DNS_CACHE_SHARD_NUM,
                                           t_dns_cache_life, NULL,
                                           dns_pump, mgmt, iotimer_epumpid(pobj));
+                LeaveCriticalSection(&mgmt->cacheCS);
             }
         }
     }
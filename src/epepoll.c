@@ -43,6 +43,9 @@
 #include "iotimer.h"
 #include "ioevent.h"
 #include "epwakeup.h"
+#include "epstat.h"
+#include "eptrace.h"
+#include "epprobe.h"
 
 #include <sys/time.h>
 #include <sys/resource.h>
@@ -125,11 +128,32 @@ int epump_epoll_setpoll (void * vepump, void * vpdev)
         curev |= EPOLLOUT;
     }
  
+#ifdef EPOLLEXCLUSIVE
+    /* the listen fd registered in all epoll sets of epump threads wakes up
+       only one of them for a new connection. EPOLLEXCLUSIVE is only allowed
+       with EPOLL_CTL_ADD, the existing registration cannot be modified */
+    if (pdev->bindtype == BIND_ALL_EPUMP && pdev->pollexcl &&
+        (pdev->fdtype == FDT_LISTEN || pdev->fdtype == FDT_USOCK_LISTEN) &&
+        ev.events != 0 && !(pdev->rwflag & RWF_WRITE))
+    {
+        ev.events |= EPOLLEXCLUSIVE;
+
+        EPTRACE(epump->epcore, EPT_POLL_CTL, EPOLL_CTL_ADD, pdev->fd, pdev->id, ev.events);
+        ret = epoll_ctl(epump->epoll_fd, EPOLL_CTL_ADD, pdev->fd, &ev);
+        if (ret >= 0 || errno == EEXIST)
+            return 0;
+
+        /* EINVAL returned by the kernel earlier than 4.5 */
+        ev.events &= ~EPOLLEXCLUSIVE;
+    }
+#endif
+
     if (ev.events != 0)
         op = EPOLL_CTL_MOD;
     else 
         op = EPOLL_CTL_DEL;
 
+    EPTRACE(epump->epcore, EPT_POLL_CTL, op, pdev->fd, pdev->id, ev.events);
     ret = epoll_ctl(epump->epoll_fd, op, pdev->fd, &ev);
     if (ret >= 0) {
         return 0;
@@ -171,6 +195,7 @@ int epump_epoll_clearpoll (void * vepump, void * vpdev)
 
     memset(&ev, 0, sizeof(ev));
 
+    EPTRACE(epump->epcore, EPT_POLL_CTL, EPOLL_CTL_DEL, pdev->fd, pdev->id, 0);
     ret = epoll_ctl(epump->epoll_fd, EPOLL_CTL_DEL, pdev->fd, &ev);
 
     return ret;
@@ -188,6 +213,7 @@ int epump_epoll_dispatch (void * veps, btime_t * delay)
     int        ret = 0;
     int        sockerr = 0;
     ep_sockaddr_t sock;
+    uint64     tick = 0;
 
     if (!epump) return -1;
 
@@ -202,7 +228,12 @@ int epump_epoll_dispatch (void * veps, btime_t * delay)
     }
 
     /* nfds is sum of ready read fd's and write fd's */
+    EPTRACE(pcore, EPT_POLL_BEGIN, 0, -1, 0, waitms);
+    tick = epnanotime();
     nfds = epoll_wait(epump->epoll_fd, epump->epoll_events, epump->epoll_size, waitms);
+    epump->pollns = epnanotime() - tick;
+    EPTRACE(pcore, EPT_POLL_END, 0, -1, 0, nfds);
+    EPPROBE2(epoll_dispatch, epump->threadid, nfds);
     if (nfds < 0) {
         if (errno != EINTR) return -1;
         return 0;
@@ -215,16 +246,47 @@ int epump_epoll_dispatch (void * veps, btime_t * delay)
         pdev = epump->epoll_events[i].data.ptr;
         if (!pdev) continue;
  
+        if ((whatup & EPOLLERR) && pdev->zerocopy) {
+            /* for MSG_ZEROCOPY-enabled device, EPOLLERR reports the completion
+               notifications queued on socket error queue. a real socket error
+               may arrive in the same edge and would not be reported again by
+               EPOLLET, SO_ERROR is checked before treating it as completion */
+            len = sizeof(int);
+            sockerr = 0;
+            ret = getsockopt(pdev->fd, SOL_SOCKET, SO_ERROR,
+                             (char *)&sockerr, (socklen_t *)&len);
+            if (ret < 0 || sockerr != 0) {
+                if (iodev_zerocopy_recv(pdev) > 0)
+                    PushZeroCopyEvent(epump, pdev);
+
+                PushInvalidDevEvent(epump, pdev);
+                continue;
+            }
+
+            /* when the notifications are drained, the device is not broken,
+               go on handling the readable/writable */
+            if (iodev_zerocopy_recv(pdev) > 0 && !(whatup & EPOLLHUP)) {
+                PushZeroCopyEvent(epump, pdev);
+
+                whatup &= ~EPOLLERR;
+                if (!(whatup & (EPOLLIN | EPOLLOUT))) continue;
+            }
+        }
+
         if (whatup & EPOLLIN) {
             if (pdev->fdtype == FDT_LISTEN || pdev->fdtype == FDT_USOCK_LISTEN) {
                 PushConnAcceptEvent(epump, pdev);
 
 #ifdef HAVE_EVENTFD
             } else if (pdev == epump->wakeupdev || pdev->fd == epump->wakeupfd) {
+                epump->wakeup_recv++;
+                EPTRACE(pcore, EPT_WAKEUP_RECV, 0, -1, 0, 0);
                 epump_wakeup_recv(epump);
 #endif
 
             } else if (pdev == pcore->wakeupdev || pdev->fd == pcore->wakeupfd) {
+                epump->wakeup_recv++;
+                EPTRACE(pcore, EPT_WAKEUP_RECV, 0, -1, 0, 0);
                 epcore_wakeup_recv(pcore);
 
             } else {
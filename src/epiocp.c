@@ -49,6 +49,8 @@
 #include "iotimer.h"
 #include "ioevent.h"
 #include "epwakeup.h"
+#include "epstat.h"
+#include "eptrace.h"
 
 #include <mswsock.h>
 
@@ -734,6 +736,7 @@ int epump_iocp_dispatch (void * veps, btime_t * delay)
     struct sockaddr * raddr = NULL;
     int               lalen = 0;
     int               ralen = 0;
+    uint64            tick = 0;
 
     if (!epump) return -1;
 
@@ -747,7 +750,11 @@ int epump_iocp_dispatch (void * veps, btime_t * delay)
         if (waitms > MAX_EPOLL_TIMEOUT_MSEC) waitms = MAX_EPOLL_TIMEOUT_MSEC;
     }
 
+    EPTRACE(pcore, EPT_POLL_BEGIN, 0, -1, 0, waitms);
+    tick = epnanotime();
     result = GetQueuedCompletionStatus(pcore->iocp_port, &bytes, &key, &ovlap, waitms);
+    epump->pollns = epnanotime() - tick;
+    EPTRACE(pcore, EPT_POLL_END, 0, -1, 0, result);
     if (!result) {
         err = WSAGetLastError();
         if (err == WAIT_TIMEOUT) {
@@ -755,8 +762,12 @@ int epump_iocp_dispatch (void * veps, btime_t * delay)
         }
     }
 
-    if (key == (ULONG_PTR)-1)  //PostQueuedCompletionStatus wakeup current thread
+    /* PostQueuedCompletionStatus wakeup current thread */
+    if (key == (ULONG_PTR)-1) {
+        epump->wakeup_recv++;
+        EPTRACE(pcore, EPT_WAKEUP_RECV, 0, -1, 0, 0);
         return 0;
+    }
 
     if (!ovlap) return -1;
 
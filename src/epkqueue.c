@@ -43,6 +43,8 @@
 #include "iotimer.h"
 #include "ioevent.h"
 #include "epwakeup.h"
+#include "epstat.h"
+#include "eptrace.h"
 
 #include <sys/resource.h>
 
@@ -156,6 +158,7 @@ int epump_kqueue_dispatch (void * veps, btime_t * delay)
     int        addrlen;
     struct timespec * waitout, timeout;
     struct sockaddr  sock;
+    uint64     tick = 0;
 
     if (!epump) return -1;
 
@@ -170,7 +173,11 @@ int epump_kqueue_dispatch (void * veps, btime_t * delay)
         waitout = &timeout;
     }
 
+    EPTRACE(pcore, EPT_POLL_BEGIN, 0, -1, 0, 0);
+    tick = epnanotime();
     nfds = kevent(epump->kqueue_fd, NULL, 0, epump->kqueue_events, epump->kqueue_size, waitout);
+    epump->pollns = epnanotime() - tick;
+    EPTRACE(pcore, EPT_POLL_END, 0, -1, 0, nfds);
     if (nfds < 0) {
         if (errno != EINTR) return -1;
         return 0;
@@ -196,9 +203,13 @@ int epump_kqueue_dispatch (void * veps, btime_t * delay)
 
 #ifdef HAVE_EVENTFD
             } else if (pdev == epump->wakeupdev || pdev->fd == epump->wakeupfd) {
+                epump->wakeup_recv++;
+                EPTRACE(pcore, EPT_WAKEUP_RECV, 0, -1, 0, 0);
                 epump_wakeup_recv(epump);
 #endif
             } else if (pdev == pcore->wakeupdev || pdev->fd == pcore->wakeupfd) {
+                epump->wakeup_recv++;
+                EPTRACE(pcore, EPT_WAKEUP_RECV, 0, -1, 0, 0);
                 epcore_wakeup_recv(pcore);
 
             } else {
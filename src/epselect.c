@@ -40,6 +40,8 @@
 #include "iotimer.h"
 #include "ioevent.h"
 #include "epwakeup.h"
+#include "epstat.h"
+#include "eptrace.h"
 
 #ifdef UNIX
 #include <sys/select.h>
@@ -150,6 +152,7 @@ int epump_select_dispatch (void * veps, btime_t * delay)
     rbtnode_t * rbt = NULL;
     struct timeval * waitout, timeout;
     ep_sockaddr_t    sock;
+    uint64           tick = 0;
 
     if (!epump) return -1;
 
@@ -172,6 +175,8 @@ int epump_select_dispatch (void * veps, btime_t * delay)
     if (maxfd <= 0) maxfd = 1024;
 
     /* nfds is sum of ready read fd's and write fd's */
+    EPTRACE(pcore, EPT_POLL_BEGIN, 0, -1, 0, 0);
+    tick = epnanotime();
 #ifdef UNIX
     nfds = select (maxfd, &rFds, &wFds, NULL, waitout);
 #else
@@ -179,6 +184,8 @@ int epump_select_dispatch (void * veps, btime_t * delay)
     nfds = select (0, &rFds, &wFds, NULL, waitout);
 #endif
 #endif
+    epump->pollns = epnanotime() - tick;
+    EPTRACE(pcore, EPT_POLL_END, 0, -1, 0, nfds);
 
     if (nfds < 0) {
         if (errno != EINTR) return -1;
@@ -213,9 +220,13 @@ int epump_select_dispatch (void * veps, btime_t * delay)
 
 #ifdef HAVE_EVENTFD
             } else if (pdev == epump->wakeupdev || pdev->fd == epump->wakeupfd) {
+                epump->wakeup_recv++;
+                EPTRACE(pcore, EPT_WAKEUP_RECV, 0, -1, 0, 0);
                 epump_wakeup_recv(epump);
 #endif
             } else if (pdev == pcore->wakeupdev || pdev->fd == pcore->wakeupfd) {
+                epump->wakeup_recv++;
+                EPTRACE(pcore, EPT_WAKEUP_RECV, 0, -1, 0, 0);
                 epcore_wakeup_recv(pcore);
 
             } else {
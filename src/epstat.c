@@ -0,0 +1,902 @@
+/*
+ * Copyright (c) 2003-2024 Ke Hengzhong <kehengzhong@hotmail.com>
+ * All rights reserved. See MIT LICENSE for redistribution.
+ *
+ * #####################################################
+ * #                       _oo0oo_                     #
+ * #                      o8888888o                    #
+ * #                      88" . "88                    #
+ * #                      (| -_- |)                    #
+ * #                      0\  =  /0                    #
+ * #                    ___/`---'\___                  #
+ * #                  .' \\|     |// '.                #
+ * #                 / \\|||  :  |||// \               #
+ * #                / _||||| -:- |||||- \              #
+ * #               |   | \\\  -  /// |   |             #
+ * #               | \_|  ''\---/''  |_/ |             #
+ * #               \  .-\__  '-'  ___/-. /             #
+ * #             ___'. .'  /--.--\  `. .'___           #
+ * #          ."" '<  `.___\_<|>_/___.'  >' "" .       #
+ * #         | | :  `- \`.;`\ _ /`;.`/ -`  : | |       #
+ * #         \  \ `_.   \_ __\ /__ _/   .-` /  /       #
+ * #     =====`-.____`.___ \_____/___.-`___.-'=====    #
+ * #                       `=---='                     #
+ * #     ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~   #
+ * #               佛力加持      佛光普照              #
+ * #  Buddha's power blessing, Buddha's light shining  #
+ * #####################################################
+ */
+
+#ifdef UNIX
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE     /* for the declaration of dladdr */
+#endif
+#endif
+
+#include "btype.h"
+#include "memory.h"
+#include "mthread.h"
+#include "dynarr.h"
+#include "frame.h"
+#include "trace.h"
+#include "strutil.h"
+
+#include "epcore.h"
+#include "epump_local.h"
+#include "worker.h"
+#include "ioevent.h"
+#include "iodev.h"
+#include "epdns.h"
+#include "epstat.h"
+
+#if defined(_WIN32) || defined(_WIN64)
+#include <windows.h>
+#endif
+
+#ifdef UNIX
+#include <time.h>
+#include <dlfcn.h>
+#endif
+
+#if defined(_WIN32) || defined(_WIN64)
+#define EP_TLS  __declspec(thread)
+#else
+#define EP_TLS  __thread
+#endif
+
+/* sequence of callbacks for slow-callback sampling, counted by each thread */
+static EP_TLS ulong tls_slowcb_seq = 0;
+
+
+uint64 epnanotime (void)
+{
+#if defined(_WIN32) || defined(_WIN64)
+    static LARGE_INTEGER freq = {0};
+    LARGE_INTEGER        cnt;
+
+    if (freq.QuadPart == 0)
+        QueryPerformanceFrequency(&freq);
+
+    QueryPerformanceCounter(&cnt);
+
+    return (uint64)(cnt.QuadPart / freq.QuadPart) * 1000000000ULL +
+           (uint64)(cnt.QuadPart % freq.QuadPart) * 1000000000ULL / freq.QuadPart;
+#else
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64)ts.tv_sec * 1000000000ULL + (uint64)ts.tv_nsec;
+#endif
+}
+
+
+static int ephist_index (uint64 val)
+{
+    int  msb = 0;
+    int  ind = 0;
+
+    if (val < (1 << EPS_HIST_SUBBITS)) return (int)val;
+
+#if defined(__GNUC__)
+    msb = 63 - __builtin_clzll(val);
+#else
+    {
+        uint64 v = val;
+        while (v >>= 1) msb++;
+    }
+#endif
+
+    ind = ((msb - EPS_HIST_SUBBITS + 1) << EPS_HIST_SUBBITS) +
+          (int)((val >> (msb - EPS_HIST_SUBBITS)) & ((1 << EPS_HIST_SUBBITS) - 1));
+    if (ind >= EPS_HIST_BUCKETS) ind = EPS_HIST_BUCKETS - 1;
+
+    return ind;
+}
+
+/* the highest value falling into bucket ind */
+static uint64 ephist_value (int ind)
+{
+    int     shift = 0;
+    uint64  sub = 0;
+
+    if (ind < (1 << EPS_HIST_SUBBITS)) return ind;
+
+    shift = (ind >> EPS_HIST_SUBBITS) - 1;
+    sub = (1 << EPS_HIST_SUBBITS) + (ind & ((1 << EPS_HIST_SUBBITS) - 1));
+
+    return ((sub + 1) << shift) - 1;
+}
+
+void ephist_add (ephist_t * hist, uint64 val)
+{
+    if (!hist) return;
+
+    hist->bucket[ephist_index(val)]++;
+    hist->count++;
+    hist->sum += val;
+    if (val > hist->max) hist->max = val;
+}
+
+void ephist_copy (ephist_t * dst, ephist_t * src)
+{
+    int  i;
+
+    if (!dst || !src) return;
+
+    dst->sum = src->sum;
+    dst->max = src->max;
+
+    /* the owner thread may be adding sample at the same time, count is
+       summed from the copied buckets to keep the percentiles consistent */
+    dst->count = 0;
+    for (i = 0; i < EPS_HIST_BUCKETS; i++) {
+        dst->bucket[i] = src->bucket[i];
+        dst->count += dst->bucket[i];
+    }
+}
+
+void ephist_merge (ephist_t * dst, ephist_t * src)
+{
+    int  i;
+
+    if (!dst || !src) return;
+
+    for (i = 0; i < EPS_HIST_BUCKETS; i++)
+        dst->bucket[i] += src->bucket[i];
+
+    dst->count += src->count;
+    dst->sum += src->sum;
+    if (src->max > dst->max) dst->max = src->max;
+}
+
+uint64 ephist_percentile (ephist_t * hist, double pct)
+{
+    uint64  rank = 0;
+    uint64  acc = 0;
+    uint64  val = 0;
+    int     i;
+
+    if (!hist || hist->count == 0) return 0;
+
+    if (pct < 0) pct = 0;
+    if (pct > 100) pct = 100;
+
+    rank = (uint64)(pct * (double)hist->count / 100.0 + 0.5);
+    if (rank < 1) rank = 1;
+
+    for (i = 0; i < EPS_HIST_BUCKETS; i++) {
+        acc += hist->bucket[i];
+        if (acc >= rank) break;
+    }
+    if (i >= EPS_HIST_BUCKETS) return hist->max;
+
+    val = ephist_value(i);
+    if (val > hist->max) val = hist->max;
+
+    return val;
+}
+
+uint64 ephist_count_le (ephist_t * hist, uint64 val)
+{
+    uint64  acc = 0;
+    int     i;
+
+    if (!hist) return 0;
+
+    /* the bucket straddling val is counted only if its highest value is in */
+    for (i = 0; i < EPS_HIST_BUCKETS; i++) {
+        if (ephist_value(i) > val) break;
+        acc += hist->bucket[i];
+    }
+
+    return acc;
+}
+
+uint64 ephist_mean (ephist_t * hist)
+{
+    if (!hist || hist->count == 0) return 0;
+
+    return hist->sum / hist->count;
+}
+
+
+void * eplat_alloc (int type)
+{
+    eplat_t * lat = NULL;
+
+    lat = kzalloc(sizeof(*lat));
+    if (!lat) return NULL;
+
+    lat->type = type;
+
+    return lat;
+}
+
+void eplat_free (void * vlat)
+{
+    eplat_t * lat = (eplat_t *)vlat;
+
+    if (!lat) return;
+
+    kfree(lat);
+}
+
+int eplat_ioe_index (int type)
+{
+    switch (type) {
+    case IOE_CONNECTED:   return 0;
+    case IOE_CONNFAIL:    return 1;
+    case IOE_ACCEPT:      return 2;
+    case IOE_READ:        return 3;
+    case IOE_WRITE:       return 4;
+    case IOE_INVALID_DEV: return 5;
+    case IOE_ZEROCOPY:    return 6;
+    case IOE_TIMEOUT:     return 7;
+    case IOE_DNS_RECV:    return 8;
+    case IOE_DNS_CLOSE:   return 9;
+    }
+
+    /* IOE_USER_DEFINED and the extern events */
+    return 10;
+}
+
+int eplat_fdt_index (int fdtype)
+{
+    int  i;
+
+    /* FDT_LISTEN ~ FDT_FILEDEV are bit 0 to bit 9 */
+    for (i = 0; i < 10; i++) {
+        if (fdtype & (1 << i)) return i;
+    }
+
+    if (fdtype & FDT_TIMER)        return 10;
+    if (fdtype & FDT_USERCMD)      return 11;
+    if (fdtype & FDT_LINGER_CLOSE) return 12;
+    if (fdtype & FDT_STDIN)        return 13;
+    if (fdtype & FDT_STDOUT)       return 14;
+
+    return 15;
+}
+
+void eplat_exec_add (void * vlat, int type, int fdtype, uint64 stamp, uint64 start, uint64 end)
+{
+    eplat_t * lat = (eplat_t *)vlat;
+    uint64    val = 0;
+
+    if (!lat) return;
+
+    /* the extern event polled by its ignitor has no enqueue time */
+    if (stamp > 0 && start >= stamp)
+        ephist_add(&lat->queue, start - stamp);
+
+    val = end >= start ? end - start : 0;
+
+    ephist_add(&lat->exec, val);
+    ephist_add(&lat->exec_ioe[eplat_ioe_index(type)], val);
+    ephist_add(&lat->exec_fdt[eplat_fdt_index(fdtype)], val);
+}
+
+void eplat_copy (eplat_t * dst, eplat_t * src)
+{
+    int  i;
+
+    if (!dst || !src) return;
+
+    dst->threadid = src->threadid;
+    dst->type = src->type;
+
+    ephist_copy(&dst->queue, &src->queue);
+    ephist_copy(&dst->exec, &src->exec);
+
+    for (i = 0; i < EPS_IOE_NUM; i++)
+        ephist_copy(&dst->exec_ioe[i], &src->exec_ioe[i]);
+
+    for (i = 0; i < EPS_FDT_NUM; i++)
+        ephist_copy(&dst->exec_fdt[i], &src->exec_fdt[i]);
+
+    ephist_copy(&dst->poll, &src->poll);
+    ephist_copy(&dst->loop, &src->loop);
+
+    for (i = 0; i < EPS_IOE_NUM; i++)
+        dst->evnum[i] = src->evnum[i];
+}
+
+void eplat_merge (eplat_t * dst, eplat_t * src)
+{
+    int  i;
+
+    if (!dst || !src) return;
+
+    ephist_merge(&dst->queue, &src->queue);
+    ephist_merge(&dst->exec, &src->exec);
+
+    for (i = 0; i < EPS_IOE_NUM; i++)
+        ephist_merge(&dst->exec_ioe[i], &src->exec_ioe[i]);
+
+    for (i = 0; i < EPS_FDT_NUM; i++)
+        ephist_merge(&dst->exec_fdt[i], &src->exec_fdt[i]);
+
+    ephist_merge(&dst->poll, &src->poll);
+    ephist_merge(&dst->loop, &src->loop);
+
+    for (i = 0; i < EPS_IOE_NUM; i++)
+        dst->evnum[i] += src->evnum[i];
+}
+
+void eplat_print (eplat_t * lat, frame_p frm, FILE * fp)
+{
+    char  buf[512];
+    int   len = 0;
+
+    if (!lat) return;
+
+#define EPS_US(hist, pct) ((double)ephist_percentile(&lat->hist, pct) / 1000.0)
+
+    len = snprintf(buf, sizeof(buf),
+                   "    latency(us) queue p50=%.1f p99=%.1f max=%.1f  "
+                   "exec p50=%.1f p99=%.1f max=%.1f  poll p50=%.1f  loop p99=%.1f\n",
+                   EPS_US(queue, 50), EPS_US(queue, 99), (double)lat->queue.max / 1000.0,
+                   EPS_US(exec, 50), EPS_US(exec, 99), (double)lat->exec.max / 1000.0,
+                   EPS_US(poll, 50), EPS_US(loop, 99));
+
+#undef EPS_US
+
+    if (len <= 0) return;
+
+    if (frm) frame_appendf(frm, "%s", buf);
+    if (fp) fprintf(fp, "%s", buf);
+}
+
+
+int epcore_slow_callback (void * vpcore, int thresms, int sample)
+{
+    epcore_t  * pcore = (epcore_t *)vpcore;
+
+    if (!pcore) return -1;
+
+    if (thresms < 0) thresms = 0;
+    if (sample < 1) sample = 1;
+
+    pcore->slowcb_sample = sample;
+    pcore->slowcb_thres = thresms;
+
+    return 0;
+}
+
+int epslow_begin (void * vpcore, epslow_t * slow, int event, void * cb,
+                  void * vdev, ulong objid, int fdtype)
+{
+    epcore_t  * pcore = (epcore_t *)vpcore;
+    iodev_t   * pdev = (iodev_t *)vdev;
+
+    if (!slow) return 0;
+
+    slow->start = 0;
+
+    if (!pcore || pcore->slowcb_thres <= 0) return 0;
+
+    /* every thread samples 1 of every slowcb_sample callbacks it runs */
+    if (pcore->slowcb_sample > 1 && (tls_slowcb_seq++ % pcore->slowcb_sample) != 0)
+        return 0;
+
+    slow->event = event;
+    slow->cb = cb;
+
+    if (pdev) {
+        /* device may be closed in callback, its attributes are kept before */
+        slow->objid = pdev->id;
+        slow->fdtype = pdev->fdtype;
+        str_secpy(slow->remote_ip, sizeof(slow->remote_ip)-1, pdev->remote_ip, strlen(pdev->remote_ip));
+        slow->remote_port = pdev->remote_port;
+    } else {
+        slow->objid = objid;
+        slow->fdtype = fdtype;
+        slow->remote_ip[0] = '\0';
+        slow->remote_port = 0;
+    }
+
+    slow->start = epnanotime();
+
+    return 1;
+}
+
+char * epstat_event_name (int event)
+{
+    switch (event) {
+    case IOE_CONNECTED:   return "IOE_CONNECTED";
+    case IOE_CONNFAIL:    return "IOE_CONNFAIL";
+    case IOE_ACCEPT:      return "IOE_ACCEPT";
+    case IOE_READ:        return "IOE_READ";
+    case IOE_WRITE:       return "IOE_WRITE";
+    case IOE_INVALID_DEV: return "IOE_INVALID_DEV";
+    case IOE_ZEROCOPY:    return "IOE_ZEROCOPY";
+    case IOE_TIMEOUT:     return "IOE_TIMEOUT";
+    case IOE_DNS_RECV:    return "IOE_DNS_RECV";
+    case IOE_DNS_CLOSE:   return "IOE_DNS_CLOSE";
+    }
+
+    return "IOE_USER_DEFINED";
+}
+
+static char * epslow_symbol (void * addr, char * buf, int len)
+{
+#ifdef UNIX
+    Dl_info   info;
+
+    /* static function has no dynamic symbol, the offset in its module is given */
+    if (addr && dladdr(addr, &info)) {
+        if (info.dli_sname) {
+            snprintf(buf, len, "%s+0x%lx", info.dli_sname,
+                     (ulong)((char *)addr - (char *)info.dli_saddr));
+            return buf;
+        }
+        if (info.dli_fname) {
+            snprintf(buf, len, "%s+0x%lx", info.dli_fname,
+                     (ulong)((char *)addr - (char *)info.dli_fbase));
+            return buf;
+        }
+    }
+#endif
+
+    snprintf(buf, len, "-");
+    return buf;
+}
+
+int epslow_end (void * vpcore, epslow_t * slow)
+{
+    epcore_t  * pcore = (epcore_t *)vpcore;
+    uint64      used = 0;
+    char        sym[256];
+
+    if (!pcore || !slow || slow->start == 0) return 0;
+
+    used = epnanotime() - slow->start;
+    slow->start = 0;
+
+    if (used < (uint64)pcore->slowcb_thres * 1000000ULL)
+        return 0;
+
+    pcore->slowcb_num++;
+
+    tolog(1, "Slow Callback: %llu us, event=%s(%d) fdtype=0x%x objid=%lu remote=%s:%d "
+             "cb=%p %s thread=%lu\n",
+          (unsigned long long)(used / 1000), epstat_event_name(slow->event),
+          slow->event, slow->fdtype, slow->objid,
+          slow->remote_ip[0] ? slow->remote_ip : "-", slow->remote_port,
+          slow->cb, epslow_symbol(slow->cb, sym, sizeof(sym)), get_threadid());
+
+    return 1;
+}
+
+
+int epcore_latency_enable (void * vpcore, int onoff)
+{
+    epcore_t  * pcore = (epcore_t *)vpcore;
+
+    if (!pcore) return -1;
+
+    pcore->latency = onoff ? 1 : 0;
+
+    return 0;
+}
+
+int epcore_latency (void * vpcore, ulong threadid, eplat_t * lat)
+{
+    epcore_t  * pcore = (epcore_t *)vpcore;
+    epump_t   * epump = NULL;
+    worker_t  * wker = NULL;
+    eplat_t   * tmp = NULL;
+    int         i, num = 0;
+
+    if (!pcore) return -1;
+    if (!lat) return -2;
+
+    memset(lat, 0, sizeof(*lat));
+
+    if (threadid > 0) {
+        EnterCriticalSection(&pcore->epumplistCS);
+        epump = ht_get(pcore->epump_tab, &threadid);
+        if (epump && epump->lat) {
+            eplat_copy(lat, epump->lat);
+            num++;
+        }
+        LeaveCriticalSection(&pcore->epumplistCS);
+
+        if (num > 0) return num;
+
+        EnterCriticalSection(&pcore->workerlistCS);
+        wker = ht_get(pcore->worker_tab, &threadid);
+        if (wker && wker->lat) {
+            eplat_copy(lat, wker->lat);
+            num++;
+        }
+        LeaveCriticalSection(&pcore->workerlistCS);
+
+        return num;
+    }
+
+    tmp = kzalloc(sizeof(*tmp));
+    if (!tmp) return -10;
+
+    EnterCriticalSection(&pcore->epumplistCS);
+    for (i = 0; i < arr_num(pcore->epump_list); i++) {
+        epump = arr_value(pcore->epump_list, i);
+        if (!epump || !epump->lat) continue;
+
+        eplat_copy(tmp, epump->lat);
+        eplat_merge(lat, tmp);
+        num++;
+    }
+    LeaveCriticalSection(&pcore->epumplistCS);
+
+    EnterCriticalSection(&pcore->workerlistCS);
+    for (i = 0; i < arr_num(pcore->worker_list); i++) {
+        wker = arr_value(pcore->worker_list, i);
+        if (!wker || !wker->lat) continue;
+
+        eplat_copy(tmp, wker->lat);
+        eplat_merge(lat, tmp);
+        num++;
+    }
+    LeaveCriticalSection(&pcore->workerlistCS);
+
+    kfree(tmp);
+
+    return num;
+}
+
+int epcore_latency_snapshot (void * vpcore, eplat_t * list, int num)
+{
+    epcore_t  * pcore = (epcore_t *)vpcore;
+    epump_t   * epump = NULL;
+    worker_t  * wker = NULL;
+    int         i, cnt = 0;
+
+    if (!pcore) return -1;
+    if (!list || num <= 0) return -2;
+
+    EnterCriticalSection(&pcore->epumplistCS);
+    for (i = 0; i < arr_num(pcore->epump_list) && cnt < num; i++) {
+        epump = arr_value(pcore->epump_list, i);
+        if (!epump || !epump->lat) continue;
+
+        eplat_copy(&list[cnt++], epump->lat);
+    }
+    LeaveCriticalSection(&pcore->epumplistCS);
+
+    EnterCriticalSection(&pcore->workerlistCS);
+    for (i = 0; i < arr_num(pcore->worker_list) && cnt < num; i++) {
+        wker = arr_value(pcore->worker_list, i);
+        if (!wker || !wker->lat) continue;
+
+        eplat_copy(&list[cnt++], wker->lat);
+    }
+    LeaveCriticalSection(&pcore->workerlistCS);
+
+    return cnt;
+}
+
+
+static void epstat_pool (epstat_pool_t * sp, mpool_t * pool)
+{
+    if (!sp || !pool) return;
+
+    sp->size = mpool_size(pool);
+    sp->allocated = mpool_allocated(pool);
+    sp->consumed = mpool_consumed(pool);
+}
+
+int epcore_stat (void * vpcore, epstat_t * st)
+{
+    epcore_t        * pcore = (epcore_t *)vpcore;
+    DnsMgmt         * mgmt = NULL;
+    DnsNSrv         * nsrv = NULL;
+    DnsHost         * host = NULL;
+    epump_t         * epump = NULL;
+    worker_t        * wker = NULL;
+    eplat_t         * lat = NULL;
+    epstat_thread_t * th = NULL;
+    int               i, num;
+
+    if (!pcore) return -1;
+    if (!st) return -2;
+
+    memset(st, 0, sizeof(*st));
+
+    st->startup = pcore->startup_time;
+    st->devnum = ht_num(pcore->device_table);
+    st->timernum = ht_num(pcore->timer_table);
+
+    st->event_num = pcore->acc_event_num;
+    st->accept_num = pcore->accept_num;
+    st->connect_num = pcore->connect_num;
+    st->close_num = pcore->close_num;
+    st->wakeup_send = pcore->wakeup_send;
+
+    epstat_pool(&st->pool[0], pcore->device_pool);
+    epstat_pool(&st->pool[1], pcore->timer_pool);
+    epstat_pool(&st->pool[2], pcore->event_pool);
+    epstat_pool(&st->pool[3], pcore->epump_pool);
+    epstat_pool(&st->pool[4], pcore->devrbn_pool);
+    epstat_pool(&st->pool[5], pcore->timrbn_pool);
+    epstat_pool(&st->pool[6], pcore->udpvec_pool);
+    epstat_pool(&st->pool[7], pcore->udpgro_pool);
+
+    mgmt = (DnsMgmt *)pcore->dnsmgmt;
+    if (mgmt) {
+        epstat_pool(&st->pool[8], mgmt->msg_pool);
+        epstat_pool(&st->pool[9], mgmt->cache_pool);
+
+        st->dns_query = mgmt->query_num;
+        st->dns_cache_hit = mgmt->cache_hit;
+        st->dns_hosts_hit = mgmt->hosts_hit;
+        st->dns_stale = mgmt->stale_num;
+        st->dns_negative = mgmt->negative_num;
+        st->dns_prefetch = mgmt->prefetch_num;
+        st->dns_tcp = mgmt->tcp_num;
+        st->dns_hedge = mgmt->hedge_num;
+        /* table sizes are summed without the shard locks */
+        st->dns_cachenum = dns_cache_mgmt_num(mgmt);
+        st->dns_msgnum = dns_msg_mgmt_num(mgmt);
+
+        /* RTT of Name Servers is read without statCS, a torn value of
+           one sample is tolerable for metrics */
+        nsrv = (DnsNSrv *)mgmt->nsrv;
+        if (nsrv) {
+            EnterCriticalSection(&nsrv->hostCS);
+            num = arr_num(nsrv->host_list);
+            for (i = 0; i < num && st->nsnum < EPS_NS_MAX; i++) {
+                host = arr_value(nsrv->host_list, i);
+                if (!host) continue;
+
+                str_secpy(st->ns[st->nsnum].ip, sizeof(st->ns[0].ip)-1, host->ip, strlen(host->ip));
+                st->ns[st->nsnum].port = host->port;
+                st->ns[st->nsnum].srtt = host->srtt;
+                st->ns[st->nsnum].rttvar = host->rttvar;
+                st->ns[st->nsnum].rttp95 = host->rttp95;
+                st->ns[st->nsnum].failnum = host->failnum;
+                st->nsnum++;
+            }
+            LeaveCriticalSection(&nsrv->hostCS);
+        }
+    }
+
+    /* the list locks only keep the thread instances from being removed,
+       the counters owned by ePump and worker threads are read directly */
+    EnterCriticalSection(&pcore->epumplistCS);
+    num = arr_num(pcore->epump_list);
+    for (i = 0; i < num && st->thread_num < EPS_THREAD_MAX; i++) {
+        epump = arr_value(pcore->epump_list, i);
+        if (!epump) continue;
+
+        th = &st->thread[st->thread_num++];
+        th->threadid = epump->threadid;
+        th->type = EPS_THREAD_EPUMP;
+        th->devnum = epump_objnum(epump, 1);
+        th->timernum = epump_objnum(epump, 2);
+        th->queuenum = lt_num(epump->ioevent_list);
+        th->wakeup_recv = epump->wakeup_recv;
+
+        lat = (eplat_t *)epump->lat;
+        if (lat) memcpy(th->evnum, lat->evnum, sizeof(th->evnum));
+
+        st->wakeup_recv += th->wakeup_recv;
+    }
+    LeaveCriticalSection(&pcore->epumplistCS);
+
+    EnterCriticalSection(&pcore->workerlistCS);
+    num = arr_num(pcore->worker_list);
+    for (i = 0; i < num && st->thread_num < EPS_THREAD_MAX; i++) {
+        wker = arr_value(pcore->worker_list, i);
+        if (!wker) continue;
+
+        th = &st->thread[st->thread_num++];
+        th->threadid = wker->threadid;
+        th->type = EPS_THREAD_WORKER;
+        th->queuenum = lt_num(wker->ioevent_list);
+
+        lat = (eplat_t *)wker->lat;
+        if (lat) memcpy(th->evnum, lat->evnum, sizeof(th->evnum));
+    }
+    LeaveCriticalSection(&pcore->workerlistCS);
+
+    return 0;
+}
+
+
+static char * eps_ioe_label[EPS_IOE_NUM] = {
+    "connected", "connfail", "accept", "read", "write", "invalid_dev",
+    "zerocopy", "timeout", "dns_recv", "dns_close", "user"
+};
+
+static void eps_prom_head (frame_p frm, char * name, char * type, char * help)
+{
+    frame_appendf(frm, "# HELP %s %s\n", name, help);
+    frame_appendf(frm, "# TYPE %s %s\n", name, type);
+}
+
+static void eps_prom_hist (frame_p frm, char * name, char * help, ephist_t * hist)
+{
+    /* the upper bounds in nanoseconds, rendered in seconds */
+    static uint64 le[] = { 1000, 10000, 100000, 1000000, 5000000, 10000000,
+                           50000000, 100000000, 500000000, 1000000000 };
+    int  i;
+
+    eps_prom_head(frm, name, "histogram", help);
+
+    for (i = 0; i < (int)(sizeof(le)/sizeof(le[0])); i++) {
+        frame_appendf(frm, "%s_bucket{le=\"%g\"} %llu\n", name, (double)le[i] / 1e9,
+                      (unsigned long long)ephist_count_le(hist, le[i]));
+    }
+    frame_appendf(frm, "%s_bucket{le=\"+Inf\"} %llu\n", name, (unsigned long long)hist->count);
+    frame_appendf(frm, "%s_sum %.9f\n", name, (double)hist->sum / 1e9);
+    frame_appendf(frm, "%s_count %llu\n", name, (unsigned long long)hist->count);
+}
+
+#define EPS_PROM_VAL(frm, name, type, help, val) do {                      \
+    eps_prom_head(frm, name, type, help);                                   \
+    frame_appendf(frm, "%s %llu\n", name, (unsigned long long)(val));       \
+} while (0)
+
+int epstat_prometheus (epstat_t * st, eplat_t * lat, frame_p frm)
+{
+    static char     * poolname[EPS_POOL_NUM] = EPS_POOL_NAMES;
+    epstat_thread_t * th = NULL;
+    char            * thtype = NULL;
+    int               i, j;
+
+    if (!st) return -1;
+    if (!frm) return -2;
+
+    EPS_PROM_VAL(frm, "epump_start_time_seconds", "gauge", "Startup time of epcore.", st->startup);
+    EPS_PROM_VAL(frm, "epump_devices", "gauge", "Devices in epcore.", st->devnum);
+    EPS_PROM_VAL(frm, "epump_timers", "gauge", "Timers in epcore.", st->timernum);
+
+    EPS_PROM_VAL(frm, "epump_events_total", "counter", "Events generated.", st->event_num);
+    EPS_PROM_VAL(frm, "epump_accepts_total", "counter", "TCP connections accepted.", st->accept_num);
+    EPS_PROM_VAL(frm, "epump_connects_total", "counter", "TCP connections initiated.", st->connect_num);
+    EPS_PROM_VAL(frm, "epump_closes_total", "counter", "Devices closed.", st->close_num);
+    EPS_PROM_VAL(frm, "epump_wakeups_sent_total", "counter", "Wakeups sent to blocking threads.", st->wakeup_send);
+    EPS_PROM_VAL(frm, "epump_wakeups_received_total", "counter", "Wakeups received by ePump threads.", st->wakeup_recv);
+
+    eps_prom_head(frm, "epump_pool_bytes", "gauge", "Memory allocated by pool.");
+    for (i = 0; i < EPS_POOL_NUM; i++)
+        frame_appendf(frm, "epump_pool_bytes{pool=\"%s\"} %ld\n", poolname[i], st->pool[i].size);
+
+    eps_prom_head(frm, "epump_pool_units", "gauge", "Units allocated and consumed by pool.");
+    for (i = 0; i < EPS_POOL_NUM; i++) {
+        frame_appendf(frm, "epump_pool_units{pool=\"%s\",state=\"allocated\"} %d\n",
+                      poolname[i], st->pool[i].allocated);
+        frame_appendf(frm, "epump_pool_units{pool=\"%s\",state=\"consumed\"} %d\n",
+                      poolname[i], st->pool[i].consumed);
+    }
+
+    eps_prom_head(frm, "epump_thread_devices", "gauge", "Devices monitored by ePump thread.");
+    for (i = 0; i < st->thread_num; i++) {
+        th = &st->thread[i];
+        if (th->type != EPS_THREAD_EPUMP) continue;
+        frame_appendf(frm, "epump_thread_devices{thread=\"%lu\"} %d\n", th->threadid, th->devnum);
+    }
+
+    eps_prom_head(frm, "epump_thread_timers", "gauge", "Timers of ePump thread.");
+    for (i = 0; i < st->thread_num; i++) {
+        th = &st->thread[i];
+        if (th->type != EPS_THREAD_EPUMP) continue;
+        frame_appendf(frm, "epump_thread_timers{thread=\"%lu\"} %d\n", th->threadid, th->timernum);
+    }
+
+    eps_prom_head(frm, "epump_thread_queue", "gauge", "Events waiting in thread queue.");
+    for (i = 0; i < st->thread_num; i++) {
+        th = &st->thread[i];
+        thtype = th->type == EPS_THREAD_EPUMP ? "epump" : "worker";
+        frame_appendf(frm, "epump_thread_queue{thread=\"%lu\",type=\"%s\"} %d\n",
+                      th->threadid, thtype, th->queuenum);
+    }
+
+    eps_prom_head(frm, "epump_thread_wakeups_received_total", "counter", "Wakeups received by ePump thread.");
+    for (i = 0; i < st->thread_num; i++) {
+        th = &st->thread[i];
+        if (th->type != EPS_THREAD_EPUMP) continue;
+        frame_appendf(frm, "epump_thread_wakeups_received_total{thread=\"%lu\"} %llu\n",
+                      th->threadid, (unsigned long long)th->wakeup_recv);
+    }
+
+    eps_prom_head(frm, "epump_thread_events_total", "counter", "Events executed by thread and event type.");
+    for (i = 0; i < st->thread_num; i++) {
+        th = &st->thread[i];
+        thtype = th->type == EPS_THREAD_EPUMP ? "epump" : "worker";
+        for (j = 0; j < EPS_IOE_NUM; j++) {
+            if (th->evnum[j] == 0) continue;
+            frame_appendf(frm, "epump_thread_events_total{thread=\"%lu\",type=\"%s\",event=\"%s\"} %llu\n",
+                          th->threadid, thtype, eps_ioe_label[j], (unsigned long long)th->evnum[j]);
+        }
+    }
+
+    EPS_PROM_VAL(frm, "epump_dns_queries_total", "counter", "DNS queries not given as IP address.", st->dns_query);
+
+    eps_prom_head(frm, "epump_dns_answers_total", "counter", "DNS queries answered without Name Server.");
+    frame_appendf(frm, "epump_dns_answers_total{source=\"cache\"} %llu\n", (unsigned long long)st->dns_cache_hit);
+    frame_appendf(frm, "epump_dns_answers_total{source=\"hosts\"} %llu\n", (unsigned long long)st->dns_hosts_hit);
+    frame_appendf(frm, "epump_dns_answers_total{source=\"stale\"} %llu\n", (unsigned long long)st->dns_stale);
+
+    EPS_PROM_VAL(frm, "epump_dns_negative_total", "counter", "DNS negative answers cached.", st->dns_negative);
+    EPS_PROM_VAL(frm, "epump_dns_prefetch_total", "counter", "DNS cache entries prefetched.", st->dns_prefetch);
+    EPS_PROM_VAL(frm, "epump_dns_tcp_total", "counter", "DNS queries retried over TCP.", st->dns_tcp);
+    EPS_PROM_VAL(frm, "epump_dns_hedge_total", "counter", "DNS hedged sends.", st->dns_hedge);
+    EPS_PROM_VAL(frm, "epump_dns_cache_entries", "gauge", "DNS cache entries.", st->dns_cachenum);
+    EPS_PROM_VAL(frm, "epump_dns_inflight", "gauge", "DNS queries in flight.", st->dns_msgnum);
+
+    eps_prom_head(frm, "epump_dns_rtt_seconds", "gauge", "Smoothed RTT, RTT variance and p95 RTT of Name Server.");
+    for (i = 0; i < st->nsnum; i++) {
+        frame_appendf(frm, "epump_dns_rtt_seconds{server=\"%s:%d\",stat=\"srtt\"} %.3f\n",
+                      st->ns[i].ip, st->ns[i].port, (double)st->ns[i].srtt / 1000.0);
+        frame_appendf(frm, "epump_dns_rtt_seconds{server=\"%s:%d\",stat=\"rttvar\"} %.3f\n",
+                      st->ns[i].ip, st->ns[i].port, (double)st->ns[i].rttvar / 1000.0);
+        frame_appendf(frm, "epump_dns_rtt_seconds{server=\"%s:%d\",stat=\"p95\"} %.3f\n",
+                      st->ns[i].ip, st->ns[i].port, (double)st->ns[i].rttp95 / 1000.0);
+    }
+
+    eps_prom_head(frm, "epump_dns_server_failures", "gauge", "Consecutive failures of Name Server.");
+    for (i = 0; i < st->nsnum; i++) {
+        frame_appendf(frm, "epump_dns_server_failures{server=\"%s:%d\"} %d\n",
+                      st->ns[i].ip, st->ns[i].port, st->ns[i].failnum);
+    }
+
+    if (lat) {
+        eps_prom_hist(frm, "epump_event_queue_seconds", "Delay from event pushed to its execution.", &lat->queue);
+        eps_prom_hist(frm, "epump_event_exec_seconds", "Execution time of event callback.", &lat->exec);
+        eps_prom_hist(frm, "epump_poll_wait_seconds", "Blocking time waiting for events.", &lat->poll);
+        eps_prom_hist(frm, "epump_loop_seconds", "Loop iteration time excluding blocking.", &lat->loop);
+    }
+
+    return 0;
+}
+
+int epcore_prometheus (void * vpcore, frame_p frm)
+{
+    epcore_t  * pcore = (epcore_t *)vpcore;
+    epstat_t  * st = NULL;
+    eplat_t   * lat = NULL;
+    int         ret = 0;
+
+    if (!pcore) return -1;
+    if (!frm) return -2;
+
+    st = kzalloc(sizeof(*st));
+    if (!st) return -10;
+
+    if (pcore->latency) {
+        lat = kzalloc(sizeof(*lat));
+        if (lat) epcore_latency(pcore, 0, lat);
+    }
+
+    if ((ret = epcore_stat(pcore, st)) >= 0)
+        ret = epstat_prometheus(st, lat, frm);
+
+    if (lat) kfree(lat);
+    kfree(st);
+
+    return ret;
+}
+
@@ -36,9 +36,12 @@
 #include "epcore.h"
 #include "epump_local.h"
 #include "iodev.h"
+#include "iotimer.h"
 #include "ioevent.h"
 #include "mlisten.h"
 #include "epdns.h"
+#include "eptcp.h"
+#include "epstat.h"
 
 #ifdef HAVE_IOCP
 #include "epiocp.h"
@@ -347,6 +350,7 @@ void * eptcp_accept (void * vpcore, void * vld, void * popt, void * para, IOHand
 
     EnterCriticalSection(&listendev->fdCS);
     clifd = accept(listendev->fd, (struct sockaddr *)&cliaddr, (socklen_t *)&addrlen);
+    if (clifd != INVALID_SOCKET) listendev->acceptnum++;
     LeaveCriticalSection(&listendev->fdCS);
 
     if (clifd == INVALID_SOCKET) {
@@ -403,6 +407,8 @@ void * eptcp_accept (void * vpcore, void * vld, void * popt, void * para, IOHand
  
     iodev_rwflag_set(pdev, RWF_READ);
 
+    epstat_inc(&pcore->accept_num);
+
     if (retval) *retval = 0;
 
     /* epump is system-decided: select one lowest load epump thread to be bound */
@@ -443,6 +449,8 @@ void * eptcp_connect (void * vpcore, char * host, int port,
     pdev->fdtype = FDT_CONNECTED;
     pdev->para = para;
  
+    epstat_inc(&pcore->connect_num);
+
     if (cb) {
         pdev->callback = cb;
         pdev->cbpara = cbpara;
@@ -516,12 +524,23 @@ int eptcp_connect_dnscb (void * vpcore, ulong devid, char * name, int len, void
     pdev = epcore_iodev_find(pcore, devid);
     if (!pdev) return -2;
 
+    /* the other address family answered after connecting started, it joins
+       the racing attempts if they are still in progress */
+    if (status == DNS_ERR_LATE_ADDR) {
+        eptcp_he_add(pcore, pdev, cache);
+        return 0;
+    }
+
     popt = pdev->iot;
     pdev->iot = NULL;
 
     if (status == DNS_ERR_IPV4 || status == DNS_ERR_IPV6) {
         str_secpy(dstip, sizeof(dstip)-1, name, len);
 
+    } else if (pcore->happyeyeballs && eptcp_he_start(pcore, pdev, cache, popt) > 0) {
+        /* connecting attempts racing among multiple addresses */
+        return 0;
+
     } else if (dns_cache_getip(cache, 0, dstip, sizeof(dstip)-1) <= 0) {
         if (pdev->callback)
             (*pdev->callback)(pdev->cbpara, pdev, IOE_CONNFAIL, pdev->fdtype);
@@ -573,6 +592,7 @@ void * eptcp_nb_connect (void * vpcore, char * host, int port, char * localip,
     iodev_t       * pdev = NULL;
     ep_sockaddr_t   addr;
     int             succ = 0;
+    int             ret = 0;
 
     if (retval) *retval = -1;
     if (!pcore) return NULL;
@@ -591,6 +611,8 @@ void * eptcp_nb_connect (void * vpcore, char * host, int port, char * localip,
     pdev->fdtype = FDT_CONNECTED;
     pdev->para = para;
 
+    epstat_inc(&pcore->connect_num);
+
     if (cb) {
         pdev->callback = cb;
         pdev->cbpara = cbpara;
@@ -602,7 +624,8 @@ void * eptcp_nb_connect (void * vpcore, char * host, int port, char * localip,
     else
         pdev->threadid = get_threadid();
 
-    str_secpy(pdev->local_ip, sizeof(pdev->local_ip), localip, strlen(localip));
+    if (localip)
+        str_secpy(pdev->local_ip, sizeof(pdev->local_ip), localip, strlen(localip));
     pdev->local_port = localport;
 
     pdev->remote_port = port;
@@ -610,14 +633,24 @@ void * eptcp_nb_connect (void * vpcore, char * host, int port, char * localip,
     if (sock_addr_parse(host, -1, port, &addr) <= 0) {
         pdev->iot = popt;
 
-        if (dns_nb_query(pcore->dnsmgmt, host, -1, NULL, NULL, eptcp_connect_dnscb, pcore, pdev->id) < 0) {
+        /* DnsCB may be invoked immediately when the name is cached, and the
+           connecting state set there must not be overwritten */
+        pdev->iostate = IOS_RESOLVING;
+
+        /* Happy Eyeballs starts connecting with the first address family
+           answered, the other one is added to the racing when answered */
+        if (pcore->happyeyeballs)
+            ret = dns_nb_query_early(pcore->dnsmgmt, host, -1, NULL, NULL, eptcp_connect_dnscb, pcore, pdev->id);
+        else
+            ret = dns_nb_query(pcore->dnsmgmt, host, -1, NULL, NULL, eptcp_connect_dnscb, pcore, pdev->id);
+
+        if (ret < 0) {
             iodev_close(pdev);
             if (retval) *retval = -30;
             return NULL;
         }
 
         pdev->iot = NULL;
-        pdev->iostate = IOS_RESOLVING;
         if (retval) *retval = -101;
 
         return pdev;
@@ -651,3 +684,398 @@ void * eptcp_nb_connect (void * vpcore, char * host, int port, char * localip,
     return pdev;
 }
 
+int eptcp_he_start (void * vpcore, void * vdev, void * cache, void * popt)
+{
+#ifdef HAVE_IOCP
+    /* the socket bound to IOCP can not be moved to another iodev_t,
+       connecting to the first address only */
+    return 0;
+#else
+    epcore_t      * pcore = (epcore_t *)vpcore;
+    iodev_t       * pdev = (iodev_t *)vdev;
+    eptcp_he_t    * he = NULL;
+    char            iplist[EPTCP_HE_ADDRNUM][41];
+    ep_sockaddr_t   addr[EPTCP_HE_ADDRNUM];
+    int             v6[EPTCP_HE_ADDRNUM];
+    int             v4[EPTCP_HE_ADDRNUM];
+    int             i, num, n6 = 0, n4 = 0;
+    int             j6 = 0, j4 = 0, ind;
+
+    if (!pcore) return -1;
+    if (!pdev) return -2;
+
+    /* single address is raced only when the addresses of the other family
+       may be answered later */
+    num = dns_cache_getiplist(cache, iplist, EPTCP_HE_ADDRNUM);
+    if (num < 1 || (num == 1 && !dns_dualstack_get(pcore->dnsmgmt))) return 0;
+
+    for (i = 0; i < num; i++) {
+        if (sock_addr_parse(iplist[i], -1, pdev->remote_port, &addr[i]) <= 0)
+            continue;
+
+        if (addr[i].family == AF_INET6) v6[n6++] = i;
+        else v4[n4++] = i;
+    }
+
+    if (n6 + n4 < 1) return 0;
+
+    he = kzalloc(sizeof(*he));
+    if (!he) return -100;
+
+    /* interleave the address families, IPv6 goes first */
+    while (j6 < n6 || j4 < n4) {
+        if (j6 < n6) {
+            ind = v6[j6++];
+            memcpy(&he->addr[he->addrnum], &addr[ind], sizeof(ep_sockaddr_t));
+            str_secpy(he->ip[he->addrnum], sizeof(he->ip[0])-1, iplist[ind], strlen(iplist[ind]));
+            he->addrnum++;
+        }
+        if (j4 < n4) {
+            ind = v4[j4++];
+            memcpy(&he->addr[he->addrnum], &addr[ind], sizeof(ep_sockaddr_t));
+            str_secpy(he->ip[he->addrnum], sizeof(he->ip[0])-1, iplist[ind], strlen(iplist[ind]));
+            he->addrnum++;
+        }
+    }
+
+    if (popt) {
+        memcpy(&he->opt, popt, sizeof(sockopt_t));
+        he->hasopt = 1;
+    }
+
+    EnterCriticalSection(&pdev->fdCS);
+    pdev->hectx = he;
+    pdev->iostate = IOS_CONNECTING;
+    LeaveCriticalSection(&pdev->fdCS);
+
+    eptcp_he_next(pcore, pdev);
+
+    return 1;
+#endif
+}
+
+int eptcp_he_add (void * vpcore, void * vdev, void * cache)
+{
+#ifdef HAVE_IOCP
+    return 0;
+#else
+    epcore_t      * pcore = (epcore_t *)vpcore;
+    iodev_t       * pdev = (iodev_t *)vdev;
+    eptcp_he_t    * he = NULL;
+    char            iplist[EPTCP_HE_ADDRNUM][41];
+    ep_sockaddr_t   addr;
+    int             i, j, num, pos;
+    int             added = 0;
+    int             start = 0;
+
+    if (!pcore) return -1;
+    if (!pdev) return -2;
+
+    num = dns_cache_getiplist(cache, iplist, EPTCP_HE_ADDRNUM);
+    if (num <= 0) return 0;
+
+    EnterCriticalSection(&pdev->fdCS);
+
+    he = (eptcp_he_t *)pdev->hectx;
+    if (!he) {
+        /* connected already or all attempts failed */
+        LeaveCriticalSection(&pdev->fdCS);
+        return 0;
+    }
+
+    for (i = 0; i < num && he->addrnum < EPTCP_HE_ADDRNUM; i++) {
+        for (j = 0; j < he->addrnum; j++) {
+            if (strcasecmp(he->ip[j], iplist[i]) == 0)
+                break;
+        }
+        if (j < he->addrnum) continue;
+
+        if (sock_addr_parse(iplist[i], -1, pdev->remote_port, &addr) <= 0)
+            continue;
+
+        /* interleaved with the addresses not tried yet */
+        pos = he->addrind + added * 2;
+        if (pos > he->addrnum) pos = he->addrnum;
+
+        for (j = he->addrnum; j > pos; j--) {
+            memcpy(&he->addr[j], &he->addr[j-1], sizeof(ep_sockaddr_t));
+            memcpy(he->ip[j], he->ip[j-1], sizeof(he->ip[0]));
+            he->attempt[j] = he->attempt[j-1];
+        }
+
+        memcpy(&he->addr[pos], &addr, sizeof(ep_sockaddr_t));
+        str_secpy(he->ip[pos], sizeof(he->ip[0])-1, iplist[i], strlen(iplist[i]));
+        he->attempt[pos] = 0;
+        he->addrnum++;
+        added++;
+    }
+
+    /* no attempt is scheduled, the late address starts after hedelay ms
+       if an attempt is still connecting, otherwise immediately */
+    if (added > 0 && !he->timer) {
+        if (he->pending > 0)
+            he->timer = iotimer_start(pcore, pcore->hedelay, t_eptcp_he_delay,
+                                      (void *)pdev->id, eptcp_he_pump, pcore, pdev->threadid);
+        else
+            start = 1;
+    }
+
+    LeaveCriticalSection(&pdev->fdCS);
+
+    if (start) eptcp_he_next(pcore, pdev);
+
+    return added;
+#endif
+}
+
+int eptcp_he_next (void * vpcore, void * vdev)
+{
+    epcore_t      * pcore = (epcore_t *)vpcore;
+    iodev_t       * pdev = (iodev_t *)vdev;
+    iodev_t       * aux = NULL;
+    eptcp_he_t    * he = NULL;
+    SOCKET          fd = INVALID_SOCKET;
+    int             succ = 0;
+    int             ind = 0;
+
+    if (!pcore) return -1;
+    if (!pdev) return -2;
+
+    EnterCriticalSection(&pdev->fdCS);
+
+    he = (eptcp_he_t *)pdev->hectx;
+    if (!he) {
+        LeaveCriticalSection(&pdev->fdCS);
+        return 0;
+    }
+
+    if (he->timer) {
+        iotimer_stop(pcore, he->timer);
+        he->timer = NULL;
+    }
+
+    while (he->addrind < he->addrnum) {
+        ind = he->addrind++;
+
+        fd = tcp_ep_connect(&he->addr[ind], 1, pdev->local_ip, pdev->local_port,
+                            he->hasopt ? &he->opt : NULL, &succ);
+        if (fd == INVALID_SOCKET)
+            continue;
+
+        if (succ > 0) { /* connect successfully */
+            LeaveCriticalSection(&pdev->fdCS);
+            return eptcp_he_won(pcore, pdev, NULL, ind, fd);
+        }
+
+        aux = iodev_new(pcore);
+        if (!aux) {
+            closesocket(fd);
+            continue;
+        }
+
+        aux->fd = fd;
+        aux->fdtype = FDT_CONNECTED;
+        aux->family = he->addr[ind].family;
+        aux->socktype = he->addr[ind].socktype;
+        aux->protocol = IPPROTO_TCP;
+
+        /* the attempt is bound to the same thread as the connecting device */
+        aux->para = (void *)pdev->id;
+        aux->callback = eptcp_he_pump;
+        aux->cbpara = pcore;
+        aux->threadid = pdev->threadid;
+
+        str_secpy(aux->remote_ip, sizeof(aux->remote_ip)-1, he->ip[ind], strlen(he->ip[ind]));
+        aux->remote_port = pdev->remote_port;
+
+        aux->iostate = IOS_CONNECTING;
+        iodev_rwflag_set(aux, RWF_READ | RWF_WRITE);
+
+        he->attempt[ind] = aux->id;
+        he->pending++;
+
+        /* next attempt starts if this one is not connected in hedelay ms */
+        if (he->addrind < he->addrnum)
+            he->timer = iotimer_start(pcore, pcore->hedelay, t_eptcp_he_delay,
+                                      (void *)pdev->id, eptcp_he_pump, pcore, pdev->threadid);
+
+        LeaveCriticalSection(&pdev->fdCS);
+
+        iodev_bind_epump(aux, BIND_GIVEN_EPUMP, pdev->threadid, 0);
+        return 1;
+    }
+
+    /* all addresses tried, wait for the attempts still connecting */
+    if (he->pending > 0) {
+        LeaveCriticalSection(&pdev->fdCS);
+        return 0;
+    }
+
+    pdev->hectx = NULL;
+    LeaveCriticalSection(&pdev->fdCS);
+
+    eptcp_he_free(pcore, he);
+
+    if (pdev->callback)
+        (*pdev->callback)(pdev->cbpara, pdev, IOE_CONNFAIL, pdev->fdtype);
+
+    return -100;
+}
+
+int eptcp_he_won (void * vpcore, void * vdev, void * vaux, int ind, SOCKET fd)
+{
+    epcore_t      * pcore = (epcore_t *)vpcore;
+    iodev_t       * pdev = (iodev_t *)vdev;
+    iodev_t       * aux = (iodev_t *)vaux;
+    eptcp_he_t    * he = NULL;
+
+    if (!pcore) return -1;
+    if (!pdev) return -2;
+
+    EnterCriticalSection(&pdev->fdCS);
+    he = (eptcp_he_t *)pdev->hectx;
+    pdev->hectx = NULL;
+    if (he) he->attempt[ind] = 0;
+    LeaveCriticalSection(&pdev->fdCS);
+
+    if (!he) {
+        if (aux) iodev_close(aux);
+        else closesocket(fd);
+        return -3;
+    }
+
+    pdev->family = he->addr[ind].family;
+    pdev->socktype = he->addr[ind].socktype;
+    pdev->protocol = IPPROTO_TCP;
+    str_secpy(pdev->remote_ip, sizeof(pdev->remote_ip)-1, he->ip[ind], strlen(he->ip[ind]));
+
+    if (aux) {
+        str_secpy(pdev->local_ip, sizeof(pdev->local_ip)-1, aux->local_ip, strlen(aux->local_ip));
+        pdev->local_port = aux->local_port;
+
+        /* detach the socket from the attempt device before closing it */
+        iodev_unbind_epump(aux);
+        aux->fd = INVALID_SOCKET;
+        iodev_close(aux);
+    }
+
+    /* stop the timer and close other attempts */
+    eptcp_he_free(pcore, he);
+
+    pdev->fd = fd;
+    pdev->iostate = IOS_READWRITE;
+    iodev_rwflag_set(pdev, RWF_READ);
+
+    iodev_bind_epump(pdev, BIND_GIVEN_EPUMP, pdev->threadid, 0);
+
+    if (pdev->callback)
+        (*pdev->callback)(pdev->cbpara, pdev, IOE_CONNECTED, pdev->fdtype);
+
+    return 1;
+}
+
+int eptcp_he_pump (void * vpcore, void * pobj, int event, int fdtype)
+{
+    epcore_t      * pcore = (epcore_t *)vpcore;
+    iodev_t       * pdev = NULL;
+    iodev_t       * aux = NULL;
+    eptcp_he_t    * he = NULL;
+    int             i, ind = -1;
+    int             sockerr = 0;
+    int             len = 0;
+
+    if (!pcore) return -1;
+
+    if (event == IOE_TIMEOUT) {
+        if (iotimer_cmdid(pobj) != t_eptcp_he_delay)
+            return 0;
+
+        pdev = epcore_iodev_find(pcore, (ulong)iotimer_para(pobj));
+        if (!pdev) return 0;
+
+        EnterCriticalSection(&pdev->fdCS);
+        he = (eptcp_he_t *)pdev->hectx;
+        if (he && (ulong)he->timer == iotimer_id(pobj)) {
+            he->timer = NULL;
+            ind = 0;
+        }
+        LeaveCriticalSection(&pdev->fdCS);
+
+        /* current attempt is not connected yet, start next one */
+        if (ind == 0)
+            eptcp_he_next(pcore, pdev);
+
+        return 0;
+    }
+
+    aux = (iodev_t *)pobj;
+    if (!aux) return -2;
+
+    pdev = epcore_iodev_find(pcore, (ulong)aux->para);
+    if (pdev) {
+        EnterCriticalSection(&pdev->fdCS);
+        he = (eptcp_he_t *)pdev->hectx;
+        for (i = 0; he && i < he->addrnum; i++) {
+            if (he->attempt[i] == aux->id) {
+                ind = i;
+                break;
+            }
+        }
+        LeaveCriticalSection(&pdev->fdCS);
+    }
+
+    if (ind < 0) {
+        /* the connecting device has been closed or connected via other attempt */
+        iodev_close(aux);
+        return 0;
+    }
+
+    if (event == IOE_READ || event == IOE_WRITE) {
+        /* readiness reported before connecting result, check socket error */
+        len = sizeof(sockerr);
+        if (getsockopt(aux->fd, SOL_SOCKET, SO_ERROR, (char *)&sockerr, (socklen_t *)&len) == 0 && sockerr == 0)
+            event = IOE_CONNECTED;
+        else
+            event = IOE_CONNFAIL;
+    }
+
+    if (event == IOE_CONNECTED)
+        return eptcp_he_won(pcore, pdev, aux, ind, aux->fd);
+
+    /* connecting failed, the next attempt starts immediately */
+    EnterCriticalSection(&pdev->fdCS);
+    he = (eptcp_he_t *)pdev->hectx;
+    if (he && he->attempt[ind] == aux->id) {
+        he->attempt[ind] = 0;
+        he->pending--;
+    }
+    LeaveCriticalSection(&pdev->fdCS);
+
+    iodev_close(aux);
+
+    return eptcp_he_next(pcore, pdev);
+}
+
+void eptcp_he_free (void * vpcore, void * vhe)
+{
+    epcore_t      * pcore = (epcore_t *)vpcore;
+    eptcp_he_t    * he = (eptcp_he_t *)vhe;
+    int             i;
+
+    if (!he) return;
+
+    if (he->timer) {
+        iotimer_stop(pcore, he->timer);
+        he->timer = NULL;
+    }
+
+    for (i = 0; i < he->addrnum; i++) {
+        if (he->attempt[i] > 0) {
+            iodev_close_by(pcore, he->attempt[i]);
+            he->attempt[i] = 0;
+        }
+    }
+
+    kfree(he);
+}
+
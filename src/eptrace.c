@@ -0,0 +1,562 @@
+/*
+ * Copyright (c) 2003-2024 Ke Hengzhong <kehengzhong@hotmail.com>
+ * All rights reserved. See MIT LICENSE for redistribution.
+ *
+ * #####################################################
+ * #                       _oo0oo_                     #
+ * #                      o8888888o                    #
+ * #                      88" . "88                    #
+ * #                      (| -_- |)                    #
+ * #                      0\  =  /0                    #
+ * #                    ___/`---'\___                  #
+ * #                  .' \\|     |// '.                #
+ * #                 / \\|||  :  |||// \               #
+ * #                / _||||| -:- |||||- \              #
+ * #               |   | \\\  -  /// |   |             #
+ * #               | \_|  ''\---/''  |_/ |             #
+ * #               \  .-\__  '-'  ___/-. /             #
+ * #             ___'. .'  /--.--\  `. .'___           #
+ * #          ."" '<  `.___\_<|>_/___.'  >' "" .       #
+ * #         | | :  `- \`.;`\ _ /`;.`/ -`  : | |       #
+ * #         \  \ `_.   \_ __\ /__ _/   .-` /  /       #
+ * #     =====`-.____`.___ \_____/___.-`___.-'=====    #
+ * #                       `=---='                     #
+ * #     ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~   #
+ * #               佛力加持      佛光普照              #
+ * #  Buddha's power blessing, Buddha's light shining  #
+ * #####################################################
+ */
+
+#include "btype.h"
+#include "memory.h"
+#include "mthread.h"
+#include "dynarr.h"
+#include "hashtab.h"
+#include "frame.h"
+
+#include "epcore.h"
+#include "epstat.h"
+#include "eptrace.h"
+
+#include <stdio.h>
+
+#if defined(_WIN32) || defined(_WIN64)
+#include <windows.h>
+#include <intrin.h>
+#define EP_TLS  __declspec(thread)
+#else
+#define EP_TLS  __thread
+#endif
+
+#define EPT_MAGIC    "EPTRACE"
+#define EPT_VERSION  1
+
+#define EPT_THREAD_OTHER   0
+#define EPT_THREAD_EPUMP   1
+#define EPT_THREAD_WORKER  2
+
+/* rings are owned by the registry trace_list of epcore and freed by
+   eptrace_clean. a thread writes its own ring only, and caches it with the
+   epcore and the generation of registry, the cached ring is used only when
+   both of them still match */
+static EP_TLS eptrace_ring_t * tls_ring = NULL;
+static EP_TLS void           * tls_pcore = NULL;
+static EP_TLS uint64           tls_gen = 0;
+
+/* generation of registries, unique among all epcore instances */
+static uint64 eptrace_gen = 0;
+
+typedef struct EPTraceBase_ {
+    uint64   tsc0;
+    uint64   ns0;
+    uint64   tsc1;
+    uint64   ns1;
+} eptrace_base_t;
+
+
+uint64 eptrace_tsc (void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    uint32  lo, hi;
+
+    __asm__ __volatile__ ("rdtsc" : "=a" (lo), "=d" (hi));
+
+    return ((uint64)hi << 32) | lo;
+#elif defined(_M_X64) || defined(_M_IX86)
+    return __rdtsc();
+#else
+    return epnanotime();
+#endif
+}
+
+uint64 eptrace_gen_next (void)
+{
+    return epstat_inc(&eptrace_gen) + 1;
+}
+
+static eptrace_ring_t * eptrace_ring_get (epcore_t * pcore)
+{
+    eptrace_ring_t * ring = NULL;
+    ulong            threadid = 0;
+    uint64           gen = 0;
+    uint32           size = 64;
+    int              i, num;
+
+    /* the cached ring is never dereferenced before the registry is checked */
+    if (tls_ring && tls_pcore == pcore && tls_gen == pcore->tracegen)
+        return tls_ring;
+
+    threadid = get_threadid();
+
+    EnterCriticalSection(&pcore->traceCS);
+
+    if (!pcore->trace_list) {
+        LeaveCriticalSection(&pcore->traceCS);
+        return NULL;
+    }
+
+    /* the ring of current thread may be registered before, when the
+       thread has cached the ring of another epcore meanwhile */
+    num = arr_num(pcore->trace_list);
+    for (i = 0; i < num; i++) {
+        ring = arr_value(pcore->trace_list, i);
+        if (ring && ring->threadid == threadid) break;
+        ring = NULL;
+    }
+
+    if (!ring) {
+        while (size < (uint32)pcore->tracesize && size < (1 << 24)) size <<= 1;
+
+        ring = kzalloc(sizeof(*ring));
+        if (ring) ring->rec = kzalloc(size * sizeof(eptrace_rec_t));
+        if (ring && !ring->rec) {
+            kfree(ring);
+            ring = NULL;
+        }
+
+        if (ring) {
+            ring->threadid = threadid;
+            ring->pcore = pcore;
+            ring->size = size;
+            ring->head = 0;
+
+            arr_push(pcore->trace_list, ring);
+        }
+    }
+
+    gen = pcore->tracegen;
+
+    LeaveCriticalSection(&pcore->traceCS);
+
+    if (!ring) return NULL;
+
+    tls_ring = ring;
+    tls_pcore = pcore;
+    tls_gen = gen;
+
+    return ring;
+}
+
+void eptrace_add (void * vpcore, int type, int event, int fd, uint64 objid, uint64 aux)
+{
+    epcore_t       * pcore = (epcore_t *)vpcore;
+    eptrace_ring_t * ring = NULL;
+    eptrace_rec_t  * rec = NULL;
+
+    if (!pcore || !pcore->trace) return;
+
+    ring = eptrace_ring_get(pcore);
+    if (!ring) return;
+
+    rec = &ring->rec[ring->head & (ring->size - 1)];
+    rec->tsc = eptrace_tsc();
+    rec->type = (uint16)type;
+    rec->event = (uint16)event;
+    rec->fd = fd;
+    rec->objid = objid;
+    rec->aux = aux;
+
+    ring->head++;
+}
+
+void eptrace_clean (void * vpcore)
+{
+    epcore_t       * pcore = (epcore_t *)vpcore;
+    eptrace_ring_t * ring = NULL;
+    int              i, num;
+
+    if (!pcore) return;
+
+    pcore->trace = 0;
+
+    EnterCriticalSection(&pcore->traceCS);
+    num = arr_num(pcore->trace_list);
+    for (i = 0; i < num; i++) {
+        ring = arr_value(pcore->trace_list, i);
+        if (!ring) continue;
+
+        kfree(ring->rec);
+        kfree(ring);
+    }
+    arr_free(pcore->trace_list);
+    pcore->trace_list = NULL;
+
+    /* the rings cached by all threads become invalid */
+    pcore->tracegen = eptrace_gen_next();
+    LeaveCriticalSection(&pcore->traceCS);
+}
+
+int epcore_trace (void * vpcore, int onoff, int ringsize)
+{
+    epcore_t * pcore = (epcore_t *)vpcore;
+
+    if (!pcore) return -1;
+
+    /* rings already allocated keep their size */
+    if (ringsize > 0) pcore->tracesize = ringsize;
+
+    if (onoff && pcore->trace_tsc0 == 0) {
+        pcore->trace_ns0 = epnanotime();
+        pcore->trace_tsc0 = eptrace_tsc();
+    }
+
+    pcore->trace = onoff ? 1 : 0;
+
+    return 0;
+}
+
+
+static int eptrace_thread_type (epcore_t * pcore, ulong threadid)
+{
+    int  type = EPT_THREAD_OTHER;
+
+    EnterCriticalSection(&pcore->epumplistCS);
+    if (ht_get(pcore->epump_tab, &threadid))
+        type = EPT_THREAD_EPUMP;
+    LeaveCriticalSection(&pcore->epumplistCS);
+
+    if (type != EPT_THREAD_OTHER) return type;
+
+    EnterCriticalSection(&pcore->workerlistCS);
+    if (ht_get(pcore->worker_tab, &threadid))
+        type = EPT_THREAD_WORKER;
+    LeaveCriticalSection(&pcore->workerlistCS);
+
+    return type;
+}
+
+static void eptrace_base_get (epcore_t * pcore, eptrace_base_t * base)
+{
+    base->tsc0 = pcore->trace_tsc0;
+    base->ns0 = pcore->trace_ns0;
+    base->ns1 = epnanotime();
+    base->tsc1 = eptrace_tsc();
+
+    if (base->tsc0 == 0) {
+        base->tsc0 = base->tsc1;
+        base->ns0 = base->ns1;
+    }
+}
+
+/* copy the valid records of ring in chronological order. records being
+   overwritten by the running thread at the tail may be inconsistent */
+static int eptrace_ring_copy (eptrace_ring_t * ring, eptrace_rec_t * dst)
+{
+    uint64  head = ring->head;
+    uint64  start = 0;
+    uint32  i, num = 0;
+
+    if (head > ring->size) start = head - ring->size;
+
+    for (i = 0; start + i < head; i++) {
+        dst[i] = ring->rec[(start + i) & (ring->size - 1)];
+        num++;
+    }
+
+    return num;
+}
+
+/* rings are freed only in epcore_clean, the pointers are taken out so that
+   no other lock is acquired while holding traceCS */
+static eptrace_ring_t ** eptrace_ring_list (epcore_t * pcore, int * pnum)
+{
+    eptrace_ring_t ** list = NULL;
+    int               i, num;
+
+    *pnum = 0;
+
+    EnterCriticalSection(&pcore->traceCS);
+    num = arr_num(pcore->trace_list);
+    if (num > 0 && (list = kzalloc(num * sizeof(*list))) != NULL) {
+        for (i = 0; i < num; i++)
+            list[i] = arr_value(pcore->trace_list, i);
+        *pnum = num;
+    }
+    LeaveCriticalSection(&pcore->traceCS);
+
+    return list;
+}
+
+/* nanoseconds since the tracing started */
+static uint64 eptrace_rec_ns (eptrace_base_t * base, uint64 tsc)
+{
+    double  rate = 1.0;
+
+    if (base->tsc1 > base->tsc0 && base->ns1 > base->ns0)
+        rate = (double)(base->ns1 - base->ns0) / (double)(base->tsc1 - base->tsc0);
+
+    if (tsc <= base->tsc0) return 0;
+
+    return (uint64)((double)(tsc - base->tsc0) * rate);
+}
+
+static char * eptrace_type_name (int type)
+{
+    switch (type) {
+    case EPT_IOE_PUSH:       return "push";
+    case EPT_IOE_DISPATCH:   return "dispatch";
+    case EPT_IOE_EXEC_BEGIN: return "exec";
+    case EPT_IOE_EXEC_END:   return "exec";
+    case EPT_DEV_CLOSE:      return "close";
+    case EPT_POLL_CTL:       return "poll_ctl";
+    case EPT_POLL_BEGIN:     return "poll";
+    case EPT_POLL_END:       return "poll";
+    case EPT_TIMER_START:    return "timer_start";
+    case EPT_TIMER_FIRE:     return "timer_fire";
+    case EPT_TIMER_STOP:     return "timer_stop";
+    case EPT_WAKEUP_SEND:    return "wakeup_send";
+    case EPT_WAKEUP_RECV:    return "wakeup_recv";
+    case EPT_MIGRATE:        return "migrate";
+    }
+
+    return "unknown";
+}
+
+static void eptrace_json_ring (frame_p frm, eptrace_base_t * base, ulong threadid,
+                               int thtype, eptrace_rec_t * rec, int num, int * first)
+{
+    char    * thname = "Thread";
+    char    * ph = "i";
+    uint64    ns = 0;
+    int       i;
+
+    if (thtype == EPT_THREAD_EPUMP) thname = "ePump";
+    else if (thtype == EPT_THREAD_WORKER) thname = "Worker";
+
+    frame_appendf(frm, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%lu,"
+                  "\"args\":{\"name\":\"%s %lu\"}}",
+                  *first ? "" : ",", threadid, thname, threadid);
+    *first = 0;
+
+    for (i = 0; i < num; i++) {
+        ns = eptrace_rec_ns(base, rec[i].tsc);
+
+        switch (rec[i].type) {
+        case EPT_IOE_EXEC_BEGIN:
+        case EPT_POLL_BEGIN:
+            ph = "B"; break;
+        case EPT_IOE_EXEC_END:
+        case EPT_POLL_END:
+            ph = "E"; break;
+        default:
+            ph = "i"; break;
+        }
+
+        frame_appendf(frm, ",\n{\"name\":\"%s", eptrace_type_name(rec[i].type));
+
+        switch (rec[i].type) {
+        case EPT_IOE_PUSH:
+        case EPT_IOE_DISPATCH:
+        case EPT_IOE_EXEC_BEGIN:
+        case EPT_IOE_EXEC_END:
+            frame_appendf(frm, " %s", epstat_event_name(rec[i].event));
+            break;
+        }
+
+        frame_appendf(frm, "\",\"cat\":\"epump\",\"ph\":\"%s\",%s\"pid\":1,\"tid\":%lu,"
+                      "\"ts\":%llu.%03u,\"args\":{\"event\":%u,\"fd\":%d,"
+                      "\"obj\":%llu,\"aux\":%llu}}",
+                      ph, ph[0] == 'i' ? "\"s\":\"t\"," : "", threadid,
+                      (unsigned long long)(ns / 1000), (unsigned)(ns % 1000),
+                      rec[i].event, rec[i].fd,
+                      (unsigned long long)rec[i].objid, (unsigned long long)rec[i].aux);
+    }
+}
+
+int epcore_trace_json (void * vpcore, frame_p frm)
+{
+    epcore_t        * pcore = (epcore_t *)vpcore;
+    eptrace_ring_t ** list = NULL;
+    eptrace_ring_t  * ring = NULL;
+    eptrace_rec_t   * rec = NULL;
+    eptrace_base_t    base;
+    int               i, num, cnt, thtype;
+    int               first = 1;
+
+    if (!pcore) return -1;
+    if (!frm) return -2;
+
+    eptrace_base_get(pcore, &base);
+
+    frame_appendf(frm, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+
+    list = eptrace_ring_list(pcore, &num);
+    for (i = 0; i < num; i++) {
+        ring = list[i];
+        if (!ring) continue;
+
+        rec = kzalloc(ring->size * sizeof(*rec));
+        if (!rec) continue;
+
+        cnt = eptrace_ring_copy(ring, rec);
+        thtype = eptrace_thread_type(pcore, ring->threadid);
+
+        eptrace_json_ring(frm, &base, ring->threadid, thtype, rec, cnt, &first);
+
+        kfree(rec);
+    }
+    if (list) kfree(list);
+
+    frame_appendf(frm, "\n]}\n");
+
+    return 0;
+}
+
+/* binary file in native byte order:
+     magic[8] version(4) recsize(4) tsc0(8) ns0(8) tsc1(8) ns1(8) ringnum(4) pad(4)
+     then each ring: threadid(8) thtype(4) recnum(4) record[recnum] */
+int epcore_trace_save (void * vpcore, char * file)
+{
+    epcore_t        * pcore = (epcore_t *)vpcore;
+    eptrace_ring_t ** list = NULL;
+    eptrace_ring_t  * ring = NULL;
+    eptrace_rec_t   * rec = NULL;
+    eptrace_base_t    base;
+    FILE            * fp = NULL;
+    char              magic[8];
+    uint32            val32[2];
+    uint64            threadid = 0;
+    int               i, num, cnt, ret = 0;
+
+    if (!pcore) return -1;
+    if (!file) return -2;
+
+    fp = fopen(file, "wb");
+    if (!fp) return -100;
+
+    eptrace_base_get(pcore, &base);
+
+    memset(magic, 0, sizeof(magic));
+    memcpy(magic, EPT_MAGIC, strlen(EPT_MAGIC));
+    fwrite(magic, 1, sizeof(magic), fp);
+
+    val32[0] = EPT_VERSION; val32[1] = sizeof(eptrace_rec_t);
+    fwrite(val32, sizeof(uint32), 2, fp);
+    fwrite(&base, sizeof(base), 1, fp);
+
+    list = eptrace_ring_list(pcore, &num);
+
+    val32[0] = num; val32[1] = 0;
+    fwrite(val32, sizeof(uint32), 2, fp);
+
+    for (i = 0; i < num; i++) {
+        ring = list[i];
+
+        cnt = 0; rec = NULL;
+        threadid = 0; val32[0] = 0;
+
+        if (ring) {
+            rec = kzalloc(ring->size * sizeof(*rec));
+            if (rec) cnt = eptrace_ring_copy(ring, rec);
+
+            threadid = ring->threadid;
+            val32[0] = eptrace_thread_type(pcore, ring->threadid);
+        }
+        val32[1] = cnt;
+
+        fwrite(&threadid, sizeof(threadid), 1, fp);
+        fwrite(val32, sizeof(uint32), 2, fp);
+        if (cnt > 0 && fwrite(rec, sizeof(*rec), cnt, fp) != (size_t)cnt)
+            ret = -101;
+
+        if (rec) kfree(rec);
+    }
+    if (list) kfree(list);
+
+    fclose(fp);
+
+    return ret;
+}
+
+int eptrace_file_json (char * file, frame_p frm)
+{
+    eptrace_rec_t  * rec = NULL;
+    eptrace_base_t   base;
+    FILE           * fp = NULL;
+    char             magic[8];
+    uint32           val32[2];
+    uint64           threadid = 0;
+    uint32           i, num;
+    int              first = 1;
+    int              ret = 0;
+
+    if (!file) return -1;
+    if (!frm) return -2;
+
+    fp = fopen(file, "rb");
+    if (!fp) return -100;
+
+    if (fread(magic, 1, sizeof(magic), fp) != sizeof(magic) ||
+        memcmp(magic, EPT_MAGIC, strlen(EPT_MAGIC)) != 0)
+    {
+        fclose(fp);
+        return -101;
+    }
+
+    if (fread(val32, sizeof(uint32), 2, fp) != 2 ||
+        val32[0] != EPT_VERSION || val32[1] != sizeof(eptrace_rec_t))
+    {
+        fclose(fp);
+        return -102;
+    }
+
+    if (fread(&base, sizeof(base), 1, fp) != 1 ||
+        fread(val32, sizeof(uint32), 2, fp) != 2)
+    {
+        fclose(fp);
+        return -103;
+    }
+    num = val32[0];
+
+    frame_appendf(frm, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+
+    for (i = 0; i < num; i++) {
+        if (fread(&threadid, sizeof(threadid), 1, fp) != 1 ||
+            fread(val32, sizeof(uint32), 2, fp) != 2 ||
+            val32[1] > (1 << 24))
+        {
+            ret = -104;
+            break;
+        }
+
+        rec = kzalloc((val32[1] + 1) * sizeof(*rec));
+        if (!rec) { ret = -105; break; }
+
+        if (fread(rec, sizeof(*rec), val32[1], fp) != val32[1]) {
+            kfree(rec);
+            ret = -106;
+            break;
+        }
+
+        eptrace_json_ring(frm, &base, (ulong)threadid, val32[0], rec, val32[1], &first);
+
+        kfree(rec);
+    }
+
+    frame_appendf(frm, "\n]}\n");
+
+    fclose(fp);
+
+    return ret;
+}
+
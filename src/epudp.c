@@ -27,6 +27,12 @@
  * #####################################################
  */
 
+#ifdef _LINUX_
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE     /* for the declaration of recvmmsg/sendmmsg */
+#endif
+#endif
+
 #include "btype.h"
 #include "tsock.h"
 #include "frame.h"
@@ -41,6 +47,26 @@
 #include "epiocp.h"
 #endif
 
+#include "epudp.h"
+
+#if defined(_LINUX_) && defined(MSG_WAITFORONE)
+#define HAVE_MMSG
+#endif
+
+#ifdef _LINUX_
+#include <netinet/udp.h>
+#endif
+
+#if defined(HAVE_MMSG) && defined(UDP_SEGMENT) && defined(UDP_GRO)
+#define HAVE_UDP_GSO
+
+/* control message buffer carrying UDP_SEGMENT or UDP_GRO segment size */
+typedef union {
+    char            buf[CMSG_SPACE(sizeof(int))];
+    struct cmsghdr  align;
+} udpseg_cmsg_t;
+#endif
+
 
 SOCKET udp_listen_all (char * localip, int port, void * psockopt,
                        sockattr_t * fdlist, int * fdnum)
@@ -451,3 +477,333 @@ int epudp_recvfrom (void * vdev, void * vfrm, void * pbuf, int bufsize, void * a
     return ret;
 }
 
+
+int epudp_recvmmsg (void * vdev, epudp_msg_t * msgs, int num)
+{
+    iodev_t         * pdev = (iodev_t *)vdev;
+#ifdef HAVE_MMSG
+    struct mmsghdr    hdrs[EPUDP_BATCH_NUM];
+    struct iovec      iovs[EPUDP_BATCH_NUM];
+    int               j, cnt;
+#endif
+#ifdef HAVE_UDP_GSO
+    udpseg_cmsg_t     ctrls[EPUDP_BATCH_NUM];
+    struct cmsghdr  * cm = NULL;
+#endif
+    int               i, ret = 0;
+
+    if (!pdev) return -1;
+    if (!msgs || num <= 0) return -2;
+
+    if (pdev->fd == INVALID_SOCKET) return -3;
+
+    if (pdev->fdtype != FDT_UDPSRV && pdev->fdtype != FDT_UDPCLI)
+        return -4;
+
+#ifdef HAVE_MMSG
+    for (i = 0; i < num; i += ret) {
+        cnt = num - i;
+        if (cnt > EPUDP_BATCH_NUM) cnt = EPUDP_BATCH_NUM;
+
+        memset(hdrs, 0, sizeof(*hdrs) * cnt);
+
+        for (j = 0; j < cnt; j++) {
+            iovs[j].iov_base = msgs[i+j].buf;
+            iovs[j].iov_len = msgs[i+j].size;
+
+            hdrs[j].msg_hdr.msg_iov = &iovs[j];
+            hdrs[j].msg_hdr.msg_iovlen = 1;
+            hdrs[j].msg_hdr.msg_name = &msgs[i+j].addr.u.addr;
+            hdrs[j].msg_hdr.msg_namelen = sizeof(msgs[i+j].addr.u);
+
+#ifdef HAVE_UDP_GSO
+            if (pdev->udp_gro) {
+                hdrs[j].msg_hdr.msg_control = ctrls[j].buf;
+                hdrs[j].msg_hdr.msg_controllen = sizeof(ctrls[j].buf);
+            }
+#endif
+        }
+
+        ret = recvmmsg(pdev->fd, hdrs, cnt, MSG_DONTWAIT, NULL);
+        if (ret < 0) {
+            if (errno == EINTR) { ret = 0; continue; }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+
+            return i > 0 ? i : -100;
+        }
+
+        if (ret == 0) break;
+
+        for (j = 0; j < ret; j++) {
+            msgs[i+j].len = hdrs[j].msg_len;
+            msgs[i+j].flags = hdrs[j].msg_hdr.msg_flags;
+            msgs[i+j].addr.socklen = hdrs[j].msg_hdr.msg_namelen;
+            msgs[i+j].addr.family = msgs[i+j].addr.u.addr.sa_family;
+            msgs[i+j].segsize = 0;
+
+#ifdef HAVE_UDP_GSO
+            if (!pdev->udp_gro) continue;
+
+            /* GRO coalesced buffer carries the segment size in UDP_GRO cmsg */
+            for (cm = CMSG_FIRSTHDR(&hdrs[j].msg_hdr); cm;
+                 cm = CMSG_NXTHDR(&hdrs[j].msg_hdr, cm))
+            {
+                if (cm->cmsg_level == SOL_UDP && cm->cmsg_type == UDP_GRO) {
+                    msgs[i+j].segsize = *(int *)CMSG_DATA(cm);
+                    if (msgs[i+j].segsize >= msgs[i+j].len)
+                        msgs[i+j].segsize = 0;
+                    break;
+                }
+            }
+#endif
+        }
+
+        /* fewer datagrams than requested: the receive queue is drained */
+        if (ret < cnt) return i + ret;
+    }
+
+    return i;
+#else
+    for (i = 0; i < num; i++) {
+        msgs[i].addr.socklen = sizeof(msgs[i].addr.u);
+
+        ret = recvfrom(pdev->fd, msgs[i].buf, msgs[i].size, 0,
+                       (struct sockaddr *)&msgs[i].addr.u.addr,
+                       (socklen_t *)&msgs[i].addr.socklen);
+        if (ret < 0) break;
+
+        msgs[i].len = ret;
+        msgs[i].flags = 0;
+        msgs[i].segsize = 0;
+        msgs[i].addr.family = msgs[i].addr.u.addr.sa_family;
+    }
+
+    if (i == 0 && ret < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+        return -100;
+
+    return i;
+#endif
+}
+
+int epudp_sendmmsg (void * vdev, epudp_msg_t * msgs, int num)
+{
+    iodev_t         * pdev = (iodev_t *)vdev;
+#ifdef HAVE_MMSG
+    struct mmsghdr    hdrs[EPUDP_BATCH_NUM];
+    struct iovec      iovs[EPUDP_BATCH_NUM];
+    int               j, cnt;
+#endif
+#ifdef HAVE_UDP_GSO
+    udpseg_cmsg_t     ctrls[EPUDP_BATCH_NUM];
+    struct cmsghdr  * cm = NULL;
+#endif
+    int               i, ret = 0;
+
+    if (!pdev) return -1;
+    if (!msgs || num <= 0) return -2;
+
+    if (pdev->fd == INVALID_SOCKET) return -3;
+
+    if (pdev->fdtype != FDT_UDPSRV && pdev->fdtype != FDT_UDPCLI)
+        return -4;
+
+#ifdef HAVE_MMSG
+    for (i = 0; i < num; i += ret) {
+        cnt = num - i;
+        if (cnt > EPUDP_BATCH_NUM) cnt = EPUDP_BATCH_NUM;
+
+        memset(hdrs, 0, sizeof(*hdrs) * cnt);
+
+        for (j = 0; j < cnt; j++) {
+            iovs[j].iov_base = msgs[i+j].buf;
+            iovs[j].iov_len = msgs[i+j].len;
+
+            hdrs[j].msg_hdr.msg_iov = &iovs[j];
+            hdrs[j].msg_hdr.msg_iovlen = 1;
+            if (msgs[i+j].addr.socklen > 0) {
+                hdrs[j].msg_hdr.msg_name = &msgs[i+j].addr.u.addr;
+                hdrs[j].msg_hdr.msg_namelen = msgs[i+j].addr.socklen;
+            }
+
+#ifdef HAVE_UDP_GSO
+            /* per-message segment size overrides the socket UDP_SEGMENT value */
+            if (msgs[i+j].segsize > 0 && msgs[i+j].segsize < msgs[i+j].len) {
+                memset(&ctrls[j], 0, sizeof(ctrls[j]));
+                hdrs[j].msg_hdr.msg_control = ctrls[j].buf;
+                hdrs[j].msg_hdr.msg_controllen = CMSG_SPACE(sizeof(uint16));
+
+                cm = CMSG_FIRSTHDR(&hdrs[j].msg_hdr);
+                cm->cmsg_level = SOL_UDP;
+                cm->cmsg_type = UDP_SEGMENT;
+                cm->cmsg_len = CMSG_LEN(sizeof(uint16));
+                *(uint16 *)CMSG_DATA(cm) = (uint16)msgs[i+j].segsize;
+            }
+#endif
+        }
+
+        ret = sendmmsg(pdev->fd, hdrs, cnt, MSG_DONTWAIT);
+        if (ret < 0) {
+            if (errno == EINTR) { ret = 0; continue; }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+
+            return i > 0 ? i : -100;
+        }
+
+        if (ret == 0) break;
+    }
+
+    return i;
+#else
+    for (i = 0; i < num; i++) {
+        if (msgs[i].addr.socklen > 0)
+            ret = sendto(pdev->fd, msgs[i].buf, msgs[i].len, 0,
+                         (struct sockaddr *)&msgs[i].addr.u.addr, msgs[i].addr.socklen);
+        else
+            ret = send(pdev->fd, msgs[i].buf, msgs[i].len, 0);
+
+        if (ret < 0) break;
+    }
+
+    if (i == 0 && ret < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+        return -100;
+
+    return i;
+#endif
+}
+
+int epudp_recv_batch (void * vdev, epudp_msg_t * msgs, int num, UdpBatchCB * cb, void * cbpara)
+{
+    iodev_t        * pdev = (iodev_t *)vdev;
+    epcore_t       * pcore = NULL;
+    epudp_vec_t    * vec = NULL;
+    epudp_grovec_t * grovec = NULL;
+    int              i, ret = 0;
+    int              total = 0;
+
+    if (!pdev) return -1;
+
+    pcore = (epcore_t *)pdev->epcore;
+    if (!pcore) return -2;
+
+    if ((!msgs || num <= 0) && pdev->udp_gro) {
+        /* coalesced GRO buffer may be up to 64K bytes */
+        grovec = mpool_fetch(pcore->udpgro_pool);
+        if (!grovec) return -100;
+
+        for (i = 0; i < EPUDP_GRO_NUM; i++) {
+            grovec->msgs[i].buf = grovec->bufs[i];
+            grovec->msgs[i].size = EPUDP_GRO_BUFSIZE;
+        }
+
+        msgs = grovec->msgs;
+        num = EPUDP_GRO_NUM;
+
+    } else if (!msgs || num <= 0) {
+        vec = mpool_fetch(pcore->udpvec_pool);
+        if (!vec) return -100;
+
+        for (i = 0; i < EPUDP_BATCH_NUM; i++) {
+            vec->msgs[i].buf = vec->bufs[i];
+            vec->msgs[i].size = EPUDP_BATCH_BUFSIZE;
+        }
+
+        msgs = vec->msgs;
+        num = EPUDP_BATCH_NUM;
+    }
+
+    /* the device is watched in edge-triggered mode, the pending datagrams
+       must be drained until EAGAIN during one readable notification */
+    while (!pcore->quit) {
+        ret = epudp_recvmmsg(pdev, msgs, num);
+        if (ret <= 0) break;
+
+        total += ret;
+
+        if (cb) (*cb)(cbpara, pdev, msgs, ret);
+
+        /* the callback may close the device */
+        if (pdev->fd == INVALID_SOCKET) break;
+
+        if (ret < num) break;
+    }
+
+    if (vec) mpool_recycle(pcore->udpvec_pool, vec);
+    if (grovec) mpool_recycle(pcore->udpgro_pool, grovec);
+
+    if (total == 0 && ret < 0) return ret;
+
+    return total;
+}
+
+
+int epudp_gso_set (void * vdev, int segsize)
+{
+    iodev_t  * pdev = (iodev_t *)vdev;
+
+    if (!pdev) return -1;
+
+    if (pdev->fd == INVALID_SOCKET) return -2;
+
+    if (pdev->fdtype != FDT_UDPSRV && pdev->fdtype != FDT_UDPCLI)
+        return -3;
+
+    if (segsize < 0 || segsize > 65535) return -4;
+
+#ifdef HAVE_UDP_GSO
+    if (setsockopt(pdev->fd, SOL_UDP, UDP_SEGMENT, (void *)&segsize, sizeof(segsize)) < 0)
+        return -100;
+
+    pdev->gso_size = (uint16)segsize;
+
+    return pdev->gso_size;
+#else
+    return segsize > 0 ? -100 : 0;
+#endif
+}
+
+int epudp_gso (void * vdev)
+{
+    iodev_t  * pdev = (iodev_t *)vdev;
+
+    if (!pdev) return 0;
+
+    return pdev->gso_size;
+}
+
+int epudp_gro_set (void * vdev, int onoff)
+{
+    iodev_t  * pdev = (iodev_t *)vdev;
+#ifdef HAVE_UDP_GSO
+    int        val = 0;
+#endif
+
+    if (!pdev) return -1;
+
+    if (pdev->fd == INVALID_SOCKET) return -2;
+
+    if (pdev->fdtype != FDT_UDPSRV && pdev->fdtype != FDT_UDPCLI)
+        return -3;
+
+#ifdef HAVE_UDP_GSO
+    val = onoff ? 1 : 0;
+
+    if (setsockopt(pdev->fd, SOL_UDP, UDP_GRO, (void *)&val, sizeof(val)) < 0)
+        return -100;
+
+    pdev->udp_gro = (uint8)val;
+
+    return pdev->udp_gro;
+#else
+    return onoff ? -100 : 0;
+#endif
+}
+
+int epudp_gro (void * vdev)
+{
+    iodev_t  * pdev = (iodev_t *)vdev;
+
+    if (!pdev) return 0;
+
+    return pdev->udp_gro;
+}
+
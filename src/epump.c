@@ -27,6 +27,12 @@
  * #####################################################
  */
  
+#ifdef _LINUX_
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE     /* for CPU_SET and pthread_setaffinity_np */
+#endif
+#endif
+
 #include "btype.h"
 #include "dynarr.h"
 #include "hashtab.h"
@@ -42,10 +48,16 @@
 #include "ioevent.h"
 #include "epwakeup.h"
 #include "mlisten.h"
+#include "epstat.h"
  
 #if defined(_WIN32) || defined(_WIN64)
 #include <process.h>
 #endif
+
+#ifdef _LINUX_
+#include <sched.h>
+#include <unistd.h>
+#endif
  
 #ifdef HAVE_EPOLL
 #include "epepoll.h"
@@ -109,6 +121,13 @@ void * epump_new (epcore_t * pcore)
 #endif
  
     epump->epumpsleep = 0;
+    epump->pollns = 0;
+    epump->cpu = -1;
+    epump->wakeup_recv = 0;
+
+    /* histograms of the recycled ePump instance are discarded */
+    if (epump->lat) eplat_free(epump->lat);
+    epump->lat = eplat_alloc(EPS_THREAD_EPUMP);
 
     /* A device such as listen device, may be associated with multiple ePump threads,
        so a device object may be added to the RBTree in multiple ePumps. Therefore,
@@ -209,6 +228,11 @@ int epump_free (void * vepump)
     epump_select_clean(epump);
 #endif
  
+    if (epump->lat) {
+        eplat_free(epump->lat);
+        epump->lat = NULL;
+    }
+
     return 0;
 }
  
@@ -290,6 +314,7 @@ int epump_hook_register (void * vepump, void * ignitor, void * igpara,
  
     ioe->externflag = 1;
     ioe->type = type;
+    ioe->stamp = 0;
     ioe->ignitor = ignitor;
     ioe->igpara = igpara;
     ioe->callback = callback;
@@ -387,6 +412,87 @@ ulong epumpid (void * veps)
     return epump->threadid;
 }
  
+/* return the CPU if the thread is allowed to run on only one CPU, or -1 */
+static int epump_cpu_affinity (epump_t * epump)
+{
+#ifdef _LINUX_
+    cpu_set_t   set;
+    int         i;
+
+    CPU_ZERO(&set);
+    if (pthread_getaffinity_np(epump->thid, sizeof(set), &set) != 0 || CPU_COUNT(&set) != 1)
+        return -1;
+
+    for (i = 0; i < CPU_SETSIZE; i++) {
+        if (CPU_ISSET(i, &set)) return i;
+    }
+#endif
+
+    return -1;
+}
+
+int epump_cpu_pin (void * veps, int cpu)
+{
+    epump_t   * epump = (epump_t *)veps;
+#ifdef _LINUX_
+    cpu_set_t   set;
+#endif
+
+    if (!epump) return -1;
+    if (cpu < 0) return -2;
+
+    if (epump->cpu == cpu) return 0;
+
+#ifdef _LINUX_
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+
+    if (pthread_setaffinity_np(epump->thid, sizeof(set), &set) != 0)
+        return -100;
+
+    epump->cpu = cpu;
+    return 0;
+#else
+    return -101;
+#endif
+}
+
+int epump_cpu (void * veps)
+{
+    epump_t  * epump = (epump_t *)veps;
+
+    if (!epump) return -1;
+
+    return epump->cpu;
+}
+
+/* fill the CPUs the process is allowed to run on, restricted by taskset or
+   cgroup cpuset. the mask of main thread is taken since the calling thread
+   may be pinned already. return the number of CPUs, negative if unknown */
+int epump_cpu_allowed (int * cpus, int max)
+{
+#ifdef _LINUX_
+    cpu_set_t   set;
+    int         i, num = 0;
+#endif
+
+    if (!cpus || max <= 0) return -1;
+
+#ifdef _LINUX_
+    CPU_ZERO(&set);
+    if (sched_getaffinity(getpid(), sizeof(set), &set) != 0)
+        return -100;
+
+    for (i = 0; i < CPU_SETSIZE && num < max; i++) {
+        if (CPU_ISSET(i, &set)) cpus[num++] = i;
+    }
+
+    return num;
+#else
+    return -101;
+#endif
+}
+
 int epump_objnum (void * veps, int type)
 {
     epump_t  * epump = (epump_t *)veps;
@@ -670,6 +776,8 @@ int epump_main_proc (void * veps)
     int         ret = 0;
     int         evnum = 0;
     btime_t     diff, * pdiff = NULL;
+    eplat_t   * lat = NULL;
+    uint64      t0 = 0, t1 = 0;
  
     if (!epump) return -1;
  
@@ -677,7 +785,15 @@ int epump_main_proc (void * veps)
     if (!pcore) return -2;
  
     epump->threadid = get_threadid();
+#ifdef UNIX
+    epump->thid = pthread_self();
+#endif
+    /* the thread pinned to one CPU by application keeps its CPU for steering */
+    epump->cpu = epump_cpu_affinity(epump);
     epump_thread_add(pcore, epump);
+
+    lat = (eplat_t *)epump->lat;
+    if (lat) lat->threadid = epump->threadid;
  
     /* wake up the epoll_wait while waiting in block for the fd-set ready */
     epump_wakeup_init(epump);
@@ -691,6 +807,8 @@ int epump_main_proc (void * veps)
  
     while (pcore->quit == 0 && epump->quit == 0) {
 
+        t0 = (lat && pcore->latency) ? epnanotime() : 0;
+
         if (lt_num(epump->ioevent_list) > 0)
             ioevent_handle(epump);
  
@@ -708,9 +826,17 @@ int epump_main_proc (void * veps)
         if (ret < 0) pdiff = NULL;
         else pdiff = &diff;
 
+        epump->pollns = 0;
         epump->epumpsleep = 1;
         (*epump->fddispatch)(epump, pdiff);
         epump->epumpsleep = 0;
+
+        /* the readiness dispatching is counted into loop time, the blocking is not */
+        if (t0 > 0) {
+            t1 = epnanotime();
+            ephist_add(&lat->poll, epump->pollns);
+            ephist_add(&lat->loop, t1 - t0 > epump->pollns ? t1 - t0 - epump->pollns : 0);
+        }
     }
  
     epump->quit = 1;
@@ -31,6 +31,8 @@
 #include "epump_local.h"
 #include "iodev.h"
 #include "epwakeup.h"
+#include "epstat.h"
+#include "eptrace.h"
 
 #ifdef HAVE_EVENTFD
 #include <sys/eventfd.h>
@@ -154,6 +156,9 @@ int epcore_wakeup_send (void * vpcore)
 
     if (!pcore) return -1;
 
+    epstat_inc(&pcore->wakeup_send);
+    EPTRACE(pcore, EPT_WAKEUP_SEND, 0, -1, 0, 0);
+
     for (i = 0; i < arr_num(pcore->epump_list); i++) {
         PostQueuedCompletionStatus(pcore->iocp_port, 0, (ULONG_PTR)-1, NULL);
     }
@@ -165,6 +170,9 @@ int epcore_wakeup_send (void * vpcore)
 
     if (!pcore) return -1;
 
+    epstat_inc(&pcore->wakeup_send);
+    EPTRACE(pcore, EPT_WAKEUP_SEND, 0, -1, 0, 0);
+
     write(pcore->wakeupfd, &val, sizeof(val));
 
     return 0;
@@ -175,6 +183,9 @@ int epcore_wakeup_send (void * vpcore)
 
     if (!pcore) return -1;
 
+    epstat_inc(&pcore->wakeup_send);
+    EPTRACE(pcore, EPT_WAKEUP_SEND, 0, -1, 0, 0);
+
     addr.sin_family = AF_INET;
     addr.sin_addr.s_addr = inet_addr("127.0.0.1");
     addr.sin_port = htons(pcore->informport);
@@ -187,6 +198,9 @@ int epcore_wakeup_send (void * vpcore)
 #else
     if (!pcore) return -1;
 
+    epstat_inc(&pcore->wakeup_send);
+    EPTRACE(pcore, EPT_WAKEUP_SEND, 0, -1, 0, 0);
+
     write(pcore->wakeupfd, "a", 1);
 
     return 0;
@@ -335,6 +349,9 @@ int epump_wakeup_send (void * vepump)
  
     if (!epump->epumpsleep) return 1;
 
+    epstat_inc(&epump->epcore->wakeup_send);
+    EPTRACE(epump->epcore, EPT_WAKEUP_SEND, 0, -1, 0, epump->threadid);
+
     write(epump->wakeupfd, &val, sizeof(val));
  
     return 0;
@@ -40,11 +40,26 @@
 #include "iodev.h"
 #include "ioevent.h"
 #include "worker.h"
+#include "eptcp.h"
+#include "epstat.h"
+#include "eptrace.h"
+#include "epprobe.h"
 
 #ifdef HAVE_IOCP
 #include "epiocp.h"
 #endif
 
+#ifdef HAVE_ZEROCOPY
+#include <linux/errqueue.h>
+
+/* zc_doneseq and zc_copied are written by epump thread and read by others */
+#define zc_load(p)      __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define zc_store(p, v)  __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#else
+#define zc_load(p)      (*(p))
+#define zc_store(p, v)  (*(p) = (v))
+#endif
+
 
 iodev_t * iodev_alloc ()
 {
@@ -111,6 +126,18 @@ int iodev_init (void * vdev)
     pdev->reuseport = 0;
     pdev->keepalive = 0;
     pdev->ssl_handshaked = 0;
+    pdev->zerocopy = 0;
+    pdev->pollexcl = 1;
+
+    pdev->zc_sendseq = 0;
+    pdev->zc_doneseq = 0;
+    pdev->zc_copied = 0;
+
+    pdev->gso_size = 0;
+    pdev->udp_gro = 0;
+
+    pdev->acceptnum = 0;
+    pdev->hectx = NULL;
 
     pdev->iot = NULL;
     pdev->epump = NULL;
@@ -146,6 +173,11 @@ int iodev_free (void * vpdev)
         pdev->iot = NULL;
     }
 
+    if (pdev->hectx) {
+        eptcp_he_free(pdev->epcore, pdev->hectx);
+        pdev->hectx = NULL;
+    }
+
     if (pdev->fd != INVALID_SOCKET) {
         if (pdev->fd <= 0 && pdev->id == 0) {
             /* invoked during unused memory pool recycling */
@@ -170,6 +202,9 @@ int iodev_free (void * vpdev)
     pdev->rwflag = 0;
     pdev->fdtype = 0x00;
     pdev->iostate = 0x00;
+    pdev->zerocopy = 0;
+    pdev->gso_size = 0;
+    pdev->udp_gro = 0;
 
 #ifdef HAVE_IOCP
     if (pdev->devfifo) {
@@ -264,6 +299,7 @@ void * iodev_new (void * vpcore)
     pdev->iostate = 0x00;
 
     pdev->iot = NULL;
+    pdev->hectx = NULL;
     pdev->epump = NULL;
     pdev->epcore = pcore;
 
@@ -323,6 +359,11 @@ void iodev_close_by_dbg (void * vpcore, ulong id, char * file, int line)
 
     EnterCriticalSection(&pdev->fdCS);
 
+    epstat_inc(&pcore->close_num);
+
+    EPTRACE(pcore, EPT_DEV_CLOSE, 0, (int)pdev->fd, pdev->id, pdev->fdtype);
+    EPPROBE3(iodev_close, pdev->id, (int)pdev->fd, pdev->fdtype);
+
     /* remove ioevents related to current iodev_t waiting in queue */
     worker_ioevent_remove(worker_thread_find(pcore, get_threadid()), pdev);
     ioevent_remove(pdev->epump, pdev);
@@ -366,6 +407,12 @@ void iodev_close_by_dbg (void * vpcore, ulong id, char * file, int line)
         pdev->iot = NULL;
     }
 
+    /* close the connecting attempts still racing for the device */
+    if (pdev->hectx) {
+        eptcp_he_free(pcore, pdev->hectx);
+        pdev->hectx = NULL;
+    }
+
     if (pdev->fd != INVALID_SOCKET) {
         if (epump && epump->delpoll)
             (*epump->delpoll)(epump, pdev);
@@ -662,6 +709,9 @@ int iodev_bind_epump (void * vdev, int bindtype, ulong epumpid, int nopoll)
         pdev->epump = epump_thread_select(pdev->epcore);
     pdev->bindtype = BIND_ONE_EPUMP;
 
+    EPPROBE4(iodev_bind_epump, pdev->id, (int)pdev->fd, pdev->bindtype,
+             pdev->epump ? ((epump_t *)pdev->epump)->threadid : 0);
+
     return epump_iocp_setpoll(NULL, pdev);
 
 #else
@@ -803,6 +853,8 @@ int iodev_bind_epump (void * vdev, int bindtype, ulong epumpid, int nopoll)
         pdev->threadid = epump->threadid;
     }
 
+    EPPROBE4(iodev_bind_epump, pdev->id, pdev->fd, pdev->bindtype, epump ? epump->threadid : 0);
+
     LeaveCriticalSection(&pdev->fdCS);
 
     return 1;
@@ -991,6 +1043,231 @@ int iodev_tcp_nopush (void * vpdev)
     return pdev->tcp_nopush;
 }
 
+
+int iodev_pollexcl (void * vpdev)
+{
+    iodev_t  * pdev = (iodev_t *)vpdev;
+
+    if (!pdev) return 0;
+
+    return pdev->pollexcl;
+}
+
+/* EPOLLEXCLUSIVE is enabled by default for the listen device bound to all
+   epump threads. the registration with EPOLLEXCLUSIVE cannot be modified,
+   so the device is removed from and added again into all epoll sets */
+
+int iodev_pollexcl_set (void * vpdev, int onoff)
+{
+    iodev_t  * pdev = (iodev_t *)vpdev;
+    int        val = 0;
+
+    if (!pdev) return -1;
+
+    val = onoff ? 1 : 0;
+
+    if (pdev->pollexcl == val) return val;
+
+    EnterCriticalSection(&pdev->fdCS);
+
+    pdev->pollexcl = val;
+
+    if (pdev->fd != INVALID_SOCKET && pdev->bindtype == BIND_ALL_EPUMP) {
+        epump_thread_delpoll(pdev->epcore, pdev);
+        epump_thread_setpoll(pdev->epcore, pdev);
+    }
+
+    LeaveCriticalSection(&pdev->fdCS);
+
+    return pdev->pollexcl;
+}
+
+
+int iodev_zerocopy (void * vpdev)
+{
+    iodev_t  * pdev = (iodev_t *)vpdev;
+
+    if (!pdev) return 0;
+
+    return pdev->zerocopy;
+}
+
+/* enable or disable MSG_ZEROCOPY transmission for TCP connection. the
+   device must keep RWF_READ notification so that the EPOLLERR indicating
+   completion notifications can be delivered by the epoll backend.
+   return value is the current zerocopy state, negative for unsupported */
+
+int iodev_zerocopy_set (void * vpdev, int onoff)
+{
+    iodev_t  * pdev = (iodev_t *)vpdev;
+#ifdef HAVE_ZEROCOPY
+    int        val = 0;
+#endif
+
+    if (!pdev) return -1;
+
+    if (pdev->fd == INVALID_SOCKET) return -2;
+
+    if (pdev->fdtype != FDT_CONNECTED && pdev->fdtype != FDT_ACCEPTED)
+        return -3;
+
+#ifdef HAVE_ZEROCOPY
+    val = onoff ? 1 : 0;
+
+    if (pdev->zerocopy != val) {
+        if (setsockopt(pdev->fd, SOL_SOCKET, SO_ZEROCOPY, (void *)&val, sizeof(val)) < 0)
+            return -100;
+
+        pdev->zerocopy = val;
+    }
+
+    return pdev->zerocopy;
+#else
+    return onoff ? -100 : 0;
+#endif
+}
+
+/* send data with MSG_ZEROCOPY flag. the pages of pbuf are pinned by kernel
+   and must not be modified or freed until the completion of the returned
+   sequence number is reported via IOE_ZEROCOPY event and iodev_zerocopy_done
+   returns 1. if zerocopy is not enabled, the data is copied as usual and
+   the buffer can be reused immediately, *pseq is set to zc_doneseq - 1.
+   return value is the bytes sent, 0 when socket buffer is full, negative
+   when the connection is broken. */
+
+int iodev_zerocopy_send (void * vpdev, void * pbuf, int len, uint32 * pseq)
+{
+    iodev_t  * pdev = (iodev_t *)vpdev;
+    int        flags = 0;
+    int        ret = 0;
+
+    if (!pdev) return -1;
+
+    if (pdev->fd == INVALID_SOCKET) return -2;
+
+    if (!pbuf || len <= 0) return 0;
+
+#ifdef MSG_NOSIGNAL
+    flags |= MSG_NOSIGNAL;
+#endif
+
+#ifdef HAVE_ZEROCOPY
+    if (pdev->zerocopy) flags |= MSG_ZEROCOPY;
+#endif
+
+    for ( ; ; ) {
+        ret = send(pdev->fd, pbuf, len, flags);
+        if (ret >= 0) break;
+
+        if (errno == EINTR) continue;
+
+        if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+
+#ifdef HAVE_ZEROCOPY
+        /* optmem_max exhausted by the pinned pages, fall back to copying */
+        if (errno == ENOBUFS && (flags & MSG_ZEROCOPY)) {
+            flags &= ~MSG_ZEROCOPY;
+            continue;
+        }
+#endif
+        return -100;
+    }
+
+#ifdef HAVE_ZEROCOPY
+    if ((flags & MSG_ZEROCOPY) && ret > 0) {
+        /* kernel numbers each zerocopy send call which queued data */
+        if (pseq) *pseq = pdev->zc_sendseq;
+        pdev->zc_sendseq++;
+        return ret;
+    }
+#endif
+
+    if (pseq) *pseq = zc_load(&pdev->zc_doneseq) - 1;
+
+    return ret;
+}
+
+/* read the completion notifications from socket error queue. invoked by
+   epump thread when EPOLLERR arrives on the zerocopy-enabled device.
+   return value is the number of completion notifications, 0 for none */
+
+int iodev_zerocopy_recv (void * vpdev)
+{
+    iodev_t  * pdev = (iodev_t *)vpdev;
+#ifdef HAVE_ZEROCOPY
+    struct sock_extended_err * serr = NULL;
+    struct cmsghdr * cm = NULL;
+    struct msghdr    msg;
+    char             control[128];
+    int              num = 0;
+    int              ret = 0;
+#endif
+
+    if (!pdev) return -1;
+
+    if (pdev->fd == INVALID_SOCKET) return -2;
+
+#ifdef HAVE_ZEROCOPY
+    if (!pdev->zerocopy) return 0;
+
+    for ( ; ; ) {
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        ret = recvmsg(pdev->fd, &msg, MSG_ERRQUEUE);
+        if (ret < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+
+        for (cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+            if (!(cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) &&
+                !(cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR))
+                continue;
+
+            serr = (struct sock_extended_err *)CMSG_DATA(cm);
+            if (serr->ee_errno != 0 || serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+                continue;
+
+            /* the range [ee_info, ee_data] of send calls is completed.
+               TCP notifications arrive in order of transmission */
+            if ((int)(serr->ee_data + 1 - pdev->zc_doneseq) > 0)
+                zc_store(&pdev->zc_doneseq, serr->ee_data + 1);
+
+            if (serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+                zc_store(&pdev->zc_copied, pdev->zc_copied + 1);
+
+            num++;
+        }
+    }
+
+    return num;
+#else
+    return 0;
+#endif
+}
+
+/* check if the buffer sent with sequence number seq is released by kernel */
+
+int iodev_zerocopy_done (void * vpdev, uint32 seq)
+{
+    iodev_t  * pdev = (iodev_t *)vpdev;
+
+    if (!pdev) return 1;
+
+    return (int)(zc_load(&pdev->zc_doneseq) - seq) > 0 ? 1 : 0;
+}
+
+uint32 iodev_zerocopy_doneseq (void * vpdev)
+{
+    iodev_t  * pdev = (iodev_t *)vpdev;
+
+    if (!pdev) return 0;
+
+    return zc_load(&pdev->zc_doneseq);
+}
+
 int iodev_tcp_nopush_set (void * vpdev, int value)
 {
     iodev_t  * pdev = (iodev_t *)vpdev;
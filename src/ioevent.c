@@ -40,6 +40,9 @@
 #include "iotimer.h"
 #include "ioevent.h"
 #include "epdns.h"
+#include "epstat.h"
+#include "eptrace.h"
+#include "epprobe.h"
 
 #ifdef HAVE_IOCP
 #include "epiocp.h"
@@ -100,6 +103,7 @@ int ioevent_dispatch (void * vepump, void * vioe)
     case IOE_READ:
     case IOE_WRITE:
     case IOE_INVALID_DEV:
+    case IOE_ZEROCOPY:
         pdev = (iodev_t *)ioe->obj;
         if (!pdev || pdev->fd == INVALID_SOCKET) {
             tolog(1, "Panic: diapatch device event failed, type=%d ioe->obj=NULL\n", ioe->type);
@@ -146,7 +150,7 @@ int ioevent_dispatch (void * vepump, void * vioe)
             return -101;
         }
 
-        ioe->objid = dnsmsg->msgid;
+        ioe->objid = dns_msg_uid(dnsmsg);
         threadid = dnsmsg->threadid;
         break;
 
@@ -158,7 +162,7 @@ int ioevent_dispatch (void * vepump, void * vioe)
             return -101;
         }
 
-        ioe->objid = dnsmsg->msgid;
+        ioe->objid = dns_msg_uid(dnsmsg);
         threadid = dnsmsg->threadid;
         break;
 
@@ -184,6 +188,8 @@ int ioevent_dispatch (void * vepump, void * vioe)
 
         if (wker) {
             if (pdev && (pdev->threadid < 10 || newchoice)) {
+                if (pdev->threadid >= 10 && pdev->threadid != wker->threadid)
+                    EPTRACE(pcore, EPT_MIGRATE, ioe->type, (int)pdev->fd, pdev->id, wker->threadid);
                 pdev->threadid = wker->threadid;
             }
             if (piot) piot->threadid = wker->threadid;
@@ -191,6 +197,9 @@ int ioevent_dispatch (void * vepump, void * vioe)
 
             ioe->workerid = wker->threadid;
 
+            EPTRACE(pcore, EPT_IOE_DISPATCH, ioe->type, -1, ioe->objid, wker->threadid);
+            EPPROBE4(ioevent_dispatch, ioe->type, ioe->objid, wker->threadid, 1);
+
             return worker_ioevent_push(wker, ioe);
         }
     }
@@ -198,6 +207,9 @@ int ioevent_dispatch (void * vepump, void * vioe)
     if (ioe->type == IOE_ACCEPT) {
         if (!dstepump) dstepump = epump;
 
+        EPTRACE(pcore, EPT_IOE_DISPATCH, ioe->type, -1, ioe->objid, dstepump->threadid);
+        EPPROBE4(ioevent_dispatch, ioe->type, ioe->objid, dstepump->threadid, 0);
+
         return epump_ioevent_push(dstepump, ioe);
     }
 
@@ -208,10 +220,16 @@ int ioevent_dispatch (void * vepump, void * vioe)
         if (!dstepump) dstepump = epump;
     }
 
+    if (pdev && pdev->threadid >= 10 && pdev->threadid != dstepump->threadid)
+        EPTRACE(pcore, EPT_MIGRATE, ioe->type, (int)pdev->fd, pdev->id, dstepump->threadid);
+
     if (pdev) pdev->threadid = dstepump->threadid;
     if (piot) piot->threadid = dstepump->threadid;
     if (dnsmsg) dnsmsg->threadid = dstepump->threadid;
 
+    EPTRACE(pcore, EPT_IOE_DISPATCH, ioe->type, -1, ioe->objid, dstepump->threadid);
+    EPPROBE4(ioevent_dispatch, ioe->type, ioe->objid, dstepump->threadid, 0);
+
     return epump_ioevent_push(dstepump, ioe);
 }
 
@@ -239,6 +257,10 @@ int ioevent_push (void * vepump, int event, void * obj, void * cb, void * cbpara
     ioe->epumpid = epump->threadid;
     ioe->workerid = 0;
 
+    ioe->stamp = epump->epcore->latency ? epnanotime() : 0;
+
+    EPTRACE(epump->epcore, EPT_IOE_PUSH, event, -1, obj, 0);
+
     epump->epcore->acc_event_num++;
 
     return ioevent_dispatch(epump, ioe);
@@ -309,7 +331,7 @@ int ioevent_remove (void * vepump, void * obj)
     return num;
 }
 
-void * ioevent_execute (void * vpcore, void * vioe)
+static void * ioevent_execute_proc (void * vpcore, void * vioe)
 {
     epcore_t   * pcore = (epcore_t *)vpcore;
     ioevent_t  * ioe = (ioevent_t *)vioe;
@@ -324,6 +346,7 @@ void * ioevent_execute (void * vpcore, void * vioe)
 #endif
 
     DnsMsg     * dnsmsg = NULL;
+    epslow_t     slow;
 
     if (!pcore) return NULL;
     if (!ioe) return NULL;
@@ -332,7 +355,9 @@ void * ioevent_execute (void * vpcore, void * vioe)
         gcb = (GeneralCB *)ioe->callback;
         if (!gcb) return NULL;
  
+        epslow_begin(pcore, &slow, ioe->type, gcb, NULL, 0, FDT_USERCMD);
         (*gcb)(ioe->obj, ioe->ignresult);
+        epslow_end(pcore, &slow);
         return NULL;
     }
 
@@ -343,6 +368,7 @@ void * ioevent_execute (void * vpcore, void * vioe)
     case IOE_READ:
     case IOE_WRITE:
     case IOE_INVALID_DEV:
+    case IOE_ZEROCOPY:
         if (ioe->objid > 0 && epcore_iodev_find(pcore, ioe->objid) != ioe->obj) {
             mpool_recycle(pcore->event_pool, ioe);
             return NULL;
@@ -361,10 +387,15 @@ void * ioevent_execute (void * vpcore, void * vioe)
         curid = pdev->id;
 #endif
 
+        epslow_begin(pcore, &slow, ioe->type, pdev->callback ? pdev->callback : pcore->callback,
+                     pdev, 0, 0);
+
         if (pdev->callback)
             (*pdev->callback)(pdev->cbpara, pdev, ioe->type, pdev->fdtype);
         else if (pcore->callback)
             (*pcore->callback)(pcore->cbpara, pdev, ioe->type, pdev->fdtype);
+
+        epslow_end(pcore, &slow);
  
 #if defined(HAVE_SELECT) || defined(HAVE_IOCP)
         /* pdev may be closed during the execution of callback */
@@ -418,17 +449,22 @@ void * ioevent_execute (void * vpcore, void * vioe)
                 iodev_close(pdev);
             }
         } else {
+            epslow_begin(pcore, &slow, ioe->type, piot->callback ? piot->callback : pcore->callback,
+                         NULL, ioe->objid, FDT_TIMER);
+
             if (piot->callback)
                 (*piot->callback)(piot->cbpara, piot, ioe->type, FDT_TIMER);
             else if (pcore->callback)
                 (*pcore->callback)(pcore->cbpara, piot, ioe->type, FDT_TIMER);
+
+            epslow_end(pcore, &slow);
         }
 
         iotimer_recycle(pcore, ioe->objid);
         break;
  
     case IOE_DNS_RECV:
-        if (ioe->objid > 0 && dns_msg_mgmt_get(pcore->dnsmgmt, (uint16)ioe->objid) != ioe->obj) {
+        if (ioe->objid > 0 && dns_msg_mgmt_get(pcore->dnsmgmt, ioe->objid) != ioe->obj) {
             mpool_recycle(pcore->event_pool, ioe);
             return NULL;
         }
@@ -436,11 +472,14 @@ void * ioevent_execute (void * vpcore, void * vioe)
         dnsmsg = (DnsMsg *)ioe->obj;
         if (!dnsmsg) break;
 
+        /* DnsCB of the resolving requester is invoked in dns_msg_handle */
+        epslow_begin(pcore, &slow, ioe->type, dnsmsg->dnscb, NULL, ioe->objid, FDT_UDPCLI);
         dns_msg_handle(dnsmsg);
+        epslow_end(pcore, &slow);
         break;
 
     case IOE_DNS_CLOSE:
-        if (ioe->objid > 0 && dns_msg_mgmt_get(pcore->dnsmgmt, (uint16)ioe->objid) != ioe->obj) {
+        if (ioe->objid > 0 && dns_msg_mgmt_get(pcore->dnsmgmt, ioe->objid) != ioe->obj) {
             mpool_recycle(pcore->event_pool, ioe);
             return NULL;
         }
@@ -453,10 +492,16 @@ void * ioevent_execute (void * vpcore, void * vioe)
 
     default:
         iocb = (IOHandler *)ioe->callback;
+
+        epslow_begin(pcore, &slow, ioe->type, iocb ? iocb : pcore->callback,
+                     NULL, ioe->objid, FDT_USERCMD);
+
         if (iocb)
             (*iocb)(ioe->cbpara, ioe->obj, ioe->type, FDT_USERCMD);
         else if (pcore->callback)
             (*pcore->callback)(pcore->cbpara, ioe->obj, ioe->type, FDT_USERCMD);
+
+        epslow_end(pcore, &slow);
         break;
     }
  
@@ -466,12 +511,99 @@ void * ioevent_execute (void * vpcore, void * vioe)
     return NULL;
 }
 
+void * ioevent_execute (void * vpcore, void * vioe)
+{
+    epcore_t   * pcore = (epcore_t *)vpcore;
+    ioevent_t  * ioe = (ioevent_t *)vioe;
+    int          type = 0;
+    ulong        objid = 0;
+
+    if (!pcore) return NULL;
+    if (!ioe) return NULL;
+
+    /* ioe is recycled after executing, its attributes are taken before */
+    type = ioe->externflag == 1 ? IOE_USER_DEFINED : ioe->type;
+    objid = ioe->objid;
+
+    EPPROBE2(ioevent_execute_begin, type, objid);
+    EPTRACE(pcore, EPT_IOE_EXEC_BEGIN, type, -1, objid, 0);
+
+    ioevent_execute_proc(pcore, ioe);
+
+    EPTRACE(pcore, EPT_IOE_EXEC_END, type, -1, 0, 0);
+    EPPROBE2(ioevent_execute_end, type, objid);
+
+    return NULL;
+}
+
+
+int ioevent_fdtype (void * vioe)
+{
+    ioevent_t  * ioe = (ioevent_t *)vioe;
+    iodev_t    * pdev = NULL;
+
+    if (!ioe) return 0;
+
+    if (ioe->externflag == 1) return FDT_USERCMD;
+
+    switch (ioe->type) {
+    case IOE_CONNECTED:
+    case IOE_CONNFAIL:
+    case IOE_ACCEPT:
+    case IOE_READ:
+    case IOE_WRITE:
+    case IOE_INVALID_DEV:
+    case IOE_ZEROCOPY:
+        /* device memory comes from device_pool and is never freed while running,
+           a closed device only makes the sample counted into another fdtype */
+        pdev = (iodev_t *)ioe->obj;
+        return pdev ? pdev->fdtype : 0;
+
+    case IOE_TIMEOUT:
+        return FDT_TIMER;
+
+    case IOE_DNS_RECV:
+    case IOE_DNS_CLOSE:
+        return FDT_UDPCLI;
+    }
+
+    return FDT_USERCMD;
+}
+
+void * ioevent_execute_lat (void * vpcore, void * vioe, void * vlat)
+{
+    epcore_t   * pcore = (epcore_t *)vpcore;
+    ioevent_t  * ioe = (ioevent_t *)vioe;
+    int          type = 0;
+    int          fdtype = 0;
+    uint64       stamp = 0;
+    uint64       start = 0;
+
+    if (!pcore) return NULL;
+    if (!ioe) return NULL;
+
+    if (!vlat || !pcore->latency) return ioevent_execute(pcore, ioe);
+
+    /* ioe is recycled after executing, its attributes are taken before */
+    type = ioe->externflag == 1 ? IOE_USER_DEFINED : ioe->type;
+    fdtype = ioevent_fdtype(ioe);
+    stamp = ioe->externflag == 1 ? 0 : ioe->stamp;
+
+    start = epnanotime();
+
+    ioevent_execute(pcore, ioe);
+
+    eplat_exec_add(vlat, type, fdtype, stamp, start, epnanotime());
+
+    return NULL;
+}
 
 int ioevent_handle (void * vepump)
 {
     epump_t    * epump = (epump_t *)vepump;
     epcore_t   * pcore = NULL;
     ioevent_t  * ioe = NULL;
+    eplat_t    * lat = NULL;
     int          evnum = 0;
 
     if (!epump) return -1;
@@ -479,13 +611,20 @@ int ioevent_handle (void * vepump)
     pcore = (epcore_t *)epump->epcore;
     if (!pcore) return -2;
 
+    lat = (eplat_t *)epump->lat;
+
     while (!epump->quit) {
         ioe = ioevent_pop(epump);
         if (!ioe) break;
 
         epump->curioe = ioe;
 
-        ioevent_execute(pcore, ioe);
+        if (lat) lat->evnum[eplat_ioe_index(ioe->type)]++;
+
+        if (pcore->latency)
+            ioevent_execute_lat(pcore, ioe, lat);
+        else
+            ioevent_execute(pcore, ioe);
         evnum++;
 
         epump->curioe = NULL;
@@ -517,6 +656,7 @@ void ioevent_print (void * vioe, char * title)
     else if (ioe->type == IOE_DNS_RECV)    sprintf(buf+strlen(buf), "IOE_DNS_RECV");
     else if (ioe->type == IOE_DNS_CLOSE) sprintf(buf+strlen(buf), "IOE_DNS_CLOSE");
     else if (ioe->type == IOE_INVALID_DEV) sprintf(buf+strlen(buf), "IOE_INVALID_DEV");
+    else if (ioe->type == IOE_ZEROCOPY)    sprintf(buf+strlen(buf), "IOE_ZEROCOPY");
     else                                   sprintf(buf+strlen(buf), "Unknown");
 
     if (ioe->type != IOE_TIMEOUT && ioe->type != IOE_DNS_RECV) {
@@ -40,6 +40,8 @@
 #include "ioevent.h"
 #include "iotimer.h"
 #include "epwakeup.h"
+#include "eptrace.h"
+#include "epprobe.h"
 
 
 int iotimer_init (void * vtimer)
@@ -194,6 +196,9 @@ void * iotimer_start(void * vpcore, int ms, int cmdid, void * para,
        indicates the current worker thread will handle the upcoming timeout event */
     iot->threadid = get_threadid();
 
+    EPTRACE(pcore, EPT_TIMER_START, cmdid, -1, iot->id, ms);
+    EPPROBE3(iotimer_start, iot->id, cmdid, ms);
+
     if (epumpid < 10) epumpid = iot->threadid;
     if (epumpid > 10)
         epump = iot->epump =  epump_thread_get(pcore, epumpid);
@@ -233,6 +238,9 @@ int iotimer_stop_dbg (void * vpcore, void * iotid, char * file, int line)
         return 0;
     }
 
+    EPTRACE(pcore, EPT_TIMER_STOP, iot->cmdid, -1, iot->id, 0);
+    EPPROBE2(iotimer_stop, iot->id, iot->cmdid);
+
     epump = (epump_t *)iot->epump;
 
     if (epump) {
@@ -334,6 +342,8 @@ int iotimer_check_timeout (void * vepump, btime_t * pdiff, int * pevnum)
                 epump_iotimer_print(epump, 1);
             LeaveCriticalSection(&epump->timertreeCS);
 
+            EPTRACE(epump->epcore, EPT_TIMER_FIRE, iot->cmdid, -1, iot->id, 0);
+            EPPROBE2(iotimer_fire, iot->id, iot->cmdid);
             PushTimeoutEvent(epump, iot);
             evnum++;
         } else {
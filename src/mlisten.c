@@ -30,12 +30,16 @@
 #include "btype.h"
 #include "memory.h"
 #include "dynarr.h"
+#include "dlist.h"
+#include "rbtree.h"
 #include "tsock.h"
 #include "trace.h"
 
 #include "epcore.h"
 #include "epump_local.h"
 #include "iodev.h"
+#include "iotimer.h"
+#include "ioevent.h"
 #include "eptcp.h"
 #include "epudp.h"
 #include "mlisten.h"
@@ -44,6 +48,12 @@
 #include "epiocp.h"
 #endif
 
+#if defined(_LINUX_) && defined(SO_ATTACH_REUSEPORT_CBPF)
+#include <unistd.h>
+#include <linux/filter.h>
+#define HAVE_REUSEPORT_CBPF
+#endif
+
 
 void * mlisten_alloc (char * localip, int port, int fdtype, void * popt, void * para, IOHandler * cb, void * cbpara)
 {
@@ -66,6 +76,10 @@ void * mlisten_alloc (char * localip, int port, int fdtype, void * popt, void *
     mln->fdtype = fdtype;
     mln->devlist = arr_new(4);
 
+    mln->steer = MLN_STEER_HASH;
+    mln->steerind = -1;
+    mln->steertimer = NULL;
+
     return mln;
 }
 
@@ -292,6 +306,10 @@ int epcore_mlisten_create (void * epcore, void * vepump)
                   epump->epoll_fd, epump->threadid, rbtree_num(epump->device_tree),
                   rbtree_num(epump->timer_tree), lt_num(epump->ioevent_list), ret);
         }
+
+        /* the size of reuseport group changed, refresh the steering program */
+        if (mln->steer != MLN_STEER_HASH && arr_num(mln->devlist) > mlndevs)
+            mlisten_steer_apply(mln);
     }
  
     LeaveCriticalSection(&pcore->glbmlistenlistCS);
@@ -457,6 +475,12 @@ void * mlisten_open (void * epcore,  char * localip, int port, int fdtype,
  
     LeaveCriticalSection(&pcore->epumplistCS);
  
+    if (mln->steer != MLN_STEER_HASH) {
+        EnterCriticalSection(&pcore->glbmlistenlistCS);
+        mlisten_steer_apply(mln);
+        LeaveCriticalSection(&pcore->glbmlistenlistCS);
+    }
+
     return mln;
 #endif
 }
@@ -477,6 +501,11 @@ int mlisten_close (void * vmln)
     if (epcore_mlisten_del(pcore, mln) == NULL)
         return 0;
 
+    if (mln->steertimer) {
+        iotimer_stop(pcore, mln->steertimer);
+        mln->steertimer = NULL;
+    }
+
     /* unbind the devices from every epump */
     EnterCriticalSection(&pcore->epumplistCS);
  
@@ -529,3 +558,300 @@ char * mlisten_lip (void * vmln)
 }
 
 
+#ifdef HAVE_REUSEPORT_CBPF
+/* val gives the pinned CPU of each listen socket for MLN_STEER_CPU, -1 if
+   not pinned, or the weight of each listen socket for MLN_STEER_LOAD */
+static int mlisten_cbpf_attach (SOCKET fd, int mode, int num, int * val)
+{
+    struct sock_filter  code[MLN_STEER_MAX * 2 + 4];
+    struct sock_fprog   prog;
+    uint32              total = 0;
+    int                 i, n = 0;
+
+    memset(code, 0, sizeof(code));
+    memset(&prog, 0, sizeof(prog));
+
+    if (num > MLN_STEER_MAX) num = MLN_STEER_MAX;
+
+    if (mode == MLN_STEER_CPU) {
+        /* A = cpu number handling the packet; return the index of the listen
+           socket whose ePump is pinned to that cpu; otherwise return A % num */
+        code[n].code = BPF_LD | BPF_W | BPF_ABS;
+        code[n++].k = SKF_AD_OFF + SKF_AD_CPU;
+
+        for (i = 0; i < num; i++) {
+            if (val[i] < 0) continue;
+
+            code[n].code = BPF_JMP | BPF_JEQ | BPF_K;
+            code[n].k = val[i];
+            code[n].jt = 0;
+            code[n++].jf = 1;
+            code[n].code = BPF_RET | BPF_K;
+            code[n++].k = i;
+        }
+
+        code[n].code = BPF_ALU | BPF_MOD | BPF_K;
+        code[n++].k = num;
+        code[n++].code = BPF_RET | BPF_A;
+
+    } else if (mode == MLN_STEER_LOAD) {
+#ifdef SKF_AD_RANDOM
+        /* A = random % total weight; return the first index whose cumulative
+           weight exceeds A, the less loaded socket gets more connections */
+        for (i = 0; i < num; i++) total += val[i] > 0 ? val[i] : 1;
+
+        code[n].code = BPF_LD | BPF_W | BPF_ABS;
+        code[n++].k = SKF_AD_OFF + SKF_AD_RANDOM;
+        code[n].code = BPF_ALU | BPF_MOD | BPF_K;
+        code[n++].k = total;
+
+        for (total = 0, i = 0; i < num - 1; i++) {
+            total += val[i] > 0 ? val[i] : 1;
+
+            code[n].code = BPF_JMP | BPF_JGE | BPF_K;
+            code[n].k = total;
+            code[n].jt = 1;
+            code[n++].jf = 0;
+            code[n].code = BPF_RET | BPF_K;
+            code[n++].k = i;
+        }
+
+        code[n].code = BPF_RET | BPF_K;
+        code[n++].k = num - 1;
+#else
+        return -102;
+#endif
+
+    } else {
+#ifdef SO_DETACH_REUSEPORT_BPF
+        int  one = 1;
+        if (setsockopt(fd, SOL_SOCKET, SO_DETACH_REUSEPORT_BPF, (void *)&one, sizeof(one)) < 0 &&
+            errno != ENOENT)
+            return -100;
+#endif
+        return 0;
+    }
+
+    prog.len = n;
+    prog.filter = code;
+
+    if (setsockopt(fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, (void *)&prog, sizeof(prog)) < 0)
+        return -101;
+
+    return 0;
+}
+#endif
+
+/* the index returned by reuseport program refers to the order in which the
+   listen sockets joined the reuseport group. the sockets of one mlisten are
+   created in order of devlist and closed together, so the index of socket in
+   group is its position among the devices of the same family in devlist.
+   in CPU mode, the ePump thread of every listen socket not yet pinned is
+   pinned to the allowed CPU of its index, so that the connection is accepted by
+   the ePump running on the CPU that handled the packet. in LOAD mode,
+   every listen socket is weighted by the inverse of its ePump load.
+   the caller should hold glbmlistenlistCS. */
+
+int mlisten_steer_apply (void * vmln)
+{
+    mlisten_t * mln = (mlisten_t *)vmln;
+#ifdef HAVE_REUSEPORT_CBPF
+    iodev_t   * pdev = NULL;
+    iodev_t   * first = NULL;
+    epump_t   * epump = NULL;
+    int         families[2] = { AF_INET, AF_INET6 };
+    int         val[MLN_STEER_MAX];
+    int         cpus[MLN_STEER_MAX];
+    int         f, i, num, devnum;
+    int         load, minload, minind;
+    int         ncpu = 1;
+    int         ret = 0;
+#endif
+
+    if (!mln) return -1;
+
+    if (!mln->reuseport) return -2;
+
+#ifdef HAVE_REUSEPORT_CBPF
+    mln->steerind = -1;
+
+    /* CPUs are chosen among the allowed ones of the process */
+    if (mln->steer == MLN_STEER_CPU) {
+        ncpu = epump_cpu_allowed(cpus, MLN_STEER_MAX);
+        if (ncpu <= 0) {
+            ncpu = (int)sysconf(_SC_NPROCESSORS_ONLN);
+            if (ncpu < 1) ncpu = 1;
+            if (ncpu > MLN_STEER_MAX) ncpu = MLN_STEER_MAX;
+            for (i = 0; i < ncpu; i++) cpus[i] = i;
+        }
+    }
+
+    for (f = 0; f < 2; f++) {
+        first = NULL;
+        devnum = 0;
+        minload = -1;
+        minind = -1;
+
+        num = arr_num(mln->devlist);
+        for (i = 0; i < num; i++) {
+            pdev = arr_value(mln->devlist, i);
+            if (!pdev || pdev->fd == INVALID_SOCKET || pdev->family != families[f])
+                continue;
+
+            if (!first) first = pdev;
+            if (devnum >= MLN_STEER_MAX) break;
+
+            val[devnum] = -1;
+
+            epump = (epump_t *)pdev->epump;
+            if (epump && mln->steer == MLN_STEER_CPU) {
+                if (epump_cpu(epump) < 0 &&
+                    (ret = epump_cpu_pin(epump, cpus[devnum % ncpu])) < 0)
+                    tolog(1, "Warning: MListen %s:%d pinning ePump %lu to CPU %d failed, "
+                             "ret=%d, the listen socket is not steered\n",
+                          mln->localip, mln->port, epumpid(epump),
+                          cpus[devnum % ncpu], ret);
+                val[devnum] = epump_cpu(epump);
+
+            } else if (epump) {
+                load = rbtree_num(epump->device_tree) + lt_num(epump->ioevent_list);
+                val[devnum] = 65536 / (load + 1);
+                if (minload < 0 || load < minload) {
+                    minload = load;
+                    minind = devnum;
+                }
+            }
+
+            devnum++;
+        }
+
+        if (!first) continue;
+
+        if (mln->steer == MLN_STEER_LOAD && minind < 0)
+            continue;
+
+        ret = mlisten_cbpf_attach(first->fd, mln->steer, devnum, val);
+
+#ifdef SO_INCOMING_CPU
+        if (ret < 0 && mln->steer == MLN_STEER_CPU) {
+            /* kernel without reuseport cBPF, prefer the listen socket
+               whose SO_INCOMING_CPU matches the CPU handling the packet,
+               which is the CPU its ePump thread is pinned to */
+            devnum = 0;
+            for (i = 0; i < num && devnum < MLN_STEER_MAX; i++) {
+                pdev = arr_value(mln->devlist, i);
+                if (!pdev || pdev->fd == INVALID_SOCKET || pdev->family != families[f])
+                    continue;
+
+                if (val[devnum] >= 0)
+                    setsockopt(pdev->fd, SOL_SOCKET, SO_INCOMING_CPU,
+                               (void *)&val[devnum], sizeof(val[devnum]));
+                devnum++;
+            }
+            ret = 0;
+        }
+#endif
+
+        if (ret < 0) {
+            tolog(1, "Warning: MListen %s:%d steer mode %d apply failed, family=%d ret=%d errno=%d\n",
+                  mln->localip, mln->port, mln->steer, families[f], ret, errno);
+            return ret;
+        }
+
+        if (mln->steer == MLN_STEER_LOAD)
+            mln->steerind = minind;
+    }
+
+    return 0;
+#else
+    return mln->steer == MLN_STEER_HASH ? 0 : -100;
+#endif
+}
+
+int mlisten_steer_set (void * vmln, int mode)
+{
+    mlisten_t * mln = (mlisten_t *)vmln;
+    epcore_t  * pcore = NULL;
+    int         ret = 0;
+
+    if (!mln) return -1;
+
+    pcore = (epcore_t *)mln->pcore;
+    if (!pcore) return -2;
+
+    if (mode != MLN_STEER_HASH && mode != MLN_STEER_CPU && mode != MLN_STEER_LOAD)
+        return -3;
+
+    EnterCriticalSection(&pcore->glbmlistenlistCS);
+
+    mln->steer = mode;
+    ret = mlisten_steer_apply(mln);
+
+    if (mode == MLN_STEER_LOAD) {
+        if (mln->steertimer == NULL)
+            mln->steertimer = iotimer_start(pcore, MLN_STEER_INTERVAL, t_mlisten_steer,
+                                            NULL, mlisten_steer_pump, mln, 0);
+    } else if (mln->steertimer) {
+        iotimer_stop(pcore, mln->steertimer);
+        mln->steertimer = NULL;
+    }
+
+    LeaveCriticalSection(&pcore->glbmlistenlistCS);
+
+    return ret;
+}
+
+int mlisten_steer_pump (void * vmln, void * pobj, int event, int fdtype)
+{
+    mlisten_t * mln = (mlisten_t *)vmln;
+    epcore_t  * pcore = NULL;
+
+    if (!mln) return -1;
+
+    pcore = (epcore_t *)mln->pcore;
+    if (!pcore) return -2;
+
+    if (event != IOE_TIMEOUT || iotimer_cmdid(pobj) != t_mlisten_steer)
+        return 0;
+
+    EnterCriticalSection(&pcore->glbmlistenlistCS);
+
+    if ((ulong)mln->steertimer == iotimer_id(pobj)) {
+        mln->steertimer = NULL;
+
+        if (mln->steer == MLN_STEER_LOAD) {
+            mlisten_steer_apply(mln);
+
+            mln->steertimer = iotimer_start(pcore, MLN_STEER_INTERVAL, t_mlisten_steer,
+                                            NULL, mlisten_steer_pump, mln,
+                                            iotimer_epumpid(pobj));
+        }
+    }
+
+    LeaveCriticalSection(&pcore->glbmlistenlistCS);
+
+    return 0;
+}
+
+int mlisten_stat (void * vmln, ulong * epumpid, ulong * acceptnum, int num)
+{
+    mlisten_t * mln = (mlisten_t *)vmln;
+    iodev_t   * pdev = NULL;
+    int         i, devnum;
+
+    if (!mln) return -1;
+
+    devnum = arr_num(mln->devlist);
+    if (devnum > num) devnum = num;
+
+    for (i = 0; i < devnum; i++) {
+        pdev = arr_value(mln->devlist, i);
+
+        if (epumpid) epumpid[i] = pdev ? iodev_epumpid(pdev) : 0;
+        if (acceptnum) acceptnum[i] = pdev ? pdev->acceptnum : 0;
+    }
+
+    return devnum;
+}
+
+
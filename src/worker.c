@@ -37,6 +37,7 @@
 #include "worker.h"
 #include "iodev.h"
 #include "ioevent.h"
+#include "epstat.h"
  
 #if defined(_WIN32) || defined(_WIN64)
 #include <process.h>
@@ -62,6 +63,8 @@ void * worker_new (epcore_t * pcore)
     wker->ioevent = event_create();
     wker->eventwait = 0;
 
+    wker->lat = eplat_alloc(EPS_THREAD_WORKER);
+
     return wker;
 }
 
@@ -86,6 +89,9 @@ void worker_free (void * vwker)
     event_destroy(wker->ioevent);
     wker->ioevent = NULL;
 
+    eplat_free(wker->lat);
+    wker->lat = NULL;
+
     kfree(wker);
 }
 
@@ -223,7 +229,6 @@ int worker_ioevent_push (void * vwker, void * vioe)
     }
 
     if (!discard) {
-        time(&ioe->stamp);
         lt_append(wker->ioevent_list, ioe);
     }
  
@@ -292,6 +297,8 @@ int worker_main_proc (void * vwker)
     btime_t     t0, t1;
     int         diff = 0;
     int         exenum = 0;
+    eplat_t   * lat = NULL;
+    uint64      ns0 = 0;
 
     if (!wker) return -1;
 
@@ -302,6 +309,9 @@ int worker_main_proc (void * vwker)
 
     worker_thread_add(pcore, wker);
 
+    lat = (eplat_t *)wker->lat;
+    if (lat) lat->threadid = wker->threadid;
+
     btime(&wker->start_time);
     wker->count_tick = wker->start_time;
     t0 = wker->start_time;
@@ -312,10 +322,14 @@ int worker_main_proc (void * vwker)
             /* calculate the worker load before sleeping */
             worker_real_load(wker);
 
+            ns0 = (lat && pcore->latency) ? epnanotime() : 0;
+
             wker->eventwait = 1;
             event_wait(wker->ioevent, 5*1000);
             wker->eventwait = 0;
 
+            if (ns0 > 0) ephist_add(&lat->poll, epnanotime() - ns0);
+
             /* calcualte load again when waking up */
             worker_real_load(wker);
             exenum = 0;
@@ -328,14 +342,24 @@ int worker_main_proc (void * vwker)
         btime(&t1);
         wker->acc_idle_time += btime_diff_ms(&t0, &t1);
 
+        ns0 = (lat && pcore->latency) ? epnanotime() : 0;
+
         while ((ioe = worker_ioevent_pop(wker)) != NULL) {
 
             wker->curioe = ioe;
-            ioevent_execute(pcore, ioe);
+
+            if (lat) lat->evnum[eplat_ioe_index(ioe->type)]++;
+
+            if (ns0 > 0)
+                ioevent_execute_lat(pcore, ioe, lat);
+            else
+                ioevent_execute(pcore, ioe);
             wker->curioe = NULL;
 
             wker->acc_event_num++;
         }
+
+        if (ns0 > 0) ephist_add(&lat->loop, epnanotime() - ns0);
     
         btime(&t0);
         diff = btime_diff_ms(&t1, &t0);